@@ -73,6 +73,8 @@ function walkAndWriteFiles(dir, writeStream, replaceRoot, originalRoot) {
 }
 
 Meteor.startup(function () {
+  if (!isPrimaryFrontendWorker()) return;
+
   // Cleanup tokens every TOKEN_CLEANUP_MINUTES
   Meteor.setInterval(function () {
     var queryDate = new Date(Date.now() - TOKEN_CLEANUP_TIMER);
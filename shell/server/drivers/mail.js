@@ -15,6 +15,9 @@
 // limitations under the License.
 
 var Crypto = Npm.require("crypto");
+var Fs = Npm.require("fs");
+var Os = Npm.require("os");
+var Path = Npm.require("path");
 var Http = Npm.require("http");
 var Https = Npm.require("https");
 var Future = Npm.require("fibers/future");
@@ -24,6 +27,7 @@ var Capnp = Npm.require("capnp");
 var EmailRpc = Capnp.importSystem("sandstorm/email.capnp");
 var HackSessionContext = Capnp.importSystem("sandstorm/hack-session.capnp").HackSessionContext;
 var Supervisor = Capnp.importSystem("sandstorm/supervisor.capnp").Supervisor;
+var ByteStream = Capnp.importSystem("sandstorm/util.capnp").ByteStream;
 var EmailSendPort = EmailRpc.EmailSendPort;
 
 var Url = Npm.require("url");
@@ -34,14 +38,28 @@ var HOSTNAME = ROOT_URL.hostname;
 var DAILY_LIMIT = 50;
 var RECIPIENT_LIMIT = 20;
 
-var dailySendCounts = {};
-// Maps user IDs to counts of the number of e-mails they have sent today.
+var DAY_MS = 24 * 60 * 60 * 1000;
 
 var CLIENT_TIMEOUT = 15000; // 15s
 
-Meteor.setInterval(function () { dailySendCounts = {}; }, 86400);
+var ATTACHMENT_CHUNK_SIZE = 65536;
+var ATTACHMENT_MAX_WRITES_IN_FLIGHT = 4;
+
+Meteor.startup(function () {
+  if (!isPrimaryFrontendWorker()) return;
+
+  // Forget earlier days' send counts.
+  Meteor.setInterval(function () {
+    MailSendCounts.remove({day: {$lt: Math.floor(Date.now() / DAY_MS)}});
+  }, 3600000);
+});
 
 Meteor.startup(function() {
+  if (!isPrimaryFrontendWorker()) {
+    // The other workers would fail to bind the port.
+    return;
+  }
+
   var SANDSTORM_SMTP_PORT = parseInt(process.env.SANDSTORM_SMTP_PORT, 10) || 30025;
 
   simplesmtp.createSimpleServer({SMTPBanner:"Sandstorm Mail Server"}, function (req) {
@@ -149,7 +167,7 @@ Meteor.startup(function() {
                   .newSession({}, makeHackSessionContext(grainId),
                               "0xc3b5ced7344b04a6", emptyParams)
                   .session.castAs(EmailSendPort);
-              return session.send(mailMessage);
+              return deliverEmail(session, mailMessage);
             }).catch(function (err) {
               if (shouldRestartGrain(err, retryCount)) {
                 return tryDeliver(retryCount + 1);
@@ -170,6 +188,63 @@ Meteor.startup(function() {
   }).listen(SANDSTORM_SMTP_PORT);
 });
 
+function deliverEmail(session, mailMessage) {
+  // Delivers `mailMessage` to the grain, streaming the attachments rather than putting them all
+  // in one RPC message, which the app would then have to hold in memory in full. Apps that
+  // don't implement sendStreaming() get the message through send().
+
+  if (mailMessage.attachments.length === 0) {
+    return session.send(mailMessage);
+  }
+
+  var headers = _.clone(mailMessage);
+  headers.attachments = mailMessage.attachments.map(function (attachment) {
+    return _.omit(attachment, "content");
+  });
+
+  return session.sendStreaming(headers).then(function (result) {
+    // The app consumes the attachments in order.
+    return result.attachments.reduce(function (promise, stream, i) {
+      return promise.then(function () {
+        return writeToByteStream(mailMessage.attachments[i].content, stream);
+      });
+    }, Promise.resolve());
+  }, function (err) {
+    if (err.type === "failed" && err.message.indexOf("not implemented") !== -1) {
+      // Apps built against a Cap'n Proto from before the "unimplemented" exception type.
+      err.type = "unimplemented";
+    }
+    if (err.type === "unimplemented") {
+      return session.send(mailMessage);
+    } else {
+      throw err;
+    }
+  });
+}
+
+function writeToByteStream(buffer, stream) {
+  // Writes `buffer` to the ByteStream `stream` in chunks, a few at a time, then calls done().
+
+  var offset = 0;
+  function writeMore() {
+    var writes = [];
+    while (writes.length < ATTACHMENT_MAX_WRITES_IN_FLIGHT && offset < buffer.length) {
+      writes.push(stream.write(buffer.slice(offset, offset + ATTACHMENT_CHUNK_SIZE)));
+      offset += ATTACHMENT_CHUNK_SIZE;
+    }
+    if (writes.length === 0) {
+      return stream.done();
+    } else {
+      return Promise.all(writes).then(writeMore);
+    }
+  }
+
+  stream.expectSize(buffer.length).catch(function (err) {
+    // expectSize() is allowed to be unimplemented; anything else shows up in write() too.
+  });
+  return writeMore();
+}
+
 function formatAddress(field) {
   if (!field) {
     return null;
@@ -186,100 +261,277 @@ function formatAddress(field) {
   return field.address;
 }
 
-hackSendEmail = function (session, email) {
-  return inMeteor((function() {
-    var recipientCount = 0;
-    recipientCount += email.to ? email.to.length : 0;
-    recipientCount += email.cc ? email.cc.length : 0;
-    recipientCount += email.bcc ? email.bcc.length : 0;
-    if (recipientCount > RECIPIENT_LIMIT) {
-      throw new Error(
-          "Sorry, Sandstorm currently only allows you to send an e-mail to " + RECIPIENT_LIMIT +
-          " recipients at a time, for spam control. Consider setting up a mailing list. " +
-          "Please feel free to contact us if this is a problem for you.");
-    }
+function checkOutgoingEmail(session, email) {
+  // Enforces the limits on what a grain may send, and returns the grain's address, which becomes
+  // the envelope sender.
+  //
+  // Must be called in a Meteor context.
+
+  var recipientCount = 0;
+  recipientCount += email.to ? email.to.length : 0;
+  recipientCount += email.cc ? email.cc.length : 0;
+  recipientCount += email.bcc ? email.bcc.length : 0;
+  if (recipientCount > RECIPIENT_LIMIT) {
+    throw new Error(
+        "Sorry, Sandstorm currently only allows you to send an e-mail to " + RECIPIENT_LIMIT +
+        " recipients at a time, for spam control. Consider setting up a mailing list. " +
+        "Please feel free to contact us if this is a problem for you.");
+  }
 
-    // Overwrite the "from" address with the grain's address.
-    if (!email.from) {
-      email.from = {};
-    }
+  // Overwrite the "from" address with the grain's address.
+  if (!email.from) {
+    email.from = {};
+  }
+
+  var grainAddress = session._getAddress();
+  var userAddress = session._getUserAddress();
+
+  // First check if we're changing the from address, and if so, move it to reply-to
+  if (email.from.address !== grainAddress && email.from.address !== userAddress.address) {
+    throw new Error(
+      "FROM header in outgoing emails need to equal either " + grainAddress + " or " +
+      userAddress.address + ". Yours was: " + email.from.address);
+  }
+
+  return grainAddress;
+}
+
+function composeEmail(email, grainAddress, attachmentContents) {
+  // Returns a MailComposer for `email`. `attachmentContents(attachment, i)` returns the
+  // properties of the i'th attachment that give its content; it may be omitted if there are no
+  // attachments.
+
+  var mc = new MailComposer();
+
+  mc.setMessageOption({
+    from:     formatAddress(email.from),
+    to:       formatAddress(email.to),
+    cc:       formatAddress(email.cc),
+    bcc:      formatAddress(email.bcc),
+    replyTo:  formatAddress(email.replyTo),
+    subject:  email.subject,
+    text:     email.text,
+    html:     email.html
+  });
 
-    var grainAddress = session._getAddress();
-    var userAddress = session._getUserAddress();
+  var envelope = mc.getEnvelope();
+  envelope.from = grainAddress;
 
-    // First check if we're changing the from address, and if so, move it to reply-to
-    if (email.from.address !== grainAddress && email.from.address !== userAddress.address) {
-      throw new Error(
-        "FROM header in outgoing emails need to equal either " + grainAddress + " or " +
-        userAddress.address + ". Yours was: " + email.from.address);
+  mc.setMessageOption({
+    envelope: envelope
+  });
+
+  var headers = {};
+  if (email.messageId) {
+    mc.addHeader("message-id", email.messageId);
+  }
+  if (email.references) {
+    mc.addHeader("references", email.references);
+  }
+  if (email.messageId) {
+    mc.addHeader("in-reply-to", email.inReplyTo);
+  }
+  if (email.date) {
+    var date = new Date(email.date / 1000000);
+    if (!isNaN(date.getTime())) { // Check to make sure date is valid
+      mc.addHeader("date", date.toUTCString());
     }
+  }
 
-    var mc = new MailComposer();
-
-    mc.setMessageOption({
-      from:     formatAddress(email.from),
-      to:       formatAddress(email.to),
-      cc:       formatAddress(email.cc),
-      bcc:      formatAddress(email.bcc),
-      replyTo:  formatAddress(email.replyTo),
-      subject:  email.subject,
-      text:     email.text,
-      html:     email.html
+  if (email.attachments) {
+    email.attachments.forEach(function (attachment, i) {
+      mc.addAttachment(_.extend({
+        cid: attachment.contentId,
+        contentType: attachment.contentType,
+        contentDisposition: attachment.contentDisposition
+      }, attachmentContents(attachment, i)));
     });
+  }
+
+  return mc;
+}
 
-    var envelope = mc.getEnvelope();
-    envelope.from = grainAddress;
+function sendComposedEmail(userId, mc) {
+  // Must be called in a Meteor context.
+
+  // Count in the database, so that the limit holds however many front-end workers there are.
+  var day = Math.floor(Date.now() / DAY_MS);
+  var countId = userId + ":" + day;
+  MailSendCounts.upsert(countId, {$set: {day: day}, $inc: {count: 1}});
+  var sentToday = MailSendCounts.findOne(countId).count;
+  if (sentToday > DAILY_LIMIT) {
+    throw new Error(
+        "Sorry, you've reached your e-mail sending limit for today. Currently, Sandstorm " +
+        "limits each user to " + DAILY_LIMIT + " e-mails per day for spam control reasons. " +
+        "Please feel free to contact us if this is a problem.");
+  }
+
+  getSmtpPool()._future_wrapped_sendMail(mc).wait();
+}
 
-    mc.setMessageOption({
-      envelope: envelope
+hackSendEmail = function (session, email) {
+  return inMeteor((function() {
+    var grainAddress = checkOutgoingEmail(session, email);
+    var mc = composeEmail(email, grainAddress, function (attachment) {
+      return { contents: attachment.content };
     });
+    sendComposedEmail(this.userId, mc);
+  }).bind(this)).catch(function (err) {
+    console.error("Error sending e-mail:", err.stack);
+    throw err;
+  });
+};
 
-    var headers = {};
-    if (email.messageId) {
-      mc.addHeader("message-id", email.messageId);
-    }
-    if (email.references) {
-      mc.addHeader("references", email.references);
-    }
-    if (email.messageId) {
-      mc.addHeader("in-reply-to", email.inReplyTo);
-    }
-    if (email.date) {
-      var date = new Date(email.date / 1000000);
-      if (!isNaN(date.getTime())) { // Check to make sure date is valid
-        mc.addHeader("date", date.toUTCString());
-      }
+hackSendEmailStreaming = function (session, email) {
+  // Implements EmailSendPort.sendStreaming(). The attachments are spooled to files as they
+  // arrive, so that they needn't be held in memory, and the message goes out once the last one
+  // is done.
+
+  return inMeteor((function() {
+    var grainAddress = checkOutgoingEmail(session, email);
+    var userId = this.userId;
+
+    var count = email.attachments ? email.attachments.length : 0;
+    if (count === 0) {
+      sendComposedEmail(userId, composeEmail(email, grainAddress));
+      return { attachments: [] };
     }
 
-    if (email.attachments) {
-      email.attachments.forEach(function (attachment) {
-        mc.addAttachment({
-          cid: attachment.contentId,
-          contentType: attachment.contentType,
-          contentDisposition: attachment.contentDisposition,
-          contents: attachment.content
+    var spool = new EmailSpool(count, function (files) {
+      return inMeteor(function () {
+        var mc = composeEmail(email, grainAddress, function (attachment, i) {
+          return { filePath: files[i] };
         });
+        sendComposedEmail(userId, mc);
       });
-    }
+    });
 
-    if (!(this.userId in dailySendCounts)) {
-      dailySendCounts[this.userId] = 0;
-    }
-    var sentToday = ++dailySendCounts[this.userId];
-    if (sentToday > DAILY_LIMIT) {
-      throw new Error(
-          "Sorry, you've reached your e-mail sending limit for today. Currently, Sandstorm " +
-          "limits each user to " + DAILY_LIMIT + " e-mails per day for spam control reasons. " +
-          "Please feel free to contact us if this is a problem.");
+    try {
+      return {
+        attachments: _.range(count).map(function (i) {
+          return new Capnp.Capability(new SpooledAttachment(spool, i), ByteStream);
+        })
+      };
+    } catch (err) {
+      spool.abandon();
+      throw err;
     }
-
-    getSmtpPool()._future_wrapped_sendMail(mc).wait();
   }).bind(this)).catch(function (err) {
     console.error("Error sending e-mail:", err.stack);
     throw err;
   });
 };
 
+function EmailSpool(count, send) {
+  // Holds the attachments of one message in files under a private temporary directory until all
+  // `count` of them are done, then calls `send(files)`, which returns a promise. The files are
+  // removed once the message is sent, or as soon as it's abandoned.
+
+  this.dir = Path.join(Os.tmpdir(), "sandstorm-mail-" + Random.id());
+  Fs.mkdirSync(this.dir, parseInt("700", 8));
+  this.files = _.range(count).map(function (i) {
+    return Path.join(this.dir, String(i));
+  }, this);
+  this.remaining = count;
+  this.abandoned = false;
+  this.send = send;
+}
+
+EmailSpool.prototype.finish = function () {
+  // Called as each attachment is done. Returns a promise for the message being sent if this was
+  // the last one.
+
+  if (this.abandoned) {
+    return Promise.reject(new Error("E-mail was abandoned."));
+  }
+  if (--this.remaining > 0) {
+    return Promise.resolve();
+  }
+
+  var self = this;
+  return this.send(this.files).then(function () {
+    self.cleanup();
+  }, function (err) {
+    self.cleanup();
+    throw err;
+  });
+};
+
+EmailSpool.prototype.abandon = function () {
+  if (!this.abandoned) {
+    this.abandoned = true;
+    this.cleanup();
+  }
+};
+
+EmailSpool.prototype.cleanup = function () {
+  this.files.forEach(function (file) {
+    try {
+      Fs.unlinkSync(file);
+    } catch (err) {
+      if (err.code !== "ENOENT") console.error("Couldn't remove spooled attachment:", err.stack);
+    }
+  });
+  try {
+    Fs.rmdirSync(this.dir);
+  } catch (err) {
+    console.error("Couldn't remove e-mail spool directory:", err.stack);
+  }
+};
+
+function SpooledAttachment(spool, index) {
+  // ByteStream for one attachment of a message being sent with sendStreaming().
+
+  this.spool = spool;
+  // Open the file now, so that it can't appear after an abandoned spool has been cleaned up.
+  var fd = Fs.openSync(spool.files[index], "wx", parseInt("600", 8));
+  this.output = Fs.createWriteStream(null, { fd: fd });
+  this.error = null;
+  this.doneCalled = false;
+
+  var self = this;
+  this.output.on("error", function (err) {
+    self.error = err;
+    spool.abandon();
+  });
+}
+
+SpooledAttachment.prototype.write = function (data) {
+  if (this.error) throw this.error;
+  if (this.doneCalled) throw new Error("write() called after done().");
+  if (this.spool.abandoned) throw new Error("E-mail was abandoned.");
+  if (this.output.write(data)) return;
+
+  // Hold off the app until the file catches up.
+  var output = this.output;
+  return new Promise(function (resolve, reject) {
+    output.once("drain", resolve);
+    output.once("error", reject);
+  });
+};
+
+SpooledAttachment.prototype.done = function () {
+  if (this.error) throw this.error;
+  if (this.doneCalled) throw new Error("done() called twice.");
+  this.doneCalled = true;
+
+  var self = this;
+  return new Promise(function (resolve, reject) {
+    self.output.once("error", reject);
+    self.output.end(resolve);
+  }).then(function () {
+    return self.spool.finish();
+  });
+};
+
+SpooledAttachment.prototype.close = function () {
+  if (!this.doneCalled) {
+    // Dropped before done(); the message must not go out without this attachment.
+    this.output.end();
+    this.spool.abandon();
+  }
+};
+
 // =======================================================================================
 // makeSmtpPool and getSmtpPool are lifted from the Meteor email package (MIT license)
 
@@ -15,6 +15,8 @@
 // limitations under the License.
 
 var Crypto = Npm.require("crypto");
+var Fs = Npm.require("fs");
+var Path = Npm.require("path");
 var Http = Npm.require("http");
 var Https = Npm.require("https");
 var Future = Npm.require("fibers/future");
@@ -125,6 +127,10 @@ HackSessionContextImpl.prototype.send = function (email) {
   return hackSendEmail(this, email);
 };
 
+HackSessionContextImpl.prototype.sendStreaming = function (email) {
+  return hackSendEmailStreaming(this, email);
+};
+
 HackSessionContextImpl.prototype.getPublicId = function() {
   return inMeteor((function () {
     var result = {};
@@ -212,6 +218,393 @@ HackSessionContextImpl.prototype.httpGet = function(url) {
   });
 };
 
+// =======================================================================================
+// httpGetStream() and its per-grain cache
+//
+// Each cache entry is a single file named after the SHA-256 of the URL, containing one line of
+// JSON metadata (the validators and MIME type) followed by the raw content. Entries are written
+// to a temporary file and renamed into place, so a reader that has opened an entry always sees a
+// consistent one.
+//
+// The cache lives outside the grain's storage, so it doesn't count against the grain's quota.
+// Instead, each grain's cache is capped at HTTP_CACHE_MAX_GRAIN_SIZE by evicting the least
+// recently used entries; an entry's mtime is bumped whenever it is served. The cache is deleted
+// along with the grain (see deleteGrain()).
+
+var HTTP_GET_TIMEOUT = 15000;
+var HTTP_GET_MAX_REDIRECTS = 10;
+var HTTP_CACHE_MAX_ENTRY_SIZE = 16 * 1024 * 1024;
+var HTTP_CACHE_MAX_GRAIN_SIZE = 64 * 1024 * 1024;
+var HTTP_CACHE_MAX_METADATA_SIZE = 4096;
+var HTTP_STREAM_MAX_WRITES_IN_FLIGHT = 4;
+
+httpCacheDir = function (grainId) {
+  // Directory holding the httpGetStream() cache for the given grain. (SANDSTORM_VARDIR is set
+  // by proxy.js, which is loaded after this file, so we can't compute this at load time.)
+
+  return Path.join(SANDSTORM_VARDIR, "http-cache", grainId);
+};
+
+function mkdirIfMissing(dir) {
+  try {
+    Fs.mkdirSync(dir);
+  } catch (err) {
+    if (err.code !== "EEXIST") throw err;
+  }
+}
+
+function unlinkIfExists(filename) {
+  try {
+    Fs.unlinkSync(filename);
+  } catch (err) {
+    if (err.code !== "ENOENT") throw err;
+  }
+}
+
+function openHttpCacheEntry(filename) {
+  // Opens a cache entry, returning `{ metadata, fd, offset, size }` where `offset` is the
+  // position of the content within the file, or null if there is no usable entry. The caller
+  // owns `fd`.
+
+  var fd;
+  try {
+    fd = Fs.openSync(filename, "r");
+  } catch (err) {
+    if (err.code === "ENOENT") return null;
+    throw err;
+  }
+
+  try {
+    var buffer = new Buffer(HTTP_CACHE_MAX_METADATA_SIZE);
+    var n = Fs.readSync(fd, buffer, 0, buffer.length, 0);
+    for (var i = 0; i < n; i++) {
+      if (buffer[i] === 10) {
+        var entry = {
+          metadata: JSON.parse(buffer.toString("utf8", 0, i)),
+          fd: fd,
+          offset: i + 1,
+          size: Fs.fstatSync(fd).size - (i + 1)
+        };
+        fd = null;
+        return entry;
+      }
+    }
+    console.error("Ignoring corrupt HTTP cache entry:", filename);
+  } catch (err) {
+    console.error("Ignoring unreadable HTTP cache entry:", filename, err.stack);
+  } finally {
+    if (fd !== null) Fs.closeSync(fd);
+  }
+
+  return null;
+}
+
+function trimHttpCache(cacheDir) {
+  // Evicts least recently used entries until the cache fits in HTTP_CACHE_MAX_GRAIN_SIZE.
+
+  var entries = [];
+  var total = 0;
+  Fs.readdirSync(cacheDir).forEach(function (name) {
+    if (/\.tmp$/.test(name)) return;  // still being written
+
+    var filename = Path.join(cacheDir, name);
+    var stats;
+    try {
+      stats = Fs.statSync(filename);
+    } catch (err) {
+      if (err.code === "ENOENT") return;  // evicted concurrently
+      throw err;
+    }
+    entries.push({ filename: filename, size: stats.size, lastUsed: stats.mtime.getTime() });
+    total += stats.size;
+  });
+
+  entries.sort(function (a, b) { return a.lastUsed - b.lastUsed; });
+  for (var i = 0; i < entries.length && total > HTTP_CACHE_MAX_GRAIN_SIZE; i++) {
+    unlinkIfExists(entries[i].filename);
+    total -= entries[i].size;
+  }
+}
+
+function httpGetResponse(url, headers, redirectCount) {
+  // Issue a GET for `url`, following redirects. Returns a promise for the response, which will
+  // have a 2xx or 304 status code; any other status is turned into an error the same way
+  // httpGet() does it. The response body has not been consumed.
+
+  return new Promise(function (resolve, reject) {
+    var requestMethod;
+    if (url.lastIndexOf("https://", 0) === 0) {
+      requestMethod = Https.request;
+    } else if (url.lastIndexOf("http://", 0) === 0) {
+      requestMethod = Http.request;
+    } else {
+      var err = new Error("Protocol not recognized.");
+      err.nature = "precondition";
+      reject(err);
+      return;
+    }
+
+    var options = Url.parse(url);
+    options.headers = headers;
+
+    var req = requestMethod(options, function (resp) {
+      var err;
+
+      switch (Math.floor(resp.statusCode / 100)) {
+        case 2:
+          resolve(resp);
+          return;
+        case 3:
+          if (resp.statusCode === 304) {
+            resolve(resp);
+            return;
+          }
+
+          resp.resume();  // discard the body
+          if (redirectCount >= HTTP_GET_MAX_REDIRECTS) {
+            err = new Error("Too many redirects.");
+            err.nature = "precondition";
+          } else if (!resp.headers.location) {
+            err = new Error("Redirect without Location header.");
+            err.nature = "precondition";
+          } else {
+            resolve(httpGetResponse(Url.resolve(url, resp.headers.location),
+                                    headers, redirectCount + 1));
+            return;
+          }
+          break;
+        case 4:
+          err = new Error("Status code " + resp.statusCode + " received in response.");
+          err.nature = "precondition";
+          break;
+        case 5:
+          err = new Error("Status code " + resp.statusCode + " received in response.");
+          err.nature = "localBug";
+          break;
+        default:
+          err = new Error("Invalid status code " + resp.statusCode + " received in response.");
+          err.nature = "localBug";
+          break;
+      }
+
+      resp.resume();
+      reject(err);
+    });
+
+    req.on("error", function (e) {
+      e.nature = "networkFailure";
+      reject(e);
+    });
+
+    req.setTimeout(HTTP_GET_TIMEOUT, function () {
+      req.abort();
+      var err = new Error("Request timed out.");
+      err.nature = "localBug";
+      err.durability = "overloaded";
+      reject(err);
+    });
+
+    req.end();
+  });
+}
+
+function pumpToByteStream(input, size, stream, onData) {
+  // Copy the readable stream `input` to the ByteStream capability `stream`, pausing `input`
+  // while too many writes are outstanding. `size`, if not null, is passed to `expectSize()`.
+  // `onData`, if given, sees each chunk as it goes by. Returns a promise that resolves once
+  // `done()` has returned.
+
+  return new Promise(function (resolve, reject) {
+    var inFlight = 0;
+    var failed = false;
+    var ended = false;
+
+    function fail(err) {
+      if (!failed) {
+        failed = true;
+        if (input.destroy) input.destroy();
+        reject(err);
+      }
+    }
+
+    if (size !== null) {
+      stream.expectSize(size).catch(function (err) {
+        // expectSize() is allowed to be unimplemented.
+        if (err.type !== "unimplemented") fail(err);
+      });
+    }
+
+    input.on("data", function (buffer) {
+      if (failed) return;
+      if (onData) onData(buffer);
+
+      if (++inFlight >= HTTP_STREAM_MAX_WRITES_IN_FLIGHT) input.pause();
+      stream.write(buffer).then(function () {
+        if (--inFlight < HTTP_STREAM_MAX_WRITES_IN_FLIGHT && !ended) input.resume();
+      }, fail);
+    });
+
+    input.on("end", function () {
+      ended = true;
+      if (!failed) stream.done().then(resolve, fail);
+    });
+
+    input.on("aborted", function () {
+      fail(new Error("HTTP response was aborted."));
+    });
+
+    input.on("error", fail);
+  });
+}
+
+function HttpCacheWriter(filename, metadata) {
+  // Writes a new cache entry alongside the content as it streams through. The entry only
+  // replaces the existing one once commit() is called.
+
+  this.filename = filename;
+  this.tmpFilename = filename + "." + Random.id() + ".tmp";
+  this.size = 0;
+  this.abandoned = false;
+
+  this.output = Fs.createWriteStream(this.tmpFilename, { flags: "wx" });
+  this.output.on("error", this.abandon.bind(this));
+  this.output.write(JSON.stringify(metadata) + "\n");
+}
+
+HttpCacheWriter.prototype.write = function (buffer) {
+  if (this.abandoned) return;
+
+  this.size += buffer.length;
+  if (this.size > HTTP_CACHE_MAX_ENTRY_SIZE) {
+    this.abandon();
+  } else {
+    this.output.write(buffer);
+  }
+};
+
+HttpCacheWriter.prototype.abandon = function (err) {
+  if (err) console.error("Error writing HTTP cache entry:", this.filename, err.stack);
+  if (!this.abandoned) {
+    this.abandoned = true;
+    this.output.destroy();
+    unlinkIfExists(this.tmpFilename);
+  }
+};
+
+HttpCacheWriter.prototype.commit = function () {
+  // Returns a promise that resolves once the entry is in place (or has been abandoned). Never
+  // rejects: failing to cache is not an error for the caller.
+
+  var self = this;
+  return new Promise(function (resolve) {
+    if (self.abandoned) {
+      resolve();
+      return;
+    }
+
+    self.output.end(function () {
+      if (!self.abandoned) {
+        try {
+          Fs.renameSync(self.tmpFilename, self.filename);
+        } catch (err) {
+          self.abandon(err);
+        }
+      }
+      resolve();
+    });
+  });
+};
+
+HackSessionContextImpl.prototype.httpGetStream = function (url, stream) {
+  var cacheDir = httpCacheDir(this.grainId);
+  var filename = Path.join(cacheDir, Crypto.createHash("sha256").update(url).digest("hex"));
+  var cached = openHttpCacheEntry(filename);
+
+  var headers = {};
+  if (cached) {
+    if (cached.metadata.etag) headers["If-None-Match"] = cached.metadata.etag;
+    if (cached.metadata.lastModified) headers["If-Modified-Since"] = cached.metadata.lastModified;
+  }
+
+  return httpGetResponse(url, headers, 0).then(function (resp) {
+    if (resp.statusCode === 304) {
+      if (!cached) {
+        // We didn't make a conditional request, so this is nonsense.
+        resp.resume();
+        var err = new Error("Status code 304 received in response to unconditional request.");
+        err.nature = "precondition";
+        throw err;
+      }
+
+      resp.resume();
+      try {
+        // Mark the entry as recently used, for trimHttpCache().
+        var now = new Date();
+        Fs.futimesSync(cached.fd, now, now);
+      } catch (err) {
+        console.error("Couldn't touch HTTP cache entry:", filename, err.stack);
+      }
+      var input = Fs.createReadStream(null, { fd: cached.fd, start: cached.offset });
+      var entry = cached;
+      cached = null;  // `input` owns the FD now.
+      return pumpToByteStream(input, entry.size, stream).then(function () {
+        return { mimeType: entry.metadata.mimeType, size: entry.size, fromCache: true };
+      });
+    }
+
+    if (cached) {
+      Fs.closeSync(cached.fd);
+      cached = null;
+    }
+
+    var mimeType = resp.headers["content-type"] || null;
+    var etag = resp.headers["etag"];
+    var lastModified = resp.headers["last-modified"];
+    var cacheControl = resp.headers["cache-control"] || "";
+    var contentLength = resp.headers["content-length"];
+    var size = contentLength === undefined ? null : parseInt(contentLength, 10);
+    if (size !== null && isNaN(size)) size = null;
+
+    var writer = null;
+    if ((etag || lastModified) && !/\bno-store\b/i.test(cacheControl) &&
+        (size === null || size <= HTTP_CACHE_MAX_ENTRY_SIZE)) {
+      try {
+        mkdirIfMissing(Path.dirname(cacheDir));
+        mkdirIfMissing(cacheDir);
+        writer = new HttpCacheWriter(filename,
+            { url: url, etag: etag, lastModified: lastModified, mimeType: mimeType });
+      } catch (err) {
+        console.error("Couldn't create HTTP cache entry:", filename, err.stack);
+      }
+    } else {
+      // Whatever we had cached is stale now.
+      unlinkIfExists(filename);
+    }
+
+    var received = 0;
+    return pumpToByteStream(resp, size, stream, function (buffer) {
+      received += buffer.length;
+      if (writer) writer.write(buffer);
+    }).then(function () {
+      return writer && writer.commit().then(function () {
+        try {
+          trimHttpCache(cacheDir);
+        } catch (err) {
+          console.error("Couldn't trim HTTP cache:", cacheDir, err.stack);
+        }
+      });
+    }, function (err) {
+      if (writer) writer.abandon();
+      throw err;
+    }).then(function () {
+      return { mimeType: mimeType, size: received, fromCache: false };
+    });
+  }).catch(function (err) {
+    if (cached) Fs.closeSync(cached.fd);
+    throw err;
+  });
+};
+
 HackSessionContextImpl.prototype.getUserAddress = function () {
   return inMeteor((function () {
     return this._getUserAddress();
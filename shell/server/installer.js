@@ -82,6 +82,16 @@ deletePackage = function (packageId) {
         console.error(error);
       }
 
+      // The supervisor records which parts of the package apps read at startup next to it.
+      var prefetchPath = Path.join(SANDSTORM_APPDIR, packageId + ".prefetch");
+      if (Fs.existsSync(prefetchPath)) {
+        try {
+          Fs.unlinkSync(prefetchPath);
+        } catch (error) {
+          console.error(error);
+        }
+      }
+
       Packages.remove(packageId);
     }
     delete installers[packageId];
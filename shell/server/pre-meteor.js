@@ -37,6 +37,14 @@ var dnsCache = {};
 // DNS_CACHE_TTL (a relatively small value) and rely on the upstream DNS server to implement
 // better caching.
 
+isPrimaryFrontendWorker = function () {
+  // When the front-end runs as several worker processes (FRONTEND_WORKERS in sandstorm.conf),
+  // work that must happen once per server -- periodic cleanup, one-time initialization, the SMTP
+  // server -- is left to worker 0.
+
+  return !process.env.SANDSTORM_WORKER_INDEX || process.env.SANDSTORM_WORKER_INDEX === "0";
+}
+
 function isSandstormShell(hostname) {
   // Is this hostname mapped to the Sandstorm shell?
 
@@ -45,6 +53,22 @@ function isSandstormShell(hostname) {
 
 Meteor.startup(function () {
 
+  if (process.env.SANDSTORM_LISTEN_FD) {
+    // We're one of several front-end workers. run-bundle already opened a SO_REUSEPORT listen
+    // socket for us, so accept connections on that rather than binding PORT ourselves. (Startup
+    // hooks run before WebApp calls listen().)
+    var listenFd = parseInt(process.env.SANDSTORM_LISTEN_FD, 10);
+    var originalListen = WebApp.httpServer.listen;
+    WebApp.httpServer.listen = function () {
+      var callback = arguments[arguments.length - 1];
+      if (typeof callback === "function") {
+        return originalListen.call(this, {fd: listenFd}, callback);
+      } else {
+        return originalListen.call(this, {fd: listenFd});
+      }
+    };
+  }
+
   var meteorUpgradeListeners = WebApp.httpServer.listeners('upgrade');
   WebApp.httpServer.removeAllListeners('upgrade');
 
@@ -87,13 +111,26 @@ Meteor.startup(function () {
         return;
       }
 
-      publicIdPromise = Promise.resolve(id);
+      // The session may have been opened through another front-end worker.
+      publicIdPromise = restoreProxyForHostId(id).then(function (proxy) {
+        if (proxy) {
+          proxy.requestHandler(req, res);
+          return null;
+        } else {
+          return id;
+        }
+      });
     } else {
       // Not a wildcard host. Perhaps it is a custom host.
       publicIdPromise = lookupPublicIdFromDns(hostname);
     }
 
     publicIdPromise.then(function (publicId) {
+      if (publicId === null) {
+        // Already handed off to a proxy.
+        return null;
+      }
+
       var handler = staticHandlers[publicId];
       if (handler) {
         return handler;
@@ -114,6 +151,7 @@ Meteor.startup(function () {
         });
       }
     }).then(function (handler) {
+      if (!handler) return;
       handler(req, res, function (err) {
         if (err) {
           next(err);
@@ -83,6 +83,32 @@ var proxies = {};
 var proxiesByHostId = {};
 
 Meteor.methods({
+  setUserStorageQuota: function (userId, bytes) {
+    // Sets the storage quota for each of the user's grains, in bytes. Zero means no limit; null
+    // reverts to the server-wide default. Grains that are running get the new quota immediately.
+
+    check(userId, String);
+    check(bytes, Match.OneOf(Number, null));
+
+    if (!isAdmin()) {
+      throw new Meteor.Error(403, "Unauthorized", "User must be admin");
+    }
+
+    if (bytes === null) {
+      Meteor.users.update(userId, {$unset: {storageQuota: ""}});
+    } else {
+      Meteor.users.update(userId, {$set: {storageQuota: bytes}});
+    }
+
+    // Each call fails harmlessly if the grain isn't running; it gets the quota when it next
+    // starts. They go out in parallel and each gives up after a while, so that one wedged grain
+    // can't hold up the rest.
+    var quota = grainStorageQuota(userId);
+    waitPromise(Promise.all(Grains.find({userId: userId}, {fields: {_id: 1}}).map(function (grain) {
+      return setGrainStorageQuota(grain._id, quota);
+    })));
+  },
+
   newGrain: function (packageId, command, title) {
     // Create and start a new grain.
 
@@ -261,8 +287,38 @@ function continueGrain(grainId) {
                            "Package ID: " + packageId);
   }
 
-  return startGrainInternal(
-      packageId, grainId, grain.userId, manifest.continueCommand, false, isDev);
+  if (!lockGrainStart(grainId)) {
+    // Another front-end worker is starting this grain. Use its supervisor once it's up.
+    waitForGrainStart(grainId);
+    return {owner: grain.userId};
+  }
+
+  try {
+    return startGrainInternal(
+        packageId, grainId, grain.userId, manifest.continueCommand, false, isDev);
+  } finally {
+    Grains.update(grainId, {$unset: {startingUntil: ""}});
+  }
+}
+
+var GRAIN_START_TIMEOUT_MS = 60000;
+
+function lockGrainStart(grainId) {
+  // Claims the start of a grain's supervisor for this front-end worker, so that two workers don't
+  // start one each. Returns false if another worker is already starting it.
+
+  var now = Date.now();
+  return Grains.update({_id: grainId, $or: [{startingUntil: {$exists: false}},
+                                            {startingUntil: {$lt: now}}]},
+                       {$set: {startingUntil: now + GRAIN_START_TIMEOUT_MS}}) > 0;
+}
+
+function waitForGrainStart(grainId) {
+  for (;;) {
+    var grain = Grains.findOne(grainId, {fields: {startingUntil: 1}});
+    if (!grain || !grain.startingUntil || grain.startingUntil < Date.now()) return;
+    Meteor._sleepForMs(100);
+  }
 }
 
 function startGrainInternal(packageId, grainId, ownerId, command, isNew, isDev) {
@@ -297,15 +353,31 @@ function startGrainInternal(packageId, grainId, ownerId, command, isNew, isDev)
     args.push("--dev");
   }
 
-  args.push("--");
+  var quota = grainStorageQuota(ownerId);
+  if (quota) {
+    args.push("--quota=" + quota);
+  }
 
   // Ugly: Stay backwards-compatible with old manifests that had "executablePath" and "args" rather
   //   than just "argv".
+  var argv = command.argv || command.args;
   var exePath = command.deprecatedExecutablePath || command.executablePath;
   if (exePath) {
-    args.push(exePath);
+    argv = [exePath].concat(argv);
+  }
+
+  if (process.env.SANDSTORM_GRAIN_CGROUP) {
+    // Run the app in a cgroup of its own, so that it can be hibernated.
+    args.push("--cgroup=" + process.env.SANDSTORM_GRAIN_CGROUP);
   }
-  args = args.concat(command.argv || command.args);
+
+  if (isHttpBridgeCommand(argv)) {
+    // The bridge speaks first on the API socket, which the shared-memory transport requires.
+    args.push("--shm-api");
+  }
+
+  args.push("--");
+  args = args.concat(argv);
 
   var proc = ChildProcess.spawn(exe, args, {
     stdio: ["ignore", "pipe", process.stderr],
@@ -345,6 +417,15 @@ function startGrainInternal(packageId, grainId, ownerId, command, isNew, isDev)
   return waitPromise(whenReady);
 }
 
+function isHttpBridgeCommand(argv) {
+  // Hacky heuristic to decide if the app uses sandstorm-http-bridge, as `spk` does.
+
+  var exe = argv && argv[0];
+  return exe === "/sandstorm-http-bridge" ||
+         exe === "./sandstorm-http-bridge" ||
+         exe === "sandstorm-http-bridge";
+}
+
 shutdownGrain = function (grainId, keepSessions) {
   if (!keepSessions) {
     Sessions.remove({grainId: grainId});
@@ -365,6 +446,70 @@ shutdownGrain = function (grainId, keepSessions) {
   });
 }
 
+function grainStorageQuota(ownerId) {
+  // Returns how many bytes of storage each grain owned by `ownerId` may use, or 0 for no limit.
+  // An admin may set `storageQuota` on a user (see setUserStorageQuota); otherwise the server-wide
+  // `grainStorageQuota` setting applies.
+
+  var user = Meteor.users.findOne(ownerId, {fields: {storageQuota: 1}});
+  if (user && typeof user.storageQuota === "number") {
+    return user.storageQuota;
+  }
+  return (Meteor.settings && Meteor.settings.grainStorageQuota) || 0;
+}
+
+var SUPERVISOR_CALL_TIMEOUT_MS = 10000;
+
+function callGrainSupervisor(grainId, call, fallback) {
+  // Makes a call to a running grain's supervisor, for housekeeping that can do without an answer.
+  // `call(supervisor)` makes the call and returns its promise. Returns a promise for the result,
+  // or for `fallback` if the grain isn't running, the call fails, or the supervisor doesn't
+  // answer within SUPERVISOR_CALL_TIMEOUT_MS.
+  var connection = Capnp.connect("unix:" + Path.join(SANDSTORM_GRAINDIR, grainId, "socket"));
+  var supervisor = connection.restore(null, Supervisor);
+  var promise = call(supervisor);
+
+  return new Promise(function (resolve) {
+    var timer = setTimeout(function () {
+      console.warn("Grain supervisor didn't answer in time:", grainId);
+      if (promise.cancel) promise.cancel();
+      resolve(fallback);
+    }, SUPERVISOR_CALL_TIMEOUT_MS);
+
+    promise.then(function (result) {
+      clearTimeout(timer);
+      resolve(result);
+    }, function (error) {
+      clearTimeout(timer);
+      resolve(fallback);
+    });
+  }).then(function (result) {
+    supervisor.close();
+    connection.close();
+    return result;
+  });
+}
+
+setGrainStorageQuota = function (grainId, bytes) {
+  // Push a new storage quota to a running grain. Zero removes the quota. If the grain isn't
+  // running, there's nothing to do; pass the quota when starting it instead.
+  return callGrainSupervisor(grainId, function (supervisor) {
+    return supervisor.setStorageQuota(bytes);
+  }, null).then(function () {});
+}
+
+getGrainWakeLocks = function (grainId) {
+  // Returns a promise for the list of wake locks held by a running grain. A grain holding wake
+  // locks is doing background work and stays up even without keep-alives, so it should not be
+  // picked for idle shutdown. If the grain isn't running, or its supervisor doesn't answer in
+  // time, it counts as holding none.
+  return callGrainSupervisor(grainId, function (supervisor) {
+    return supervisor.getWakeLocks();
+  }, {locks: []}).then(function (result) {
+    return result.locks;
+  });
+}
+
 deleteGrain = function (grainId) {
   shutdownGrain(grainId);
   // Give time to shut down before deleting.
@@ -373,6 +518,11 @@ deleteGrain = function (grainId) {
     if (Fs.existsSync(dir)) {
       recursiveRmdir(dir);
     }
+
+    var cacheDir = httpCacheDir(grainId);
+    if (Fs.existsSync(cacheDir)) {
+      recursiveRmdir(cacheDir);
+    }
   }, 1000);
 }
 
@@ -400,15 +550,18 @@ getGrainSize = function (sessionId, oldSize) {
 }
 
 Meteor.startup(function () {
-  // Every time the set of dev apps changes, clear all sessions.
-  DevApps.find().observeChanges({
-    removed : function (app) {
-      Sessions.remove({});
-    },
-    added : function (app) {
-      Sessions.remove({});
-    }
-  });
+  if (isPrimaryFrontendWorker()) {
+    // Every time the set of dev apps changes, clear all sessions. (The other workers drop their
+    // proxies when they see the sessions go, below.)
+    DevApps.find().observeChanges({
+      removed : function (app) {
+        Sessions.remove({});
+      },
+      added : function (app) {
+        Sessions.remove({});
+      }
+    });
+  }
 
   Sessions.find().observeChanges({
     removed : function(session) {
@@ -422,26 +575,70 @@ Meteor.startup(function () {
 var TIMEOUT_MS = 300000;
 function gcSessions() {
   var now = new Date().getTime();
-  Sessions.remove({timestamp: {$lt: (now - TIMEOUT_MS)}});
-}
-Meteor.setInterval(gcSessions, 60000);
+  var stale = {timestamp: {$lt: (now - TIMEOUT_MS)}};
+
+  // A grain holding a wake lock is doing background work, possibly on behalf of one of these
+  // sessions (e.g. a long request through it). Leave its sessions alone until the locks go.
+  var grainIds = _.uniq(Sessions.find(stale, {fields: {grainId: 1}}).map(function (session) {
+    return session.grainId;
+  }));
+  // Ask all the grains at once; each call gives up after a while, so a wedged grain can't stall
+  // session GC.
+  var locks = waitPromise(Promise.all(grainIds.map(getGrainWakeLocks)));
+  var busyGrainIds = grainIds.filter(function (grainId, i) {
+    return locks[i].length > 0;
+  });
 
+  Sessions.remove(_.extend(stale, {grainId: {$nin: busyGrainIds}}));
+}
 // Try to restore sessions on server restart.
 Meteor.startup(function () {
-  // Delete stale sessions from session list.
-  gcSessions();
+  if (isPrimaryFrontendWorker()) {
+    // Delete stale sessions from session list, now and periodically.
+    gcSessions();
+    Meteor.setInterval(gcSessions, 60000);
+  }
 
   // Remake proxies for all sessions that remain.
-  Sessions.find({}).forEach(function (session) {
-    var grain = Grains.findOne(session.grainId);
-    var user = Meteor.users.findOne({_id: session.userId});
-    var isOwner = grain.userId === session.userId;
-    var proxy = new Proxy(session.grainId, session._id, session.hostId, isOwner, user, null, false);
-    proxies[session._id] = proxy;
-    proxiesByHostId[session.hostId] = proxy;
-  });
+  Sessions.find({}).forEach(restoreProxy);
 });
 
+function restoreProxy(session) {
+  // Rebuild the proxy for a session recorded in the database. Must be called in a Meteor context.
+
+  var grain = Grains.findOne(session.grainId);
+  if (!grain) return undefined;
+  var user = Meteor.users.findOne({_id: session.userId});
+  var isOwner = grain.userId === session.userId;
+  var proxy = new Proxy(session.grainId, session._id, session.hostId, isOwner, user, null, false);
+  proxies[session._id] = proxy;
+  proxiesByHostId[session.hostId] = proxy;
+  return proxy;
+}
+
+restoreProxyForHostId = function (hostId) {
+  // When the front-end runs as several worker processes (FRONTEND_WORKERS in sandstorm.conf), a
+  // session opened through one worker may receive requests on another. Look the session up in
+  // the database and build a local proxy for it. Returns a Promise for the proxy, or for
+  // undefined if there is no such session.
+
+  if (hostId in proxiesByHostId) {
+    return Promise.resolve(proxiesByHostId[hostId]);
+  } else if (!process.env.SANDSTORM_WORKER_COUNT) {
+    // Single front-end process; every live session already has a proxy here.
+    return Promise.resolve(undefined);
+  }
+
+  return inMeteor(function () {
+    if (hostId in proxiesByHostId) {
+      // Raced with another request for the same session.
+      return proxiesByHostId[hostId];
+    }
+    var session = Sessions.findOne({hostId: hostId});
+    return session && restoreProxy(session);
+  });
+}
+
 // =======================================================================================
 // API tokens
 
@@ -565,6 +762,20 @@ tryProxyUpgrade = function (hostId, req, socket, head) {
 
       proxy.upgradeHandler(req, socket, head);
       return true;
+    } else if (process.env.SANDSTORM_WORKER_COUNT) {
+      // The session may belong to another front-end worker.
+      restoreProxyForHostId(hostId).then(function (proxy) {
+        if (proxy) {
+          socket.setTimeout(120000);
+          proxy.upgradeHandler(req, socket, head);
+        } else {
+          socket.destroy();
+        }
+      }, function (err) {
+        console.error("Failed to restore proxy for WebSocket:", err.stack);
+        socket.destroy();
+      });
+      return true;
     } else {
       return false;
     }
@@ -946,6 +1157,25 @@ function parseAcceptHeader(request) {
   return result;
 }
 
+function parseETagListHeader(header) {
+  // Parses a list of ETags, as in If-None-Match, e.g. `"abc", W/"def"`. "*" and malformed
+  // entries are dropped, which at worst means the full response is sent.
+
+  var result = [];
+  if (header) {
+    var re = /\s*(W\/)?"([^"]*)"\s*(,|$)/g;
+    var match;
+    while ((match = re.exec(header)) !== null) {
+      result.push({ value: match[2], weak: !!match[1] });
+    }
+  }
+  return result;
+}
+
+function formatETag(eTag) {
+  return (eTag.weak ? "W/\"" : "\"") + eTag.value + "\"";
+}
+
 Proxy.prototype.doSessionInit = function (request, response, path) {
   path = path || "/";
 
@@ -991,6 +1221,13 @@ Proxy.prototype.makeContext = function (request, response) {
 
   context.accept = parseAcceptHeader(request);
 
+  if (request.method === "GET") {
+    var eTags = parseETagListHeader(request.headers["if-none-match"]);
+    if (eTags.length > 0) {
+      context.eTagPrecondition = { matchesNoneOf: eTags };
+    }
+  }
+
   var promise = new Promise(function (resolve, reject) {
     response.resolveResponseStream = resolve;
     response.rejectResponseStream = reject;
@@ -1141,6 +1378,9 @@ Proxy.prototype.translateResponse = function (rpcResponse, response) {
     if (content.language) {
       response.setHeader("Content-Language", content.language);
     }
+    if (content.eTag && content.eTag.value) {
+      response.setHeader("ETag", formatETag(content.eTag));
+    }
     if (("disposition" in content) && ("download" in content.disposition)) {
       response.setHeader("Content-Disposition", "attachment; filename=\"" +
           content.disposition.download.replace(/([\\"\n])/g, "\\$1") + "\"");
@@ -1170,6 +1410,14 @@ Proxy.prototype.translateResponse = function (rpcResponse, response) {
     if ("bytes" in content.body) {
       response.end(content.body.bytes);
     }
+  } else if ("preconditionFailed" in rpcResponse) {
+    // We only send preconditions with GET requests.
+    var matchingETag = rpcResponse.preconditionFailed.matchingETag;
+    if (matchingETag && matchingETag.value) {
+      response.setHeader("ETag", formatETag(matchingETag));
+    }
+    response.writeHead(304, "Not Modified");
+    response.end();
   } else if ("noContent" in rpcResponse) {
     var noContent = rpcResponse.noContent;
     var noContentCode = noContentSuccessCodes[noContent.shouldResetForm * 1];
@@ -16,9 +16,27 @@
 
 // This file is for various startup code that doesn't fit neatly anywhere else
 
+var Fs = Npm.require("fs");
+
 var ROOT_URL = process.env.ROOT_URL;
 
+if (process.env.SANDSTORM_HEARTBEAT_FD) {
+  // run-bundle restarts the front-end if it stops writing to this pipe, e.g. because the event
+  // loop is stuck.
+  var heartbeatFd = parseInt(process.env.SANDSTORM_HEARTBEAT_FD, 10);
+  var heartbeatByte = new Buffer(".");
+  setInterval(function () {
+    Fs.write(heartbeatFd, heartbeatByte, 0, 1, null, function (err) {
+      if (err) {
+        console.error("Failed to write front-end heartbeat:", err.message);
+      }
+    });
+  }, 5000);
+}
+
 Meteor.startup(function () {
+  if (!isPrimaryFrontendWorker()) return;
+
   var baseUrlRow = Misc.findOne({_id: "BASE_URL"});
 
   if (!baseUrlRow) {
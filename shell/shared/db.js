@@ -85,6 +85,10 @@ Grains = new Mongo.Collection("grains");
 // is implemented.
 //   publicId:  An id used to publicly identify this grain. Used e.g. to route incoming e-mail and
 //       web publishing. This field is initialized when first requested by the app.
+//
+// While a front-end worker is starting the grain's supervisor:
+//   startingUntil:  Time (ms since epoch) after which the start is presumed to have failed. Other
+//       workers wait for it rather than starting a second supervisor.
 
 RoleAssignments = new Mongo.Collection("roleAssignments");
 // Edges in the permissions sharing graph.
@@ -240,6 +244,14 @@ StatsTokens = new Mongo.Collection("statsTokens");
 // Each contains:
 //   _id:       The token. At least 128 bits entropy (Random.id(22)).
 
+MailSendCounts = new Mongo.Collection("mailSendCounts");
+// Number of e-mails each user has sent from grains per day, for the daily sending limit.
+//
+// Each contains:
+//   _id:    The user's `_id`, a colon, and the day.
+//   day:    Days since the epoch, UTC.
+//   count:  Number of e-mails sent that day.
+
 Misc = new Mongo.Collection("misc");
 // Miscellaneous configuration and other settings
 //
@@ -67,7 +67,9 @@ if (Meteor.isServer) {
     });
   }
 
-  Meteor.startup(cleanupExpiredUsers);
+  if (isPrimaryFrontendWorker()) {
+    Meteor.startup(cleanupExpiredUsers);
+  }
 
   if (allowDemo) {
     Meteor.methods({
@@ -115,7 +117,11 @@ if (Meteor.isServer) {
       return packageCursor;
     });
 
-    Meteor.setInterval(cleanupExpiredUsers, DEMO_EXPIRATION_MS);
+    Meteor.startup(function () {
+      if (isPrimaryFrontendWorker()) {
+        Meteor.setInterval(cleanupExpiredUsers, DEMO_EXPIRATION_MS);
+      }
+    });
 
     // The demo displays some assets loaded from sandstorm.io.
     BrowserPolicy.content.allowOriginForAll("https://sandstorm.io");
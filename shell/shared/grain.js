@@ -103,7 +103,11 @@ if (Meteor.isServer) {
     ApiTokens.remove({expires: {$lt: now}});
   }
 
-  Meteor.setInterval(cleanupExpiredTokens, 3600000);
+  Meteor.startup(function () {
+    if (isPrimaryFrontendWorker()) {
+      Meteor.setInterval(cleanupExpiredTokens, 3600000);
+    }
+  });
 }
 
 var GrainSizes = new Mongo.Collection("grainSizes");
@@ -38,13 +38,16 @@ if (Meteor.isServer) {
   }
 
   // Wait until 10:00 UTC (2:00 PST / 5:00 EST), then start recording stats every 24 hours.
-  Meteor.setTimeout(function () {
-    Meteor.setInterval(function () {
-      recordStats();
-    }, DAY_MS);
+  Meteor.startup(function () {
+    if (!isPrimaryFrontendWorker()) return;
+    Meteor.setTimeout(function () {
+      Meteor.setInterval(function () {
+        recordStats();
+      }, DAY_MS);
 
-    recordStats();
-  }, DAY_MS - (Date.now() - 10*60*60*1000) % DAY_MS);
+      recordStats();
+    }, DAY_MS - (Date.now() - 10*60*60*1000) % DAY_MS);
+  });
 
   Meteor.publish("activityStats", function () {
     var user = this.userId && Meteor.users.findOne({_id: this.userId}, {fields: {isAdmin: 1}});
@@ -84,7 +87,7 @@ if (Meteor.isServer) {
   });
 
   Meteor.startup(function () {
-    if (StatsTokens.find().count() === 0) {
+    if (isPrimaryFrontendWorker() && StatsTokens.find().count() === 0) {
       StatsTokens.remove({});
       StatsTokens.insert({_id: Random.id(22)});
     }
@@ -0,0 +1,323 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "http_parser.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <string.h>
+
+namespace {
+
+// The header fast paths only ever skip bytes within a single http_parser_execute() call, so
+// feeding the parser one byte at a time runs the plain per-character state machine. These tests
+// check that parsing the same input in larger pieces produces exactly the same callbacks, state
+// and errors.
+
+enum EventType {
+  MESSAGE_BEGIN, URL, STATUS, HEADER_FIELD, HEADER_VALUE, HEADERS_COMPLETE, BODY, MESSAGE_COMPLETE
+};
+
+struct Event {
+  EventType type;
+  kj::Vector<char> data;
+};
+
+struct Recorder: public http_parser {
+  kj::Vector<Event> events;
+
+  explicit Recorder(http_parser_type type) {
+    http_parser_init(this, type);
+    data = this;
+  }
+
+  void notify(EventType type) {
+    events.add(Event { type, kj::Vector<char>() });
+  }
+
+  void addData(EventType type, const char* ptr, size_t size) {
+    // Data callbacks may be split arbitrarily across execute() calls, so merge consecutive
+    // callbacks of the same kind.
+    if (events.size() == 0 || events.back().type != type) {
+      events.add(Event { type, kj::Vector<char>() });
+    }
+    events.back().data.addAll(ptr, ptr + size);
+  }
+
+  size_t parse(kj::ArrayPtr<const char> input, kj::ArrayPtr<const size_t> chunkSizes) {
+    // Feed `input` in pieces of the given sizes (cycling), stopping at the first error. Returns
+    // the total number of bytes consumed.
+
+    static const http_parser_settings settings = {
+#define NOTIFY(TYPE) [](http_parser* p) { \
+        static_cast<Recorder*>(p->data)->notify(TYPE); return 0; }
+#define DATA(TYPE) [](http_parser* p, const char* d, size_t s) { \
+        static_cast<Recorder*>(p->data)->addData(TYPE, d, s); return 0; }
+      NOTIFY(MESSAGE_BEGIN), DATA(URL), DATA(STATUS), DATA(HEADER_FIELD), DATA(HEADER_VALUE),
+      NOTIFY(HEADERS_COMPLETE), DATA(BODY), NOTIFY(MESSAGE_COMPLETE)
+#undef NOTIFY
+#undef DATA
+    };
+
+    size_t pos = 0;
+    size_t i = 0;
+    while (pos < input.size()) {
+      size_t n = kj::min(chunkSizes[i++ % chunkSizes.size()], input.size() - pos);
+      size_t nread = http_parser_execute(this, &settings, input.begin() + pos, n);
+      pos += nread;
+      if (nread != n || HTTP_PARSER_ERRNO(this) != HPE_OK || upgrade) break;
+    }
+    return pos;
+  }
+};
+
+void expectSameParse(http_parser_type type, kj::ArrayPtr<const char> input,
+                     kj::ArrayPtr<const size_t> chunkSizes) {
+  Recorder reference(type);
+  size_t one = 1;
+  size_t referenceConsumed = reference.parse(input, kj::arrayPtr(&one, 1));
+
+  Recorder fast(type);
+  size_t fastConsumed = fast.parse(input, chunkSizes);
+
+  auto inputText = kj::heapString(input.begin(), kj::min(input.size(), 200));
+  KJ_ASSERT(fastConsumed == referenceConsumed, inputText);
+  KJ_ASSERT(HTTP_PARSER_ERRNO(&fast) == HTTP_PARSER_ERRNO(&reference),
+            http_errno_name(HTTP_PARSER_ERRNO(&fast)),
+            http_errno_name(HTTP_PARSER_ERRNO(&reference)), inputText);
+  KJ_ASSERT(fast.state == reference.state, inputText);
+  KJ_ASSERT(fast.header_state == reference.header_state, inputText);
+  KJ_ASSERT(fast.flags == reference.flags, inputText);
+  KJ_ASSERT(fast.nread == reference.nread, inputText);
+  KJ_ASSERT(fast.content_length == reference.content_length, inputText);
+  KJ_ASSERT(fast.status_code == reference.status_code, inputText);
+  KJ_ASSERT(fast.upgrade == reference.upgrade, inputText);
+
+  if (HTTP_PARSER_ERRNO(&reference) == HPE_OK) {
+    KJ_ASSERT(fast.events.size() == reference.events.size(), inputText);
+  } else {
+    // On error, execute() returns without delivering data marked earlier in the same call, so
+    // the last data callback may be cut short or missing when the input comes in larger pieces.
+    KJ_ASSERT(fast.events.size() + 1 >= reference.events.size() &&
+              fast.events.size() <= reference.events.size(), inputText);
+  }
+
+  for (size_t i = 0; i < fast.events.size(); i++) {
+    auto& a = fast.events[i];
+    auto& b = reference.events[i];
+    KJ_ASSERT(a.type == b.type, i, inputText);
+    if (HTTP_PARSER_ERRNO(&reference) != HPE_OK && i + 1 == reference.events.size()) {
+      KJ_ASSERT(a.data.size() <= b.data.size(), i, inputText);
+    } else {
+      KJ_ASSERT(a.data.size() == b.data.size(), i, inputText);
+    }
+    KJ_ASSERT(a.data.size() == 0 || memcmp(a.data.begin(), b.data.begin(), a.data.size()) == 0,
+              i, inputText);
+  }
+}
+
+class Random {
+  // xorshift64*; deterministic so that failures are reproducible.
+
+public:
+  explicit Random(uint64_t seed): state(seed) {}
+
+  uint64_t next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ull;
+  }
+
+  uint operator()(uint n) { return next() % n; }
+
+private:
+  uint64_t state;
+};
+
+void addString(kj::Vector<char>& out, kj::StringPtr text) {
+  out.addAll(text.begin(), text.end());
+}
+
+void addRandomToken(kj::Vector<char>& out, Random& random, uint maxLength) {
+  // Mostly plain header-name characters, with the occasional other token character and the
+  // occasional byte that isn't allowed at all.
+  static const char plain[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-";
+  static const char other[] = "!#$%&'*+.^_`|~ \t\"(),/;<=>?@[\\]{}\x7f\x80\xff";
+  uint length = random(maxLength) + 1;
+  for (uint i = 0; i < length; i++) {
+    uint roll = random(100);
+    if (roll < 90) {
+      out.add(plain[random(sizeof(plain) - 1)]);
+    } else if (roll < 99) {
+      out.add(other[random(sizeof(other) - 1)]);
+    } else {
+      out.add(random(256));
+    }
+  }
+}
+
+void addRandomValue(kj::Vector<char>& out, Random& random, uint maxLength) {
+  uint length = random(maxLength);
+  for (uint i = 0; i < length; i++) {
+    uint roll = random(1000);
+    if (roll < 990) {
+      out.add(' ' + random(95));
+    } else if (roll < 994) {
+      out.add('\t');
+    } else if (roll < 997) {
+      out.add('\r');
+    } else {
+      out.add('\n');
+    }
+  }
+}
+
+kj::Array<char> randomMessage(Random& random, http_parser_type type) {
+  static const kj::StringPtr SPECIAL_HEADERS[] = {
+    "Connection: keep-alive", "Connection: close", "Content-Length: 5",
+    "Transfer-Encoding: chunked", "Upgrade: websocket", "Proxy-Connection: close",
+    "content-length:  12 ", "CONNECTION:Close", "Transfer-Encoding: gzip, chunked",
+    "Connectionx: close", "Content-Type: text/plain"
+  };
+
+  kj::Vector<char> out;
+  uint messages = random(3) + 1;
+  for (uint m = 0; m < messages; m++) {
+    if (type == HTTP_REQUEST) {
+      addString(out, random(2) ? "GET /foo/bar?baz=qux HTTP/1.1\r\n" : "POST / HTTP/1.0\n");
+    } else {
+      addString(out, random(2) ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.0 404 Not Found\n");
+    }
+
+    uint headers = random(12);
+    bool chunked = false;
+    for (uint h = 0; h < headers; h++) {
+      if (random(4) == 0) {
+        auto header = SPECIAL_HEADERS[random(kj::size(SPECIAL_HEADERS))];
+        chunked = chunked || header.startsWith("Transfer-Encoding: chunked");
+        addString(out, header);
+      } else {
+        addRandomToken(out, random, random(4) == 0 ? 80 : 20);
+        addString(out, random(8) ? ": " : ":");
+        addRandomValue(out, random, random(4) == 0 ? 300 : 40);
+      }
+      addString(out, random(4) ? "\r\n" : "\n");
+
+      if (random(20) == 0) {
+        // Obsolete line folding.
+        addString(out, " continued");
+        addRandomValue(out, random, 40);
+        addString(out, "\r\n");
+      }
+    }
+    addString(out, "\r\n");
+
+    if (chunked) {
+      addString(out, "5\r\nhello\r\n0\r\n");
+      if (random(2)) {
+        // Trailer headers go through the same states.
+        addRandomToken(out, random, 30);
+        addString(out, ": ");
+        addRandomValue(out, random, 60);
+        addString(out, "\r\n");
+      }
+      addString(out, "\r\n");
+    } else {
+      addString(out, "hello");
+    }
+  }
+
+  // Sometimes corrupt a few bytes.
+  if (random(4) == 0 && out.size() > 0) {
+    uint flips = random(3) + 1;
+    for (uint i = 0; i < flips; i++) {
+      out[random(out.size())] = random(256);
+    }
+  }
+
+  auto result = kj::heapArray<char>(out.size());
+  memcpy(result.begin(), out.begin(), out.size());
+  return result;
+}
+
+KJ_TEST("http_parser fast paths match byte-at-a-time parsing") {
+  Random random(0x5eed1234abcd0001ull);
+
+  for (uint iteration = 0; iteration < 3000; iteration++) {
+    auto type = random(2) ? HTTP_REQUEST : HTTP_RESPONSE;
+    auto input = randomMessage(random, type);
+
+    size_t whole = input.size() == 0 ? 1 : input.size();
+    expectSameParse(type, input, kj::arrayPtr(&whole, 1));
+
+    size_t chunks[4];
+    for (auto& chunk: chunks) {
+      chunk = random(64) + 1;
+    }
+    expectSameParse(type, input, kj::arrayPtr(chunks, kj::size(chunks)));
+  }
+}
+
+KJ_TEST("http_parser fast paths on block boundaries") {
+  // Place the terminator of a header name and value at every offset across a couple of vector
+  // widths, so that every position in a block and the scalar tail are exercised.
+
+  for (uint nameLength = 1; nameLength < 80; nameLength++) {
+    for (uint valueLength = 0; valueLength < 80; valueLength += 7) {
+      kj::Vector<char> out;
+      addString(out, "HTTP/1.1 200 OK\r\n");
+      for (uint i = 0; i < nameLength; i++) {
+        out.add("Xy-z9_"[i % 6]);
+      }
+      addString(out, ": ");
+      for (uint i = 0; i < valueLength; i++) {
+        out.add("ab c;=\t"[i % 7]);
+      }
+      addString(out, "\r\nContent-Length: 0\r\n\r\n");
+
+      size_t whole = out.size();
+      expectSameParse(HTTP_RESPONSE, out.asPtr(), kj::arrayPtr(&whole, 1));
+    }
+  }
+}
+
+KJ_TEST("http_parser fast paths respect HTTP_MAX_HEADER_SIZE") {
+  // A huge header value must still fail on exactly the byte that crosses the limit.
+
+  for (uint slack = 0; slack < 40; slack++) {
+    kj::Vector<char> out;
+    addString(out, "HTTP/1.1 200 OK\r\nX-Big: ");
+    size_t valueLength = HTTP_MAX_HEADER_SIZE - out.size() - 20 + slack;
+    for (size_t i = 0; i < valueLength; i++) {
+      out.add('a' + i % 26);
+    }
+    addString(out, "\r\nX-Long-Name-");
+    for (uint i = 0; i < 100; i++) {
+      out.add('n');
+    }
+    addString(out, ": x\r\n\r\n");
+
+    size_t whole = out.size();
+    expectSameParse(HTTP_RESPONSE, out.asPtr(), kj::arrayPtr(&whole, 1));
+
+    Recorder parser(HTTP_RESPONSE);
+    parser.parse(out.asPtr(), kj::arrayPtr(&whole, 1));
+    KJ_EXPECT(HTTP_PARSER_ERRNO(&parser) == HPE_HEADER_OVERFLOW);
+  }
+}
+
+}  // namespace
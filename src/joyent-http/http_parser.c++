@@ -29,6 +29,12 @@
 #include <string.h>
 #include <limits.h>
 
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
 #ifndef ULLONG_MAX
 # define ULLONG_MAX ((uint64_t) -1) /* 2^64-1 */
 #endif
@@ -399,6 +405,141 @@ do {                                                                 \
 #endif
 
 
+/* Fast scanners for the bulk of header names and values.
+ *
+ * Once a header name or value has been classified as h_general, the state
+ * machine does nothing with its bytes except look for the terminator. These
+ * return the first byte in [p, end) that the state machine needs to see;
+ * every byte before it would have been a no-op. The vector loops only test
+ * for the common characters (alphanumerics and '-' in names, anything other
+ * than CR and LF in values) and defer to the scalar tables for the rest, so
+ * all three variants stop on exactly the same byte.
+ */
+#if defined(__SSE2__)
+/* Bit i is set if byte i of the block is not [A-Za-z0-9-]. */
+static inline unsigned int
+header_name_mask_sse2(__m128i v)
+{
+  __m128i l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(l, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+  __m128i dash = _mm_cmpeq_epi8(v, _mm_set1_epi8('-'));
+  __m128i ok = _mm_or_si128(_mm_or_si128(alpha, digit), dash);
+  return ~_mm_movemask_epi8(ok) & 0xffff;
+}
+
+/* Bit i is set if byte i of the block is CR or LF. */
+static inline unsigned int
+header_value_mask_sse2(__m128i v)
+{
+  return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(CR)),
+                                        _mm_cmpeq_epi8(v, _mm_set1_epi8(LF))));
+}
+#endif
+
+#if defined(__AVX2__)
+static inline unsigned int
+header_name_mask_avx2(__m256i v)
+{
+  __m256i l = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+  __m256i alpha = _mm256_and_si256(
+      _mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), l));
+  __m256i digit = _mm256_and_si256(
+      _mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+  __m256i dash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-'));
+  __m256i ok = _mm256_or_si256(_mm256_or_si256(alpha, digit), dash);
+  return ~(unsigned int) _mm256_movemask_epi8(ok);
+}
+
+static inline unsigned int
+header_value_mask_avx2(__m256i v)
+{
+  return (unsigned int) _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(CR)),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(LF))));
+}
+#endif
+
+static const char *
+scan_header_name(const char *p, const char *end)
+{
+  unsigned int mask;
+
+#if defined(__AVX2__)
+  while (end - p >= 32) {
+    mask = header_name_mask_avx2(_mm256_loadu_si256((const __m256i *) p));
+    if (mask == 0) {
+      p += 32;
+      continue;
+    }
+    p += __builtin_ctz(mask);
+    /* Not alphanumeric, but maybe still a token, e.g. '_'. */
+    if (!TOKEN(*p)) return p;
+    ++p;
+  }
+#endif
+#if defined(__SSE2__)
+  while (end - p >= 16) {
+    mask = header_name_mask_sse2(_mm_loadu_si128((const __m128i *) p));
+    if (mask == 0) {
+      p += 16;
+      continue;
+    }
+    p += __builtin_ctz(mask);
+    if (!TOKEN(*p)) return p;
+    ++p;
+  }
+#endif
+  (void) mask;
+
+  while (p != end && TOKEN(*p)) ++p;
+  return p;
+}
+
+static const char *
+scan_header_value(const char *p, const char *end)
+{
+  unsigned int mask;
+
+#if defined(__AVX2__)
+  while (end - p >= 32) {
+    mask = header_value_mask_avx2(_mm256_loadu_si256((const __m256i *) p));
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 32;
+  }
+#endif
+#if defined(__SSE2__)
+  while (end - p >= 16) {
+    mask = header_value_mask_sse2(_mm_loadu_si128((const __m128i *) p));
+    if (mask != 0) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  (void) mask;
+
+  while (p != end && *p != CR && *p != LF) ++p;
+  return p;
+}
+
+/* Skip ahead after the current byte 'p' with SCAN, accounting the skipped
+ * bytes in nread. The skip is capped so that the byte which would overflow
+ * HTTP_MAX_HEADER_SIZE is still seen by the main loop, which reports it.
+ */
+#define SKIP_AHEAD(SCAN)                                             \
+do {                                                                 \
+  const char *end_ = data + len;                                     \
+  size_t room_ = HTTP_MAX_HEADER_SIZE - parser->nread;               \
+  if ((size_t) (end_ - (p + 1)) > room_) end_ = p + 1 + room_;       \
+  const char *q_ = SCAN(p + 1, end_);                                \
+  parser->nread += q_ - (p + 1);                                     \
+  p = q_ - 1;                                                        \
+} while (0)
+
+
 /* Map errno values to strings for human-readable output */
 #define HTTP_STRERROR_GEN(n, s) { "HPE_" #n, s },
 static struct {
@@ -1278,6 +1419,7 @@ size_t http_parser_execute (http_parser *parser,
         if (c) {
           switch (parser->header_state) {
             case h_general:
+              SKIP_AHEAD(scan_header_name);
               break;
 
             case h_C:
@@ -1487,6 +1629,7 @@ size_t http_parser_execute (http_parser *parser,
 
         switch (parser->header_state) {
           case h_general:
+            SKIP_AHEAD(scan_header_value);
             break;
 
           case h_connection:
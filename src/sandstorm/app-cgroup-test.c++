@@ -0,0 +1,138 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "app-cgroup.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace sandstorm {
+namespace {
+
+kj::Maybe<kj::String> ownCgroup() {
+  // Returns the path of the cgroup v2 directory containing this process, if there is one.
+
+  auto text = readAll("/proc/self/cgroup");
+  for (auto& line: split(text, '\n')) {
+    auto str = kj::heapString(line);
+    if (str.startsWith("0::")) {
+      return kj::str("/sys/fs/cgroup", str.slice(3));
+    }
+  }
+  return nullptr;
+}
+
+KJ_TEST("AppCgroup freezes and thaws its processes") {
+  kj::String parent;
+  KJ_IF_MAYBE(p, ownCgroup()) {
+    parent = kj::mv(*p);
+  } else {
+    KJ_LOG(WARNING, "not in a cgroup v2 hierarchy; skipping test");
+    return;
+  }
+
+  auto name = kj::str("app-cgroup-test-", getpid());
+  kj::Maybe<kj::Own<AppCgroup>> maybeCgroup;
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    maybeCgroup = kj::heap<AppCgroup>(parent, name);
+  })) {
+    KJ_LOG(WARNING, "can't create a cgroup here; skipping test", *exception);
+    return;
+  }
+  auto& cgroup = *KJ_ASSERT_NONNULL(maybeCgroup);
+  KJ_DEFER(rmdir(kj::str(parent, '/', name).cStr()));
+  KJ_EXPECT(!cgroup.isFrozen());
+
+  void* shared = mmap(nullptr, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap", errno);
+  }
+  KJ_DEFER(munmap(shared, sizeof(uint64_t)));
+  volatile uint64_t* counter = reinterpret_cast<volatile uint64_t*>(shared);
+  *counter = 0;
+
+  // Joining the cgroup can fail where creating it didn't, e.g. if our own cgroup isn't
+  // delegated to us. The child reports which.
+  int fds[2];
+  KJ_SYSCALL(pipe(fds));
+  kj::AutoCloseFd readEnd(fds[0]);
+  kj::AutoCloseFd writeEnd(fds[1]);
+
+  pid_t child;
+  KJ_SYSCALL(child = fork());
+  if (child == 0) {
+    readEnd = nullptr;
+    char status = 'y';
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { cgroup.enter(); })) {
+      status = 'n';
+    }
+    if (write(writeEnd, &status, 1) < 0 || status != 'y') _exit(1);
+    for (;;) ++*counter;
+  }
+  KJ_DEFER({
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+  });
+  writeEnd = nullptr;
+
+  char status = 'n';
+  kj::FdInputStream(readEnd.get()).tryRead(&status, 1, 1);
+  if (status != 'y') {
+    KJ_LOG(WARNING, "can't move processes into the cgroup; skipping test");
+    return;
+  }
+
+  cgroup.freeze();
+  KJ_EXPECT(cgroup.isFrozen());
+  for (uint i = 0; i < 100 && !cgroup.isFullyFrozen(); i++) {
+    usleep(10000);
+  }
+  KJ_ASSERT(cgroup.isFullyFrozen());
+
+  uint64_t frozenAt = *counter;
+  usleep(50000);
+  KJ_EXPECT(*counter == frozenAt, "process kept running while frozen");
+
+  // Only tells us something if the memory controller is enabled, but mustn't throw either way.
+  {
+    auto io = kj::setupAsyncIo();
+    KJ_IF_MAYBE(bytes, cgroup.reclaimMemory(io.provider->getTimer()).wait(io.waitScope)) {
+      KJ_EXPECT(*bytes > 0);
+    }
+  }
+
+  cgroup.thaw();
+  KJ_EXPECT(!cgroup.isFrozen());
+  usleep(50000);
+  KJ_EXPECT(*counter != frozenAt, "process didn't resume after thawing");
+  KJ_EXPECT(!cgroup.isFullyFrozen());
+
+  // Without cgroup.kill (before Linux 5.14) the child outlives this, so the cgroup stays.
+  bool canKill = access(kj::str(parent, '/', name, "/cgroup.kill").cStr(), W_OK) == 0;
+  cgroup.killAndRemove();
+  if (canKill) {
+    KJ_EXPECT(access(kj::str(parent, '/', name).cStr(), F_OK) < 0, "cgroup wasn't removed");
+  }
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,152 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "app-cgroup.h"
+#include <kj/debug.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "util.h"
+
+namespace sandstorm {
+
+static const long CGROUP2_SUPER_MAGIC = 0x63677270;
+// From <linux/magic.h>.
+
+static uint64_t parseBytes(kj::StringPtr text) {
+  char* end;
+  errno = 0;
+  uint64_t result = strtoull(text.cStr(), &end, 10);
+  KJ_ASSERT(text.size() > 0 && *end == '\0' && errno == 0, "bad cgroup byte count", text);
+  return result;
+}
+
+static constexpr uint64_t RECLAIM_STEP_BYTES = 8 << 20;
+// How much memory.reclaim is asked for at a time. The kernel takes a few milliseconds per step.
+
+AppCgroup::AppCgroup(kj::StringPtr parent, kj::StringPtr name)
+    : parentDir(raiiOpen(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+      name(kj::heapString(name)) {
+  struct statfs stats;
+  KJ_SYSCALL(fstatfs(parentDir, &stats), parent);
+  KJ_REQUIRE(stats.f_type == CGROUP2_SUPER_MAGIC, "not a cgroup v2 directory", parent);
+
+  if (mkdirat(parentDir, name.cStr(), 0755) < 0) {
+    int error = errno;
+    if (error != EEXIST) {
+      KJ_FAIL_SYSCALL("mkdirat(cgroup)", error, parent, name);
+    }
+  }
+  dir = raiiOpenAt(parentDir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  // A cgroup left behind by a supervisor that died while its grain was hibernating would freeze
+  // our app as soon as it entered.
+  thaw();
+}
+
+void AppCgroup::enter() {
+  // "0" means the writing process, whatever PID namespace it's in.
+  write("cgroup.procs", "0");
+}
+
+void AppCgroup::freeze() {
+  write("cgroup.freeze", "1");
+  frozen = true;
+}
+
+void AppCgroup::thaw() {
+  write("cgroup.freeze", "0");
+  frozen = false;
+}
+
+bool AppCgroup::isFullyFrozen() {
+  auto events = read("cgroup.events");
+  for (auto& line: split(events, '\n')) {
+    auto words = split(line, ' ');
+    if (words.size() == 2 && kj::heapString(words[0]) == "frozen") {
+      return kj::heapString(words[1]) == "1";
+    }
+  }
+  return false;
+}
+
+kj::Promise<kj::Maybe<uint64_t>> AppCgroup::reclaimMemory(kj::Timer& timer) {
+  if (faccessat(dir, "memory.reclaim", W_OK, 0) < 0) {
+    int error = errno;
+    if (error == ENOENT) return kj::Maybe<uint64_t>(nullptr);
+    KJ_FAIL_SYSCALL("faccessat(memory.reclaim)", error);
+  }
+
+  return reclaimSteps(timer, raiiOpenAt(dir, "memory.reclaim", O_WRONLY | O_CLOEXEC))
+      .then([](uint64_t bytes) -> kj::Maybe<uint64_t> { return bytes; });
+}
+
+kj::Promise<uint64_t> AppCgroup::reclaimSteps(kj::Timer& timer, kj::AutoCloseFd reclaimFd) {
+  uint64_t current = parseBytes(read("memory.current"));
+  if (current == 0 || !frozen) {
+    return current;
+  }
+
+  // The kernel fails with EAGAIN once it can't find as much as we asked for; we're done then.
+  auto amount = kj::str(kj::min(current, RECLAIM_STEP_BYTES));
+  if (::write(reclaimFd, amount.begin(), amount.size()) < 0) {
+    int error = errno;
+    if (error != EAGAIN) {
+      KJ_FAIL_SYSCALL("write(memory.reclaim)", error);
+    }
+    return parseBytes(read("memory.current"));
+  }
+
+  // Go through the timer rather than evalLater(), so that I/O gets a look in between steps.
+  return timer.afterDelay(0 * kj::MILLISECONDS)
+      .then([this, &timer, KJ_MVCAP(reclaimFd)]() mutable {
+    return reclaimSteps(timer, kj::mv(reclaimFd));
+  });
+}
+
+void AppCgroup::killAndRemove() {
+  int fd = openat(dir, "cgroup.kill", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    ssize_t n = ::write(fd, "1", 1);
+    (void)n;
+    close(fd);
+  }
+
+  // rmdir fails with EBUSY until the last process is gone. Give them up to 100ms.
+  for (uint i = 0; i < 100; i++) {
+    if (unlinkat(parentDir, name.cStr(), AT_REMOVEDIR) == 0 || errno != EBUSY) return;
+    struct timespec delay = { 0, 1000000 };
+    nanosleep(&delay, nullptr);
+  }
+}
+
+void AppCgroup::write(kj::StringPtr file, kj::StringPtr value) {
+  auto fd = raiiOpenAt(dir, file, O_WRONLY | O_CLOEXEC);
+  ssize_t n;
+  KJ_SYSCALL(n = ::write(fd, value.begin(), value.size()), file, value);
+  KJ_ASSERT(size_t(n) == value.size(), "short write to cgroup file", file);
+}
+
+kj::String AppCgroup::read(kj::StringPtr file) {
+  return trim(readAll(raiiOpenAt(dir, file, O_RDONLY | O_CLOEXEC)));
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,93 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_APP_CGROUP_H_
+#define SANDSTORM_APP_CGROUP_H_
+
+#include <kj/async-io.h>
+#include <kj/io.h>
+#include <kj/string.h>
+
+namespace sandstorm {
+
+constexpr const char* GRAIN_CGROUP_ENV = "SANDSTORM_GRAIN_CGROUP";
+// Set by the server monitor, per the GRAIN_CGROUP config key, to where that cgroup is mounted
+// within its chroot. The front-end passes it on to supervisors as --cgroup.
+
+class AppCgroup {
+  // A cgroup (v2) holding a grain's whole process tree, through which the supervisor can freeze
+  // the tree ("hibernate" the grain) and thaw it again. Needs Linux 5.2, or 5.19 to reclaim
+  // memory.
+  //
+  // The cgroup is opened by file descriptor, so it can still be used after the supervisor has
+  // left the filesystem it was found in.
+
+public:
+  AppCgroup(kj::StringPtr parent, kj::StringPtr name);
+  // Creates the cgroup `name` in the cgroup directory `parent`, or reuses it if it already
+  // exists, e.g. left behind by an earlier run of the same grain. It starts out thawed.
+  //
+  // `parent` must be writable by the caller, and so must the `cgroup.procs` of the closest cgroup
+  // containing both `parent` and the caller, as is the case within a cgroup delegated to the
+  // caller's user.
+
+  KJ_DISALLOW_COPY(AppCgroup);
+
+  void enter();
+  // Moves the calling process into the cgroup. Its children will start out there too.
+
+  void freeze();
+  // Starts freezing every process in the cgroup. The kernel finishes asynchronously; see
+  // isFullyFrozen().
+
+  void thaw();
+  // Lets the processes run again.
+
+  bool isFrozen() const { return frozen; }
+  // Whether freeze() has been called more recently than thaw().
+
+  bool isFullyFrozen();
+  // Whether the kernel reports every process in the cgroup as frozen.
+
+  kj::Promise<kj::Maybe<uint64_t>> reclaimMemory(kj::Timer& timer);
+  // Asks the kernel to push as much of the cgroup's memory as it can out to swap, or, for file
+  // pages, back to disk. Returns the bytes still charged to the cgroup, or null if the memory
+  // controller isn't enabled for it.
+  //
+  // Each write to memory.reclaim blocks until the kernel has done it, so this goes a few
+  // megabytes at a time, letting other events in between. It stops early if the cgroup is
+  // thawed.
+
+  void killAndRemove();
+  // Kills every process in the cgroup, if the kernel supports that (Linux 5.14), and removes the
+  // cgroup, waiting briefly for the processes to go. Makes only system calls, so it may be called
+  // from a signal handler. Failures are ignored.
+
+private:
+  kj::AutoCloseFd parentDir;
+  kj::String name;
+  kj::AutoCloseFd dir;
+  bool frozen = false;
+
+  kj::Promise<uint64_t> reclaimSteps(kj::Timer& timer, kj::AutoCloseFd reclaimFd);
+
+  void write(kj::StringPtr file, kj::StringPtr value);
+  kj::String read(kj::StringPtr file);
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_APP_CGROUP_H_
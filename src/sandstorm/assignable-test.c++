@@ -0,0 +1,226 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "assignable.h"
+#include <kj/test.h>
+
+#include "test-util.h"
+
+namespace sandstorm {
+namespace {
+
+typedef Assignable<capnp::Text> TextAssignable;
+
+class RecordingSetter final: public TextAssignable::Setter::Server {
+  // Counts calls and remembers the last value. If `slow` is set, calls don't return until
+  // release() is called. If `broken` is set, calls throw.
+
+public:
+  uint calls = 0;
+  kj::String last;
+  bool slow = false;
+  bool broken = false;
+
+  void release() {
+    KJ_IF_MAYBE(f, held) {
+      (*f)->fulfill();
+      held = nullptr;
+    }
+  }
+
+protected:
+  kj::Promise<void> set(SetContext context) override {
+    KJ_REQUIRE(!broken, "broken setter");
+    KJ_REQUIRE(held == nullptr, "more than one call in flight");
+
+    ++calls;
+    last = kj::heapString(context.getParams().getValue());
+
+    if (slow) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      held = kj::mv(paf.fulfiller);
+      return kj::mv(paf.promise);
+    }
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> held;
+};
+
+struct Subscription {
+  RecordingSetter* setter;
+  kj::Maybe<Handle::Client> handle;
+};
+
+Subscription subscribe(TextAssignable::Getter::Client& getter, kj::WaitScope& waitScope,
+                       bool slow = false) {
+  auto server = kj::heap<RecordingSetter>();
+  auto& setter = *server;
+  setter.slow = slow;
+
+  auto request = getter.subscribeRequest();
+  request.setSetter(kj::mv(server));
+  Handle::Client handle = request.send().wait(waitScope).getHandle();
+  return Subscription { &setter, kj::mv(handle) };
+}
+
+KJ_TEST("AssignableFanOut stress: many subscribers, bursts of sets") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto fanOut = kj::refcounted<AssignableFanOut<capnp::Text>>("initial");
+  auto getter = fanOut->getGetter();
+
+  const uint FAST = 500;
+  const uint SLOW = 20;
+  kj::Vector<Subscription> fast;
+  kj::Vector<Subscription> slow;
+  for (uint i = 0; i < FAST; i++) {
+    fast.add(subscribe(getter, waitScope));
+  }
+  for (uint i = 0; i < SLOW; i++) {
+    slow.add(subscribe(getter, waitScope, true));
+  }
+  turn(waitScope);
+  KJ_EXPECT(fanOut->getSubscriberCount() == FAST + SLOW);
+
+  // Everyone gets the current value on subscribing.
+  for (auto& sub: fast) {
+    KJ_EXPECT(sub.setter->calls == 1);
+    KJ_EXPECT(sub.setter->last == "initial");
+  }
+  for (auto& sub: slow) {
+    KJ_EXPECT(sub.setter->calls == 1);
+  }
+
+  // A burst of sets within one turn is delivered once, as the latest value.
+  for (uint i = 0; i < 10000; i++) {
+    fanOut->set(kj::str("burst", i));
+  }
+  turn(waitScope);
+  for (auto& sub: fast) {
+    KJ_EXPECT(sub.setter->calls == 2, sub.setter->calls);
+    KJ_EXPECT(sub.setter->last == "burst9999");
+  }
+
+  // Changes spread across turns are each delivered to fast subscribers, while the slow ones,
+  // still stuck on the initial value, receive nothing.
+  for (uint i = 0; i < 100; i++) {
+    fanOut->set(kj::str("step", i));
+    turn(waitScope);
+  }
+  for (auto& sub: fast) {
+    KJ_EXPECT(sub.setter->calls == 102, sub.setter->calls);
+    KJ_EXPECT(sub.setter->last == "step99");
+  }
+  for (auto& sub: slow) {
+    KJ_EXPECT(sub.setter->calls == 1);
+    KJ_EXPECT(sub.setter->last == "initial");
+  }
+
+  // When a slow subscriber catches up it gets only the latest value.
+  for (auto& sub: slow) {
+    sub.setter->release();
+  }
+  turn(waitScope);
+  for (auto& sub: slow) {
+    KJ_EXPECT(sub.setter->calls == 2, sub.setter->calls);
+    KJ_EXPECT(sub.setter->last == "step99");
+  }
+
+  // Releasing handles drops subscribers, including one with a call in flight.
+  for (uint i = 0; i < FAST; i += 2) {
+    fast[i].handle = nullptr;
+  }
+  slow[0].handle = nullptr;
+  turn(waitScope);
+  KJ_EXPECT(fanOut->getSubscriberCount() == FAST / 2 + SLOW - 1, fanOut->getSubscriberCount());
+
+  fanOut->set("after-drop");
+  turn(waitScope);
+  for (uint i = 0; i < FAST; i++) {
+    if (i % 2 == 0) {
+      KJ_EXPECT(fast[i].setter->last == "step99", i);
+    } else {
+      KJ_EXPECT(fast[i].setter->last == "after-drop", i);
+    }
+  }
+
+  for (auto& sub: slow) {
+    sub.setter->release();
+  }
+  turn(waitScope);
+  KJ_EXPECT(slow[0].setter->last == "step99");
+  KJ_EXPECT(slow[1].setter->last == "after-drop");
+}
+
+KJ_TEST("AssignableFanOut drops subscribers whose setter fails") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto fanOut = kj::refcounted<AssignableFanOut<capnp::Text>>("a");
+  auto getter = fanOut->getGetter();
+
+  auto good = subscribe(getter, waitScope);
+  auto bad = subscribe(getter, waitScope);
+  turn(waitScope);
+  KJ_EXPECT(fanOut->getSubscriberCount() == 2);
+
+  bad.setter->broken = true;
+  fanOut->set("b");
+  turn(waitScope);
+  KJ_EXPECT(fanOut->getSubscriberCount() == 1);
+  KJ_EXPECT(good.setter->last == "b");
+}
+
+KJ_TEST("AssignableFanOut get() setter is disconnected by other sets") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto fanOut = kj::refcounted<AssignableFanOut<capnp::Text>>("a");
+  auto assignable = fanOut->getAssignable();
+
+  auto response = assignable.getRequest().send().wait(waitScope);
+  KJ_EXPECT(response.getValue() == "a");
+  auto setter = response.getSetter();
+
+  {
+    // The setter from get() works repeatedly while nobody else sets.
+    for (auto value: {"b", "c"}) {
+      auto request = setter.setRequest();
+      request.setValue(value);
+      request.send().wait(waitScope);
+    }
+    KJ_EXPECT(fanOut->get() == "c");
+  }
+
+  {
+    auto request = assignable.asSetterRequest().send().wait(waitScope).getSetter().setRequest();
+    request.setValue("d");
+    request.send().wait(waitScope);
+  }
+
+  {
+    auto request = setter.setRequest();
+    request.setValue("e");
+    KJ_EXPECT_THROW_MESSAGE("modified since get()", request.send().wait(waitScope));
+    KJ_EXPECT(fanOut->get() == "d");
+  }
+}
+
+}  // namespace
+}  // namespace sandstorm
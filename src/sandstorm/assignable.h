@@ -0,0 +1,249 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_ASSIGNABLE_H_
+#define SANDSTORM_ASSIGNABLE_H_
+
+#include <kj/async.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <capnp/message.h>
+#include <sandstorm/util.capnp.h>
+
+namespace sandstorm {
+
+template <typename T>
+class AssignableFanOut final: public kj::Refcounted, private kj::TaskSet::ErrorHandler {
+  // Server-side implementation of Util.Assignable(T) for values watched by many subscribers.
+  //
+  // The value is stored once. set() only replaces it and, if nothing is scheduled yet, schedules
+  // a single fan-out for later in the event loop turn, so a burst of sets costs O(1) each
+  // regardless of the number of subscribers. The fan-out sends the current value to each
+  // subscriber that doesn't already have a set() call outstanding; a subscriber that does will be
+  // sent whatever is current once its call returns. So slow subscribers see only the latest value
+  // rather than falling further and further behind, and at most one call per subscriber is ever
+  // in flight.
+  //
+  // subscribe() sends the current value right away. A subscriber is dropped when its Handle is
+  // released or when a call to its setter fails.
+  //
+  // Create with kj::refcounted<AssignableFanOut<T>>(initialValue). The capabilities handed out
+  // hold references, so the value lives on as long as any of them do.
+
+public:
+  explicit AssignableFanOut(capnp::ReaderFor<T> initialValue): tasks(*this) {
+    store(initialValue);
+  }
+  KJ_DISALLOW_COPY(AssignableFanOut);
+
+  capnp::ReaderFor<T> get() {
+    return value->template getRoot<capnp::AnyPointer>().asReader().template getAs<T>();
+  }
+
+  void set(capnp::ReaderFor<T> newValue) {
+    store(newValue);
+    ++version;
+
+    if (!flushScheduled && subscribers.size() > 0) {
+      flushScheduled = true;
+      tasks.add(kj::evalLater([this]() { flush(); }));
+    }
+  }
+
+  typename Assignable<T>::Client getAssignable() {
+    return kj::heap<AssignableServer>(kj::addRef(*this));
+  }
+
+  typename Assignable<T>::Getter::Client getGetter() {
+    return kj::heap<GetterServer>(kj::addRef(*this));
+  }
+
+  typename Assignable<T>::Setter::Client getSetter() {
+    return kj::heap<SetterServer>(kj::addRef(*this), nullptr);
+  }
+
+  size_t getSubscriberCount() { return subscribers.size(); }
+
+private:
+  struct Subscriber: public kj::Refcounted {
+    typename Assignable<T>::Setter::Client setter;
+    uint64_t sentVersion = 0;
+    bool inFlight = false;
+    bool dropped = false;
+    size_t index;  // position in `subscribers`
+
+    explicit Subscriber(typename Assignable<T>::Setter::Client&& setter)
+        : setter(kj::mv(setter)) {}
+  };
+
+  class SetterServer final: public Assignable<T>::Setter::Server {
+  public:
+    SetterServer(kj::Own<AssignableFanOut> fanOut, kj::Maybe<uint64_t> expectedVersion)
+        : fanOut(kj::mv(fanOut)), expectedVersion(expectedVersion) {}
+
+  protected:
+    kj::Promise<void> set(typename Assignable<T>::Setter::Server::SetContext context) override {
+      KJ_IF_MAYBE(v, expectedVersion) {
+        KJ_REQUIRE(*v == fanOut->version, "Assignable was modified since get().");
+      }
+      fanOut->set(context.getParams().getValue());
+      KJ_IF_MAYBE(v, expectedVersion) {
+        *v = fanOut->version;
+      }
+      return kj::READY_NOW;
+    }
+
+  private:
+    kj::Own<AssignableFanOut> fanOut;
+    kj::Maybe<uint64_t> expectedVersion;
+    // If non-null, this setter came from get() and fails once someone else has set the value.
+  };
+
+  class SubscriptionHandle final: public Handle::Server {
+  public:
+    SubscriptionHandle(kj::Own<AssignableFanOut> fanOut, kj::Own<Subscriber> subscriber)
+        : fanOut(kj::mv(fanOut)), subscriber(kj::mv(subscriber)) {}
+    ~SubscriptionHandle() noexcept(false) {
+      fanOut->removeSubscriber(*subscriber);
+    }
+
+  private:
+    kj::Own<AssignableFanOut> fanOut;
+    kj::Own<Subscriber> subscriber;
+  };
+
+  class GetterServer final: public Assignable<T>::Getter::Server {
+  public:
+    explicit GetterServer(kj::Own<AssignableFanOut> fanOut): fanOut(kj::mv(fanOut)) {}
+
+  protected:
+    kj::Promise<void> get(typename Assignable<T>::Getter::Server::GetContext context) override {
+      context.getResults().setValue(fanOut->get());
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> subscribe(
+        typename Assignable<T>::Getter::Server::SubscribeContext context) override {
+      auto subscriber = kj::refcounted<Subscriber>(context.getParams().getSetter());
+      fanOut->addSubscriber(*subscriber);
+      context.getResults().setHandle(
+          kj::heap<SubscriptionHandle>(kj::addRef(*fanOut), kj::mv(subscriber)));
+      return kj::READY_NOW;
+    }
+
+  private:
+    kj::Own<AssignableFanOut> fanOut;
+  };
+
+  class AssignableServer final: public Assignable<T>::Server {
+  public:
+    explicit AssignableServer(kj::Own<AssignableFanOut> fanOut): fanOut(kj::mv(fanOut)) {}
+
+  protected:
+    kj::Promise<void> get(typename Assignable<T>::Server::GetContext context) override {
+      auto results = context.getResults();
+      results.setValue(fanOut->get());
+      results.setSetter(kj::heap<SetterServer>(kj::addRef(*fanOut), fanOut->version));
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> asGetter(typename Assignable<T>::Server::AsGetterContext context) override {
+      context.getResults().setGetter(fanOut->getGetter());
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> asSetter(typename Assignable<T>::Server::AsSetterContext context) override {
+      context.getResults().setSetter(fanOut->getSetter());
+      return kj::READY_NOW;
+    }
+
+  private:
+    kj::Own<AssignableFanOut> fanOut;
+  };
+
+  kj::Own<capnp::MallocMessageBuilder> value;
+  uint64_t version = 1;
+  // Incremented on every set(). Subscribers record the version they were last sent.
+
+  kj::Vector<kj::Own<Subscriber>> subscribers;
+  bool flushScheduled = false;
+  kj::TaskSet tasks;
+
+  void store(capnp::ReaderFor<T> newValue) {
+    // Copy into a fresh message so the old value's space is freed rather than orphaned.
+    auto message = kj::heap<capnp::MallocMessageBuilder>();
+    message->template getRoot<capnp::AnyPointer>().template setAs<T>(newValue);
+    value = kj::mv(message);
+  }
+
+  void addSubscriber(Subscriber& subscriber) {
+    subscriber.index = subscribers.size();
+    subscribers.add(kj::addRef(subscriber));
+    send(subscriber);
+  }
+
+  void removeSubscriber(Subscriber& subscriber) {
+    if (subscriber.dropped) return;
+    subscriber.dropped = true;
+
+    // Swap-remove to keep this O(1).
+    size_t i = subscriber.index;
+    KJ_ASSERT(subscribers[i].get() == &subscriber);
+    if (i != subscribers.size() - 1) {
+      subscribers[i] = kj::mv(subscribers[subscribers.size() - 1]);
+      subscribers[i]->index = i;
+    }
+    subscribers.removeLast();
+  }
+
+  void flush() {
+    flushScheduled = false;
+    for (auto& subscriber: subscribers) {
+      if (!subscriber->inFlight && subscriber->sentVersion < version) {
+        send(*subscriber);
+      }
+    }
+  }
+
+  void send(Subscriber& subscriber) {
+    subscriber.inFlight = true;
+    subscriber.sentVersion = version;
+
+    auto request = subscriber.setter.setRequest();
+    request.setValue(get());
+
+    Subscriber* ptr = &subscriber;
+    tasks.add(request.send().then([this, ptr](auto&&) {
+      ptr->inFlight = false;
+      if (!ptr->dropped && ptr->sentVersion < version) {
+        // Changed while we were waiting; catch up to the latest value.
+        send(*ptr);
+      }
+    }, [this, ptr](kj::Exception&& exception) {
+      ptr->inFlight = false;
+      KJ_LOG(WARNING, "dropping Assignable subscriber whose setter failed", exception);
+      removeSubscriber(*ptr);
+    }).attach(kj::addRef(subscriber)));
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, exception);
+  }
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_ASSIGNABLE_H_
@@ -0,0 +1,226 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "byte-stream.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <string.h>
+
+#include "test-util.h"
+
+namespace sandstorm {
+namespace {
+
+class FakeByteStream final: public ByteStream::Server {
+  // Records what it receives. While `holdAcks` is true, write() doesn't return until
+  // releaseAcks() is called.
+
+public:
+  kj::Vector<size_t> writeSizes;
+  kj::Vector<kj::byte> received;
+  kj::Maybe<uint64_t> expectedSize;
+  bool doneCalled = false;
+  bool holdAcks = false;
+
+  void releaseAcks() {
+    for (; nextAck < heldAcks.size(); nextAck++) {
+      heldAcks[nextAck]->fulfill();
+    }
+  }
+
+protected:
+  kj::Promise<void> write(WriteContext context) override {
+    auto data = context.getParams().getData();
+    writeSizes.add(data.size());
+    received.addAll(data);
+
+    if (holdAcks) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      heldAcks.add(kj::mv(paf.fulfiller));
+      return kj::mv(paf.promise);
+    } else {
+      return kj::READY_NOW;
+    }
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    doneCalled = true;
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> expectSize(ExpectSizeContext context) override {
+    expectedSize = context.getParams().getSize();
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> heldAcks;
+  size_t nextAck = 0;
+};
+
+KJ_TEST("ByteStreamWriter coalesces writes and bounds bytes in flight") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto fake = kj::heap<FakeByteStream>();
+  auto& stream = *fake;
+  stream.holdAcks = true;
+  ByteStreamWriter writer(ByteStream::Client(kj::mv(fake)), 4096, 1024);
+
+  // 100 writes of 100 bytes while nothing is acknowledged.
+  kj::byte chunk[100];
+  bool writable = false;
+  kj::Promise<void> lastWrite = nullptr;
+  for (uint i = 0; i < 100; i++) {
+    for (uint j = 0; j < sizeof(chunk); j++) {
+      chunk[j] = patternByte(i * sizeof(chunk) + j);
+    }
+    writable = false;
+    lastWrite = writer.write(chunk, sizeof(chunk)).then([&]() { writable = true; })
+        .eagerlyEvaluate([](kj::Exception&& e) { KJ_FAIL_EXPECT(e); });
+    memset(chunk, 0, sizeof(chunk));  // the writer must have copied it already
+  }
+  turn(waitScope);
+
+  // The first write went out alone since the stream was idle; the rest were coalesced into full
+  // frames, leaving 684 bytes pending.
+  KJ_ASSERT(stream.writeSizes.size() == 10, stream.writeSizes.size());
+  KJ_EXPECT(stream.writeSizes[0] == 100);
+  for (uint i = 1; i < 10; i++) {
+    KJ_EXPECT(stream.writeSizes[i] == 1024, i);
+  }
+
+  // Way over the window, so the last write() hasn't completed.
+  KJ_EXPECT(!writable);
+
+  // Acknowledging everything sends the pending frame and opens the window.
+  stream.holdAcks = false;
+  stream.releaseAcks();
+  turn(waitScope);
+  KJ_EXPECT(writable);
+  KJ_ASSERT(stream.writeSizes.size() == 11);
+  KJ_EXPECT(stream.writeSizes[10] == 684);
+
+  writer.done().wait(waitScope);
+  KJ_EXPECT(stream.doneCalled);
+
+  KJ_ASSERT(stream.received.size() == 10000);
+  for (size_t i = 0; i < stream.received.size(); i++) {
+    KJ_ASSERT(stream.received[i] == patternByte(i), i);
+  }
+}
+
+KJ_TEST("ByteStreamWriter sizes frames from expectSize()") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto fake = kj::heap<FakeByteStream>();
+  auto& stream = *fake;
+  stream.holdAcks = true;
+  ByteStreamWriter writer(ByteStream::Client(kj::mv(fake)), 4096, 1024);
+
+  writer.expectSize(150);
+  kj::byte chunk[50];
+  memset(chunk, 'x', sizeof(chunk));
+  for (uint i = 0; i < 3; i++) {
+    writer.write(chunk, sizeof(chunk));
+  }
+  turn(waitScope);
+
+  // The last 100 bytes filled a frame sized to what remained, so they were sent without waiting
+  // for an ack or done().
+  KJ_EXPECT(KJ_ASSERT_NONNULL(stream.expectedSize) == 150);
+  KJ_ASSERT(stream.writeSizes.size() == 2);
+  KJ_EXPECT(stream.writeSizes[0] == 50);
+  KJ_EXPECT(stream.writeSizes[1] == 100);
+
+  stream.holdAcks = false;
+  stream.releaseAcks();
+  writer.done().wait(waitScope);
+  KJ_EXPECT(stream.received.size() == 150);
+}
+
+KJ_TEST("ByteStreamWriter expectSize() after coalesced writes") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newOneWayPipe();
+  ByteStreamWriter writer(kj::heap<AsyncOutputByteStream>(kj::mv(pipe.out)));
+
+  // The first write goes out right away, so the second is held back to be coalesced.
+  writer.write("hello", 5);
+  writer.write(" world", 6);
+  writer.expectSize(1);
+  writer.write("!", 1).wait(io.waitScope);
+  writer.done().wait(io.waitScope);
+
+  char buffer[12];
+  pipe.in->read(buffer, sizeof(buffer)).wait(io.waitScope);
+  KJ_EXPECT(kj::heapString(buffer, sizeof(buffer)) == "hello world!");
+}
+
+KJ_TEST("ByteStreamWriter through AsyncOutputByteStream to a pipe") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newOneWayPipe();
+
+  ByteStream::Client client = kj::heap<AsyncOutputByteStream>(kj::mv(pipe.out), 8192);
+  ByteStreamWriter writer(client, 16384, 4096);
+
+  // Much bigger than the pipe buffer and both windows, so every stage has to apply backpressure.
+  auto data = kj::heapArray<kj::byte>(1 << 20);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = patternByte(i);
+  }
+  auto readBuffer = kj::heapArray<kj::byte>(data.size());
+  auto readPromise = pipe.in->read(readBuffer.begin(), readBuffer.size())
+      .eagerlyEvaluate([](kj::Exception&& e) { KJ_FAIL_EXPECT(e); });
+
+  writer.expectSize(data.size());
+
+  // Write in odd-sized pieces, waiting for each as an AsyncOutputStream user would.
+  size_t offset = 0;
+  while (offset < data.size()) {
+    size_t n = kj::min(data.size() - offset, 777);
+    writer.write(data.begin() + offset, n).wait(io.waitScope);
+    offset += n;
+  }
+  writer.done().wait(io.waitScope);
+  readPromise.wait(io.waitScope);
+
+  KJ_EXPECT(memcmp(readBuffer.begin(), data.begin(), data.size()) == 0);
+}
+
+KJ_TEST("AsyncOutputByteStream enforces expectSize()") {
+  auto io = kj::setupAsyncIo();
+
+  {
+    auto pipe = io.provider->newOneWayPipe();
+    ByteStreamWriter writer(kj::heap<AsyncOutputByteStream>(kj::mv(pipe.out)));
+    writer.expectSize(10);
+    writer.write("hello", 5).wait(io.waitScope);
+    KJ_EXPECT_THROW_MESSAGE("before all bytes expected", writer.done().wait(io.waitScope));
+  }
+
+  {
+    auto pipe = io.provider->newOneWayPipe();
+    ByteStreamWriter writer(kj::heap<AsyncOutputByteStream>(kj::mv(pipe.out)));
+    writer.expectSize(3);
+    writer.write("hello", 5).wait(io.waitScope);
+    turn(io.waitScope);  // let the failed write() come back
+    KJ_EXPECT_THROW_MESSAGE("more bytes than expected", writer.done().wait(io.waitScope));
+  }
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,263 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "byte-stream.h"
+#include <kj/debug.h>
+#include <string.h>
+#include "util.h"
+
+namespace sandstorm {
+
+constexpr size_t ByteStreamWriter::DEFAULT_WINDOW_SIZE;
+constexpr size_t ByteStreamWriter::DEFAULT_FRAME_SIZE;
+
+ByteStreamWriter::ByteStreamWriter(ByteStream::Client stream, size_t windowSize, size_t frameSize)
+    : stream(kj::mv(stream)), windowSize(windowSize), frameSize(frameSize), tasks(*this) {
+  KJ_REQUIRE(frameSize > 0 && windowSize >= frameSize);
+}
+
+kj::Promise<void> ByteStreamWriter::write(const void* buffer, size_t size) {
+  queue(kj::arrayPtr(reinterpret_cast<const kj::byte*>(buffer), size));
+  return whenWritable();
+}
+
+kj::Promise<void> ByteStreamWriter::write(
+    kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) {
+  for (auto piece: pieces) {
+    queue(piece);
+  }
+  return whenWritable();
+}
+
+void ByteStreamWriter::expectSize(uint64_t size) {
+  KJ_REQUIRE(!doneCalled, "expectSize() called after done()");
+
+  // The remote counts `size` from the bytes it has received when the call arrives, so anything
+  // still being coalesced must go out ahead of it.
+  if (pendingSize > 0) {
+    sendPending();
+  }
+  bytesExpected = size;
+
+  auto request = stream.expectSizeRequest();
+  request.setSize(size);
+  tasks.add(request.send().then([](auto&&) {}, [](kj::Exception&&) {
+    // The caller of expectSize() is supposed to ignore exceptions.
+  }));
+}
+
+kj::Promise<void> ByteStreamWriter::done() {
+  KJ_REQUIRE(!doneCalled, "done() called twice");
+  doneCalled = true;
+
+  if (pendingSize > 0) {
+    sendPending();
+  }
+
+  KJ_IF_MAYBE(e, error) {
+    return kj::Exception(*e);
+  }
+
+  // done() is E-ordered after all our writes, so there's no need to wait for them before sending
+  // it. We still wait for their acks to make sure none of them failed.
+  return stream.doneRequest().send().then([this](auto&&) {
+    return whenDrained();
+  });
+}
+
+void ByteStreamWriter::queue(kj::ArrayPtr<const kj::byte> data) {
+  KJ_REQUIRE(!doneCalled, "write() called after done()");
+
+  if (error != nullptr) {
+    // whenWritable() will report it.
+    return;
+  }
+
+  while (data.size() > 0) {
+    if (pendingSize == 0 && bytesInFlight == 0) {
+      // The stream is idle; send immediately rather than waiting to coalesce.
+      size_t n = kj::min(data.size(), frameSize);
+      sendFrame(data.slice(0, n));
+      data = data.slice(n, data.size());
+      continue;
+    }
+
+    if (pending == nullptr) {
+      size_t capacity = frameSize;
+      KJ_IF_MAYBE(e, bytesExpected) {
+        capacity = kj::max(kj::min<uint64_t>(capacity, *e), 1);
+      }
+      pending = kj::heapArray<kj::byte>(capacity);
+    }
+
+    size_t n = kj::min(data.size(), pending.size() - pendingSize);
+    memcpy(pending.begin() + pendingSize, data.begin(), n);
+    pendingSize += n;
+    data = data.slice(n, data.size());
+
+    if (pendingSize == pending.size()) {
+      sendPending();
+    }
+  }
+}
+
+void ByteStreamWriter::sendPending() {
+  sendFrame(pending.slice(0, pendingSize));
+  pending = nullptr;
+  pendingSize = 0;
+}
+
+void ByteStreamWriter::sendFrame(kj::ArrayPtr<const kj::byte> data) {
+  size_t size = data.size();
+
+  auto request = stream.writeRequest(
+      capnp::MessageSize { size / sizeof(capnp::word) + 8, 0 });
+  memcpy(request.initData(size).begin(), data.begin(), size);
+
+  KJ_IF_MAYBE(e, bytesExpected) {
+    *e -= kj::min<uint64_t>(*e, size);
+  }
+
+  bytesInFlight += size;
+  tasks.add(request.send().then([this, size](auto&&) {
+    onAck(size);
+  }));
+}
+
+void ByteStreamWriter::onAck(size_t size) {
+  bytesInFlight -= size;
+
+  // Whatever accumulated while that write was outstanding goes out now.
+  if (pendingSize > 0) {
+    sendPending();
+  }
+
+  if (bytesInFlight + pendingSize < windowSize) {
+    KJ_IF_MAYBE(f, writableFulfiller) {
+      (*f)->fulfill();
+      writableFulfiller = nullptr;
+    }
+  }
+
+  if (bytesInFlight == 0) {
+    KJ_IF_MAYBE(f, drainedFulfiller) {
+      (*f)->fulfill();
+      drainedFulfiller = nullptr;
+    }
+  }
+}
+
+kj::Promise<void> ByteStreamWriter::whenWritable() {
+  KJ_IF_MAYBE(e, error) {
+    return kj::Exception(*e);
+  }
+
+  if (bytesInFlight + pendingSize < windowSize) {
+    return kj::READY_NOW;
+  }
+
+  // Replaces any previous waiter, whose promise the caller has presumably dropped.
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  writableFulfiller = kj::mv(paf.fulfiller);
+  return kj::mv(paf.promise);
+}
+
+kj::Promise<void> ByteStreamWriter::whenDrained() {
+  KJ_IF_MAYBE(e, error) {
+    return kj::Exception(*e);
+  }
+
+  if (bytesInFlight == 0) {
+    return kj::READY_NOW;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  drainedFulfiller = kj::mv(paf.fulfiller);
+  return kj::mv(paf.promise);
+}
+
+void ByteStreamWriter::taskFailed(kj::Exception&& exception) {
+  if (error == nullptr) {
+    KJ_IF_MAYBE(f, writableFulfiller) {
+      (*f)->reject(kj::Exception(exception));
+      writableFulfiller = nullptr;
+    }
+    KJ_IF_MAYBE(f, drainedFulfiller) {
+      (*f)->reject(kj::Exception(exception));
+      drainedFulfiller = nullptr;
+    }
+    error = kj::mv(exception);
+  }
+}
+
+// =======================================================================================
+
+AsyncOutputByteStream::AsyncOutputByteStream(
+    kj::Own<kj::AsyncOutputStream> output, size_t windowSize)
+    : output(kj::mv(output)), windowSize(windowSize) {}
+
+kj::Promise<void> AsyncOutputByteStream::write(WriteContext context) {
+  KJ_REQUIRE(!doneCalled, "write() called after done()");
+
+  auto data = context.getParams().getData();
+  bytesReceived += data.size();
+  KJ_IF_MAYBE(s, expectedSize) {
+    KJ_REQUIRE(bytesReceived <= *s, "received more bytes than expected");
+  }
+
+  // Copy the data so that we can return before it's written.
+  auto copy = kj::heapArray<kj::byte>(data);
+  context.releaseParams();
+
+  size_t size = copy.size();
+  bytesQueued += size;
+  auto promise = previousWrite.then([this, KJ_MVCAP(copy)]() {
+    return output->write(copy.begin(), copy.size());
+  }).then([this, size]() {
+    bytesQueued -= size;
+  });
+
+  if (bytesQueued <= windowSize) {
+    previousWrite = kj::mv(promise);
+    return kj::READY_NOW;
+  } else {
+    // Too much is queued. Make the caller wait for this write, by which point everything before
+    // it has been written too.
+    auto fork = promise.fork();
+    previousWrite = fork.addBranch();
+    return fork.addBranch();
+  }
+}
+
+kj::Promise<void> AsyncOutputByteStream::done(DoneContext context) {
+  KJ_IF_MAYBE(s, expectedSize) {
+    KJ_REQUIRE(bytesReceived == *s,
+        "done() called before all bytes expected via expectedSize() were written");
+  }
+  KJ_REQUIRE(!doneCalled, "done() called twice");
+  doneCalled = true;
+
+  auto fork = previousWrite.fork();
+  previousWrite = fork.addBranch();
+  return fork.addBranch();
+}
+
+kj::Promise<void> AsyncOutputByteStream::expectSize(ExpectSizeContext context) {
+  expectedSize = bytesReceived + context.getParams().getSize();
+  return kj::READY_NOW;
+}
+
+}  // namespace sandstorm
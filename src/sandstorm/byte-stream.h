@@ -0,0 +1,128 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_BYTE_STREAM_H_
+#define SANDSTORM_BYTE_STREAM_H_
+
+#include <kj/async-io.h>
+#include <sandstorm/util.capnp.h>
+
+namespace sandstorm {
+
+// Helpers for speaking Util.ByteStream with flow control. The interface itself only offers hints
+// (a callee may delay returning from write()), so these implement both halves of the convention:
+// ByteStreamWriter bounds how many bytes it has in flight, and AsyncOutputByteStream delays its
+// write() returns once it has too much queued.
+
+class ByteStreamWriter final: public kj::AsyncOutputStream,
+                              private kj::TaskSet::ErrorHandler {
+  // Writes to a remote ByteStream, presented as a kj::AsyncOutputStream.
+  //
+  // Bytes passed to write() are copied immediately, so the caller's buffer can be reused as soon
+  // as write() returns (before its promise resolves). The promise resolves once fewer than
+  // `windowSize` bytes are queued or in flight; a caller that waits for it before writing more
+  // never holds more than about one window of data in memory.
+  //
+  // Small writes are coalesced: when nothing is in flight, data is sent right away, otherwise it
+  // accumulates into frames of up to `frameSize` bytes which are sent when full or when an earlier
+  // write() is acknowledged. So a chatty producer costs few RPCs without adding latency when the
+  // stream is idle.
+  //
+  // Errors from the remote stream are reported by the next write() or done().
+
+public:
+  static constexpr size_t DEFAULT_WINDOW_SIZE = 256 * 1024;
+  static constexpr size_t DEFAULT_FRAME_SIZE = 64 * 1024;
+
+  explicit ByteStreamWriter(ByteStream::Client stream,
+                            size_t windowSize = DEFAULT_WINDOW_SIZE,
+                            size_t frameSize = DEFAULT_FRAME_SIZE);
+  KJ_DISALLOW_COPY(ByteStreamWriter);
+
+  kj::Promise<void> write(const void* buffer, size_t size) override;
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override;
+  // As with any AsyncOutputStream, wait for each write() to complete before starting the next.
+  // It's also fine to drop the returned promise, since the data is already queued; only the most
+  // recent write()'s promise will ever resolve.
+
+  void expectSize(uint64_t size);
+  // Forwards to ByteStream.expectSize(), ignoring errors as the interface allows. `size` counts
+  // bytes written after this call; any coalesced data is sent first. Also sizes the remaining
+  // frames to fit, so a small known-size body doesn't allocate a full frame.
+
+  kj::Promise<void> done();
+  // Sends any buffered data, then calls ByteStream.done(). Resolves once every write has been
+  // acknowledged.
+
+private:
+  ByteStream::Client stream;
+  size_t windowSize;
+  size_t frameSize;
+
+  kj::Array<kj::byte> pending;
+  size_t pendingSize = 0;
+  // Frame being coalesced; not yet sent.
+
+  size_t bytesInFlight = 0;
+  // Bytes sent whose write() hasn't returned yet.
+
+  kj::Maybe<uint64_t> bytesExpected;
+  // Bytes still to come, if expectSize() was called.
+
+  bool doneCalled = false;
+  kj::Maybe<kj::Exception> error;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> writableFulfiller;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainedFulfiller;
+  kj::TaskSet tasks;
+
+  void queue(kj::ArrayPtr<const kj::byte> data);
+  void sendPending();
+  void sendFrame(kj::ArrayPtr<const kj::byte> data);
+  void onAck(size_t size);
+  kj::Promise<void> whenWritable();
+  kj::Promise<void> whenDrained();
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+class AsyncOutputByteStream final: public ByteStream::Server {
+  // Implements ByteStream by writing to a kj::AsyncOutputStream. Writes are performed in order,
+  // one at a time. write() returns as soon as its data is queued unless more than `windowSize`
+  // bytes are waiting, in which case it returns only once the output has caught up, telling the
+  // caller to back off. expectSize() is enforced: done() fails if the byte count doesn't match.
+
+public:
+  explicit AsyncOutputByteStream(kj::Own<kj::AsyncOutputStream> output,
+                                 size_t windowSize = ByteStreamWriter::DEFAULT_WINDOW_SIZE);
+
+protected:
+  kj::Promise<void> write(WriteContext context) override;
+  kj::Promise<void> done(DoneContext context) override;
+  kj::Promise<void> expectSize(ExpectSizeContext context) override;
+
+private:
+  kj::Own<kj::AsyncOutputStream> output;
+  size_t windowSize;
+  size_t bytesQueued = 0;
+  uint64_t bytesReceived = 0;
+  kj::Maybe<uint64_t> expectedSize;
+  bool doneCalled = false;
+  kj::Promise<void> previousWrite = kj::READY_NOW;
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_BYTE_STREAM_H_
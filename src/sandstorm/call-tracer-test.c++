@@ -0,0 +1,205 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "call-tracer.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <capnp/message.h>
+#include <capnp/rpc-twoparty.h>
+#include <capnp/rpc.capnp.h>
+#include <kj/async-io.h>
+#include <sandstorm/grain.capnp.h>
+#include <sandstorm/util.capnp.h>
+#include <sandstorm/web-session.capnp.h>
+#include <string.h>
+
+namespace sandstorm {
+namespace {
+
+class TestStream final: public ByteStream::Server {
+public:
+  size_t bytesReceived = 0;
+
+protected:
+  kj::Promise<void> write(WriteContext context) override {
+    bytesReceived += context.getParams().getData().size();
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    KJ_FAIL_REQUIRE("done() not allowed");
+  }
+};
+
+MethodCallStats::Reader findStats(capnp::List<MethodCallStats>::Reader list,
+                                  kj::StringPtr methodName) {
+  for (auto stats: list) {
+    if (stats.getMethodName() == methodName) return stats;
+  }
+  KJ_FAIL_ASSERT("method not found", methodName);
+}
+
+uint64_t sum(capnp::List<uint64_t>::Reader list) {
+  uint64_t result = 0;
+  for (auto n: list) result += n;
+  return result;
+}
+
+KJ_TEST("CallTracer counts and samples calls") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto server = kj::heap<TestStream>();
+  TestStream& stream = *server;
+  CallTracer tracer(4);
+  auto client = tracer.wrap<ByteStream>(kj::mv(server));
+
+  const uint COUNT = 10;
+  for (uint i = 0; i < COUNT; i++) {
+    auto request = client.writeRequest();
+    request.initData(100);
+    request.send().wait(waitScope);
+  }
+  KJ_EXPECT(stream.bytesReceived == COUNT * 100);
+
+  KJ_EXPECT_THROW_MESSAGE("done() not allowed", client.doneRequest().send().wait(waitScope));
+
+  capnp::MallocMessageBuilder message;
+  auto orphan = tracer.getStats(message.getOrphanage());
+  auto list = orphan.getReader();
+  KJ_ASSERT(list.size() == 2);
+
+  auto write = findStats(list, "write");
+  KJ_EXPECT(write.getInterfaceName() == "ByteStream");
+  KJ_EXPECT(write.getInterfaceId() == capnp::typeId<ByteStream>());
+  KJ_EXPECT(write.getMethodId() == 0);
+  KJ_EXPECT(write.getCalls() == COUNT);
+  KJ_EXPECT(write.getSampledCalls() == 3);  // calls 0, 4, and 8
+  KJ_EXPECT(write.getFailedCalls() == 0);
+  KJ_EXPECT(write.getLatencyHistogram().size() == CallTracer::HISTOGRAM_BUCKETS);
+  KJ_EXPECT(sum(write.getLatencyHistogram()) == 3);
+
+  auto done = findStats(list, "done");
+  KJ_EXPECT(done.getCalls() == 1);
+  KJ_EXPECT(done.getSampledCalls() == 1);
+  KJ_EXPECT(done.getFailedCalls() == 1);
+
+  auto text = tracer.dump();
+  KJ_EXPECT(text.startsWith("ByteStream.write: 10 calls, 3 sampled, 0 failed, mean "), text);
+  KJ_EXPECT(strstr(text.cStr(), "ByteStream.done: 1 calls, 1 sampled, 1 failed") != nullptr,
+            text);
+}
+
+KJ_TEST("CallTracer forwards concurrent calls") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto server = kj::heap<TestStream>();
+  TestStream& stream = *server;
+  CallTracer tracer(1);
+  auto client = tracer.wrap<ByteStream>(kj::mv(server));
+
+  // Calls made before any of them complete are delivered in order.
+  kj::Vector<kj::Promise<void>> promises;
+  for (uint i = 0; i < 5; i++) {
+    auto request = client.writeRequest();
+    request.initData(i + 1);
+    promises.add(request.send().then([](auto&&) {}));
+  }
+  kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+  KJ_EXPECT(stream.bytesReceived == 15);
+
+  KJ_EXPECT(tracer.dump().startsWith("ByteStream.write: 5 calls, 5 sampled, 0 failed"));
+}
+
+KJ_TEST("CallTracer counts failures of calls that aren't sampled") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  CallTracer tracer(4);
+  auto client = tracer.wrap<ByteStream>(kj::heap<TestStream>());
+
+  for (uint i = 0; i < 3; i++) {
+    KJ_EXPECT_THROW_MESSAGE("done() not allowed", client.doneRequest().send().wait(waitScope));
+  }
+
+  KJ_EXPECT(tracer.dump().startsWith("ByteStream.done: 3 calls, 1 sampled, 3 failed"),
+            tracer.dump());
+}
+
+class TestSession final: public WebSession::Server {
+protected:
+  kj::Promise<void> get(GetContext context) override {
+    return kj::READY_NOW;
+  }
+};
+
+class TestView final: public UiView::Server {
+protected:
+  kj::Promise<void> newSession(NewSessionContext context) override {
+    context.getResults().setSession(kj::heap<TestSession>());
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("CallTracer traces capabilities returned by traced calls") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  CallTracer tracer(1);
+  tracer.addInterface(capnp::Schema::from<WebSession>());
+  auto view = tracer.wrap<UiView>(kj::heap<TestView>());
+
+  auto session = view.newSessionRequest().send().wait(waitScope).getSession();
+  session.castAs<WebSession>().getRequest().send().wait(waitScope);
+  session.castAs<WebSession>().getRequest().send().wait(waitScope);
+
+  auto text = tracer.dump();
+  KJ_EXPECT(strstr(text.cStr(), "UiView.newSession: 1 calls") != nullptr, text);
+  KJ_EXPECT(strstr(text.cStr(), "WebSession.get: 2 calls") != nullptr, text);
+}
+
+KJ_TEST("CallTracer traces calls arriving over RPC, including pipelined ones") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  CallTracer tracer(1);
+  tracer.addInterface(capnp::Schema::from<WebSession>());
+  capnp::TwoPartyVatNetwork serverNetwork(*pipe.ends[0], capnp::rpc::twoparty::Side::SERVER);
+  auto server = capnp::makeRpcServer(serverNetwork, tracer.wrap<UiView>(kj::heap<TestView>()));
+
+  capnp::TwoPartyVatNetwork clientNetwork(*pipe.ends[1], capnp::rpc::twoparty::Side::CLIENT);
+  auto client = capnp::makeRpcClient(clientNetwork);
+  capnp::MallocMessageBuilder message;
+  auto vatId = message.initRoot<capnp::rpc::twoparty::VatId>();
+  vatId.setSide(capnp::rpc::twoparty::Side::SERVER);
+  auto view = client.bootstrap(vatId).castAs<UiView>();
+
+  // The session is used before newSession() returns, and is traced all the same.
+  auto promise = view.newSessionRequest().send();
+  auto pipelined = promise.getSession().castAs<WebSession>().getRequest().send();
+  auto session = promise.wait(io.waitScope).getSession();
+  pipelined.wait(io.waitScope);
+  session.castAs<WebSession>().getRequest().send().wait(io.waitScope);
+
+  auto text = tracer.dump();
+  KJ_EXPECT(strstr(text.cStr(), "UiView.newSession: 1 calls, 1 sampled, 0 failed") != nullptr,
+            text);
+  KJ_EXPECT(strstr(text.cStr(), "WebSession.get: 2 calls") != nullptr, text);
+}
+
+}  // namespace
+}  // namespace sandstorm
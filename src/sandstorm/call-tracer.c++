@@ -0,0 +1,336 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "call-tracer.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <time.h>
+
+namespace sandstorm {
+
+constexpr uint CallTracer::HISTOGRAM_BUCKETS;
+constexpr uint CallTracer::DEFAULT_SAMPLE_INTERVAL;
+
+static uint64_t nowMicros() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+template <typename Func>
+kj::Promise<void> CallTracer::traced(Method& method, Func&& makeCall) {
+  // Failures are counted for every call, but only sampled calls are timed.
+  bool sampled = method.calls++ % sampleInterval == 0;
+  uint64_t start = sampled ? nowMicros() : 0;
+  return makeCall().then([&method, sampled, start]() {
+    if (sampled) method.record(nowMicros() - start);
+  }, [&method, sampled, start](kj::Exception&& exception) {
+    ++method.failedCalls;
+    if (sampled) method.record(nowMicros() - start);
+    kj::throwFatalException(kj::mv(exception));
+  });
+}
+
+class CallTracer::TracedServer final: public capnp::Capability::Server {
+  // Traces local calls, which arrive as requests of their own: the params are copied into a
+  // request to the wrapped capability, and for methods returning capabilities, so are the results.
+
+public:
+  TracedServer(CallTracer& tracer, capnp::Capability::Client inner,
+               capnp::InterfaceSchema schema)
+      : tracer(tracer), inner(kj::mv(inner)), schema(schema) {}
+
+  kj::Promise<void> dispatchCall(
+      uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+    Method& method = tracer.getMethod(schema, interfaceId, methodId);
+
+    return tracer.traced(method, [&]() -> kj::Promise<void> {
+      auto params = context.getParams();
+      auto request = inner.typelessRequest(interfaceId, methodId, params.targetSize());
+      request.set(params);
+      context.releaseParams();
+
+      KJ_IF_MAYBE(resultType, method.capResultType) {
+        auto type = *resultType;
+        CallTracer& tracer = this->tracer;
+        return request.send().then(
+            [&tracer, context, type](capnp::Response<capnp::AnyPointer>&& response) mutable {
+          auto results = context.getResults(response.targetSize());
+          results.set(response);
+          tracer.wrapCapabilities(results.getAs<capnp::DynamicStruct>(type));
+        });
+      } else {
+        return context.tailCall(kj::mv(request));
+      }
+    });
+  }
+
+private:
+  CallTracer& tracer;
+  capnp::Capability::Client inner;
+  capnp::InterfaceSchema schema;
+};
+
+class CallTracer::TracedPipeline final: public capnp::PipelineHook, public kj::Refcounted {
+  // Wraps capabilities pipelined on the results of a call, as wrapCapabilities() does once the
+  // results arrive.
+
+public:
+  TracedPipeline(CallTracer& tracer, kj::Own<capnp::PipelineHook> inner,
+                 capnp::StructSchema resultType)
+      : tracer(tracer), inner(kj::mv(inner)), resultType(resultType) {}
+
+  kj::Own<capnp::PipelineHook> addRef() override {
+    return kj::addRef(*this);
+  }
+
+  kj::Own<capnp::ClientHook> getPipelinedCap(kj::ArrayPtr<const capnp::PipelineOp> ops) override {
+    auto cap = inner->getPipelinedCap(ops);
+    if (ops.size() == 1 && ops[0].type == capnp::PipelineOp::GET_POINTER_FIELD) {
+      for (auto field: resultType.getFields()) {
+        auto proto = field.getProto();
+        auto type = field.getType();
+        if (proto.isSlot() && type.isInterface() &&
+            proto.getSlot().getOffset() == ops[0].pointerIndex) {
+          return capnp::ClientHook::from(
+              tracer.wrap(capnp::Capability::Client(kj::mv(cap)), type.asInterface()));
+        }
+      }
+    }
+    return kj::mv(cap);
+  }
+
+private:
+  CallTracer& tracer;
+  kj::Own<capnp::PipelineHook> inner;
+  capnp::StructSchema resultType;
+};
+
+class CallTracer::TracedHook final: public capnp::ClientHook, public kj::Refcounted {
+public:
+  TracedHook(CallTracer& tracer, kj::Own<capnp::ClientHook> inner, capnp::InterfaceSchema schema)
+      : tracer(tracer), inner(kj::mv(inner)), schema(schema),
+        local(kj::heap<TracedServer>(tracer, capnp::Capability::Client(this->inner->addRef()),
+                                     schema)) {}
+
+  capnp::Request<capnp::AnyPointer, capnp::AnyPointer> newCall(
+      uint64_t interfaceId, uint16_t methodId, kj::Maybe<capnp::MessageSize> sizeHint) override {
+    return local.typelessRequest(interfaceId, methodId, sizeHint);
+  }
+
+  VoidPromiseAndPipeline call(uint64_t interfaceId, uint16_t methodId,
+                              kj::Own<capnp::CallContextHook>&& context) override {
+    Method& method = tracer.getMethod(schema, interfaceId, methodId);
+
+    kj::Own<capnp::PipelineHook> pipeline;
+    auto promise = tracer.traced(method, [&]() -> kj::Promise<void> {
+      KJ_IF_MAYBE(resultType, method.capResultType) {
+        // The results land in the caller's response; wrap their capabilities there.
+        auto type = *resultType;
+        auto resultContext = context->addRef();
+        auto result = inner->call(interfaceId, methodId, kj::mv(context));
+        pipeline = kj::refcounted<TracedPipeline>(tracer, kj::mv(result.pipeline), type);
+        CallTracer& tracer = this->tracer;
+        return result.promise.then([&tracer, type, KJ_MVCAP(resultContext)]() mutable {
+          tracer.wrapCapabilities(
+              resultContext->getResults(nullptr).getAs<capnp::DynamicStruct>(type));
+        });
+      } else {
+        auto result = inner->call(interfaceId, methodId, kj::mv(context));
+        pipeline = kj::mv(result.pipeline);
+        return kj::mv(result.promise);
+      }
+    });
+
+    return { kj::mv(promise), kj::mv(pipeline) };
+  }
+
+  kj::Maybe<capnp::ClientHook&> getResolved() override {
+    return nullptr;
+  }
+
+  kj::Maybe<kj::Promise<kj::Own<capnp::ClientHook>>> whenMoreResolved() override {
+    return nullptr;
+  }
+
+  kj::Own<capnp::ClientHook> addRef() override {
+    return kj::addRef(*this);
+  }
+
+  const void* getBrand() override {
+    return &BRAND;
+  }
+
+private:
+  static const char BRAND;
+
+  CallTracer& tracer;
+  kj::Own<capnp::ClientHook> inner;
+  capnp::InterfaceSchema schema;
+  capnp::Capability::Client local;
+};
+
+const char CallTracer::TracedHook::BRAND = 0;
+
+void CallTracer::Method::record(uint64_t micros) {
+  ++sampledCalls;
+  totalMicros += micros;
+
+  uint bucket = micros < 2 ? 0 : 63 - __builtin_clzll(micros);
+  ++histogram[kj::min(bucket, HISTOGRAM_BUCKETS - 1)];
+}
+
+CallTracer::CallTracer(uint sampleInterval): sampleInterval(kj::max(sampleInterval, 1u)) {}
+
+capnp::Capability::Client CallTracer::wrap(
+    capnp::Capability::Client inner, capnp::InterfaceSchema schema) {
+  return capnp::Capability::Client(
+      kj::refcounted<TracedHook>(*this, capnp::ClientHook::from(kj::mv(inner)), schema));
+}
+
+void CallTracer::addInterface(capnp::InterfaceSchema schema) {
+  knownInterfaces.add(schema);
+}
+
+void CallTracer::wrapCapabilities(capnp::DynamicStruct::Builder results) {
+  // Only direct fields: that covers every method the app's main view has that returns
+  // capabilities.
+  for (auto field: results.getSchema().getFields()) {
+    auto type = field.getType();
+    if (type.isInterface() && results.has(field)) {
+      auto schema = type.asInterface();
+      capnp::Capability::Client cap = results.get(field).as<capnp::DynamicCapability>();
+      results.set(field, wrap(kj::mv(cap), schema).castAs<capnp::DynamicCapability>(schema));
+    }
+  }
+}
+
+static kj::StringPtr shortName(capnp::Schema schema) {
+  auto proto = schema.getProto();
+  return proto.getDisplayName().slice(proto.getDisplayNamePrefixLength());
+}
+
+static kj::Maybe<capnp::InterfaceSchema> findInterface(
+    capnp::InterfaceSchema schema, uint64_t interfaceId) {
+  if (schema.getProto().getId() == interfaceId) {
+    return schema;
+  } else {
+    return schema.findSuperclass(interfaceId);
+  }
+}
+
+CallTracer::Method& CallTracer::getMethod(
+    capnp::InterfaceSchema schema, uint64_t interfaceId, uint16_t methodId) {
+  auto key = std::make_pair(interfaceId, methodId);
+  auto iter = methods.find(key);
+  if (iter != methods.end()) return iter->second;
+
+  Method method;
+  kj::Maybe<capnp::InterfaceSchema> iface = findInterface(schema, interfaceId);
+  for (uint i = 0; i < knownInterfaces.size() && iface == nullptr; i++) {
+    iface = findInterface(knownInterfaces[i], interfaceId);
+  }
+  KJ_IF_MAYBE(i, iface) {
+    method.interfaceName = kj::heapString(shortName(*i));
+    auto methodList = i->getMethods();
+    if (methodId < methodList.size()) {
+      method.methodName = kj::heapString(methodList[methodId].getProto().getName());
+
+      auto resultType = methodList[methodId].getResultType();
+      for (auto field: resultType.getFields()) {
+        if (field.getType().isInterface()) {
+          method.capResultType = resultType;
+          break;
+        }
+      }
+    }
+  } else {
+    method.interfaceName = kj::str("0x", kj::hex(interfaceId));
+  }
+  if (method.methodName == nullptr) {
+    method.methodName = kj::str(methodId);
+  }
+
+  return methods.insert(std::make_pair(key, kj::mv(method))).first->second;
+}
+
+capnp::Orphan<capnp::List<MethodCallStats>> CallTracer::getStats(
+    capnp::Orphanage orphanage) const {
+  auto orphan = orphanage.newOrphan<capnp::List<MethodCallStats>>(methods.size());
+  auto list = orphan.get();
+  uint i = 0;
+  for (auto& entry: methods) {
+    auto& method = entry.second;
+    auto stats = list[i++];
+    stats.setInterfaceId(entry.first.first);
+    stats.setMethodId(entry.first.second);
+    stats.setInterfaceName(method.interfaceName);
+    stats.setMethodName(method.methodName);
+    stats.setCalls(method.calls);
+    stats.setSampledCalls(method.sampledCalls);
+    stats.setFailedCalls(method.failedCalls);
+    stats.setTotalMicros(method.totalMicros);
+    auto histogram = stats.initLatencyHistogram(HISTOGRAM_BUCKETS);
+    for (uint j = 0; j < HISTOGRAM_BUCKETS; j++) {
+      histogram.set(j, method.histogram[j]);
+    }
+  }
+  return orphan;
+}
+
+static kj::String formatMicros(uint64_t micros) {
+  if (micros < 1000) {
+    return kj::str(micros, "us");
+  } else if (micros < 1000000) {
+    return kj::str(micros / 1000, "ms");
+  } else {
+    return kj::str(micros / 1000000, "s");
+  }
+}
+
+kj::String CallTracer::dump() const {
+  kj::Vector<kj::String> lines(methods.size());
+  for (auto& entry: methods) {
+    auto& method = entry.second;
+    kj::String latency;
+    if (method.sampledCalls > 0) {
+      // Report the upper bound of the buckets containing the median and 99th percentile.
+      kj::String percentiles[2];
+      uint64_t thresholds[2] = {
+        (method.sampledCalls + 1) / 2,
+        method.sampledCalls - method.sampledCalls / 100
+      };
+      uint64_t seen = 0;
+      uint found = 0;
+      for (uint i = 0; i < HISTOGRAM_BUCKETS && found < 2; i++) {
+        seen += method.histogram[i];
+        while (found < 2 && seen >= thresholds[found]) {
+          percentiles[found++] = i == HISTOGRAM_BUCKETS - 1 ?
+              kj::str(">", formatMicros(1ull << i)) : kj::str("<", formatMicros(2ull << i));
+        }
+      }
+      latency = kj::str(", mean ", formatMicros(method.totalMicros / method.sampledCalls),
+                        ", p50 ", percentiles[0], ", p99 ", percentiles[1]);
+    }
+    lines.add(kj::str(method.interfaceName, '.', method.methodName, ": ",
+                      method.calls, " calls, ", method.sampledCalls, " sampled, ",
+                      method.failedCalls, " failed", latency, '\n'));
+  }
+  return kj::strArray(lines, "");
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,106 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_CALL_TRACER_H_
+#define SANDSTORM_CALL_TRACER_H_
+
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <capnp/capability.h>
+#include <capnp/dynamic.h>
+#include <capnp/orphan.h>
+#include <capnp/schema.h>
+#include <sandstorm/supervisor.capnp.h>
+#include <map>
+
+namespace sandstorm {
+
+class CallTracer {
+  // Counts calls made through capabilities wrapped with wrap(), per interface and method, and
+  // times a sample of them into latency histograms. Capabilities returned by those calls are
+  // wrapped too, so e.g. calls on a session returned by `UiView.newSession()` are counted.
+  //
+  // Calls arriving over RPC, i.e. everything the front-end sends the app, are handed to the
+  // wrapped capability along with the caller's own call context, so neither their params nor
+  // their results are copied, and pipelining works. Capabilities in the results are wrapped in
+  // place. Calls made locally, e.g. by the supervisor itself, go through a Capability::Server,
+  // which does copy. The tracer must outlive every capability it has wrapped.
+
+public:
+  static constexpr uint HISTOGRAM_BUCKETS = 24;
+  // The last bucket starts at 2^23us, about 8 seconds.
+
+  static constexpr uint DEFAULT_SAMPLE_INTERVAL = 16;
+
+  explicit CallTracer(uint sampleInterval = DEFAULT_SAMPLE_INTERVAL);
+  // Every `sampleInterval`th call to each method is timed, starting with the first.
+
+  KJ_DISALLOW_COPY(CallTracer);
+
+  capnp::Capability::Client wrap(capnp::Capability::Client inner, capnp::InterfaceSchema schema);
+  // Returns a capability which forwards all calls to `inner`, recording them. `schema` is used
+  // only to name the methods in stats; calls to other interfaces are still forwarded and counted.
+
+  template <typename T>
+  typename T::Client wrap(typename T::Client inner) {
+    return wrap(kj::mv(inner), capnp::Schema::from<T>()).template castAs<T>();
+  }
+
+  void addInterface(capnp::InterfaceSchema schema);
+  // Lets calls to `schema` and its superclasses be named in stats even when they are made on a
+  // capability wrapped as some other type, e.g. on a WebSession returned as a UiSession.
+
+  capnp::Orphan<capnp::List<MethodCallStats>> getStats(capnp::Orphanage orphanage) const;
+  // Returns stats for every method called so far, in order of interface and method ID.
+
+  kj::String dump() const;
+  // Formats the stats as text, one line per method, for the log. Empty if nothing was called.
+
+private:
+  struct Method {
+    kj::String interfaceName;
+    kj::String methodName;
+    uint64_t calls = 0;
+    uint64_t sampledCalls = 0;
+    uint64_t failedCalls = 0;
+    uint64_t totalMicros = 0;
+    uint64_t histogram[HISTOGRAM_BUCKETS] = {};
+
+    kj::Maybe<capnp::StructSchema> capResultType;
+    // The method's result type, if it has capability fields to wrap.
+
+    void record(uint64_t micros);
+  };
+
+  class TracedHook;
+  class TracedServer;
+  class TracedPipeline;
+
+  uint sampleInterval;
+  std::map<std::pair<uint64_t, uint16_t>, Method> methods;
+  kj::Vector<capnp::InterfaceSchema> knownInterfaces;
+
+  Method& getMethod(capnp::InterfaceSchema schema, uint64_t interfaceId, uint16_t methodId);
+  void wrapCapabilities(capnp::DynamicStruct::Builder results);
+
+  template <typename Func>
+  kj::Promise<void> traced(Method& method, Func&& makeCall);
+  // Counts the call that `makeCall()` makes and returns the promise for, timing it if sampled.
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_CALL_TRACER_H_
@@ -0,0 +1,120 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "grain-placement.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace sandstorm {
+namespace {
+
+KJ_TEST("CPU lists") {
+  auto cpus = parseCpuList("0-3,8,10-11\n");
+  KJ_EXPECT(cpus.size() == 7);
+  KJ_EXPECT(cpus[0] == 0);
+  KJ_EXPECT(cpus[4] == 8);
+  KJ_EXPECT(cpus[6] == 11);
+  KJ_EXPECT(formatCpuList(cpus) == "0-3,8,10-11");
+
+  // Out of order and overlapping.
+  KJ_EXPECT(formatCpuList(parseCpuList("8,0-1,1")) == "0-1,8");
+
+  KJ_EXPECT(parseCpuList("").size() == 0);
+  KJ_EXPECT(formatCpuList(nullptr) == "");
+
+  KJ_EXPECT_THROW_MESSAGE("invalid", parseCpuList("3-1"));
+  KJ_EXPECT_THROW_MESSAGE("invalid", parseCpuList("0,x"));
+  KJ_EXPECT_THROW_MESSAGE("too large", parseCpuList("100000"));
+}
+
+KJ_TEST("placement domains") {
+  auto domains = parsePlacementDomains("0:0-3,8-11;1:4-7,12-15");
+  KJ_ASSERT(domains.size() == 2);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(domains[1].node) == 1);
+  KJ_EXPECT(formatCpuList(domains[1].cpus) == "4-7,12-15");
+  KJ_EXPECT(formatPlacementDomains(domains) == "0:0-3,8-11;1:4-7,12-15");
+
+  auto single = parsePlacementDomains("2-5");
+  KJ_ASSERT(single.size() == 1);
+  KJ_EXPECT(single[0].node == nullptr);
+  KJ_EXPECT(formatPlacementDomains(single) == "2-5");
+
+  KJ_EXPECT_THROW_MESSAGE("no CPUs", parsePlacementDomains("0:"));
+
+  // Whatever the host looks like, the domains cover exactly the CPUs we gave.
+  auto allowed = getAllowedCpus();
+  KJ_ASSERT(allowed.size() > 0);
+  size_t total = 0;
+  for (auto& domain: findPlacementDomains(allowed, true)) {
+    total += domain.cpus.size();
+  }
+  KJ_EXPECT(total == allowed.size());
+  KJ_EXPECT(findPlacementDomains(allowed, false).size() == 1);
+}
+
+KJ_TEST("choosePlacementDomain picks the least busy domain") {
+  auto domains = parsePlacementDomains("0:0-3;1:4-7;2:8-11");
+
+  KJ_EXPECT(choosePlacementDomain(domains, nullptr) == 0);
+
+  kj::Array<uint> running[] = {
+    parseCpuList("0-3"), parseCpuList("0-3"), parseCpuList("8-11"),
+    // Not confined to a domain, so not counted.
+    parseCpuList("0-11"), parseCpuList("4-5"),
+  };
+  KJ_EXPECT(choosePlacementDomain(domains, kj::arrayPtr(running, 5)) == 1);
+  KJ_EXPECT(choosePlacementDomain(domains, kj::arrayPtr(running, 3)) == 1);
+  KJ_EXPECT(choosePlacementDomain(domains, kj::arrayPtr(running, 2)) == 1);
+  KJ_EXPECT(choosePlacementDomain(domains, kj::arrayPtr(running, 1)) == 1);
+  KJ_EXPECT(choosePlacementDomain(domains, kj::arrayPtr(running + 2, 1)) == 0);
+}
+
+KJ_TEST("applyPlacement confines the process and its children") {
+  // Do it in a child so as not to confine the test runner.
+  auto allowed = getAllowedCpus();
+  PlacementDomain domain { nullptr, kj::heapArray<uint>(1) };
+  domain.cpus[0] = allowed.back();
+
+  pid_t child;
+  KJ_SYSCALL(child = fork());
+  if (child == 0) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      applyPlacement(domain);
+
+      pid_t grandchild;
+      KJ_SYSCALL(grandchild = fork());
+      if (grandchild == 0) {
+        _exit(getAllowedCpus().asPtr() == domain.cpus.asPtr() ? 0 : 1);
+      }
+      int status;
+      KJ_SYSCALL(waitpid(grandchild, &status, 0));
+      KJ_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child wasn't confined");
+    })) {
+      KJ_LOG(ERROR, *exception);
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  int status;
+  KJ_SYSCALL(waitpid(child, &status, 0));
+  KJ_EXPECT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+}  // namespace
+}  // namespace sandstorm
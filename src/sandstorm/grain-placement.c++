@@ -0,0 +1,244 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "grain-placement.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <algorithm>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "util.h"
+
+namespace sandstorm {
+
+static const char SUPERVISOR_CMDLINE[] = "/bin/sandstorm-supervisor";
+// How supervisors show up in /proc/<pid>/cmdline, both when the front-end starts them and when
+// the server starts them for `sandstorm supervise`.
+
+static uint parseNumber(kj::StringPtr number, kj::StringPtr context) {
+  uint result = 0;
+  KJ_IF_MAYBE(n, parseUInt(number, 10)) {
+    result = *n;
+  } else {
+    KJ_FAIL_REQUIRE("invalid number in CPU placement", context);
+  }
+  return result;
+}
+
+kj::Array<uint> parseCpuList(kj::StringPtr text) {
+  auto trimmed = trim(text);
+  kj::Vector<uint> result;
+  if (trimmed.size() == 0) {
+    // E.g. the cpulist of a node that only has memory.
+    return result.releaseAsArray();
+  }
+
+  for (auto& piece: split(trimmed, ',')) {
+    auto range = kj::heapString(piece);
+    uint first, last;
+    KJ_IF_MAYBE(dash, range.findFirst('-')) {
+      first = parseNumber(kj::heapString(range.slice(0, *dash)), text);
+      last = parseNumber(range.slice(*dash + 1), text);
+      KJ_REQUIRE(first <= last, "invalid CPU list", text);
+    } else {
+      first = last = parseNumber(range, text);
+    }
+    KJ_REQUIRE(last < CPU_SETSIZE, "CPU number too large", text);
+    for (uint cpu = first; cpu <= last; cpu++) {
+      result.add(cpu);
+    }
+  }
+
+  std::sort(result.begin(), result.end());
+  auto end = std::unique(result.begin(), result.end());
+  result.resize(end - result.begin());
+  return result.releaseAsArray();
+}
+
+kj::String formatCpuList(kj::ArrayPtr<const uint> cpus) {
+  kj::Vector<kj::String> ranges;
+  size_t i = 0;
+  while (i < cpus.size()) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+    if (j == i) {
+      ranges.add(kj::str(cpus[i]));
+    } else {
+      ranges.add(kj::str(cpus[i], '-', cpus[j]));
+    }
+    i = j + 1;
+  }
+  return kj::strArray(ranges, ",");
+}
+
+kj::Array<uint> getAllowedCpus() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  KJ_SYSCALL(sched_getaffinity(0, sizeof(set), &set));
+
+  kj::Vector<uint> result;
+  for (uint cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) result.add(cpu);
+  }
+  return result.releaseAsArray();
+}
+
+kj::Array<PlacementDomain> findPlacementDomains(kj::ArrayPtr<const uint> cpus, bool byNode) {
+  kj::Vector<PlacementDomain> result;
+
+  if (byNode) {
+    KJ_IF_MAYBE(dir, raiiOpenIfExists("/sys/devices/system/node",
+                                      O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+      for (auto& name: listDirectoryFd(*dir)) {
+        if (!name.startsWith("node")) continue;
+        KJ_IF_MAYBE(node, parseUInt(name.slice(strlen("node")), 10)) {
+          auto nodeCpus = parseCpuList(
+              readAll(raiiOpenAt(*dir, kj::str(name, "/cpulist"), O_RDONLY | O_CLOEXEC)));
+
+          kj::Vector<uint> usable;
+          for (uint cpu: nodeCpus) {
+            if (std::binary_search(cpus.begin(), cpus.end(), cpu)) usable.add(cpu);
+          }
+          if (usable.size() > 0) {
+            result.add(PlacementDomain { *node, usable.releaseAsArray() });
+          }
+        }
+      }
+    }
+
+    std::sort(result.begin(), result.end(),
+        [](const PlacementDomain& a, const PlacementDomain& b) {
+      return KJ_ASSERT_NONNULL(a.node) < KJ_ASSERT_NONNULL(b.node);
+    });
+  }
+
+  if (result.size() == 0 && cpus.size() > 0) {
+    result.add(PlacementDomain { nullptr, kj::heapArray(cpus) });
+  }
+
+  return result.releaseAsArray();
+}
+
+kj::String formatPlacementDomains(kj::ArrayPtr<const PlacementDomain> domains) {
+  kj::Vector<kj::String> pieces;
+  for (auto& domain: domains) {
+    KJ_IF_MAYBE(node, domain.node) {
+      pieces.add(kj::str(*node, ':', formatCpuList(domain.cpus)));
+    } else {
+      pieces.add(formatCpuList(domain.cpus));
+    }
+  }
+  return kj::strArray(pieces, ";");
+}
+
+kj::Array<PlacementDomain> parsePlacementDomains(kj::StringPtr text) {
+  kj::Vector<PlacementDomain> result;
+  for (auto& piece: split(text, ';')) {
+    auto domain = kj::heapString(piece);
+    PlacementDomain parsed;
+    KJ_IF_MAYBE(colon, domain.findFirst(':')) {
+      parsed.node = parseNumber(kj::heapString(domain.slice(0, *colon)), domain);
+      parsed.cpus = parseCpuList(domain.slice(*colon + 1));
+    } else {
+      parsed.cpus = parseCpuList(domain);
+    }
+    KJ_REQUIRE(parsed.cpus.size() > 0, "placement domain has no CPUs", domain);
+    result.add(kj::mv(parsed));
+  }
+  return result.releaseAsArray();
+}
+
+kj::Array<kj::Array<uint>> findRunningGrainCpus() {
+  kj::Vector<kj::Array<uint>> result;
+  pid_t self = getpid();
+
+  for (auto& file: listDirectory("/proc")) {
+    KJ_IF_MAYBE(pid, parseUInt(file, 10)) {
+      if (pid_t(*pid) == self) continue;
+
+      // Processes can disappear while we look at them, so every open may fail.
+      KJ_IF_MAYBE(fd, raiiOpenIfExists(kj::str("/proc/", file, "/cmdline"), O_RDONLY)) {
+        char buf[sizeof(SUPERVISOR_CMDLINE)];
+        size_t n = kj::FdInputStream(kj::mv(*fd)).tryRead(buf, sizeof(buf), sizeof(buf));
+        // Compare including the terminating NUL byte.
+        if (n != sizeof(buf) || memcmp(buf, SUPERVISOR_CMDLINE, n) != 0) continue;
+      } else {
+        continue;
+      }
+
+      KJ_IF_MAYBE(fd, raiiOpenIfExists(kj::str("/proc/", file, "/status"), O_RDONLY)) {
+        for (auto& line: splitLines(readAll(*fd))) {
+          if (line.startsWith("Cpus_allowed_list:")) {
+            result.add(parseCpuList(line.slice(strlen("Cpus_allowed_list:"))));
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  return result.releaseAsArray();
+}
+
+size_t choosePlacementDomain(kj::ArrayPtr<const PlacementDomain> domains,
+                             kj::ArrayPtr<const kj::Array<uint>> runningGrainCpus) {
+  KJ_REQUIRE(domains.size() > 0);
+
+  auto counts = kj::heapArray<uint>(domains.size());
+  memset(counts.begin(), 0, counts.asBytes().size());
+  for (auto& grainCpus: runningGrainCpus) {
+    for (auto i: kj::indices(domains)) {
+      if (grainCpus.asPtr() == domains[i].cpus.asPtr()) {
+        ++counts[i];
+        break;
+      }
+    }
+  }
+
+  size_t best = 0;
+  for (auto i: kj::indices(domains)) {
+    if (counts[i] < counts[best]) best = i;
+  }
+  return best;
+}
+
+void applyPlacement(const PlacementDomain& domain) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (uint cpu: domain.cpus) {
+    KJ_REQUIRE(cpu < CPU_SETSIZE, "CPU number too large", cpu);
+    CPU_SET(cpu, &set);
+  }
+  KJ_SYSCALL(sched_setaffinity(0, sizeof(set), &set), formatCpuList(domain.cpus));
+
+  KJ_IF_MAYBE(node, domain.node) {
+    // The policy is inherited across fork() and exec(), so it covers the app.
+    constexpr uint BITS = sizeof(unsigned long) * 8;
+    auto mask = kj::heapArray<unsigned long>(*node / BITS + 1);
+    memset(mask.begin(), 0, mask.asBytes().size());
+    mask[*node / BITS] = 1ul << (*node % BITS);
+    // The kernel ignores the last bit of `maxnode`, so pass one more than the mask's size.
+    KJ_SYSCALL(syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.begin(), mask.size() * BITS + 1),
+               *node);
+  }
+}
+
+}  // namespace sandstorm
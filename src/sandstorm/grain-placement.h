@@ -0,0 +1,83 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_GRAIN_PLACEMENT_H_
+#define SANDSTORM_GRAIN_PLACEMENT_H_
+
+#include <kj/array.h>
+#include <kj/string.h>
+
+namespace sandstorm {
+
+// Grain placement confines each grain -- its supervisor and the app -- to one "domain" of CPUs,
+// so that busy grains keep their caches warm and, on NUMA hosts, stay next to their memory.
+//
+// The server decides the domains at startup, from sandstorm.conf, while it can still see
+// /sys (see `findPlacementDomains()`), and passes them down to every supervisor in the
+// environment variable below. Each supervisor then joins the domain with the fewest grains
+// already running in it before it starts the app. The app's seccomp filter forbids it from
+// changing its own memory policy or CPU affinity, so the placement holds.
+
+constexpr const char* GRAIN_PLACEMENT_ENV = "SANDSTORM_GRAIN_PLACEMENT";
+// Holds the output of `formatPlacementDomains()`.
+
+struct PlacementDomain {
+  kj::Maybe<uint> node;
+  // NUMA node whose memory the grain should prefer, if any.
+
+  kj::Array<uint> cpus;
+  // CPUs the grain may run on, in increasing order.
+};
+
+kj::Array<uint> parseCpuList(kj::StringPtr text);
+// Parses a CPU list in the kernel's format, e.g. "0-3,8,10-11", as used by cpulist files in /sys
+// and Cpus_allowed_list in /proc/<pid>/status. Throws if malformed.
+
+kj::String formatCpuList(kj::ArrayPtr<const uint> cpus);
+// Inverse of `parseCpuList()`. `cpus` must be in increasing order.
+
+kj::Array<uint> getAllowedCpus();
+// The CPUs the calling thread may run on.
+
+kj::Array<PlacementDomain> findPlacementDomains(kj::ArrayPtr<const uint> cpus, bool byNode);
+// Returns the domains to spread grains over, given the CPUs that grains may use. If `byNode` is
+// true, there is one domain per NUMA node with any of those CPUs; otherwise there is a single
+// domain with no node. Reads /sys/devices/system/node; a host without it counts as one node.
+
+kj::String formatPlacementDomains(kj::ArrayPtr<const PlacementDomain> domains);
+kj::Array<PlacementDomain> parsePlacementDomains(kj::StringPtr text);
+// Serialize domains as e.g. "0:0-7,16-23;1:8-15,24-31", or just "2-15" for a domain with no node.
+
+kj::Array<kj::Array<uint>> findRunningGrainCpus();
+// Returns the CPU list of every other supervisor process visible in /proc. Supervisors are
+// recognized by argv[0] being exactly "/bin/sandstorm-supervisor", which is how both the
+// front-end and the server (for `sandstorm supervise`, in dev mode) exec them; the
+// `sandstorm supervise` client itself isn't confined to a domain and so isn't counted.
+
+size_t choosePlacementDomain(kj::ArrayPtr<const PlacementDomain> domains,
+                             kj::ArrayPtr<const kj::Array<uint>> runningGrainCpus);
+// Returns the index of the domain in which the fewest of `runningGrainCpus` are confined, the
+// lowest index among ties. Grains confined to anything other than exactly one domain are not
+// counted.
+
+void applyPlacement(const PlacementDomain& domain);
+// Confines the calling thread, and all processes it later starts, to the domain's CPUs, and makes
+// them prefer the domain's node for new memory allocations. They still fall back to other nodes
+// when the preferred one is full.
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_GRAIN_PLACEMENT_H_
@@ -0,0 +1,210 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "util.h"
+
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#define PR_GET_MEMORY_MERGE 68
+#endif
+
+namespace sandstorm {
+
+class KsmBench {
+  // A benchmark program showing what `supervisor --merge-memory` saves. It starts two processes
+  // the way the supervisor starts an app -- opting into memory merging and then exec()ing -- has
+  // each fill the same amount of anonymous memory with the same contents, as two grains running
+  // the same runtime would, and watches how many of their pages the kernel merges.
+
+public:
+  KsmBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    if (getenv(CHILD_ENV) != nullptr) {
+      return KJ_BIND_METHOD(*this, runChild);
+    }
+
+    return kj::MainBuilder(context, "Memory merging benchmark, unknown version",
+          "Starts two processes with memory merging enabled, as `supervisor --merge-memory` "
+          "would, fills <size> MiB of memory in each with identical contents, and reports how "
+          "much of it the kernel merges and how quickly. KSM must be running: "
+          "echo 1 > /sys/kernel/mm/ksm/run")
+        .addOptionWithArg({'s', "size"}, KJ_BIND_METHOD(*this, setSize), "<size>",
+                          "MiB to fill in each process. Default: 64.")
+        .addOptionWithArg({'t', "timeout"}, KJ_BIND_METHOD(*this, setTimeout), "<seconds>",
+                          "Give up waiting for merging after this long. Default: 60.")
+        .addOption({"no-merge"}, [this]() { merge = false; return true; },
+                   "Don't opt the processes into merging, for comparison.")
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  size_t size = 64ull << 20;
+  uint64_t timeout = 60;
+  bool merge = true;
+
+  static constexpr const char* CHILD_ENV = "SANDSTORM_KSM_BENCH_FILL";
+  // Set, to the number of bytes to fill, in the children's environment.
+
+  kj::MainBuilder::Validity setSize(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n == 0) return "Must be positive.";
+      size = static_cast<size_t>(*n) << 20;
+      return true;
+    } else {
+      return "Not a number.";
+    }
+  }
+
+  kj::MainBuilder::Validity setTimeout(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      timeout = *n;
+      return true;
+    } else {
+      return "Not a number.";
+    }
+  }
+
+  kj::MainBuilder::Validity run() {
+    auto ksmRun = trim(readAll("/sys/kernel/mm/ksm/run"));
+    if (ksmRun != "1") {
+      return "KSM isn't running. As root: echo 1 > /sys/kernel/mm/ksm/run";
+    }
+
+    pid_t children[2] = { 0, 0 };
+    KJ_DEFER({
+      for (auto child: children) {
+        if (child != 0) {
+          kill(child, SIGKILL);
+          waitpid(child, nullptr, 0);
+        }
+      }
+    });
+    for (auto& child: children) {
+      child = startChild();
+    }
+
+    // Sample until merging stops making progress.
+    const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    const uint64_t start = now();
+    uint64_t merged = 0;
+    uint64_t lastProgress = start;
+    for (;;) {
+      usleep(100000);
+      uint64_t total = 0;
+      for (auto child: children) {
+        auto path = kj::str("/proc/", child, "/ksm_merging_pages");
+        total += parseUInt(trim(readAll(path)), 10).orDefault(0);
+      }
+      uint64_t time = now();
+      if (total > merged) {
+        merged = total;
+        lastProgress = time;
+      }
+      if (time - lastProgress > 2000000 || time - start > timeout * 1000000) break;
+    }
+
+    uint64_t filled = size / pageSize * 2;
+    context.warning(kj::str("filled: ", size >> 20, " MiB in each of 2 processes",
+                            merge ? "" : " (merging not requested)"));
+    context.warning(kj::str("merged: ", merged * pageSize >> 20, " MiB (", merged * 100 / filled,
+                            "% of pages) after ", (lastProgress - start) / 1000, "ms"));
+    // Each merged page is now shared by both processes.
+    context.exitInfo(kj::str("saved: ", merged / 2 * pageSize >> 20, " MiB"));
+  }
+
+  pid_t startChild() {
+    // Starts a process which opts into merging, exec()s, fills its memory, and then reports
+    // whether merging is still enabled, as a supervisor-started app would be.
+
+    int fds[2];
+    KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+    kj::AutoCloseFd readEnd(fds[0]);
+    kj::AutoCloseFd writeEnd(fds[1]);
+
+    pid_t child;
+    KJ_SYSCALL(child = fork());
+    if (child == 0) {
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        if (merge) {
+          KJ_SYSCALL(prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0), "kernel doesn't support merging");
+        }
+        KJ_SYSCALL(dup2(writeEnd, STDOUT_FILENO));
+        KJ_SYSCALL(setenv(CHILD_ENV, kj::str(size).cStr(), true));
+        KJ_SYSCALL(execl("/proc/self/exe", "ksm-bench", (char*)nullptr));
+      })) {
+        KJ_LOG(ERROR, *exception);
+      }
+      _exit(1);
+    }
+
+    writeEnd = nullptr;
+    char status;
+    KJ_ASSERT(kj::FdInputStream(readEnd.get()).tryRead(&status, 1, 1) == 1,
+              "child failed to start");
+    if (merge && status != 'y') {
+      context.warning("merging was lost across exec(); this kernel is too old for "
+                      "supervisor --merge-memory to have any effect");
+    }
+    return child;
+  }
+
+  void runChild(kj::StringPtr programName, kj::ArrayPtr<const kj::StringPtr> params) {
+    size_t fillSize = KJ_ASSERT_NONNULL(parseUInt(getenv(CHILD_ENV), 10));
+    void* ptr = mmap(nullptr, fillSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    if (ptr == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno);
+    }
+
+    // Every page is different, so that any merging is between the two processes.
+    uint64_t* words = reinterpret_cast<uint64_t*>(ptr);
+    const size_t pageWords = sysconf(_SC_PAGESIZE) / sizeof(uint64_t);
+    for (size_t i = 0; i < fillSize / sizeof(uint64_t); i++) {
+      words[i] = (i / pageWords) * 0x9e3779b97f4a7c15ull + i % pageWords;
+    }
+
+    char status = prctl(PR_GET_MEMORY_MERGE, 0, 0, 0, 0) > 0 ? 'y' : 'n';
+    KJ_SYSCALL(write(STDOUT_FILENO, &status, 1));
+
+    for (;;) pause();
+  }
+
+  static uint64_t now() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+  }
+};
+
+constexpr const char* KsmBench::CHILD_ENV;
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::KsmBench)
@@ -0,0 +1,219 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "maildir.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <capnp/message.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "byte-stream.h"
+#include "test-util.h"
+#include "util.h"
+
+namespace sandstorm {
+namespace {
+
+class TempMaildir: public TempDir {
+public:
+  TempMaildir(): TempDir("sandstorm-maildir-test") {
+    KJ_SYSCALL(mkdir(kj::str(path, "/tmp").cStr(), 0777));
+    KJ_SYSCALL(mkdir(kj::str(path, "/new").cStr(), 0777));
+  }
+
+  kj::Array<kj::String> list(kj::StringPtr subdir) {
+    return listDirectory(kj::str(path, '/', subdir));
+  }
+
+  kj::String readOnlyMessage() {
+    // Returns the one delivered message, with its MIME boundary replaced by "BOUNDARY" so that
+    // messages from different deliveries can be compared.
+    auto names = list("new");
+    KJ_ASSERT(names.size() == 1);
+    KJ_ASSERT(names[0].startsWith("_"));
+    auto text = readAll(kj::str(path, "/new/", names[0]));
+    return replaceAll(text, names[0].slice(1), "BOUNDARY");
+  }
+
+private:
+  static kj::String replaceAll(kj::StringPtr text, kj::StringPtr from, kj::StringPtr to) {
+    kj::Vector<char> result(text.size());
+    const char* pos = text.begin();
+    while (const char* match = strstr(pos, from.cStr())) {
+      result.addAll(pos, match);
+      result.addAll(to);
+      pos = match + from.size();
+    }
+    result.addAll(pos, text.end());
+    result.add('\0');
+    return kj::String(result.releaseAsArray());
+  }
+};
+
+void initEmail(EmailMessage::Builder email) {
+  email.setDate(1420070400ll * 1000000000ll);
+  email.initFrom().setAddress("alice@example.com");
+  auto to = email.initTo(1)[0];
+  to.setName("Bob");
+  to.setAddress("bob@example.com");
+  email.setSubject("Pictures");
+  email.setText("See attached.");
+
+  auto attachments = email.initAttachments(2);
+  attachments[0].setContentType("image/jpeg");
+  attachments[0].setContentDisposition("attachment; filename=\"big.jpg\"");
+  attachments[1].setContentType("text/plain");
+  attachments[1].setContentDisposition("attachment; filename=\"note.txt\"");
+  attachments[1].setContentId("note");
+}
+
+KJ_TEST("deliverToMaildirStreaming writes multi-megabyte attachments as they arrive") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  auto big = makeContent(5 << 20, 0);
+  auto small = makeContent(1000, 7);
+
+  TempMaildir maildir;
+  capnp::MallocMessageBuilder message;
+  auto email = message.getRoot<EmailMessage>();
+  initEmail(email);
+
+  auto streams = deliverToMaildirStreaming(maildir.path, email);
+  KJ_ASSERT(streams.size() == 2);
+
+  // The second attachment is written first; it must wait for the first to be done.
+  ByteStreamWriter second(kj::mv(streams[1]));
+  auto secondWrite = second.write(small.begin(), small.size());
+  auto secondDone = second.done();
+  turn(waitScope);
+
+  // Feed the first attachment in odd-sized chunks, waiting for each as a real sender would.
+  const size_t CHUNK = 65521;
+  ByteStreamWriter first(kj::mv(streams[0]));
+  for (size_t offset = 0; offset < big.size(); offset += CHUNK) {
+    first.write(big.begin() + offset, kj::min(CHUNK, big.size() - offset)).wait(waitScope);
+  }
+  turn(waitScope);
+
+  // Nothing is delivered until every attachment is done.
+  KJ_EXPECT(maildir.list("new").size() == 0);
+  KJ_EXPECT(maildir.list("tmp").size() == 1);
+
+  first.done().wait(waitScope);
+  secondWrite.wait(waitScope);
+  secondDone.wait(waitScope);
+
+  KJ_EXPECT(maildir.list("tmp").size() == 0);
+  auto streamed = maildir.readOnlyMessage();
+
+  // The result is exactly what deliverToMaildir() writes given the same content in memory.
+  TempMaildir reference;
+  email.getAttachments()[0].setContent(big);
+  email.getAttachments()[1].setContent(small);
+  deliverToMaildir(reference.path, email);
+  KJ_EXPECT(streamed == reference.readOnlyMessage());
+
+  // And the attachments decode back to their content.
+  kj::Vector<kj::Array<kj::byte>> decoded;
+  const char* pos = streamed.cStr();
+  while (const char* start = strstr(pos, "Content-Transfer-Encoding: base64\n")) {
+    start = strstr(start, "\n\n") + 2;
+    const char* end = strstr(start, "\n--BOUNDARY");
+    KJ_ASSERT(end != nullptr);
+    decoded.add(base64Decode(kj::heapString(start, end - start)));
+    pos = end;
+  }
+  KJ_ASSERT(decoded.size() == 2);
+  KJ_EXPECT(decoded[0].asPtr() == big.asPtr());
+  KJ_EXPECT(decoded[1].asPtr() == small.asPtr());
+}
+
+KJ_TEST("deliverToMaildirStreaming done() returns per attachment, the last once delivered") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  TempMaildir maildir;
+  capnp::MallocMessageBuilder message;
+  auto email = message.getRoot<EmailMessage>();
+  initEmail(email);
+
+  auto content = makeContent(1000, 5);
+  auto streams = deliverToMaildirStreaming(maildir.path, email);
+  KJ_ASSERT(streams.size() == 2);
+
+  // Finish the first attachment before even starting on the second, as a sender that works
+  // through them one at a time would.
+  ByteStreamWriter first(kj::mv(streams[0]));
+  first.write(content.begin(), content.size()).wait(waitScope);
+  first.done().wait(waitScope);
+  KJ_EXPECT(maildir.list("new").size() == 0);
+
+  ByteStreamWriter second(kj::mv(streams[1]));
+  second.write(content.begin(), content.size()).wait(waitScope);
+  second.done().wait(waitScope);
+  KJ_EXPECT(maildir.list("new").size() == 1);
+}
+
+KJ_TEST("deliverToMaildirStreaming abandons the message when a stream is dropped") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  TempMaildir maildir;
+  capnp::MallocMessageBuilder message;
+  auto email = message.getRoot<EmailMessage>();
+  initEmail(email);
+
+  auto content = makeContent(100000, 3);
+  auto streams = deliverToMaildirStreaming(maildir.path, email);
+  KJ_ASSERT(streams.size() == 2);
+
+  ByteStreamWriter first(kj::mv(streams[0]));
+  first.write(content.begin(), content.size()).wait(waitScope);
+  KJ_EXPECT(maildir.list("tmp").size() == 1);
+
+  // Drop the second attachment without calling done().
+  streams[1] = nullptr;
+  turn(waitScope);
+
+  KJ_EXPECT(maildir.list("tmp").size() == 0);
+  KJ_EXPECT(maildir.list("new").size() == 0);
+  KJ_EXPECT(first.done().then([]() { return false; }, [](kj::Exception&&) { return true; })
+      .wait(waitScope));
+}
+
+KJ_TEST("deliverToMaildirStreaming delivers immediately without attachments") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  TempMaildir maildir;
+  capnp::MallocMessageBuilder message;
+  auto email = message.getRoot<EmailMessage>();
+  initEmail(email);
+  email.initAttachments(0);
+
+  KJ_EXPECT(deliverToMaildirStreaming(maildir.path, email).size() == 0);
+  auto streamed = maildir.readOnlyMessage();
+
+  TempMaildir reference;
+  deliverToMaildir(reference.path, email);
+  KJ_EXPECT(streamed == reference.readOnlyMessage());
+  KJ_EXPECT(streamed.startsWith("Date: Thu, 01 Jan 2015 00:00:00 +0000\n"));
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,419 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "maildir.h"
+#include <kj/async.h>
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/vector.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace sandstorm {
+
+namespace {
+
+kj::String genRandomString() {
+  // Generate a unique random string.
+
+  // Get 16 random bytes.
+  kj::byte bytes[16];
+  kj::FdInputStream(raiiOpen("/dev/urandom", O_RDONLY)).read(bytes, sizeof(bytes));
+
+  // Base64 encode, using digits safe for MIME boundary or a filename.
+  static const char DIGITS[65] =
+      "0123456789"
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+      "abcdefghijklmnopqrstuvwxyz_.";
+  uint buffer = 0;
+  uint bufBits = 0;
+  auto chars = kj::heapArrayBuilder<char>(23);
+  for (kj::byte b: bytes) {
+    buffer |= b << bufBits;
+    bufBits += 8;
+
+    while (bufBits >= 6) {
+      chars.add(DIGITS[buffer & 63]);
+      buffer >>= 6;
+      bufBits -= 6;
+    }
+  }
+  chars.add(DIGITS[buffer & 63]);
+  chars.add('\0');
+
+  return kj::String(chars.finish());
+}
+
+kj::String formatAddress(EmailAddress::Reader email) {
+  auto name = email.getName();
+  auto address = email.getAddress();
+  if (name.size() == 0) {
+    return kj::str(address);
+  } else {
+    return kj::str(name, " <", address, ">");
+  }
+}
+
+class MaildirMessage final: public kj::Refcounted {
+  // A message being written to <maildir>/tmp. Each line goes straight to the file; nothing but the
+  // write buffer is held in memory. Unless commit() is called, the file is deleted on destruction.
+
+public:
+  MaildirMessage(kj::StringPtr maildir, EmailMessage::Reader email)
+      : maildir(kj::heapString(maildir)),
+        id(genRandomString()),
+        // Prefix name with _ in case `id` starts with '.'.
+        tmpFilename(kj::str(maildir, "/tmp/_", id)),
+        fd(raiiOpen(tmpFilename, O_WRONLY | O_CREAT | O_EXCL)),
+        fdStream(fd),
+        output(fdStream) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() { writeHeaders(email); })) {
+      // The destructor won't run, so remove the file we just created here.
+      unlink(tmpFilename.cStr());
+      kj::throwFatalException(kj::mv(*exception));
+    }
+  }
+
+  ~MaildirMessage() noexcept(false) {
+    if (!committed) {
+      // Abandoned; don't leave a partial message behind in tmp/.
+      unlink(tmpFilename.cStr());
+    }
+  }
+
+  void beginAttachment(kj::StringPtr contentType, kj::StringPtr contentDisposition,
+                       kj::StringPtr contentId) {
+    writeLine(kj::str("--", id));
+    addHeader("Content-Type", contentType);
+    addHeader("Content-Disposition", contentDisposition);
+    addHeader("Content-Transfer-Encoding", "base64");
+    addHeader("Content-Id", contentId);
+    writeLine(nullptr);
+  }
+
+  void writeAttachmentData(kj::ArrayPtr<const kj::byte> data) {
+    encoder.encode(data, output);
+  }
+
+  void endAttachment() {
+    encoder.finish(output);
+    writeLine(nullptr);
+  }
+
+  void commit() {
+    writeLine(kj::str("--", id, "--"));
+    output.flush();
+    fd = nullptr;
+
+    // Move to final location.
+    KJ_SYSCALL(rename(tmpFilename.cStr(), kj::str(maildir, "/new/_", id).cStr()));
+    committed = true;
+  }
+
+private:
+  kj::String maildir;
+  kj::String id;
+  kj::String tmpFilename;
+  kj::AutoCloseFd fd;
+  kj::FdOutputStream fdStream;
+  kj::BufferedOutputStreamWrapper output;
+  Base64Encoder encoder { true };
+  bool committed = false;
+
+  void writeHeaders(EmailMessage::Reader email) {
+    addDateHeader(email.getDate());
+
+    addHeader("To", email.getTo());
+    addHeader("From", email.getFrom());
+    addHeader("Reply-To", email.getReplyTo());
+    addHeader("CC", email.getCc());
+    addHeader("BCC", email.getBcc());
+    addHeader("Subject", email.getSubject());
+
+    addHeader("Message-Id", email.getMessageId());
+    addHeader("References", email.getReferences());
+    addHeader("In-Reply-To", email.getInReplyTo());
+
+    addHeader("Content-Type", kj::str("multipart/alternative; boundary=", id));
+
+    writeLine(nullptr);  // blank line starts body.
+
+    if (email.hasText()) {
+      writeLine(kj::str("--", id));
+      addHeader("Content-Type", "text/plain; charset=UTF-8");
+      writeLine(nullptr);
+      writeLine(email.getText());
+    }
+    if (email.hasHtml()) {
+      writeLine(kj::str("--", id));
+      addHeader("Content-Type", "text/html; charset=UTF-8");
+      writeLine(nullptr);
+      writeLine(email.getHtml());
+    }
+  }
+
+  void writeLine(kj::StringPtr line) {
+    output.write(line.begin(), line.size());
+    output.write("\n", 1);
+  }
+
+  void addHeader(kj::StringPtr name, kj::StringPtr value) {
+    if (value.size() > 0) {
+      writeLine(kj::str(name, ": ", value));
+    }
+  }
+
+  void addHeader(kj::StringPtr name, EmailAddress::Reader email) {
+    addHeader(name, formatAddress(email));
+  }
+
+  void addHeader(kj::StringPtr name, capnp::List<EmailAddress>::Reader emails) {
+    addHeader(name, kj::strArray(KJ_MAP(e, emails) { return formatAddress(e); }, ", "));
+  }
+
+  void addHeader(kj::StringPtr name, capnp::List<capnp::Text>::Reader items) {
+    // Used for lists of message IDs (e.g. References an In-Reply-To). Each ID should be "quoted"
+    // with <>.
+    addHeader(name, kj::strArray(KJ_MAP(i, items) { return kj::str('<', i, '>'); }, " "));
+  }
+
+  void addDateHeader(int64_t nanoseconds) {
+    time_t seconds(nanoseconds / 1000000000u);
+    struct tm *tm = gmtime(&seconds);
+    char date[40];
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", tm);
+
+    addHeader("Date", date);
+  }
+};
+
+class StreamingDelivery final: public kj::Refcounted {
+  // Shared by the attachment streams of one message, handing the file to each in turn.
+
+public:
+  StreamingDelivery(kj::Own<MaildirMessage>&& message,
+                    capnp::List<EmailAttachment>::Reader attachments)
+      : message(kj::mv(message)), committed(newCommitPromise()) {
+    for (auto attachment: attachments) {
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      parts.add(Part {
+        kj::heapString(attachment.getContentType()),
+        kj::heapString(attachment.getContentDisposition()),
+        kj::heapString(attachment.getContentId()),
+        paf.promise.fork(),
+        kj::mv(paf.fulfiller)
+      });
+    }
+
+    KJ_REQUIRE(parts.size() > 0);
+    startPart(0);
+  }
+
+  bool isTurn(uint index) {
+    return index == current && message != nullptr;
+  }
+
+  kj::Promise<void> whenTurn(uint index) {
+    return parts[index].turn.addBranch();
+  }
+
+  bool isLast(uint index) {
+    return index + 1 == parts.size();
+  }
+
+  kj::Promise<void> whenCommitted() {
+    // Resolves once the message is in new/, or throws if it was abandoned.
+    return committed.addBranch();
+  }
+
+  void write(uint index, kj::ArrayPtr<const kj::byte> data) {
+    auto& m = *KJ_REQUIRE_NONNULL(message, "e-mail was abandoned");
+    KJ_ASSERT(index == current);
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      m.writeAttachmentData(data);
+    })) {
+      abandon("writing the message failed");
+      kj::throwFatalException(kj::mv(*exception));
+    }
+  }
+
+  void done(uint index) {
+    auto& m = *KJ_REQUIRE_NONNULL(message, "e-mail was abandoned");
+    KJ_ASSERT(index == current);
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      m.endAttachment();
+      if (index + 1 == parts.size()) {
+        m.commit();
+      }
+    })) {
+      abandon("writing the message failed");
+      kj::throwFatalException(kj::mv(*exception));
+    }
+
+    if (++current < parts.size()) {
+      startPart(current);
+    } else {
+      message = nullptr;
+      commitFulfiller->fulfill();
+    }
+  }
+
+  void dropped(uint index) {
+    // Called when a stream is dropped without done().
+    if (index >= current) {
+      abandon("an earlier attachment stream was dropped before done()");
+    }
+  }
+
+private:
+  struct Part {
+    kj::String contentType;
+    kj::String contentDisposition;
+    kj::String contentId;
+    kj::ForkedPromise<void> turn;
+    kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  };
+
+  kj::Maybe<kj::Own<MaildirMessage>> message;
+  // Null once committed or abandoned.
+
+  kj::Own<kj::PromiseFulfiller<void>> commitFulfiller;
+  kj::ForkedPromise<void> committed;
+  // Fulfilled when the message is moved into place, rejected if it is abandoned.
+
+  kj::Vector<Part> parts;
+  uint current = 0;
+
+  kj::ForkedPromise<void> newCommitPromise() {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    commitFulfiller = kj::mv(paf.fulfiller);
+    return paf.promise.fork();
+  }
+
+  void startPart(uint index) {
+    auto& part = parts[index];
+    KJ_ASSERT_NONNULL(message)->beginAttachment(
+        part.contentType, part.contentDisposition, part.contentId);
+    part.fulfiller->fulfill();
+  }
+
+  void abandon(kj::StringPtr reason) {
+    if (message == nullptr) return;
+    message = nullptr;  // deletes the temporary file
+    commitFulfiller->reject(KJ_EXCEPTION(DISCONNECTED, "e-mail abandoned", reason));
+    for (uint i = current + 1; i < parts.size(); i++) {
+      parts[i].fulfiller->reject(KJ_EXCEPTION(DISCONNECTED, "e-mail abandoned", reason));
+    }
+  }
+};
+
+class AttachmentStream final: public ByteStream::Server {
+public:
+  AttachmentStream(kj::Own<StreamingDelivery>&& delivery, uint index)
+      : delivery(kj::mv(delivery)), index(index) {}
+  ~AttachmentStream() noexcept(false) {
+    if (!doneCalled) {
+      delivery->dropped(index);
+    }
+  }
+
+protected:
+  kj::Promise<void> write(WriteContext context) override {
+    KJ_REQUIRE(!doneCalled, "write() called after done()");
+
+    if (waiting == 0 && delivery->isTurn(index)) {
+      delivery->write(index, context.getParams().getData());
+      return kj::READY_NOW;
+    }
+
+    // An earlier attachment is still being written. Queue behind it, and behind any earlier
+    // write() of ours that is also waiting.
+    ++waiting;
+    return delivery->whenTurn(index).then([this, context]() mutable {
+      --waiting;
+      delivery->write(index, context.getParams().getData());
+    });
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    KJ_REQUIRE(!doneCalled, "done() called twice");
+    doneCalled = true;
+
+    if (waiting == 0 && delivery->isTurn(index)) {
+      return finish();
+    }
+
+    ++waiting;
+    return delivery->whenTurn(index).then([this]() {
+      --waiting;
+      return finish();
+    });
+  }
+
+private:
+  kj::Own<StreamingDelivery> delivery;
+  uint index;
+  uint waiting = 0;
+  bool doneCalled = false;
+
+  kj::Promise<void> finish() {
+    delivery->done(index);
+
+    // An earlier attachment's data is in the file once it's done, and the sender may well wait
+    // for that before starting on the next one. The last attachment's done() is what tells the
+    // sender the message was delivered, so that one waits for the message to be in new/.
+    if (delivery->isLast(index)) {
+      return delivery->whenCommitted();
+    } else {
+      return kj::READY_NOW;
+    }
+  }
+};
+
+}  // namespace
+
+void deliverToMaildir(kj::StringPtr maildir, EmailMessage::Reader email) {
+  MaildirMessage message(maildir, email);
+  for (auto attachment: email.getAttachments()) {
+    message.beginAttachment(attachment.getContentType(), attachment.getContentDisposition(),
+                            attachment.getContentId());
+    message.writeAttachmentData(attachment.getContent());
+    message.endAttachment();
+  }
+  message.commit();
+}
+
+kj::Array<ByteStream::Client> deliverToMaildirStreaming(
+    kj::StringPtr maildir, EmailMessage::Reader email) {
+  auto message = kj::refcounted<MaildirMessage>(maildir, email);
+  auto attachments = email.getAttachments();
+  if (attachments.size() == 0) {
+    message->commit();
+    return nullptr;
+  }
+
+  auto delivery = kj::refcounted<StreamingDelivery>(kj::mv(message), attachments);
+  auto streams = kj::heapArrayBuilder<ByteStream::Client>(attachments.size());
+  for (uint i = 0; i < attachments.size(); i++) {
+    streams.add(kj::heap<AttachmentStream>(kj::addRef(*delivery), i));
+  }
+  return streams.finish();
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,45 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_MAILDIR_H_
+#define SANDSTORM_MAILDIR_H_
+
+#include <kj/string.h>
+#include <sandstorm/email.capnp.h>
+#include <sandstorm/util.capnp.h>
+
+namespace sandstorm {
+
+// Delivery of incoming e-mail into a maildir, as sandstorm-http-bridge does for apps. The message
+// is formatted as MIME and written directly to a file under <maildir>/tmp, which is moved into
+// <maildir>/new once complete, so readers never see a partial message.
+
+void deliverToMaildir(kj::StringPtr maildir, EmailMessage::Reader email);
+// Writes `email`, attachments included, as one new message.
+
+kj::Array<ByteStream::Client> deliverToMaildirStreaming(
+    kj::StringPtr maildir, EmailMessage::Reader email);
+// Implements EmailSendPort.sendStreaming(): writes the headers and text parts of `email` now and
+// returns one stream per attachment, whose contents are base64-encoded into the file as they
+// arrive instead of being held in memory. The `content` fields of `email`'s attachments are
+// ignored. The streams are consumed in order; the message is moved into place when the last one
+// is done, and abandoned if any is dropped before then. A stream's done() returns once its
+// attachment is written, except the last one's, which waits for the message to be moved into
+// place.
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_MAILDIR_H_
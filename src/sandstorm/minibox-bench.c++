@@ -0,0 +1,216 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <algorithm>
+
+#include "util.h"
+
+namespace sandstorm {
+
+class MiniboxBench {
+  // A benchmark program comparing per-job latency of one-shot minibox invocations against jobs
+  // submitted to a minibox job server (`minibox --serve`). Both modes use the same box as the
+  // backup/restore code in the shell: the host root read-only with /proc, /var and /etc hidden.
+
+public:
+  MiniboxBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Minibox benchmark, unknown version",
+          "Runs <command> (default: `true`) <count> times in a one-shot minibox and then <count> "
+          "times through a minibox job server, and reports per-job latency for each. <sandstorm> "
+          "is the path to the sandstorm binary (or the `minibox` symlink to it).")
+        .addOptionWithArg({'n', "count"}, KJ_BIND_METHOD(*this, setCount), "<count>",
+                          "Number of jobs to run in each mode. Default: 100.")
+        .expectArg("<sandstorm>", KJ_BIND_METHOD(*this, setExe))
+        .expectZeroOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::StringPtr exe;
+  uint count = 100;
+  kj::Vector<kj::StringPtr> command;
+
+  kj::MainBuilder::Validity setCount(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n == 0) return "Must be positive.";
+      count = *n;
+      return true;
+    } else {
+      return "Not a number.";
+    }
+  }
+
+  kj::MainBuilder::Validity setExe(kj::StringPtr arg) {
+    exe = arg;
+    return true;
+  }
+
+  kj::MainBuilder::Validity addCommandArg(kj::StringPtr arg) {
+    command.add(arg);
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    if (command.size() == 0) {
+      command.add("true");
+    }
+
+    char tmpl[] = "/tmp/minibox-bench.XXXXXX";
+    KJ_ASSERT(mkdtemp(tmpl) != nullptr);
+    KJ_DEFER(recursivelyDelete(tmpl));
+    auto socketPath = kj::str(tmpl, "/socket");
+
+    kj::StringPtr boxArgs[] = { "-r/=/", "-h/proc", "-h/var", "-h/etc", "-t/tmp" };
+
+    // One-shot mode.
+    kj::Vector<uint64_t> oneShot;
+    for (uint i = 0; i < count; i++) {
+      kj::Vector<kj::StringPtr> args;
+      args.addAll(boxArgs, boxArgs + kj::size(boxArgs));
+      args.add("-d/tmp");
+      args.add("--");
+      args.addAll(command);
+      oneShot.add(timeRun(args.asPtr()));
+    }
+
+    // Job server mode.
+    pid_t server;
+    {
+      kj::Vector<kj::StringPtr> args;
+      auto serveArg = kj::str("--serve=", socketPath);
+      args.add(serveArg);
+      args.addAll(boxArgs, boxArgs + kj::size(boxArgs));
+      server = spawn(args.asPtr());
+    }
+    KJ_DEFER({
+      kill(server, SIGTERM);
+      int status;
+      waitpid(server, &status, 0);
+    });
+
+    // Wait for the server to be listening. Connections made while the server is still building
+    // its box simply queue, so a successful connect() is all we need.
+    waitForSocket(socketPath);
+
+    kj::Vector<uint64_t> served;
+    auto jobServerArg = kj::str("--job-server=", socketPath);
+    for (uint i = 0; i < count; i++) {
+      kj::Vector<kj::StringPtr> args;
+      args.add(jobServerArg);
+      args.add("-d/tmp");
+      args.add("--");
+      args.addAll(command);
+      served.add(timeRun(args.asPtr()));
+    }
+
+    report("one-shot", oneShot);
+    report("job server", served);
+    context.exitInfo(kj::str("speedup (median): ",
+        (double)median(oneShot) / kj::max(median(served), (uint64_t)1), "x"));
+  }
+
+  pid_t spawn(kj::ArrayPtr<const kj::StringPtr> args) {
+    pid_t pid;
+    KJ_SYSCALL(pid = fork());
+    if (pid == 0) {
+      auto argv = kj::heapArrayBuilder<const char*>(args.size() + 2);
+      argv.add("minibox");  // so the sandstorm binary dispatches to MiniboxMain
+      for (auto& arg: args) {
+        argv.add(arg.cStr());
+      }
+      argv.add(nullptr);
+      KJ_SYSCALL(execv(exe.cStr(), const_cast<char**>(argv.begin())), exe);
+      KJ_UNREACHABLE;
+    }
+    return pid;
+  }
+
+  uint64_t timeRun(kj::ArrayPtr<const kj::StringPtr> args) {
+    // Run minibox to completion and return elapsed microseconds.
+
+    uint64_t start = now();
+    pid_t pid = spawn(args);
+    int status;
+    KJ_SYSCALL(waitpid(pid, &status, 0));
+    uint64_t elapsed = now() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      context.exitError(kj::str("minibox job failed with status ", status));
+    }
+    return elapsed;
+  }
+
+  void waitForSocket(kj::StringPtr path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    KJ_ASSERT(path.size() < sizeof(addr.sun_path));
+    memcpy(addr.sun_path, path.begin(), path.size());
+
+    for (uint i = 0; i < 1000; i++) {
+      int fd;
+      KJ_SYSCALL(fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+      kj::AutoCloseFd sock(fd);
+      if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+        // The server ignores connections that close without submitting a job.
+        return;
+      }
+      usleep(10000);
+    }
+    context.exitError("minibox job server didn't start listening.");
+  }
+
+  static uint64_t now() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+  }
+
+  static uint64_t median(kj::Vector<uint64_t>& samples) {
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+  }
+
+  void report(kj::StringPtr mode, kj::Vector<uint64_t>& samples) {
+    std::sort(samples.begin(), samples.end());
+    uint64_t total = 0;
+    for (auto sample: samples) total += sample;
+
+    context.warning(kj::str(mode, ": ", samples.size(), " jobs, "
+        "mean ", total / samples.size(), "us, "
+        "median ", samples[samples.size() / 2], "us, "
+        "p99 ", samples[samples.size() * 99 / 100], "us"));
+  }
+};
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::MiniboxBench)
@@ -27,14 +27,18 @@
 #include <sys/prctl.h>
 #include <sys/capability.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <mntent.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "util.h"
 #include "version.h"
+#include "send-fd.h"
 
 // In case kernel headers are old.
 #ifndef PR_SET_NO_NEW_PRIVS
@@ -43,6 +47,8 @@
 
 namespace sandstorm {
 
+static const char MOUNT_POINT[] = "/tmp/minibox-mount";
+
 class MiniboxMain: public AbstractMain {
   // Main class for a mini sandbox we use to wrap command-line tools (especially zip/unzip) which
   // we don't totally trust. This box makes the entire filesystem read-only except for some
@@ -84,7 +90,20 @@ public:
                    "Allow IPC to be sent out of the box.")
         .addOption({'P', "pid"}, KJ_BIND_METHOD(*this, enablePid),
                    "Allow signals to be sent out of the box.")
-        .expectOneOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
+        .addOptionWithArg({'S', "serve"}, KJ_BIND_METHOD(*this, setServePath), "<socket>",
+                          "Instead of running a command, build the box once and then serve jobs "
+                          "submitted with --job-server=<socket>. Each job runs in a fresh child "
+                          "of the prepared box with its own mount, PID, IPC, UTS and network "
+                          "namespaces (subject to -n, -i and -P), and its own tempfs mounts, so "
+                          "jobs can't see each other. "
+                          "Only the user who started the server may submit jobs.")
+        .addOptionWithArg({'j', "job-server"}, KJ_BIND_METHOD(*this, setJobServerPath),
+                          "<socket>",
+                          "Run <command> in the box of the job server listening on <socket> "
+                          "rather than building a new box. Mappings given here are added on top "
+                          "of the server's mappings (and may not remap '/'). Network, IPC and "
+                          "PID options are fixed by the server.")
+        .expectZeroOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
         .callAfterParsing(KJ_BIND_METHOD(*this, run))
         .build();
   }
@@ -106,11 +125,34 @@ private:
     bool isDirectory;
   };
 
+  static constexpr int DEFAULT_UNSHARE_FLAGS = CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWIPC |
+                                               CLONE_NEWUTS | CLONE_NEWPID | CLONE_NEWNET;
+
+  static constexpr int PER_JOB_UNSHARE_FLAGS = CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWPID |
+                                               CLONE_NEWNET;
+  // Namespaces which the job server recreates for each job (if the server itself was asked for
+  // them). Every job also gets its own mount namespace.
+
+  static constexpr uint32_t MAX_JOB_SIZE = 1 << 20;
+
   kj::Vector<Mapping> mappings;
   kj::Vector<kj::String> command;
   kj::String workingDir;
-  int unshareFlags = CLONE_NEWUSER | CLONE_NEWNS | CLONE_NEWIPC | CLONE_NEWUTS | CLONE_NEWPID |
-                     CLONE_NEWNET;
+  int unshareFlags = DEFAULT_UNSHARE_FLAGS;
+
+  kj::Maybe<kj::String> servePath;
+  kj::Maybe<kj::String> jobServerPath;
+
+  int jobConnection = -1;
+  // When this MiniboxMain is parsing a job inside the job server, the connection to report the
+  // job's exit status on.
+
+  int serverUnshareFlags = 0;
+  // When parsing a job, the unshare flags the job server was started with.
+
+  kj::ArrayPtr<const Mapping> serverJobMappings;
+  // When parsing a job, the job server's mappings that each job gets a fresh copy of (see
+  // `serve()`), to be mounted before the job's own.
 
   kj::MainBuilder::Validity addMapping(kj::StringPtr arg, MappingType mappingType) {
     Mapping mapping;
@@ -182,12 +224,53 @@ private:
     return true;
   }
 
+  kj::MainBuilder::Validity setServePath(kj::StringPtr arg) {
+    servePath = kj::heapString(arg);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setJobServerPath(kj::StringPtr arg) {
+    jobServerPath = kj::heapString(arg);
+    return true;
+  }
+
   kj::MainBuilder::Validity run() {
+    if (jobConnection >= 0) {
+      return runJobInServer();
+    }
+
+    KJ_IF_MAYBE(path, jobServerPath) {
+      return submitJob(*path);
+    }
+
     if (mappings.size() == 0 || mappings[0].vpath != "/") {
       return "The first mapping must be for '/'.";
     }
 
-    static const char MOUNT_POINT[] = "/tmp/minibox-mount";
+    KJ_IF_MAYBE(path, servePath) {
+      if (command.size() > 0) {
+        return "--serve does not take a command; submit jobs with --job-server.";
+      }
+      if (workingDir.size() > 0) {
+        return "--set-cwd applies to individual jobs, not the job server.";
+      }
+      serve(*path);
+    }
+
+    if (command.size() == 0) {
+      return "Missing <command>.";
+    }
+
+    buildBox();
+    mountMappings(mappings.asPtr());
+    enterBox();
+  }
+
+  void buildBox() {
+    // Enter fresh namespaces as specified by `unshareFlags`, with the real uid/gid mapped to
+    // 1000 inside, and make all mounts private. If a PID namespace was requested, this process
+    // forks; the parent only waits for the child and propagates its exit status.
+
     mkdir(MOUNT_POINT, 0777);
 
     uid_t uid = getuid();
@@ -204,18 +287,7 @@ private:
       pid_t child;
       KJ_SYSCALL(child = fork());
       if (child != 0) {
-        for (;;) {
-          int status;
-          KJ_SYSCALL(waitpid(child, &status, 0));
-          if (WIFEXITED(status)) {
-            _exit(WEXITSTATUS(status));
-          } else if (WIFSIGNALED(status)) {
-            // Kill ourselves with the same signal.
-            KJ_SYSCALL(kill(getpid(), WTERMSIG(status)));
-            // Shouldn't get here.
-            context.exitError(strsignal(WTERMSIG(status)));
-          }
-        }
+        exitLikeChild(child);
       }
 
       // We're in the child process. Arrange to kill the child if the parent dies.
@@ -224,9 +296,39 @@ private:
 
     // Make sure all mounts are private.
     KJ_SYSCALL(mount("none", "/", nullptr, MS_REC | MS_PRIVATE, nullptr));
+  }
 
-    // Map all mounts.
-    for (auto& mapping: mappings) {
+  [[noreturn]] void exitLikeChild(pid_t child) {
+    // Wait for `child` and then exit the same way it did.
+
+    for (;;) {
+      int status;
+      KJ_SYSCALL(waitpid(child, &status, 0));
+      if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        exitWithStatus(status);
+      }
+    }
+  }
+
+  [[noreturn]] void exitWithStatus(int status) {
+    // Exit with the given wait() status.
+
+    if (WIFEXITED(status)) {
+      _exit(WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+      // Kill ourselves with the same signal.
+      KJ_SYSCALL(kill(getpid(), WTERMSIG(status)));
+      // Shouldn't get here.
+      context.exitError(strsignal(WTERMSIG(status)));
+    } else {
+      KJ_FAIL_ASSERT("not an exit status", status);
+    }
+  }
+
+  void mountMappings(kj::ArrayPtr<const Mapping> toMount) {
+    // Mount all of `toMount` under MOUNT_POINT.
+
+    for (auto& mapping: toMount) {
       auto vpath = mapping.vpath == "/" ? kj::str(MOUNT_POINT) :
           mapping.vpath.startsWith("/") ? kj::str(MOUNT_POINT, mapping.vpath) :
                                           kj::str(MOUNT_POINT, '/', mapping.vpath);
@@ -258,6 +360,10 @@ private:
           break;
       }
     }
+  }
+
+  [[noreturn]] void enterBox() {
+    // Pivot into the box at MOUNT_POINT, drop privileges, and exec `command`.
 
     // Use Andy's ridiculous pivot_root trick to place ourselves into the sandbox.
     // See supervisor-main.c++ for more discussion.
@@ -295,6 +401,266 @@ private:
     KJ_UNREACHABLE;
   }
 
+  // ---------------------------------------------------------------------------
+  // Job server
+  //
+  // Building the box -- namespaces, uid maps, and especially bind-mounting and remounting the
+  // host filesystem read-only -- dominates the cost of short jobs. The job server pays that once.
+  // It binds a unix socket, builds the box, and then forks a handler per connection. The handler
+  // receives the client's stdio FDs and its job, which is encoded as minibox command-line
+  // arguments and parsed by a fresh MiniboxMain. It then forks the job into a new mount namespace
+  // (plus new PID/IPC/UTS/network namespaces if the server has them), where the job's own
+  // mappings are added before pivoting into the box. Finally it reports the job's wait() status
+  // back to the client, which exits the same way.
+
+  [[noreturn]] void serve(kj::StringPtr path) {
+    // Bind before entering the namespaces, so that the socket lives on the host filesystem and is
+    // owned by our real uid.
+    auto listener = listenUnix(path);
+
+    buildBox();
+
+    // Tempfs mounts, including those hiding paths, must not be shared between jobs, or jobs could
+    // exchange data through them. So only mappings up to the first of them are set up once here;
+    // that one and all mappings after it, which may be nested inside it, are mounted afresh in
+    // each job's mount namespace.
+    size_t sharedCount = 0;
+    while (sharedCount < mappings.size() &&
+           mappings[sharedCount].mappingType != MappingType::TEMPFS &&
+           mappings[sharedCount].mappingType != MappingType::HIDE) {
+      ++sharedCount;
+    }
+    mountMappings(mappings.asPtr().slice(0, sharedCount));
+    auto jobMappings = mappings.asPtr().slice(sharedCount, mappings.size());
+
+    // Each handler does its own waiting, so let the kernel reap them.
+    KJ_ASSERT(signal(SIGCHLD, SIG_IGN) != SIG_ERR);
+
+    for (;;) {
+      int fd;
+      KJ_SYSCALL(fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC));
+      kj::AutoCloseFd connection(fd);
+
+      pid_t child;
+      KJ_SYSCALL(child = fork());
+      if (child == 0) {
+        listener = nullptr;
+        handleJob(kj::mv(connection), jobMappings);
+      }
+    }
+  }
+
+  [[noreturn]] void handleJob(kj::AutoCloseFd connection,
+                              kj::ArrayPtr<const Mapping> jobMappings) {
+    KJ_SYSCALL(prctl(PR_SET_PDEATHSIG, SIGKILL));
+    KJ_ASSERT(signal(SIGCHLD, SIG_DFL) != SIG_ERR);
+
+    // Only accept jobs from our own user. Inside the user namespace, that user appears as our own
+    // uid; anyone else appears as the overflow uid.
+    struct ucred creds;
+    socklen_t credsLen = sizeof(creds);
+    KJ_SYSCALL(getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &creds, &credsLen));
+    KJ_REQUIRE(creds.uid == getuid(), "minibox job submitted by another user");
+
+    {
+      // Quietly drop connections that close without sending anything, e.g. a client checking
+      // whether we're up yet.
+      char c;
+      ssize_t n;
+      KJ_SYSCALL(n = recv(connection, &c, 1, MSG_PEEK));
+      if (n == 0) _exit(0);
+    }
+
+    // Receive the client's stdio along with the size of the job. From here on, errors (including
+    // usage errors while parsing the job) are reported to the client's stderr.
+    uint32_t size;
+    auto stdio = receiveFds(connection, 3,
+        kj::arrayPtr(reinterpret_cast<kj::byte*>(&size), sizeof(size)));
+    for (int i = 0; i < 3; i++) {
+      KJ_SYSCALL(dup2(stdio[i], i));
+    }
+
+    // Receive the job: NUL-terminated arguments.
+    KJ_REQUIRE(size <= MAX_JOB_SIZE, "minibox job too large", size);
+    auto blob = kj::heapArray<char>(size);
+    kj::FdInputStream(connection.get()).read(blob.begin(), blob.size());
+    KJ_REQUIRE(size == 0 || blob[size - 1] == '\0', "malformed minibox job");
+
+    kj::Vector<kj::StringPtr> args;
+    size_t start = 0;
+    for (size_t i: kj::indices(blob)) {
+      if (blob[i] == '\0') {
+        args.add(kj::StringPtr(blob.begin() + start, i - start));
+        start = i + 1;
+      }
+    }
+
+    MiniboxMain job(context);
+    job.jobConnection = connection;
+    job.serverUnshareFlags = unshareFlags;
+    job.serverJobMappings = jobMappings;
+    job.getMain()(context.getProgramName(), args.asPtr());
+    KJ_UNREACHABLE;
+  }
+
+  kj::MainBuilder::Validity runJobInServer() {
+    // We're in a job handler forked from the job server, having parsed the job's arguments.
+
+    for (auto& mapping: mappings) {
+      if (mapping.vpath == "/") {
+        return "Jobs can't remap '/'; it's mapped by the job server.";
+      }
+    }
+    if (unshareFlags != DEFAULT_UNSHARE_FLAGS) {
+      return "-n, -i and -P must be passed to the job server, not to individual jobs.";
+    }
+    if (command.size() == 0) {
+      return "Missing <command>.";
+    }
+
+    // Give the job its own copy of the box's mounts, so its mappings are invisible to other jobs,
+    // and its own instance of each other namespace the server isolates.
+    KJ_SYSCALL(unshare(CLONE_NEWNS | (serverUnshareFlags & PER_JOB_UNSHARE_FLAGS)));
+
+    pid_t child;
+    KJ_SYSCALL(child = fork());
+    if (child == 0) {
+      KJ_SYSCALL(prctl(PR_SET_PDEATHSIG, SIGKILL));
+      mountMappings(serverJobMappings);
+      mountMappings(mappings.asPtr());
+      enterBox();
+    }
+
+    int status;
+    for (;;) {
+      KJ_SYSCALL(waitpid(child, &status, 0));
+      if (WIFEXITED(status) || WIFSIGNALED(status)) break;
+    }
+
+    kj::FdOutputStream(jobConnection).write(&status, sizeof(status));
+    _exit(0);
+  }
+
+  kj::MainBuilder::Validity submitJob(kj::StringPtr path) {
+    // Client side of --job-server.
+
+    for (auto& mapping: mappings) {
+      if (mapping.vpath == "/") {
+        return "Jobs can't remap '/'; it's mapped by the job server.";
+      }
+    }
+    if (unshareFlags != DEFAULT_UNSHARE_FLAGS) {
+      return "-n, -i and -P must be passed to the job server, not to individual jobs.";
+    }
+    if (servePath != nullptr) {
+      return "--serve and --job-server are mutually exclusive.";
+    }
+    if (command.size() == 0) {
+      return "Missing <command>.";
+    }
+
+    // Encode the job as the equivalent command line. Host paths are made absolute since the
+    // server resolves them relative to its own working directory.
+    kj::Vector<kj::String> args;
+    for (auto& mapping: mappings) {
+      switch (mapping.mappingType) {
+        case MappingType::READABLE:
+          args.add(kj::str("--map-readonly=", mapping.vpath, '=', absolutePath(mapping.path)));
+          break;
+        case MappingType::WRITABLE:
+          args.add(kj::str("--map-writable=", mapping.vpath, '=', absolutePath(mapping.path)));
+          break;
+        case MappingType::TEMPFS:
+          args.add(kj::str("--map-tempfs=", mapping.vpath));
+          break;
+        case MappingType::PROCFS:
+          args.add(kj::str("--map-procfs=", mapping.vpath));
+          break;
+        case MappingType::HIDE:
+          args.add(kj::str("--hide=", mapping.vpath));
+          break;
+      }
+    }
+    if (workingDir.size() > 0) {
+      args.add(kj::str("--set-cwd=", workingDir));
+    }
+    args.add(kj::str("--"));
+    for (auto& arg: command) {
+      args.add(kj::heapString(arg));
+    }
+
+    kj::Vector<char> blob;
+    for (auto& arg: args) {
+      blob.addAll(arg.begin(), arg.end() + 1);  // include NUL
+    }
+    uint32_t size = blob.size();
+
+    // Send our stdio along with the job's size in one message, then the job itself.
+    auto connection = connectUnix(path);
+    int stdio[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    sendFds(connection, kj::arrayPtr(stdio, 3),
+            kj::arrayPtr(reinterpret_cast<const kj::byte*>(&size), sizeof(size)));
+    kj::FdOutputStream(connection.get()).write(blob.begin(), blob.size());
+
+    int status;
+    size_t n = kj::FdInputStream(connection.get()).tryRead(&status, sizeof(status),
+                                                            sizeof(status));
+    if (n < sizeof(status)) {
+      // The handler failed before the job finished. It will have written the reason to our
+      // stderr.
+      context.exitError("minibox job server did not report an exit status.");
+    }
+    exitWithStatus(status);
+  }
+
+  static kj::String absolutePath(kj::StringPtr path) {
+    char* result = realpath(path.cStr(), nullptr);
+    if (result == nullptr) {
+      KJ_FAIL_SYSCALL("realpath", errno, path);
+    }
+    KJ_DEFER(free(result));
+    return kj::heapString(result);
+  }
+
+  static struct sockaddr_un unixAddress(kj::StringPtr path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    KJ_REQUIRE(path.size() < sizeof(addr.sun_path), "socket path too long", path);
+    memcpy(addr.sun_path, path.begin(), path.size());
+    return addr;
+  }
+
+  static kj::AutoCloseFd listenUnix(kj::StringPtr path) {
+    auto addr = unixAddress(path);
+
+    int fd;
+    KJ_SYSCALL(fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd result(fd);
+
+    if (unlink(path.cStr()) < 0 && errno != ENOENT) {
+      KJ_FAIL_SYSCALL("unlink", errno, path);
+    }
+
+    // Only our own user may connect.
+    mode_t oldUmask = umask(0077);
+    KJ_DEFER(umask(oldUmask));
+    KJ_SYSCALL(bind(result, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)), path);
+    KJ_SYSCALL(listen(result, SOMAXCONN));
+
+    return result;
+  }
+
+  static kj::AutoCloseFd connectUnix(kj::StringPtr path) {
+    auto addr = unixAddress(path);
+
+    int fd;
+    KJ_SYSCALL(fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd result(fd);
+    KJ_SYSCALL(connect(result, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)), path);
+    return result;
+  }
+
   void writeSetgroupsIfPresent(const char *contents) {
     KJ_IF_MAYBE(fd, raiiOpenIfExists("/proc/self/setgroups", O_WRONLY | O_CLOEXEC)) {
       kj::FdOutputStream(kj::mv(*fd)).write(contents, strlen(contents));
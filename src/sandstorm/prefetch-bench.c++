@@ -0,0 +1,132 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "prefetch.h"
+#include "util.h"
+
+namespace sandstorm {
+
+class PrefetchBench {
+  // A benchmark program showing what package prefetching saves on a cold start. It drops the
+  // package from the page cache and reads everything in its profile a page at a time, the way an
+  // app faults in its binaries, first with nothing else going on and then after a prefetch.
+
+public:
+  PrefetchBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Package prefetch benchmark, unknown version",
+          "Times cold reads of the startup working set of the package at <package-dir>, with "
+          "and without prefetching. The package must already have a profile, i.e. a grain of "
+          "it must have been started at least once. Pages mapped by running grains can't be "
+          "dropped, so stop them first for meaningful results.")
+        .addOptionWithArg({'n', "runs"}, KJ_BIND_METHOD(*this, setRuns), "<runs>",
+                          "Times to repeat each measurement. Default: 3.")
+        .expectArg("<package-dir>", KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  uint runs = 3;
+
+  kj::MainBuilder::Validity setRuns(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n == 0) return "Must be positive.";
+      runs = *n;
+      return true;
+    } else {
+      return "Not a number.";
+    }
+  }
+
+  kj::MainBuilder::Validity run(kj::StringPtr pkgPath) {
+    PackagePrefetcher prefetcher(pkgPath);
+    PackagePrefetchProfile::Reader profile;
+    KJ_IF_MAYBE(p, prefetcher.getProfile()) {
+      profile = *p;
+    } else {
+      return "Package has no prefetch profile yet. Start a grain of it first.";
+    }
+    auto pkgDir = raiiOpen(pkgPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    uint64_t coldTime = 0;
+    uint64_t prefetchCallTime = 0;
+    uint64_t prefetchedTime = 0;
+    uint64_t bytes = 0;
+    for (uint i = 0; i < runs; i++) {
+      prefetcher.evict();
+      uint64_t start = now();
+      bytes = readProfile(pkgDir, profile);
+      coldTime += now() - start;
+
+      prefetcher.evict();
+      start = now();
+      prefetcher.prefetch();
+      uint64_t mid = now();
+      readProfile(pkgDir, profile);
+      prefetchCallTime += mid - start;
+      prefetchedTime += now() - start;
+    }
+
+    context.warning(kj::str("working set: ", profile.getFiles().size(), " files, ",
+                            bytes >> 10, " KiB"));
+    context.warning(kj::str("cold: ", coldTime / runs / 1000, "ms"));
+    context.warning(kj::str("prefetched: ", prefetchedTime / runs / 1000, "ms (of which ",
+                            prefetchCallTime / runs / 1000, "ms issuing the prefetch)"));
+    context.exitInfo(kj::str("cold/prefetched: ",
+        (double)coldTime / kj::max(prefetchedTime, (uint64_t)1)));
+  }
+
+  static uint64_t readProfile(int pkgDir, PackagePrefetchProfile::Reader profile) {
+    // Reads every profiled range a page at a time. Returns the number of bytes read.
+
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    auto buffer = kj::heapArray<kj::byte>(pageSize);
+    uint64_t total = 0;
+    for (auto file: profile.getFiles()) {
+      KJ_IF_MAYBE(fd, raiiOpenAtIfExists(pkgDir, file.getPath(),
+                                         O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) {
+        for (auto range: file.getRanges()) {
+          uint64_t end = range.getOffset() + range.getLength();
+          for (uint64_t offset = range.getOffset(); offset < end; offset += pageSize) {
+            ssize_t n;
+            KJ_SYSCALL(n = pread(*fd, buffer.begin(), pageSize, offset), file.getPath());
+            if (n == 0) break;
+            total += n;
+          }
+        }
+      }
+    }
+    return total;
+  }
+
+  static uint64_t now() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+  }
+};
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::PrefetchBench)
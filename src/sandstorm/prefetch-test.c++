@@ -0,0 +1,109 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "prefetch.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <map>
+
+#include "test-util.h"
+#include "util.h"
+
+namespace sandstorm {
+namespace {
+
+void writeFile(kj::StringPtr path, size_t size) {
+  auto fd = raiiOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  auto content = kj::heapArray<kj::byte>(size);
+  for (size_t i = 0; i < size; i++) content[i] = i * 7;
+  kj::FdOutputStream(fd.get()).write(content.begin(), content.size());
+}
+
+std::map<kj::String, uint64_t> profiledBytes(PackagePrefetchProfile::Reader profile) {
+  std::map<kj::String, uint64_t> result;
+  for (auto file: profile.getFiles()) {
+    uint64_t total = 0;
+    for (auto range: file.getRanges()) total += range.getLength();
+    result[kj::heapString(file.getPath())] = total;
+  }
+  return result;
+}
+
+KJ_TEST("PackagePrefetcher records resident pages and skips symlinks") {
+  TempDir dir;
+  auto pkg = kj::str(dir.path, "/pkg");
+  KJ_SYSCALL(mkdir(pkg.cStr(), 0755));
+  KJ_SYSCALL(mkdir(kj::str(pkg, "/bin").cStr(), 0755));
+
+  const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+  writeFile(kj::str(pkg, "/bin/app"), pageSize * 3 + 100);
+  writeFile(kj::str(pkg, "/lib.so"), 1);
+  writeFile(kj::str(pkg, "/empty"), 0);
+  KJ_SYSCALL(symlink("/etc/passwd", kj::str(pkg, "/link").cStr()));
+
+  {
+    PackagePrefetcher prefetcher(pkg);
+    KJ_EXPECT(!prefetcher.hasProfile());
+    prefetcher.record();
+  }
+
+  // Only the profile itself is left behind.
+  auto names = listDirectory(dir.path);
+  KJ_EXPECT(names.size() == 2);
+
+  PackagePrefetcher prefetcher(pkg);
+  KJ_ASSERT(prefetcher.hasProfile());
+  KJ_IF_MAYBE(profile, prefetcher.getProfile()) {
+    // Everything was just written, so it's all in the page cache.
+    auto bytes = profiledBytes(*profile);
+    KJ_EXPECT(bytes.size() == 2);
+    KJ_EXPECT(bytes[kj::heapString("bin/app")] == pageSize * 4);
+    KJ_EXPECT(bytes[kj::heapString("lib.so")] == pageSize);
+
+    for (auto file: profile->getFiles()) {
+      for (auto range: file.getRanges()) {
+        KJ_EXPECT(range.getOffset() % pageSize == 0);
+        KJ_EXPECT(range.getLength() % pageSize == 0);
+      }
+    }
+  }
+
+  // A stale profile doesn't cause trouble, and a symlink substituted for a profiled file isn't
+  // followed.
+  KJ_SYSCALL(unlink(kj::str(pkg, "/bin/app").cStr()));
+  KJ_SYSCALL(unlink(kj::str(pkg, "/lib.so").cStr()));
+  KJ_SYSCALL(symlink("/etc/passwd", kj::str(pkg, "/lib.so").cStr()));
+  prefetcher.prefetch();
+  prefetcher.evict();
+}
+
+KJ_TEST("PackagePrefetcher ignores a damaged profile") {
+  TempDir dir;
+  auto pkg = kj::str(dir.path, "/pkg");
+  KJ_SYSCALL(mkdir(pkg.cStr(), 0755));
+
+  writeFile(kj::str(pkg, ".prefetch"), 0);
+  KJ_EXPECT(!PackagePrefetcher(pkg).hasProfile());
+
+  writeFile(kj::str(pkg, ".prefetch"), 1000);
+  KJ_EXPECT(!PackagePrefetcher(pkg).hasProfile());
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,226 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "prefetch.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <capnp/serialize.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "util.h"
+
+namespace sandstorm {
+
+static const uint64_t PREFETCH_MAX_BYTES = 256ull << 20;
+// Never record more than this. A package whose startup really reads more than this would thrash
+// the page cache if prefetched all at once anyway.
+
+namespace {
+
+struct Range {
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct FileRanges {
+  kj::String path;
+  kj::Array<Range> ranges;
+};
+
+}  // namespace
+
+template <typename Func>
+static void forEachFile(int dirFd, kj::StringPtr prefix, Func& func) {
+  // Calls `func(fd, path)` for every regular file under `dirFd`, without following symlinks.
+
+  auto listing = listDirectoryEntries(raiiOpenAt(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  for (auto& entry: listing) {
+    auto type = entry.type;
+    if (type == DT_UNKNOWN) {
+      struct stat stats;
+      KJ_SYSCALL(fstatat(dirFd, entry.name.cStr(), &stats, AT_SYMLINK_NOFOLLOW), entry.name);
+      type = S_ISDIR(stats.st_mode) ? DT_DIR : S_ISREG(stats.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+
+    if (type == DT_DIR) {
+      auto subdir = raiiOpenAt(dirFd, entry.name,
+                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      forEachFile(subdir, kj::str(prefix, entry.name, '/'), func);
+    } else if (type == DT_REG) {
+      auto fd = raiiOpenAt(dirFd, entry.name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      func(fd.get(), kj::str(prefix, entry.name));
+    }
+  }
+}
+
+static kj::Maybe<kj::AutoCloseFd> openInPackage(int pkgDir, kj::StringPtr path) {
+  // Opens a regular file in the package by a path taken from a profile, one component at a time
+  // so that no symlink is ever followed. Returns null if there's no such file any more.
+
+  auto components = split(path, '/');
+  kj::AutoCloseFd current;
+  int dirFd = pkgDir;
+  for (uint i: kj::indices(components)) {
+    auto name = kj::heapString(components[i]);
+    if (name.size() == 0 || name == "." || name == "..") return nullptr;
+
+    int flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+    if (i + 1 < components.size()) flags |= O_DIRECTORY;
+    int fd = openat(dirFd, name.cStr(), flags);
+    if (fd < 0) return nullptr;
+    current = kj::AutoCloseFd(fd);
+    dirFd = current;
+  }
+
+  struct stat stats;
+  KJ_SYSCALL(fstat(current, &stats));
+  if (!S_ISREG(stats.st_mode)) return nullptr;
+  return kj::mv(current);
+}
+
+PackagePrefetcher::PackagePrefetcher(kj::StringPtr pkgPath)
+    : pkgDir(raiiOpen(pkgPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+  kj::StringPtr name = pkgPath;
+  kj::String parent;
+  KJ_IF_MAYBE(slash, pkgPath.findLast('/')) {
+    name = pkgPath.slice(*slash + 1);
+    parent = *slash == 0 ? kj::heapString("/") : kj::heapString(pkgPath.begin(), *slash);
+  } else {
+    parent = kj::heapString(".");
+  }
+  KJ_REQUIRE(name.size() > 0, "package path must not end in '/'", pkgPath);
+
+  parentDir = raiiOpen(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  profileName = kj::str(name, ".prefetch");
+
+  KJ_IF_MAYBE(fd, raiiOpenAtIfExists(parentDir, profileName, O_RDONLY | O_CLOEXEC)) {
+    // A crash at the wrong moment can leave an empty or truncated profile. Treat that as no
+    // profile, so that a new one is recorded.
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      capnp::StreamFdMessageReader reader(fd->get());
+      auto copy = kj::heap<capnp::MallocMessageBuilder>();
+      copy->setRoot(reader.getRoot<PackagePrefetchProfile>());
+      profile = kj::mv(copy);
+    })) {
+      KJ_LOG(WARNING, "ignoring unreadable package prefetch profile", profileName, *exception);
+    }
+  }
+}
+
+kj::Maybe<PackagePrefetchProfile::Reader> PackagePrefetcher::getProfile() {
+  KJ_IF_MAYBE(p, profile) {
+    return p->get()->getRoot<PackagePrefetchProfile>().asReader();
+  } else {
+    return nullptr;
+  }
+}
+
+void PackagePrefetcher::prefetch() {
+  KJ_IF_MAYBE(p, getProfile()) {
+    for (auto file: p->getFiles()) {
+      KJ_IF_MAYBE(fd, openInPackage(pkgDir, file.getPath())) {
+        for (auto range: file.getRanges()) {
+          // readahead() queues the reads and returns; it's only refused by filesystems that don't
+          // go through the page cache, for which posix_fadvise() is the portable spelling.
+          if (readahead(*fd, range.getOffset(), range.getLength()) < 0) {
+            posix_fadvise(*fd, range.getOffset(), range.getLength(), POSIX_FADV_WILLNEED);
+          }
+        }
+      }
+    }
+  }
+}
+
+void PackagePrefetcher::evict() {
+  auto func = [](int fd, kj::String&& path) {
+    // Only fails on bad arguments, and a filesystem that can't drop pages has nothing to drop.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  };
+  forEachFile(pkgDir, "", func);
+}
+
+void PackagePrefetcher::record() {
+  const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+  uint64_t totalBytes = 0;
+  kj::Vector<FileRanges> files;
+
+  auto func = [&](int fd, kj::String&& path) {
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats), path);
+    if (stats.st_size == 0 || totalBytes >= PREFETCH_MAX_BYTES) return;
+
+    size_t size = stats.st_size;
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno, path);
+    }
+    KJ_DEFER(munmap(mapping, size));
+
+    // mincore() reports which pages are in the page cache without touching them.
+    size_t pageCount = (size + pageSize - 1) / pageSize;
+    auto resident = kj::heapArray<unsigned char>(pageCount);
+    KJ_SYSCALL(mincore(mapping, size, resident.begin()), path);
+
+    kj::Vector<Range> ranges;
+    for (size_t i = 0; i < pageCount && totalBytes < PREFETCH_MAX_BYTES;) {
+      if (!(resident[i] & 1)) {
+        ++i;
+        continue;
+      }
+      size_t start = i;
+      while (i < pageCount && (resident[i] & 1)) ++i;
+      uint64_t length = kj::min((i - start) * pageSize, PREFETCH_MAX_BYTES - totalBytes);
+      ranges.add(Range { start * pageSize, length });
+      totalBytes += length;
+    }
+
+    if (ranges.size() > 0) {
+      files.add(FileRanges { kj::mv(path), ranges.releaseAsArray() });
+    }
+  };
+  forEachFile(pkgDir, "", func);
+
+  capnp::MallocMessageBuilder message;
+  auto fileList = message.initRoot<PackagePrefetchProfile>().initFiles(files.size());
+  for (uint i: kj::indices(files)) {
+    auto file = fileList[i];
+    file.setPath(files[i].path);
+    auto rangeList = file.initRanges(files[i].ranges.size());
+    for (uint j: kj::indices(files[i].ranges)) {
+      rangeList[j].setOffset(files[i].ranges[j].offset);
+      rangeList[j].setLength(files[i].ranges[j].length);
+    }
+  }
+
+  auto tmpName = kj::str(profileName, ".tmp.", getpid());
+  {
+    auto fd = raiiOpenAt(parentDir, tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      capnp::writeMessageToFd(fd, message);
+    })) {
+      unlinkat(parentDir, tmpName.cStr(), 0);
+      kj::throwFatalException(kj::mv(*exception));
+    }
+  }
+  KJ_SYSCALL(renameat(parentDir, tmpName.cStr(), parentDir, profileName.cStr()), profileName);
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,73 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_PREFETCH_H_
+#define SANDSTORM_PREFETCH_H_
+
+#include <kj/io.h>
+#include <kj/time.h>
+#include <capnp/message.h>
+#include <sandstorm/supervisor.capnp.h>
+
+namespace sandstorm {
+
+constexpr kj::Duration PREFETCH_RECORD_DELAY = 10 * kj::SECONDS;
+// How long after starting the app the supervisor waits before recording a package's profile.
+
+class PackagePrefetcher {
+  // Warms the page cache with the part of an app package that its grains need to start, so that
+  // starting a grain after a reboot doesn't have to fault in the app's binaries and libraries one
+  // page at a time.
+  //
+  // The first grain of a package to start without a profile evicts the package from the page
+  // cache, lets the app start, and then records the pages of the package that are resident again
+  // as the profile (see `PackagePrefetchProfile`). Later starts readahead() exactly those ranges.
+  //
+  // Package contents are controlled by the app, so symlinks in the package are never followed.
+
+public:
+  explicit PackagePrefetcher(kj::StringPtr pkgPath);
+  // Opens the package directory and the directory containing it, and loads the profile if there
+  // is one. Must be called while `pkgPath` is still reachable; the object only uses directory FDs
+  // afterwards.
+
+  bool hasProfile() const { return profile != nullptr; }
+
+  kj::Maybe<PackagePrefetchProfile::Reader> getProfile();
+
+  void prefetch();
+  // Asks the kernel to read in every range in the profile. Does not wait for the reads to finish.
+  // Files that have disappeared or become something other than a regular file are skipped.
+
+  void evict();
+  // Drops the whole package from the page cache, as far as the kernel allows. (Pages mapped by
+  // running processes stay.)
+
+  void record();
+  // Writes the pages of the package currently in the page cache as its profile, replacing any
+  // existing profile. The file is written under a temporary name and renamed into place, so
+  // concurrent grain starts never see a partial profile.
+
+private:
+  kj::AutoCloseFd pkgDir;
+  kj::AutoCloseFd parentDir;
+  kj::String profileName;
+  kj::Maybe<kj::Own<capnp::MallocMessageBuilder>> profile;
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_PREFETCH_H_
@@ -0,0 +1,157 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "request-limiter.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+
+#include "test-util.h"
+
+namespace sandstorm {
+namespace {
+
+class Request {
+public:
+  void start(RequestLimiter::Queue& queue) {
+    promise = queue.acquire().then([this](kj::Own<RequestLimiter::Slot>&& slot) {
+      this->slot = kj::mv(slot);
+    }, [this](kj::Exception&& e) {
+      failed = true;
+    }).eagerlyEvaluate([](kj::Exception&& e) {
+      KJ_FAIL_EXPECT(e);
+    });
+  }
+
+  bool isRunning() { return slot != nullptr; }
+  bool isFailed() { return failed; }
+
+  void finish() {
+    KJ_ASSERT(isRunning());
+    slot = nullptr;
+  }
+
+  void cancel() {
+    promise = nullptr;
+  }
+
+private:
+  kj::Promise<void> promise = nullptr;
+  kj::Maybe<kj::Own<RequestLimiter::Slot>> slot;
+  bool failed = false;
+};
+
+KJ_TEST("RequestLimiter serves sessions round-robin") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  RequestLimiter limiter(2);
+  auto a = limiter.newQueue();
+  auto b = limiter.newQueue();
+
+  Request a1, a2, a3, a4, b1;
+  a1.start(*a);
+  a2.start(*a);
+  a3.start(*a);
+  a4.start(*a);
+  b1.start(*b);
+  turn(waitScope);
+
+  KJ_EXPECT(a1.isRunning());
+  KJ_EXPECT(a2.isRunning());
+  KJ_EXPECT(!a3.isRunning());
+  KJ_EXPECT(!a4.isRunning());
+  KJ_EXPECT(!b1.isRunning());
+  KJ_EXPECT(limiter.getStats().inFlight == 2);
+  KJ_EXPECT(limiter.getStats().queued == 3);
+  KJ_EXPECT(limiter.getStats().peakQueued == 3);
+
+  // b's request came in after a's backlog, but doesn't have to wait for all of it.
+  a1.finish();
+  turn(waitScope);
+  KJ_EXPECT(a3.isRunning());
+  KJ_EXPECT(!b1.isRunning());
+
+  a2.finish();
+  turn(waitScope);
+  KJ_EXPECT(b1.isRunning());
+  KJ_EXPECT(!a4.isRunning());
+
+  a3.finish();
+  turn(waitScope);
+  KJ_EXPECT(a4.isRunning());
+
+  auto stats = limiter.getStats();
+  KJ_EXPECT(stats.inFlight == 2);
+  KJ_EXPECT(stats.queued == 0);
+  KJ_EXPECT(stats.waited == 3);
+  KJ_EXPECT(stats.maxWaitMicros <= stats.totalWaitMicros);
+
+  a4.finish();
+  b1.finish();
+  KJ_EXPECT(limiter.getStats().inFlight == 0);
+}
+
+KJ_TEST("RequestLimiter drops canceled requests and closed sessions") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  RequestLimiter limiter(1);
+  auto a = limiter.newQueue();
+  auto b = limiter.newQueue();
+  auto c = limiter.newQueue();
+
+  Request a1, a2, b1, c1;
+  a1.start(*a);
+  a2.start(*a);
+  b1.start(*b);
+  c1.start(*c);
+  turn(waitScope);
+  KJ_EXPECT(a1.isRunning());
+  KJ_EXPECT(limiter.getStats().queued == 3);
+
+  a2.cancel();
+  KJ_EXPECT(limiter.getStats().queued == 2);
+
+  b = nullptr;
+  turn(waitScope);
+  KJ_EXPECT(b1.isFailed());
+  KJ_EXPECT(limiter.getStats().queued == 1);
+
+  a1.finish();
+  turn(waitScope);
+  KJ_EXPECT(c1.isRunning());
+  c1.finish();
+  KJ_EXPECT(limiter.getStats().inFlight == 0);
+}
+
+KJ_TEST("RequestLimiter with no limit only counts") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  RequestLimiter limiter(0);
+  auto a = limiter.newQueue();
+
+  Request requests[100];
+  for (auto& request: requests) request.start(*a);
+  turn(waitScope);
+
+  for (auto& request: requests) KJ_EXPECT(request.isRunning());
+  KJ_EXPECT(limiter.getStats().inFlight == 100);
+  KJ_EXPECT(limiter.getStats().waited == 0);
+
+  for (auto& request: requests) request.finish();
+  KJ_EXPECT(limiter.getStats().inFlight == 0);
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -0,0 +1,158 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "request-limiter.h"
+#include <kj/debug.h>
+#include <time.h>
+
+namespace sandstorm {
+
+static const uint64_t BACKLOG_REPORT_MICROS = 1000000;
+// A backlog during which some request waited at least this long is logged once it clears.
+
+static uint64_t now() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+class RequestLimiter::Waiter {
+  // Adapter for the promise returned by `Queue::acquire()` when the request has to wait.
+
+public:
+  Waiter(kj::PromiseFulfiller<kj::Own<Slot>>& fulfiller, RequestLimiter& limiter, Queue& queue)
+      : fulfiller(fulfiller), limiter(limiter), queue(queue), enqueueTime(now()) {
+    limiter.enqueue(queue, *this);
+  }
+
+  ~Waiter() noexcept(false) {
+    if (isQueued) {
+      // Canceled.
+      limiter.dequeue(queue, *this);
+    }
+  }
+
+  kj::PromiseFulfiller<kj::Own<Slot>>& fulfiller;
+  RequestLimiter& limiter;
+  Queue& queue;
+  uint64_t enqueueTime;
+  std::list<Waiter*>::iterator position;
+  bool isQueued = false;
+};
+
+RequestLimiter::RequestLimiter(uint maxConcurrent): maxConcurrent(maxConcurrent) {}
+
+kj::Own<RequestLimiter::Queue> RequestLimiter::newQueue() {
+  return kj::heap<Queue>(*this);
+}
+
+void RequestLimiter::enqueue(Queue& queue, Waiter& waiter) {
+  waiter.position = queue.waiters.insert(queue.waiters.end(), &waiter);
+  waiter.isQueued = true;
+  if (!queue.isReady) {
+    ready.push_back(&queue);
+    queue.isReady = true;
+  }
+
+  if (stats.queued++ == 0) {
+    backlogStart = waiter.enqueueTime;
+    backlogMaxWait = 0;
+    stats.peakQueued = 0;
+  }
+  stats.peakQueued = kj::max(stats.peakQueued, stats.queued);
+}
+
+void RequestLimiter::dequeue(Queue& queue, Waiter& waiter) {
+  queue.waiters.erase(waiter.position);
+  waiter.isQueued = false;
+  if (queue.waiters.empty() && queue.isReady) {
+    ready.remove(&queue);
+    queue.isReady = false;
+  }
+
+  --stats.queued;
+  checkBacklogOver();
+}
+
+void RequestLimiter::release() {
+  --stats.inFlight;
+  dispatch();
+}
+
+void RequestLimiter::dispatch() {
+  while (!ready.empty() && (maxConcurrent == 0 || stats.inFlight < maxConcurrent)) {
+    // Take the next request from the queue whose turn it is, and send that queue to the back.
+    Queue& queue = *ready.front();
+    ready.pop_front();
+    Waiter& waiter = *queue.waiters.front();
+    queue.waiters.pop_front();
+    waiter.isQueued = false;
+    if (queue.waiters.empty()) {
+      queue.isReady = false;
+    } else {
+      ready.push_back(&queue);
+    }
+
+    uint64_t wait = now() - waiter.enqueueTime;
+    --stats.queued;
+    ++stats.waited;
+    stats.totalWaitMicros += wait;
+    stats.maxWaitMicros = kj::max(stats.maxWaitMicros, wait);
+    backlogMaxWait = kj::max(backlogMaxWait, wait);
+
+    ++stats.inFlight;
+    waiter.fulfiller.fulfill(kj::heap<Slot>(*this));
+  }
+
+  checkBacklogOver();
+}
+
+void RequestLimiter::checkBacklogOver() {
+  if (stats.queued == 0 && backlogStart != 0) {
+    if (backlogMaxWait >= BACKLOG_REPORT_MICROS) {
+      uint64_t durationMs = (now() - backlogStart) / 1000;
+      uint64_t maxWaitMs = backlogMaxWait / 1000;
+      KJ_LOG(WARNING, "app was overloaded; requests were queued",
+             maxConcurrent, stats.peakQueued, durationMs, maxWaitMs);
+    }
+    backlogStart = 0;
+  }
+}
+
+RequestLimiter::Queue::~Queue() noexcept(false) {
+  while (!waiters.empty()) {
+    Waiter& waiter = *waiters.front();
+    limiter.dequeue(*this, waiter);
+    waiter.fulfiller.reject(
+        KJ_EXCEPTION(DISCONNECTED, "session closed while request was queued"));
+  }
+}
+
+kj::Promise<kj::Own<RequestLimiter::Slot>> RequestLimiter::Queue::acquire() {
+  if (limiter.ready.empty() &&
+      (limiter.maxConcurrent == 0 || limiter.stats.inFlight < limiter.maxConcurrent)) {
+    ++limiter.stats.inFlight;
+    return kj::heap<Slot>(limiter);
+  }
+
+  return kj::newAdaptedPromise<kj::Own<Slot>, Waiter>(limiter, *this);
+}
+
+RequestLimiter::Slot::~Slot() noexcept(false) {
+  limiter.release();
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,117 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_REQUEST_LIMITER_H_
+#define SANDSTORM_REQUEST_LIMITER_H_
+
+#include <kj/async.h>
+#include <list>
+
+namespace sandstorm {
+
+class RequestLimiter {
+  // Caps the number of requests in flight to the app at once. Requests beyond the cap wait in a
+  // FIFO queue belonging to their session, and the sessions with waiting requests are served
+  // round-robin, so a session which sends a burst of requests only delays itself.
+
+public:
+  class Queue;
+  class Slot;
+
+  explicit RequestLimiter(uint maxConcurrent);
+  // `maxConcurrent` of zero means no limit. Requests are still counted.
+
+  KJ_DISALLOW_COPY(RequestLimiter);
+
+  kj::Own<Queue> newQueue();
+  // Makes a queue for a new session.
+
+  struct Stats {
+    uint inFlight = 0;
+    // Requests currently holding a slot.
+
+    uint queued = 0;
+    // Requests currently waiting for one.
+
+    uint peakQueued = 0;
+    // Most requests waiting at once since the last time the queue was empty.
+
+    uint64_t waited = 0;
+    // Total requests which have had to wait.
+
+    uint64_t totalWaitMicros = 0;
+    uint64_t maxWaitMicros = 0;
+    // Total and longest wait of those requests.
+  };
+
+  Stats getStats() const { return stats; }
+  // sandstorm-http-bridge hands these to the supervisor for `Supervisor.getCallStats()`.
+
+private:
+  class Waiter;
+
+  uint maxConcurrent;
+  Stats stats;
+  uint64_t backlogStart = 0;
+  uint64_t backlogMaxWait = 0;
+
+  std::list<Queue*> ready;
+  // Queues with waiting requests, in the order they'll next be served.
+
+  void enqueue(Queue& queue, Waiter& waiter);
+  void dequeue(Queue& queue, Waiter& waiter);
+  void release();
+  void dispatch();
+  void checkBacklogOver();
+};
+
+class RequestLimiter::Queue {
+public:
+  explicit Queue(RequestLimiter& limiter): limiter(limiter) {}
+  // Use `RequestLimiter::newQueue()`.
+
+  ~Queue() noexcept(false);
+  // Fails any requests still waiting.
+
+  KJ_DISALLOW_COPY(Queue);
+
+  kj::Promise<kj::Own<Slot>> acquire();
+  // Resolves when the request may go ahead. Drop the slot when the request is done. Dropping the
+  // promise instead takes the request out of the queue.
+
+private:
+  RequestLimiter& limiter;
+  std::list<Waiter*> waiters;
+  bool isReady = false;  // i.e. in `limiter.ready`
+
+  friend class RequestLimiter;
+};
+
+class RequestLimiter::Slot {
+public:
+  explicit Slot(RequestLimiter& limiter): limiter(limiter) {}
+  // Use `Queue::acquire()`.
+
+  ~Slot() noexcept(false);
+  KJ_DISALLOW_COPY(Slot);
+
+private:
+  RequestLimiter& limiter;
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_REQUEST_LIMITER_H_
@@ -31,6 +31,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/signalfd.h>
+#include <poll.h>
+#include <netinet/in.h>
 #include <sys/wait.h>
 #include <sys/sendfile.h>
 #include <sys/prctl.h>
@@ -49,14 +51,21 @@
 #include <sys/un.h>
 #include <netdb.h>
 #include <dirent.h>
+#include <algorithm>
 
 #include "version.h"
 #include "send-fd.h"
 #include "supervisor.h"
+#include "grain-placement.h"
 #include "util.h"
 #include "spk.h"
 #include "minibox.h"
 
+// In case kernel headers are old.
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
 namespace sandstorm {
 
 // We use SIGALRM to timeout waitpid()s.
@@ -1045,9 +1054,8 @@ public:
     kj::FdOutputStream((int)sock).write(&DEVMODE_COMMAND_SUPERVISE, 1);
 
     // Forward our standard I/O FDs.
-    sendFd(sock, STDIN_FILENO);
-    sendFd(sock, STDOUT_FILENO);
-    sendFd(sock, STDERR_FILENO);
+    int stdio[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    sendFds(sock, kj::arrayPtr(stdio, 3));
 
     // Send supervisor args.
     kj::FdOutputStream((int)sock).write(superviseArgs.begin(), superviseArgs.size());
@@ -1096,6 +1104,11 @@ private:
     bool allowDemoAccounts = false;
     bool isTesting = false;
     bool allowDevAccounts = false;
+    uint frontendWorkers = 1;
+    bool grainPlacementByNode = false;
+    kj::Maybe<kj::Array<uint>> grainCpus;
+    bool mergeMemory = false;
+    kj::String grainCgroup = nullptr;
   };
 
   kj::String updateFile;
@@ -1235,7 +1248,7 @@ private:
     }
   }
 
-  void enterChroot(bool inPidNamespace) {
+  void enterChroot(bool inPidNamespace, kj::StringPtr grainCgroup = nullptr) {
     KJ_REQUIRE(changedDir);
 
     // Verify ownership is intact.
@@ -1282,6 +1295,11 @@ private:
     KJ_SYSCALL(mount("../var", "var", nullptr, MS_BIND, nullptr));
     KJ_SYSCALL(mount("../tmp", "tmp", nullptr, MS_BIND, nullptr));
 
+    // Bind the cgroup that supervisors run grains in, if any, so that they can find it.
+    if (grainCgroup != nullptr) {
+      KJ_SYSCALL(mount(grainCgroup.cStr(), "cgroup", nullptr, MS_BIND, nullptr), grainCgroup);
+    }
+
     // Bind devices from /dev into our chroot environment.
     // We can't bind /dev itself because this is apparently not allowed when in a UID namespace
     // (returns EINVAL; haven't figured out why yet).
@@ -1354,7 +1372,8 @@ private:
   }
 
   void copyEtc() {
-    auto files = splitLines(readAll("etc.list"));
+    auto list = readAll("etc.list");
+    auto files = splitLinesInPlace(list);
 
     // Now copy over each file.
     for (auto& file: files) {
@@ -1382,7 +1401,8 @@ private:
     config.uids.uid = getuid();
     config.uids.gid = getgid();
 
-    auto lines = splitLines(readAll("../sandstorm.conf"));
+    auto text = readAll("../sandstorm.conf");
+    auto lines = splitLinesInPlace(text);
     for (auto& line: lines) {
       auto equalsPos = KJ_ASSERT_NONNULL(line.findFirst('='), "Invalid config line", line);
       auto key = trim(line.slice(0, equalsPos));
@@ -1439,6 +1459,25 @@ private:
         config.allowDevAccounts = value == "true" || value == "yes";
       } else if (key == "IS_TESTING") {
         config.isTesting = value == "true" || value == "yes";
+      } else if (key == "FRONTEND_WORKERS") {
+        KJ_IF_MAYBE(n, parseUInt(value, 10)) {
+          KJ_REQUIRE(*n >= 1 && *n <= 256, "FRONTEND_WORKERS must be between 1 and 256", value);
+          config.frontendWorkers = *n;
+        } else {
+          KJ_FAIL_REQUIRE("invalid config value FRONTEND_WORKERS", value);
+        }
+      } else if (key == "GRAIN_PLACEMENT") {
+        if (value == "numa") {
+          config.grainPlacementByNode = true;
+        } else {
+          KJ_REQUIRE(value == "none", "invalid config value GRAIN_PLACEMENT", value);
+        }
+      } else if (key == "GRAIN_CPUS") {
+        config.grainCpus = parseCpuList(value);
+      } else if (key == "MERGE_MEMORY") {
+        config.mergeMemory = value == "true" || value == "yes";
+      } else if (key == "GRAIN_CGROUP") {
+        config.grainCgroup = kj::mv(value);
       }
     }
 
@@ -1552,9 +1591,24 @@ private:
   }
 
   [[noreturn]] void runServerMonitor(const Config& config) {
-    // Run the server monitor, which runs node and mongo and deals with them dying.
+    // Run the server monitor, which runs node and mongo and deals with them dying or hanging.
 
-    enterChroot(true);
+    // Must happen before we lose sight of /sys.
+    auto grainPlacement = planGrainPlacement(config);
+
+    enterChroot(true, config.grainCgroup);
+
+    // Tell the supervisors the front-end starts how to set up grains. This must come after
+    // enterChroot(), which clears the environment.
+    KJ_IF_MAYBE(domains, grainPlacement) {
+      KJ_SYSCALL(setenv(GRAIN_PLACEMENT_ENV, domains->cStr(), true));
+    }
+    if (config.mergeMemory) {
+      KJ_SYSCALL(setenv(MERGE_MEMORY_ENV, "1", true));
+    }
+    if (config.grainCgroup != nullptr) {
+      KJ_SYSCALL(setenv(GRAIN_CGROUP_ENV, "/cgroup", true));
+    }
 
     // For later use when killing children with timeout.
     registerAlarmHandler();
@@ -1565,8 +1619,9 @@ private:
     auto sigfd = prepareMonitoringLoop();
 
     context.warning("** Starting MongoDB...");
-    pid_t mongoPid = startMongo(config);
-    int64_t mongoStartTime = getTime();
+    SupervisedChild mongo;
+    mongo.pid = startMongo(config);
+    mongo.startTime = getTime();
 
     // Create the mongo user if it hasn't been created already.
     maybeCreateMongoUser(config);
@@ -1592,74 +1647,367 @@ private:
       context.warning("Note: Not accepting \"spk dev\" connections because not running as root.");
     }
 
-    pid_t nodePid = startNode(config);
-    int64_t nodeStartTime = getTime();
+    // Start the front-end. With FRONTEND_WORKERS > 1 we run several Node processes, each on its
+    // own SO_REUSEPORT listener, so that the kernel spreads incoming connections across them and
+    // the front-end can use more than one core. Each worker is restarted independently.
+    auto frontends = kj::heapArray<SupervisedChild>(config.frontendWorkers);
+    for (uint i: kj::indices(frontends)) {
+      startFrontend(config, i, frontends[i]);
+    }
 
-    for (;;) {
-      // Wait for a signal -- any signal.
-      struct signalfd_siginfo siginfo;
-      KJ_SYSCALL(read(sigfd, &siginfo, sizeof(siginfo)));
+    int64_t nextProbeTime = getTime() + PROBE_INTERVAL;
 
-      if (siginfo.ssi_signo == SIGCHLD) {
-        // Some child exited.  If it's Mongo or Node we have a problem, but it could also be some
-        // grandchild that was orphaned and thus reparented to the PID namespace's init process,
-        // which is us.
+    for (;;) {
+      // Wait for a signal, or until it's time to restart a child or probe liveness.
+      int64_t now = getTime();
+      int64_t wakeTime = nextProbeTime;
+      if (mongo.restartPending) wakeTime = kj::min(wakeTime, mongo.restartTime);
+      for (auto& frontend: frontends) {
+        if (frontend.restartPending) wakeTime = kj::min(wakeTime, frontend.restartTime);
+      }
+      int timeoutMs = wakeTime <= now ? 0 : (wakeTime - now + 999999) / 1000000;
+
+      struct pollfd pollFd;
+      memset(&pollFd, 0, sizeof(pollFd));
+      pollFd.fd = sigfd;
+      pollFd.events = POLLIN;
+      int pollResult = poll(&pollFd, 1, timeoutMs);
+      if (pollResult < 0) {
+        int error = errno;
+        if (error == EINTR) continue;  // e.g. SIGALRM left over from killChild()
+        KJ_FAIL_SYSCALL("poll(sigfd)", error);
+      }
 
-        // Reap zombies until there are no more.
-        bool mongoDied = false;
-        bool nodeDied = false;
-        for (;;) {
-          int status;
-          pid_t deadPid = waitpid(-1, &status, WNOHANG);
-          if (deadPid <= 0) {
-            // No more zombies.
-            break;
-          } else if (deadPid == mongoPid) {
-            mongoDied = true;
-          } else if (deadPid == nodePid) {
-            nodeDied = true;
-          } else if (deadPid == devDaemonPid) {
-            // We don't restart the dev daemon since it should never crash in the first place.
-            // Just record that we already reaped it.
-            devDaemonPid = 0;
+      if (pollResult > 0) {
+        struct signalfd_siginfo siginfo;
+        KJ_SYSCALL(read(sigfd, &siginfo, sizeof(siginfo)));
+
+        if (siginfo.ssi_signo == SIGCHLD) {
+          // Some child exited.  If it's Mongo or Node we have a problem, but it could also be
+          // some grandchild that was orphaned and thus reparented to the PID namespace's init
+          // process, which is us.
+
+          // Reap zombies until there are no more.
+          for (;;) {
+            int status;
+            pid_t deadPid = waitpid(-1, &status, WNOHANG);
+            if (deadPid <= 0) {
+              // No more zombies.
+              break;
+            } else if (deadPid == mongo.pid) {
+              scheduleRestart("MongoDB", mongo);
+            } else if (deadPid == devDaemonPid) {
+              // We don't restart the dev daemon since it should never crash in the first place.
+              // Just record that we already reaped it.
+              devDaemonPid = 0;
+            } else {
+              for (uint i: kj::indices(frontends)) {
+                if (deadPid == frontends[i].pid) {
+                  scheduleRestart(frontendTitle(config, i), frontends[i]);
+                }
+              }
+            }
+          }
+        } else if (siginfo.ssi_signo == SIGINT) {
+          if (siginfo.ssi_int) {
+            // Requested startup of front-end after previous shutdown.
+            bool startedAny = false;
+            for (uint i: kj::indices(frontends)) {
+              if (frontends[i].pid == 0) {
+                if (!startedAny) {
+                  context.warning("** Starting front-end by admin request");
+                  startedAny = true;
+                }
+                startFrontend(config, i, frontends[i]);
+              }
+            }
+            if (!startedAny) {
+              context.warning("** Request to start front-end, but it is already running");
+            }
+          } else {
+            // Requested shutdown of the front-end but not the back-end.
+            context.warning("** Shutting down front-end by admin request");
+            killFrontends(config, frontends);
           }
+        } else {
+          // SIGTERM or something.
+          context.warning("** Shutting down due to signal");
+          killFrontends(config, frontends);
+          killChild("MongoDB", mongo.pid);
+          killChild("Dev daemon", devDaemonPid);
+          context.exit();
         }
+      }
 
-        // Deal with mongo or node dying.
-        if (mongoDied) {
-          maybeWaitAfterChildDeath("MongoDB", mongoStartTime);
-          mongoPid = startMongo(config);
-          mongoStartTime = getTime();
-        } else if (nodeDied) {
-          maybeWaitAfterChildDeath("Front-end", nodeStartTime);
-          nodePid = startNode(config);
-          nodeStartTime = getTime();
+      // Perform any restarts that have come due.
+      now = getTime();
+      if (mongo.restartPending && mongo.restartTime <= now) {
+        mongo.restartPending = false;
+        mongo.pid = startMongo(config);
+        mongo.startTime = getTime();
+        logRestart("MongoDB", mongo);
+      }
+      for (uint i: kj::indices(frontends)) {
+        auto& frontend = frontends[i];
+        if (frontend.restartPending && frontend.restartTime <= getTime()) {
+          frontend.restartPending = false;
+          startFrontend(config, i, frontend);
+          logRestart(frontendTitle(config, i), frontend);
         }
-      } else if (siginfo.ssi_signo == SIGINT) {
-        if (siginfo.ssi_int) {
-          // Requested startup of front-end after previous shutdown.
-          if (nodePid == 0) {
-            context.warning("** Starting front-end by admin request");
-            nodePid = startNode(config);
-            nodeStartTime = getTime();
-          } else {
-            context.warning("** Request to start front-end, but it is already running");
+      }
+
+      // Probe liveness. A child that is running but unresponsive is killed; the resulting
+      // SIGCHLD schedules its restart like any other death.
+      now = getTime();
+      if (now >= nextProbeTime) {
+        nextProbeTime = now + PROBE_INTERVAL;
+
+        if (mongo.pid != 0 && !mongo.restartPending) {
+          if (probeMongo(config)) {
+            mongo.failedProbes = 0;
+          } else if (++mongo.failedProbes >= MONGO_MAX_FAILED_PROBES) {
+            context.warning(kj::str("** MongoDB failed ", mongo.failedProbes,
+                                    " liveness probes in a row; restarting it"));
+            killHungChild("MongoDB", mongo);
           }
-        } else {
-          // Requested shutdown of the front-end but not the back-end.
-          context.warning("** Shutting down front-end by admin request");
-          killChild("Front-end", nodePid);
-          nodePid = 0;
         }
+
+        for (uint i: kj::indices(frontends)) {
+          auto& frontend = frontends[i];
+          if (frontend.pid != 0 && !frontend.restartPending && checkHeartbeat(frontend, now)) {
+            context.warning(kj::str("** ", frontendTitle(config, i),
+                                    " stopped sending heartbeats; restarting it"));
+            killHungChild(frontendTitle(config, i), frontend);
+          }
+        }
+      }
+    }
+  }
+
+  struct SupervisedChild {
+    // State of a child process watched by the server monitor.
+
+    pid_t pid = 0;
+    // 0 if not running.
+
+    int64_t startTime = 0;
+    // When the child was last started.
+
+    bool restartPending = false;
+    int64_t restartTime = 0;
+    int64_t deathTime = 0;
+    // If restartPending, the child died at deathTime and will be restarted at restartTime.
+
+    uint consecutiveCrashes = 0;
+    // Number of times in a row that the child died soon after starting. Drives the backoff.
+
+    uint totalCrashes = 0;
+
+    uint failedProbes = 0;
+    // Consecutive failed liveness probes (MongoDB).
+
+    kj::AutoCloseFd heartbeat;
+    int64_t lastHeartbeat = 0;
+    // Read end of the front-end's heartbeat pipe, and when we last saw a byte on it.
+  };
+
+  static constexpr int64_t MILLISECONDS = 1000ll * 1000;
+  static constexpr int64_t SECONDS = 1000 * MILLISECONDS;
+
+  static constexpr int64_t PROBE_INTERVAL = 10 * SECONDS;
+  // How often we probe liveness of our children.
+
+  static constexpr uint MONGO_MAX_FAILED_PROBES = 3;
+  static constexpr int64_t MONGO_PROBE_TIMEOUT = 5 * SECONDS;
+  // MongoDB is considered hung after this many consecutive probes time out or fail.
+
+  static constexpr int64_t HEARTBEAT_TIMEOUT = 60 * SECONDS;
+  static constexpr int64_t FIRST_HEARTBEAT_TIMEOUT = 5 * 60 * SECONDS;
+  // A front-end is considered hung if it hasn't written to its heartbeat pipe for this long. It
+  // gets more slack before its first heartbeat, since Meteor startup (and any DB migrations) run
+  // before the event loop is free.
+
+  static constexpr int64_t CRASH_LOOP_WINDOW = 10 * SECONDS;
+  static constexpr int64_t MIN_RESTART_BACKOFF = 250 * MILLISECONDS;
+  static constexpr int64_t MAX_RESTART_BACKOFF = 60 * SECONDS;
+  // A child that dies within CRASH_LOOP_WINDOW of starting is crash-looping. Each consecutive
+  // such death doubles the restart delay, starting at MIN_RESTART_BACKOFF. A child that ran
+  // longer than that is restarted immediately.
+
+  void scheduleRestart(kj::StringPtr title, SupervisedChild& child) {
+    // Called when we've reaped `child`. Decides when to restart it.
+
+    int64_t now = getTime();
+    child.pid = 0;
+    child.heartbeat = nullptr;
+    child.failedProbes = 0;
+    child.deathTime = now;
+    ++child.totalCrashes;
+
+    int64_t delay = 0;
+    if (now - child.startTime < CRASH_LOOP_WINDOW) {
+      ++child.consecutiveCrashes;
+      delay = MIN_RESTART_BACKOFF;
+      for (uint i = 1; i < child.consecutiveCrashes && delay < MAX_RESTART_BACKOFF; i++) {
+        delay *= 2;
+      }
+      delay = kj::min(delay, MAX_RESTART_BACKOFF);
+      context.warning(kj::str(
+          "** ", title, " died immediately after starting (", child.consecutiveCrashes,
+          " times in a row, ", child.totalCrashes, " total).\n"
+          "** Waiting ", delay / MILLISECONDS, "ms before trying again..."));
+    } else {
+      child.consecutiveCrashes = 0;
+      context.warning(kj::str("** ", title, " died! (", child.totalCrashes,
+                              " total) Restarting it..."));
+    }
+
+    child.restartPending = true;
+    child.restartTime = now + delay;
+  }
+
+  void logRestart(kj::StringPtr title, SupervisedChild& child) {
+    context.warning(kj::str("** ", title, " restarted ",
+                            (child.startTime - child.deathTime) / MILLISECONDS,
+                            "ms after it died."));
+  }
+
+  void killHungChild(kj::StringPtr title, SupervisedChild& child) {
+    // Kill a child that is alive but unresponsive, then schedule its restart. killChild() reaps
+    // it, so we won't see it again in the SIGCHLD handler.
+
+    killChild(title, child.pid);
+    scheduleRestart(title, child);
+  }
+
+  bool checkHeartbeat(SupervisedChild& child, int64_t now) {
+    // Drain the child's heartbeat pipe. Returns true if the child seems to be hung.
+
+    if (child.heartbeat.get() < 0) return false;
+
+    for (;;) {
+      char buffer[256];
+      ssize_t n = read(child.heartbeat, buffer, sizeof(buffer));
+      if (n > 0) {
+        child.lastHeartbeat = now;
+      } else if (n == 0) {
+        // EOF; the child is exiting and we'll get SIGCHLD shortly.
+        return false;
       } else {
-        // SIGTERM or something.
-        context.warning("** Shutting down due to signal");
-        killChild("Front-end", nodePid);
-        killChild("MongoDB", mongoPid);
-        killChild("Dev daemon", devDaemonPid);
-        context.exit();
+        int error = errno;
+        if (error == EINTR) continue;
+        if (error == EAGAIN || error == EWOULDBLOCK) break;
+        KJ_FAIL_SYSCALL("read(heartbeat)", error);
+      }
+    }
+
+    if (child.lastHeartbeat == 0) {
+      return now - child.startTime > FIRST_HEARTBEAT_TIMEOUT;
+    } else {
+      return now - child.lastHeartbeat > HEARTBEAT_TIMEOUT;
+    }
+  }
+
+  bool probeMongo(const Config& config) {
+    // Check that MongoDB is actually answering requests by sending it an `isMaster` command,
+    // which requires no authentication. Returns false on any error or timeout.
+
+    int sockFd;
+    KJ_SYSCALL(sockFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd sock(sockFd);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(config.mongoPort);
+
+    int64_t deadline = getTime() + MONGO_PROBE_TIMEOUT;
+    auto waitFor = [&](short events) {
+      for (;;) {
+        int64_t now = getTime();
+        if (now >= deadline) return false;
+        struct pollfd pollFd;
+        memset(&pollFd, 0, sizeof(pollFd));
+        pollFd.fd = sock;
+        pollFd.events = events;
+        int n = poll(&pollFd, 1, (deadline - now + 999999) / 1000000);
+        if (n > 0) return true;
+        if (n < 0 && errno != EINTR) return false;
+      }
+    };
+
+    if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+      if (errno != EINPROGRESS || !waitFor(POLLOUT)) return false;
+      int error;
+      socklen_t errorLen = sizeof(error);
+      KJ_SYSCALL(getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errorLen));
+      if (error != 0) return false;
+    }
+
+    // Build an OP_QUERY for {isMaster: 1} against admin.$cmd. See the MongoDB wire protocol docs.
+    static constexpr int32_t OP_QUERY = 2004;
+    static constexpr int32_t OP_REPLY = 1;
+    const int32_t requestId = getpid() ^ static_cast<int32_t>(getTime());
+
+    kj::Vector<kj::byte> message(64);
+    auto addInt32 = [&](int32_t value) {
+      // The wire protocol is little-endian, as are all platforms we run on.
+      message.addAll(reinterpret_cast<kj::byte*>(&value),
+                     reinterpret_cast<kj::byte*>(&value) + sizeof(value));
+    };
+    auto addCString = [&](kj::StringPtr text) {
+      message.addAll(text.begin(), text.end() + 1);
+    };
+
+    addInt32(0);             // messageLength, filled in below
+    addInt32(requestId);     // requestID
+    addInt32(0);             // responseTo
+    addInt32(OP_QUERY);      // opCode
+    addInt32(0);             // flags
+    addCString("admin.$cmd");
+    addInt32(0);             // numberToSkip
+    addInt32(-1);            // numberToReturn
+    size_t docStart = message.size();
+    addInt32(0);             // BSON document length, filled in below
+    message.add(0x10);       // int32 element...
+    addCString("isMaster");  // ...named "isMaster"...
+    addInt32(1);             // ...with value 1.
+    message.add(0);          // end of document
+
+    int32_t docLength = message.size() - docStart;
+    memcpy(message.begin() + docStart, &docLength, sizeof(docLength));
+    int32_t messageLength = message.size();
+    memcpy(message.begin(), &messageLength, sizeof(messageLength));
+
+    size_t written = 0;
+    while (written < message.size()) {
+      ssize_t n = write(sock, message.begin() + written, message.size() - written);
+      if (n > 0) {
+        written += n;
+      } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        if (!waitFor(POLLOUT)) return false;
+      } else {
+        return false;
       }
     }
+
+    // We only need the reply header to know that Mongo is serving requests.
+    int32_t header[4];
+    size_t received = 0;
+    while (received < sizeof(header)) {
+      ssize_t n = read(sock, reinterpret_cast<kj::byte*>(header) + received,
+                       sizeof(header) - received);
+      if (n > 0) {
+        received += n;
+      } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        if (!waitFor(POLLIN)) return false;
+      } else {
+        return false;
+      }
+    }
+
+    return header[2] == requestId && header[3] == OP_REPLY;
   }
 
   pid_t startMongo(const Config& config) {
@@ -1760,13 +2108,139 @@ private:
     }
   }
 
-  pid_t startNode(const Config& config) {
+  kj::String frontendTitle(const Config& config, uint workerIndex) {
+    if (config.frontendWorkers == 1) {
+      return kj::str("Front-end");
+    } else {
+      return kj::str("Front-end worker ", workerIndex);
+    }
+  }
+
+  void killFrontends(const Config& config, kj::ArrayPtr<SupervisedChild> frontends) {
+    // Ask all workers to shut down at once so that they exit in parallel, then reap each one
+    // (killing it hard if it takes too long). Also cancels any pending restarts.
+    for (auto& frontend: frontends) {
+      if (frontend.pid != 0) {
+        KJ_SYSCALL(kill(frontend.pid, SIGTERM));
+      }
+    }
+    for (uint i: kj::indices(frontends)) {
+      auto& frontend = frontends[i];
+      if (frontend.pid != 0) {
+        killChild(frontendTitle(config, i), frontend.pid);
+      }
+      frontend.pid = 0;
+      frontend.restartPending = false;
+      frontend.heartbeat = nullptr;
+    }
+  }
+
+  void startFrontend(const Config& config, uint workerIndex, SupervisedChild& child) {
+    // Start a front-end worker along with a heartbeat pipe through which it tells us it is alive.
+
+    int pipeFds[2];
+    KJ_SYSCALL(pipe2(pipeFds, O_CLOEXEC));
+    kj::AutoCloseFd heartbeatIn(pipeFds[0]), heartbeatOut(pipeFds[1]);
+    KJ_SYSCALL(fcntl(heartbeatIn, F_SETFL, O_NONBLOCK));
+
+    child.pid = startNode(config, workerIndex, heartbeatOut);
+    child.startTime = getTime();
+    child.heartbeat = kj::mv(heartbeatIn);
+    child.lastHeartbeat = 0;
+    child.restartPending = false;
+  }
+
+  kj::AutoCloseFd openFrontendListener(const Config& config) {
+    // Open a listen socket for one front-end worker. Every worker gets its own socket bound to the
+    // same address with SO_REUSEPORT, and the kernel balances incoming connections among them.
+    // When a worker dies its socket dies with it, so new connections go only to live workers.
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+
+    // We're a static binary, so we can only accept numeric addresses here (no NSS).
+    struct addrinfo* addrs;
+    int error = getaddrinfo(config.bindIp.cStr(), kj::str(config.port).cStr(), &hints, &addrs);
+    if (error != 0) {
+      KJ_FAIL_REQUIRE("BIND_IP must be a numeric address when FRONTEND_WORKERS > 1",
+                      config.bindIp, gai_strerror(error));
+    }
+    KJ_DEFER(freeaddrinfo(addrs));
+
+    int sockFd;
+    KJ_SYSCALL(sockFd = socket(addrs->ai_family, addrs->ai_socktype | SOCK_CLOEXEC,
+                               addrs->ai_protocol));
+    kj::AutoCloseFd sock(sockFd);
+
+    int one = 1;
+    KJ_SYSCALL(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)));
+    KJ_SYSCALL(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)));
+    KJ_SYSCALL(bind(sock, addrs->ai_addr, addrs->ai_addrlen), config.bindIp, config.port);
+    KJ_SYSCALL(listen(sock, 511));  // same backlog Node uses
+
+    return sock;
+  }
+
+  kj::Maybe<kj::String> planGrainPlacement(const Config& config) {
+    // Decide which CPUs grains run on, per GRAIN_CPUS and GRAIN_PLACEMENT. Returns the domains to
+    // tell supervisors about through GRAIN_PLACEMENT_ENV, or null if grains run anywhere.
+
+    if (config.grainCpus == nullptr && !config.grainPlacementByNode) {
+      return nullptr;
+    }
+
+    auto allowed = getAllowedCpus();
+    kj::Vector<uint> cpus;
+    KJ_IF_MAYBE(grainCpus, config.grainCpus) {
+      for (uint cpu: *grainCpus) {
+        if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+          cpus.add(cpu);
+        }
+      }
+      KJ_REQUIRE(cpus.size() > 0, "none of GRAIN_CPUS are available to Sandstorm",
+                 formatCpuList(*grainCpus), formatCpuList(allowed));
+    } else {
+      cpus.addAll(allowed);
+    }
+
+    auto domains = formatPlacementDomains(
+        findPlacementDomains(cpus.asPtr(), config.grainPlacementByNode));
+    context.warning(kj::str("** Grains will be placed on CPUs: ", domains));
+    return kj::mv(domains);
+  }
+
+  pid_t startNode(const Config& config, uint workerIndex, int heartbeatFd) {
+    kj::AutoCloseFd listenFd;
+    if (config.frontendWorkers > 1) {
+      // Bind before forking, while we still have our privileges (e.g. to bind port 80). Our own
+      // copy of the fd is closed when we return.
+      listenFd = openFrontendListener(config);
+    }
+
     pid_t result;
     KJ_SYSCALL(result = fork());
     if (result == 0) {
       dropPrivs(config.uids);
       clearSignalMask();
 
+      if (listenFd.get() >= 0) {
+        // Let the worker inherit its listen socket; pre-meteor.js listens on it instead of
+        // binding PORT itself.
+        KJ_SYSCALL(fcntl(listenFd, F_SETFD, 0));
+        KJ_SYSCALL(setenv("SANDSTORM_LISTEN_FD", kj::str(listenFd.get()).cStr(), true));
+        KJ_SYSCALL(setenv("SANDSTORM_WORKER_INDEX", kj::str(workerIndex).cStr(), true));
+        KJ_SYSCALL(setenv("SANDSTORM_WORKER_COUNT", kj::str(config.frontendWorkers).cStr(),
+                          true));
+        listenFd.release();
+      }
+
+      // The front-end writes to this pipe periodically so that we can detect if it hangs.
+      KJ_SYSCALL(fcntl(heartbeatFd, F_SETFD, 0));
+      KJ_SYSCALL(setenv("SANDSTORM_HEARTBEAT_FD", kj::str(heartbeatFd).cStr(), true));
+
       kj::String authPrefix;
       kj::StringPtr authSuffix;
       if (access("/var/mongo/passwd", F_OK) == 0) {
@@ -1830,19 +2304,6 @@ private:
     return result;
   }
 
-  void maybeWaitAfterChildDeath(kj::StringPtr title, int64_t startTime) {
-    if (getTime() - startTime < 10ll * 1000 * 1000 * 1000) {
-      context.warning(kj::str(
-          "** ", title, " died immediately after starting.\n"
-          "** Sleeping for a bit before trying again..."));
-
-      // Sleep for 10 seconds to avoid burning resources on a restart loop.
-      usleep(10 * 1000 * 1000);
-    } else {
-      context.warning(kj::str("** ", title, " died! Restarting it..."));
-    }
-  }
-
   void killChild(kj::StringPtr title, pid_t pid) {
     if (pid == 0) {
       // We use PID = 0 to indicate that a process isn't running, so there's nothing to do.
@@ -2166,8 +2627,8 @@ private:
   // running in meteor dev mode (outside of the sandbox) in order to start an app. The front-end
   // can't just invoke sandstorm-supervisor directly in this case since it's not in the proper
   // namespace. This command must be followed by three file descriptors (to represent stdin,
-  // stdout, stderr), a series of NUL-terminated strings representing the arguments, and then
-  // EOF.
+  // stdout, stderr) sent together with sendFds(), a series of NUL-terminated strings
+  // representing the arguments, and then EOF.
 
   [[noreturn]] void runDevSession(const Config& config, kj::AutoCloseFd internalFd) {
     auto exception = kj::runCatchingExceptions([&]() {
@@ -2183,9 +2644,10 @@ private:
         // Oh, they want us to run a sandstorm-supervisor.
 
         // Receive the standard FDs and dup2() them into place.
-        KJ_SYSCALL(dup2(receiveFd(internalFd), STDIN_FILENO));
-        KJ_SYSCALL(dup2(receiveFd(internalFd), STDOUT_FILENO));
-        KJ_SYSCALL(dup2(receiveFd(internalFd), STDERR_FILENO));
+        auto stdio = receiveFds(internalFd, 3);
+        KJ_SYSCALL(dup2(stdio[0], STDIN_FILENO));
+        KJ_SYSCALL(dup2(stdio[1], STDOUT_FILENO));
+        KJ_SYSCALL(dup2(stdio[2], STDERR_FILENO));
 
         // Re-enable child reaping.
         KJ_SYSCALL(signal(SIGCHLD, SIG_DFL));
@@ -2257,6 +2719,7 @@ private:
         KJ_FAIL_SYSCALL("mkdtemp(dir)", errno, dir);
       }
       KJ_DEFER(rmdir(dir));
+      KJ_DEFER(unlink(kj::str(dir, ".prefetch").cStr()));  // left by the supervisor, if any
       if (runningAsRoot) { KJ_SYSCALL(chown(dir, config.uids.uid, config.uids.gid)); }
 
       char* pkgId = strrchr(dir, '/') + 1;
@@ -2471,6 +2934,16 @@ private:
 constexpr kj::byte RunBundleMain::DEVMODE_COMMAND_CONNECT;
 constexpr kj::byte RunBundleMain::DEVMODE_COMMAND_GETNS;
 constexpr kj::byte RunBundleMain::DEVMODE_COMMAND_SUPERVISE;
+constexpr int64_t RunBundleMain::MILLISECONDS;
+constexpr int64_t RunBundleMain::SECONDS;
+constexpr int64_t RunBundleMain::PROBE_INTERVAL;
+constexpr uint RunBundleMain::MONGO_MAX_FAILED_PROBES;
+constexpr int64_t RunBundleMain::MONGO_PROBE_TIMEOUT;
+constexpr int64_t RunBundleMain::HEARTBEAT_TIMEOUT;
+constexpr int64_t RunBundleMain::FIRST_HEARTBEAT_TIMEOUT;
+constexpr int64_t RunBundleMain::CRASH_LOOP_WINDOW;
+constexpr int64_t RunBundleMain::MIN_RESTART_BACKOFF;
+constexpr int64_t RunBundleMain::MAX_RESTART_BACKOFF;
 
 }  // namespace sandstorm
 
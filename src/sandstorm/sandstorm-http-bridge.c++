@@ -34,6 +34,7 @@
 #include <unordered_map>
 #include <time.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
@@ -49,10 +50,16 @@
 #include <sandstorm/sandstorm-http-bridge.capnp.h>
 #include <sandstorm/hack-session.capnp.h>
 #include <sandstorm/package.capnp.h>
+#include <sandstorm/supervisor.capnp.h>
 #include <joyent-http/http_parser.h>
 
 #include "version.h"
 #include "util.h"
+#include "byte-stream.h"
+#include "maildir.h"
+#include "shm-stream.h"
+#include "static-files.h"
+#include "request-limiter.h"
 
 namespace sandstorm {
 
@@ -103,6 +110,12 @@ HttpStatusInfo noContentInfo(bool shouldResetForm) {
   return result;
 }
 
+HttpStatusInfo preconditionFailedInfo() {
+  HttpStatusInfo result;
+  result.type = WebSession::Response::PRECONDITION_FAILED;
+  return result;
+}
+
 HttpStatusInfo redirectInfo(bool isPermanent, bool switchToGet) {
   HttpStatusInfo result;
   result.type = WebSession::Response::REDIRECT;
@@ -140,6 +153,9 @@ std::unordered_map<uint, HttpStatusInfo> makeStatusCodes() {
   result[204] = noContentInfo(false);
   result[205] = noContentInfo(true);
 
+  // We only forward If-None-Match on GET requests, so this is the only meaning 304 can have.
+  result[304] = preconditionFailedInfo();
+
   result[301] = redirectInfo(true, true);
   result[302] = redirectInfo(false, true);
   result[303] = redirectInfo(false, true);
@@ -154,12 +170,37 @@ std::unordered_map<uint, HttpStatusInfo> makeStatusCodes() {
 const std::unordered_map<uint, HttpStatusInfo> HTTP_STATUS_CODES = makeStatusCodes();
 #pragma clang diagnostic pop
 
+struct ETagInfo {
+  kj::String value;
+  bool weak;
+};
+
+kj::Maybe<ETagInfo> parseETag(kj::StringPtr header) {
+  // Parses an ETag header value, i.e. `"value"` or `W/"value"`.
+
+  auto text = trim(header);
+  kj::StringPtr rest = text;
+  bool weak = false;
+  if (rest.startsWith("W/")) {
+    weak = true;
+    rest = rest.slice(2);
+  }
+  if (rest.size() < 2 || !rest.startsWith("\"") || !rest.endsWith("\"")) {
+    return nullptr;
+  }
+  return ETagInfo { kj::heapString(rest.slice(1, rest.size() - 1)), weak };
+}
+
+kj::String formatETag(WebSession::ETag::Reader eTag) {
+  return kj::str(eTag.getWeak() ? "W/" : "", '"', eTag.getValue(), '"');
+}
+
 class HttpParser: public sandstorm::Handle::Server,
                   private http_parser,
                   private kj::TaskSet::ErrorHandler {
 public:
   HttpParser(sandstorm::ByteStream::Client responseStream)
-    : responseStream(responseStream),
+    : responseWriter(responseStream),
       taskSet(*this) {
     memset(&settings, 0, sizeof(settings));
     settings.on_status = &on_status;
@@ -201,11 +242,13 @@ public:
 
   void pumpStream(kj::Own<kj::AsyncIoStream>&& stream) {
     if (isStreaming) {
+      if (!(flags & F_CHUNKED) && content_length != ULLONG_MAX) {
+        // The parser counts content_length down as it consumes the body.
+        responseWriter.expectSize(body.size() + content_length);
+      }
+
       if (body.size() > 0) {
-        auto request = responseStream.writeRequest();
-        auto dst = request.initData(body.size());
-        memcpy(dst.begin(), body.begin(), body.size());
-        taskSet.add(request.send().then([](auto x){}));
+        bodyWritable = responseWriter.write(body.begin(), body.size());
         body.resize(0);
       }
 
@@ -268,6 +311,11 @@ public:
         KJ_IF_MAYBE(mimeType, findHeader("content-type")) {
           content.setMimeType(*mimeType);
         }
+        KJ_IF_MAYBE(eTag, findETag()) {
+          auto builder = content.initETag();
+          builder.setValue(eTag->value);
+          builder.setWeak(eTag->weak);
+        }
         KJ_IF_MAYBE(disposition, findHeader("content-disposition")) {
           // Parse `attachment; filename="foo"`
           // TODO(cleanup):  This is awful.  Use KJ parser library?
@@ -325,6 +373,15 @@ public:
         }
         break;
       }
+      case WebSession::Response::PRECONDITION_FAILED: {
+        auto preconditionFailed = builder.initPreconditionFailed();
+        KJ_IF_MAYBE(eTag, findETag()) {
+          auto matching = preconditionFailed.initMatchingETag();
+          matching.setValue(eTag->value);
+          matching.setWeak(eTag->weak);
+        }
+        break;
+      }
       case WebSession::Response::NO_CONTENT: {
         auto noContent = builder.initNoContent();
         noContent.setShouldResetForm(statusInfo.noContent.shouldResetForm);
@@ -400,7 +457,11 @@ private:
     bool httpOnly = false;
   };
 
-  sandstorm::ByteStream::Client responseStream;
+  sandstorm::ByteStreamWriter responseWriter;
+  kj::Promise<void> bodyWritable = kj::READY_NOW;
+  // Resolves when responseWriter has room for more of a streaming body. We don't read more from
+  // the app until then, so a large download is not buffered in RAM.
+
   kj::TaskSet taskSet;
   bool headersComplete = false;
   bool messageComplete = false;
@@ -422,12 +483,20 @@ private:
       if (nread != actual) {
         const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
         KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
-      } else if (messageComplete || actual == 0) {
+      }
+
+      auto writable = kj::mv(bodyWritable);
+      bodyWritable = kj::READY_NOW;
+      if (messageComplete || actual == 0) {
         // The parser is done or the stream has closed.
-        taskSet.add(responseStream.doneRequest().send().then([](auto x){}));
+        taskSet.add(writable.then([this]() {
+          return responseWriter.done();
+        }));
         return kj::READY_NOW;
       } else {
-        taskSet.add(pumpStreamInternal(kj::mv(stream)));
+        taskSet.add(writable.then([this, KJ_MVCAP(stream)]() mutable {
+          return pumpStreamInternal(kj::mv(stream));
+        }));
         return kj::READY_NOW;
       }
     });
@@ -446,6 +515,14 @@ private:
     }
   }
 
+  kj::Maybe<ETagInfo> findETag() {
+    KJ_IF_MAYBE(header, findHeader("etag")) {
+      return parseETag(*header);
+    } else {
+      return nullptr;
+    }
+  }
+
   void onStatus(kj::ArrayPtr<const char> status) {
     rawStatusString.addAll(status);
   }
@@ -549,16 +626,13 @@ private:
 
   void onBody(kj::ArrayPtr<const char> data) {
     if (isStreaming) {
-      // TODO(soon): Pause the input whenever too many write requests are in-flight at once.
-      //   Otherwise, a large file download may end up entirely buffered in RAM.
+      // responseWriter copies the data, coalescing small pieces. pumpStreamInternal() waits on
+      // bodyWritable before reading more.
       // TODO(security): Cap'n Proto itself should stop processing inbound messages when too many
-      //   requests are in-flight, measured by the size of the requests. Otherwise the queuing
-      //   described above will actually happen at the front-end and not even be charged to the
-      //   user. Watch out for deadlock, though.
-      auto request = responseStream.writeRequest();
-      auto dst = request.initData(data.size());
-      memcpy(dst.begin(), data.begin(), data.size());
-      taskSet.add(request.send().then([](auto x){}));
+      //   requests are in-flight, measured by the size of the requests. Otherwise a client that
+      //   ignores flow control can still make the front-end queue data. Watch out for deadlock,
+      //   though.
+      bodyWritable = responseWriter.write(data.begin(), data.size());
     } else {
       body.addAll(data);
     }
@@ -691,6 +765,35 @@ private:
   kj::Own<kj::AsyncIoStream> stream;
 };
 
+class LimitedAsyncIoStream final: public kj::AsyncIoStream {
+  // A connection to the app which holds one of the RequestLimiter's slots while it's open.
+
+public:
+  LimitedAsyncIoStream(kj::Own<kj::AsyncIoStream>&& stream,
+                       kj::Own<RequestLimiter::Slot>&& slot)
+      : stream(kj::mv(stream)), slot(kj::mv(slot)) {}
+
+  kj::Promise<size_t> read(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return stream->read(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return stream->tryRead(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    return stream->write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    return stream->write(pieces);
+  }
+  void shutdownWrite() override {
+    return stream->shutdownWrite();
+  }
+
+private:
+  kj::Own<kj::AsyncIoStream> stream;
+  kj::Own<RequestLimiter::Slot> slot;
+};
+
 class RequestStreamImpl final: public WebSession::RequestStream::Server {
 public:
   RequestStreamImpl(kj::String httpRequest,
@@ -830,12 +933,14 @@ typedef std::map<kj::StringPtr, SessionContext::Client&> SessionContextMap;
 
 class WebSessionImpl final: public WebSession::Server {
 public:
-  WebSessionImpl(kj::NetworkAddress& serverAddr,
+  WebSessionImpl(kj::NetworkAddress& serverAddr, RequestLimiter& requestLimiter,
                  UserInfo::Reader userInfo, SessionContext::Client sessionContext,
                  SessionContextMap& sessionContextMap, kj::String&& sessionId,
                  kj::String&& basePath, kj::String&& userAgent, kj::String&& acceptLanguages,
-                 kj::String&& rootPath, kj::String&& permissions)
+                 kj::String&& rootPath, kj::String&& permissions,
+                 kj::Maybe<StaticFileServer&> staticFiles = nullptr)
       : serverAddr(serverAddr),
+        requestQueue(requestLimiter.newQueue()),
         sessionContext(kj::mv(sessionContext)),
         sessionContextMap(sessionContextMap),
         sessionId(kj::mv(sessionId)),
@@ -844,7 +949,8 @@ public:
         basePath(kj::mv(basePath)),
         userAgent(kj::mv(userAgent)),
         acceptLanguages(kj::mv(acceptLanguages)),
-        rootPath(kj::mv(rootPath)) {
+        rootPath(kj::mv(rootPath)),
+        staticFiles(staticFiles) {
     if (userInfo.hasUserId()) {
       auto id = userInfo.getUserId();
       KJ_ASSERT(id.size() == 32, "User ID not a SHA-256?");
@@ -861,7 +967,20 @@ public:
 
   kj::Promise<void> get(GetContext context) override {
     GetParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders("GET", params.getPath(), params.getContext());
+    KJ_IF_MAYBE(s, staticFiles) {
+      if (s->tryGet(params.getPath(), params.getContext(), context.getResults())) {
+        return kj::READY_NOW;
+      }
+    }
+
+    kj::String ifNoneMatch;
+    auto precondition = params.getContext().getETagPrecondition();
+    if (precondition.isMatchesNoneOf() && precondition.getMatchesNoneOf().size() > 0) {
+      ifNoneMatch = kj::str("If-None-Match: ", kj::strArray(
+          KJ_MAP(eTag, precondition.getMatchesNoneOf()) { return formatETag(eTag); }, ", "));
+    }
+    kj::String httpRequest = makeHeaders("GET", params.getPath(), params.getContext(),
+                                         kj::mv(ifNoneMatch));
     return sendRequest(toBytes(httpRequest), context);
   }
 
@@ -962,6 +1081,7 @@ public:
 
 private:
   kj::NetworkAddress& serverAddr;
+  kj::Own<RequestLimiter::Queue> requestQueue;
   SessionContext::Client sessionContext;
   SessionContextMap& sessionContextMap;
   kj::String sessionId;
@@ -972,6 +1092,7 @@ private:
   kj::String userAgent;
   kj::String acceptLanguages;
   kj::String rootPath;
+  kj::Maybe<StaticFileServer&> staticFiles;
   spk::BridgeConfig::Reader config;
 
   kj::String makeHeaders(kj::StringPtr method, kj::StringPtr path,
@@ -1043,12 +1164,27 @@ private:
     lines.add(kj::str(""));
   }
 
+  kj::Promise<kj::Own<kj::AsyncIoStream>> connectForRequest() {
+    // Waits for this session's turn to send the app a request, then connects. The request counts
+    // against the limit until the connection is dropped.
+    //
+    // WebSockets stay open indefinitely, so they connect directly instead.
+
+    return requestQueue->acquire().then([this](kj::Own<RequestLimiter::Slot>&& slot) {
+      return serverAddr.connect().then(
+          [KJ_MVCAP(slot)](kj::Own<kj::AsyncIoStream>&& stream) mutable
+          -> kj::Own<kj::AsyncIoStream> {
+        return kj::heap<LimitedAsyncIoStream>(kj::mv(stream), kj::mv(slot));
+      });
+    });
+  }
+
   template <typename Context>
   kj::Promise<void> sendRequest(kj::Array<byte> httpRequest, Context& context) {
     sandstorm::ByteStream::Client responseStream =
         context.getParams().getContext().getResponseStream();
     context.releaseParams();
-    return serverAddr.connect().then(
+    return connectForRequest().then(
         [KJ_MVCAP(httpRequest), responseStream, context]
         (kj::Own<kj::AsyncIoStream>&& stream) mutable {
       kj::ArrayPtr<const byte> httpRequestRef = httpRequest;
@@ -1080,7 +1216,7 @@ private:
     sandstorm::ByteStream::Client responseStream =
       context.getParams().getContext().getResponseStream();
     context.releaseParams();
-    return serverAddr.connect().then(
+    return connectForRequest().then(
         [KJ_MVCAP(httpRequest), responseStream, context]
         (kj::Own<kj::AsyncIoStream>&& stream) mutable {
       auto requestStream = kj::heap<RequestStreamImpl>(
@@ -1094,148 +1230,18 @@ class EmailSessionImpl final: public HackEmailSession::Server {
 public:
   kj::Promise<void> send(SendContext context) override {
     // We're receiving an e-mail. We place the message in maildir format under /var/mail.
-
-    auto email = context.getParams().getEmail();
-    auto id = genRandomString();
-
-    // TODO(perf): The following does a lot more copying than necessary.
-
-    // Construct the mail file.
-    kj::Vector<kj::String> lines;
-
-    addDateHeader(lines, email.getDate());
-
-    addHeader(lines, "To", email.getTo());
-    addHeader(lines, "From", email.getFrom());
-    addHeader(lines, "Reply-To", email.getReplyTo());
-    addHeader(lines, "CC", email.getCc());
-    addHeader(lines, "BCC", email.getBcc());
-    addHeader(lines, "Subject", email.getSubject());
-
-    addHeader(lines, "Message-Id", email.getMessageId());
-    addHeader(lines, "References", email.getReferences());
-    addHeader(lines, "In-Reply-To", email.getInReplyTo());
-
-    addHeader(lines, "Content-Type",
-        kj::str("multipart/alternative; boundary=", id));
-
-    lines.add(nullptr);  // blank line starts body.
-
-    if (email.hasText()) {
-      lines.add(kj::str("--", id));
-      addHeader(lines, "Content-Type", kj::str("text/plain; charset=UTF-8"));
-      lines.add(nullptr);
-      lines.add(kj::str(email.getText()));
-    }
-    if (email.hasHtml()) {
-      lines.add(kj::str("--", id));
-      addHeader(lines, "Content-Type", kj::str("text/html; charset=UTF-8"));
-      lines.add(nullptr);
-      lines.add(kj::str(email.getHtml()));
-    }
-    for (auto attachment : email.getAttachments()) {
-      addAttachment(lines, id, attachment);
-    }
-    lines.add(kj::str("--", id, "--"));
-
-    lines.add(nullptr);
-    auto text = kj::strArray(lines, "\n");
-
-    // Write to temp file. Prefix name with _ in case `id` starts with '.'.
-    auto tmpFilename = kj::str("/var/mail/tmp/_", id);
-    auto mailFd = raiiOpen(tmpFilename, O_WRONLY | O_CREAT | O_EXCL);
-    kj::FdOutputStream((int)mailFd).write(text.begin(), text.size());
-    mailFd = nullptr;
-
-    // Move to final location.
-    KJ_SYSCALL(rename(tmpFilename.cStr(), kj::str("/var/mail/new/_", id).cStr()));
-
+    deliverToMaildir("/var/mail", context.getParams().getEmail());
     return kj::READY_NOW;
   }
 
-private:
-  static kj::String genRandomString() {
-    // Generate a unique random string.
-
-    // Get 16 random bytes.
-    kj::byte bytes[16];
-    kj::FdInputStream(raiiOpen("/dev/urandom", O_RDONLY)).read(bytes, sizeof(bytes));
-
-    // Base64 encode, using digits safe for MIME boundary or a filename.
-    static const char DIGITS[65] =
-        "0123456789"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "abcdefghijklmnopqrstuvwxyz_.";
-    uint buffer = 0;
-    uint bufBits = 0;
-    auto chars = kj::heapArrayBuilder<char>(23);
-    for (kj::byte b: bytes) {
-      buffer |= b << bufBits;
-      bufBits += 8;
-
-      while (bufBits >= 6) {
-        chars.add(DIGITS[buffer & 63]);
-        buffer >>= 6;
-        bufBits -= 6;
-      }
-    }
-    chars.add(DIGITS[buffer & 63]);
-    chars.add('\0');
-
-    return kj::String(chars.finish());
-  }
-
-  static void addHeader(kj::Vector<kj::String>& lines, kj::StringPtr name, kj::StringPtr value) {
-    if (value.size() > 0) {
-      lines.add(kj::str(name, ": ", value));
-    }
-  }
-
-  static kj::String formatAddress(EmailAddress::Reader email) {
-    auto name = email.getName();
-    auto address = email.getAddress();
-    if (name.size() == 0) {
-      return kj::str(address);
-    } else {
-      return kj::str(name, " <", address, ">");
+  kj::Promise<void> sendStreaming(SendStreamingContext context) override {
+    // Same, but attachments arrive as streams and are written to the file as they come in.
+    auto streams = deliverToMaildirStreaming("/var/mail", context.getParams().getEmail());
+    auto results = context.getResults().initAttachments(streams.size());
+    for (uint i = 0; i < streams.size(); i++) {
+      results.set(i, kj::mv(streams[i]));
     }
-  }
-
-  static void addHeader(kj::Vector<kj::String>& lines, kj::StringPtr name,
-                        EmailAddress::Reader email) {
-    addHeader(lines, name, formatAddress(email));
-  }
-
-  static void addHeader(kj::Vector<kj::String>& lines, kj::StringPtr name,
-                        capnp::List<EmailAddress>::Reader emails) {
-    addHeader(lines, name, kj::strArray(KJ_MAP(e, emails) { return formatAddress(e); }, ", "));
-  }
-
-  static void addHeader(kj::Vector<kj::String>& lines, kj::StringPtr name,
-                        capnp::List<capnp::Text>::Reader items) {
-    // Used for lists of message IDs (e.g. References an In-Reply-To). Each ID should be "quoted"
-    // with <>.
-    addHeader(lines, name, kj::strArray(KJ_MAP(i, items) { return kj::str('<', i, '>'); }, " "));
-  }
-
-  static void addDateHeader(kj::Vector<kj::String>& lines, int64_t nanoseconds) {
-    time_t seconds(nanoseconds / 1000000000u);
-    struct tm *tm = gmtime(&seconds);
-    char date[40];
-    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", tm);
-
-    addHeader(lines, "Date", date);
-  }
-
-  static void addAttachment(kj::Vector<kj::String>& lines, kj::StringPtr boundaryId, EmailAttachment::Reader & attachment) {
-    lines.add(kj::str("--", boundaryId));
-    addHeader(lines, "Content-Type", attachment.getContentType());
-    addHeader(lines, "Content-Disposition", attachment.getContentDisposition());
-    addHeader(lines, "Content-Transfer-Encoding", "base64");
-    addHeader(lines, "Content-Id", attachment.getContentId());
-    lines.add(nullptr);
-
-    lines.add(base64Encode(attachment.getContent(), true));
+    return kj::READY_NOW;
   }
 };
 
@@ -1265,12 +1271,15 @@ private:
   SessionContextMap& sessionContextMap;
 };
 
-class UiViewImpl final: public UiView::Server {
+class UiViewImpl final: public HttpBridgeUiView::Server {
 public:
   explicit UiViewImpl(kj::NetworkAddress& serverAddress,
                       SessionContextMap& sessionContextMap,
-                      spk::BridgeConfig::Reader config)
-      : serverAddress(serverAddress), sessionContextMap(sessionContextMap), config(config) {}
+                      spk::BridgeConfig::Reader config,
+                      StaticFileServer& staticFiles,
+                      RequestLimiter& requestLimiter)
+      : serverAddress(serverAddress), sessionContextMap(sessionContextMap), config(config),
+        staticFiles(staticFiles), requestLimiter(requestLimiter) {}
 
   kj::Promise<void> getViewInfo(GetViewInfoContext context) override {
     context.setResults(config.getViewInfo());
@@ -1291,18 +1300,21 @@ public:
       auto sessionParams = params.getSessionParams().getAs<WebSession::Params>();
 
       context.getResults(capnp::MessageSize {2, 1}).setSession(
-          kj::heap<WebSessionImpl>(serverAddress, params.getUserInfo(), params.getContext(),
+          kj::heap<WebSessionImpl>(serverAddress, requestLimiter,
+                                   params.getUserInfo(), params.getContext(),
                                    sessionContextMap, kj::str(sessionIdCounter++),
                                    kj::heapString(sessionParams.getBasePath()),
                                    kj::heapString(sessionParams.getUserAgent()),
                                    kj::strArray(sessionParams.getAcceptableLanguages(), ","),
                                    kj::heapString("/"),
-                                   formatPermissions(userPermissions)));
+                                   formatPermissions(userPermissions),
+                                   staticFiles));
     } else if (sessionType == capnp::typeId<ApiSession>()) {
       auto userPermissions = params.getUserInfo().getPermissions();
 
       context.getResults(capnp::MessageSize {2, 1}).setSession(
-          kj::heap<WebSessionImpl>(serverAddress, params.getUserInfo(), params.getContext(),
+          kj::heap<WebSessionImpl>(serverAddress, requestLimiter,
+                                   params.getUserInfo(), params.getContext(),
                                    sessionContextMap, kj::str(sessionIdCounter++),
                                    kj::heapString(""), kj::heapString(""), kj::heapString(""),
                                    kj::heapString(config.getApiPath()),
@@ -1314,6 +1326,18 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> getRequestQueueStats(GetRequestQueueStatsContext context) override {
+    auto stats = requestLimiter.getStats();
+    auto results = context.getResults(capnp::MessageSize {8, 1}).initStats();
+    results.setInFlight(stats.inFlight);
+    results.setQueued(stats.queued);
+    results.setPeakQueued(stats.peakQueued);
+    results.setWaited(stats.waited);
+    results.setTotalWaitMicros(stats.totalWaitMicros);
+    results.setMaxWaitMicros(stats.maxWaitMicros);
+    return kj::READY_NOW;
+  }
+
 private:
   inline kj::String formatPermissions(capnp::List<bool>::Reader& userPermissions) {
     auto configPermissions = config.getViewInfo().getPermissions();
@@ -1329,6 +1353,8 @@ private:
   kj::NetworkAddress& serverAddress;
   SessionContextMap& sessionContextMap;
   spk::BridgeConfig::Reader config;
+  StaticFileServer& staticFiles;
+  RequestLimiter& requestLimiter;
   uint sessionIdCounter = 0;
   // SessionIds are assigned sequentially.
   // TODO(security): It might be useful to make these sessionIds more random, to reduce the chance
@@ -1405,6 +1431,11 @@ public:
   };
 
   kj::MainBuilder::Validity run() {
+    // Set up the Supervisor API connection, over shared memory if the supervisor offers it. Do
+    // this first: the supervisor waits for our answer before it will talk to us, and the shared
+    // memory must not be inherited by the app.
+    auto stream = connectShmTransport(ioContext, 3);
+
     pid_t child;
     KJ_SYSCALL(child = fork());
     if (child == 0) {
@@ -1470,12 +1501,13 @@ public:
       auto config = reader.getRoot<spk::BridgeConfig>();
 
       SessionContextMap sessionContextMap;
+      StaticFileServer staticFiles(config.getStaticPaths(),
+                                   raiiOpen("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      RequestLimiter requestLimiter(config.getMaxConcurrentRequests());
 
-      // Set up the Supervisor API socket.
-      auto stream = ioContext.lowLevelProvider->wrapSocketFd(3);
       capnp::TwoPartyVatNetwork network(*stream, capnp::rpc::twoparty::Side::CLIENT);
       auto rpcSystem = capnp::makeRpcServer(network,
-          kj::heap<UiViewImpl>(*address, sessionContextMap, config));
+          kj::heap<UiViewImpl>(*address, sessionContextMap, config, staticFiles, requestLimiter));
 
       // Get the SandstormApi by restoring a null SturdyRef.
       capnp::MallocMessageBuilder message;
@@ -0,0 +1,248 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "saved-caps.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <capnp/message.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test-util.h"
+#include "util.h"
+
+namespace sandstorm {
+namespace {
+
+class TestObject final: public AppPersistent<>::Server {
+public:
+  explicit TestObject(uint id): id(id) {}
+
+protected:
+  kj::Promise<void> save(SaveContext context) override {
+    context.getResults().getObjectId().setAs<capnp::Text>(kj::str("object-", id));
+    return kj::READY_NOW;
+  }
+
+private:
+  uint id;
+};
+
+class TestApp final: public MainView<>::Server {
+  // Hosts `TestObject`s, whose object IDs are "object-<n>".
+
+public:
+  uint restoreCount = 0;
+  kj::Vector<kj::String> dropped;
+
+  kj::Maybe<kj::Promise<void>> failNextRestore;
+  // If set, the next restore() waits for this promise and then fails.
+
+protected:
+  kj::Promise<void> restore(RestoreContext context) override {
+    ++restoreCount;
+    KJ_IF_MAYBE(promise, failNextRestore) {
+      auto result = promise->then([]() {
+        kj::throwFatalException(KJ_EXCEPTION(FAILED, "restore failed"));
+      });
+      failNextRestore = nullptr;
+      return kj::mv(result);
+    }
+    auto objectId = context.getParams().getObjectId().getAs<capnp::Text>();
+    KJ_ASSERT(objectId.startsWith("object-"));
+    auto id = KJ_ASSERT_NONNULL(parseUInt(objectId.slice(7), 10));
+    context.getResults().setCap(kj::heap<TestObject>(id));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> drop(DropContext context) override {
+    dropped.add(kj::heapString(context.getParams().getObjectId().getAs<capnp::Text>()));
+    return kj::READY_NOW;
+  }
+};
+
+kj::Own<SavedCapTable> openTable(kj::StringPtr logPath, MainView<>::Client app,
+                                 size_t liveCacheSize = SavedCapTable::DEFAULT_LIVE_CACHE_SIZE) {
+  return kj::heap<SavedCapTable>(logPath, raiiOpen("/dev/urandom", O_RDONLY | O_CLOEXEC),
+                                 kj::mv(app), liveCacheSize);
+}
+
+kj::Array<kj::byte> saveObject(SavedCapTable& table, uint id, kj::WaitScope& waitScope) {
+  capnp::MallocMessageBuilder label;
+  label.initRoot<Util::LocalizedText>().setDefaultText(kj::str("thing ", id));
+  return table.save(kj::heap<TestObject>(id), label.getRoot<Util::LocalizedText>())
+      .wait(waitScope);
+}
+
+kj::String objectIdOf(capnp::Capability::Client cap, kj::WaitScope& waitScope) {
+  auto response = cap.castAs<AppPersistent<>>().saveRequest().send().wait(waitScope);
+  return kj::heapString(response.getObjectId().getAs<capnp::Text>());
+}
+
+off_t fileSize(kj::StringPtr path) {
+  struct stat stats;
+  KJ_SYSCALL(stat(path.cStr(), &stats));
+  return stats.st_size;
+}
+
+KJ_TEST("SavedCapTable survives a restart") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  TempDir dir;
+  auto logPath = kj::str(dir.path, "/saved-caps");
+
+  auto appServer = kj::heap<TestApp>();
+  TestApp& testApp = *appServer;
+  MainView<>::Client app = kj::mv(appServer);
+
+  const uint COUNT = 5000;
+  kj::Vector<kj::Array<kj::byte>> tokens(COUNT);
+  {
+    auto table = openTable(logPath, app);
+    for (uint i = 0; i < COUNT; i++) {
+      tokens.add(saveObject(*table, i, waitScope));
+    }
+    KJ_EXPECT(table->size() == COUNT);
+
+    for (uint i = 0; i < COUNT; i += 2) {
+      table->drop(tokens[i]);
+      table->drop(tokens[i]);  // no-op
+    }
+    KJ_EXPECT(table->size() == COUNT / 2);
+
+    // Let the drop() calls reach the app before the table goes away.
+    turn(waitScope);
+  }
+
+  // Simulate a crash in the middle of an append.
+  {
+    auto fd = raiiOpen(logPath, O_WRONLY | O_APPEND);
+    capnp::word garbage[3];
+    memset(garbage, 0x5a, sizeof(garbage));
+    kj::FdOutputStream(fd.get()).write(garbage, sizeof(garbage));
+  }
+
+  {
+    auto table = openTable(logPath, app);
+    KJ_EXPECT(table->size() == COUNT / 2);
+
+    testApp.restoreCount = 0;
+    for (uint i = 1; i < COUNT; i += 2) {
+      KJ_EXPECT(objectIdOf(table->restore(tokens[i]), waitScope) == kj::str("object-", i));
+    }
+    KJ_EXPECT(testApp.restoreCount == COUNT / 2);
+
+    for (uint i = 0; i < COUNT; i += 2) {
+      KJ_EXPECT_THROW_MESSAGE("no such saved capability", table->restore(tokens[i]));
+    }
+  }
+
+  KJ_EXPECT(testApp.dropped.size() == COUNT / 2);
+  KJ_EXPECT(testApp.dropped[0] == "object-0");
+}
+
+KJ_TEST("SavedCapTable caches live capabilities") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  TempDir dir;
+  auto logPath = kj::str(dir.path, "/saved-caps");
+
+  auto appServer = kj::heap<TestApp>();
+  TestApp& testApp = *appServer;
+  auto table = openTable(logPath, kj::mv(appServer), 2);
+
+  auto token0 = saveObject(*table, 0, waitScope);
+  auto token1 = saveObject(*table, 1, waitScope);
+  auto token2 = saveObject(*table, 2, waitScope);
+
+  KJ_EXPECT(objectIdOf(table->restore(token0), waitScope) == "object-0");
+  KJ_EXPECT(objectIdOf(table->restore(token1), waitScope) == "object-1");
+  KJ_EXPECT(objectIdOf(table->restore(token0), waitScope) == "object-0");
+  KJ_EXPECT(testApp.restoreCount == 2);
+
+  // Evicts token1, the least recently used.
+  KJ_EXPECT(objectIdOf(table->restore(token2), waitScope) == "object-2");
+  KJ_EXPECT(objectIdOf(table->restore(token0), waitScope) == "object-0");
+  KJ_EXPECT(testApp.restoreCount == 3);
+  KJ_EXPECT(objectIdOf(table->restore(token1), waitScope) == "object-1");
+  KJ_EXPECT(testApp.restoreCount == 4);
+}
+
+KJ_TEST("SavedCapTable keeps a newer capability when an earlier restore fails") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  TempDir dir;
+  auto logPath = kj::str(dir.path, "/saved-caps");
+
+  auto appServer = kj::heap<TestApp>();
+  TestApp& testApp = *appServer;
+  auto table = openTable(logPath, kj::mv(appServer), 1);
+
+  auto token0 = saveObject(*table, 0, waitScope);
+  auto token1 = saveObject(*table, 1, waitScope);
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  testApp.failNextRestore = kj::mv(paf.promise);
+  auto failing = table->restore(token0);
+  turn(waitScope);
+
+  // Evict token0 while its restore is still outstanding, then restore it again.
+  KJ_EXPECT(objectIdOf(table->restore(token1), waitScope) == "object-1");
+  KJ_EXPECT(objectIdOf(table->restore(token0), waitScope) == "object-0");
+  KJ_EXPECT(testApp.restoreCount == 3);
+
+  // The first restore's failure must not evict the second's capability.
+  paf.fulfiller->fulfill();
+  turn(waitScope);
+  KJ_EXPECT(objectIdOf(table->restore(token0), waitScope) == "object-0");
+  KJ_EXPECT(testApp.restoreCount == 3);
+}
+
+KJ_TEST("SavedCapTable compacts its log") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  TempDir dir;
+  auto logPath = kj::str(dir.path, "/saved-caps");
+  auto table = openTable(logPath, kj::heap<TestApp>());
+
+  const uint COUNT = 3000;
+  kj::Vector<kj::Array<kj::byte>> tokens(COUNT);
+  for (uint i = 0; i < COUNT; i++) {
+    tokens.add(saveObject(*table, i, waitScope));
+  }
+  off_t fullSize = fileSize(logPath);
+
+  for (uint i = 0; i < COUNT - 10; i++) {
+    table->drop(tokens[i]);
+  }
+
+  KJ_EXPECT(table->size() == 10);
+  KJ_EXPECT(fileSize(logPath) < fullSize / 4, fileSize(logPath), fullSize);
+
+  for (uint i = COUNT - 10; i < COUNT; i++) {
+    KJ_EXPECT(objectIdOf(table->restore(tokens[i]), waitScope) == kj::str("object-", i));
+  }
+
+  // Saving after compaction appends to the new log.
+  auto token = saveObject(*table, 12345, waitScope);
+  table = nullptr;
+  table = openTable(logPath, kj::heap<TestApp>());
+  KJ_EXPECT(table->size() == 11);
+  KJ_EXPECT(objectIdOf(table->restore(token), waitScope) == "object-12345");
+}
+
+}  // namespace
+}  // namespace sandstorm
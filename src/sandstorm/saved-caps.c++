@@ -0,0 +1,242 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "saved-caps.h"
+#include <kj/debug.h>
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <sandstorm/supervisor.capnp.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace sandstorm {
+
+static const size_t TOKEN_SIZE = 16;
+
+static const size_t COMPACT_MIN_DEAD_RECORDS = 1024;
+// Don't bother rewriting the log until at least this many records are dead.
+
+constexpr size_t SavedCapTable::DEFAULT_LIVE_CACHE_SIZE;
+
+SavedCapTable::SavedCapTable(kj::StringPtr logPath, kj::AutoCloseFd randomFd,
+                             MainView<>::Client app, size_t liveCacheSize)
+    : logPath(kj::heapString(logPath)),
+      logFd(raiiOpen(logPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)),
+      randomFd(kj::mv(randomFd)),
+      app(kj::mv(app)),
+      liveCacheSize(kj::max(liveCacheSize, (size_t)1)),
+      tasks(*this) {
+  load();
+  maybeCompact();
+}
+
+SavedCapTable::~SavedCapTable() noexcept(false) {}
+
+kj::Promise<kj::Array<kj::byte>> SavedCapTable::save(
+    capnp::Capability::Client cap, Util::LocalizedText::Reader label) {
+  // Copy the label now, since the caller's params may be gone by the time the app responds.
+  auto message = kj::heap<capnp::MallocMessageBuilder>();
+  message->initRoot<SavedCapRecord>().initSaved().setLabel(label);
+
+  return cap.castAs<AppPersistent<>>().saveRequest().send()
+      .then([this, KJ_MVCAP(message)](
+          capnp::Response<AppPersistent<>::SaveResults>&& response) mutable {
+    auto token = kj::heapArray<kj::byte>(TOKEN_SIZE);
+    kj::FdInputStream(randomFd.get()).read(token.begin(), token.size());
+
+    auto record = message->getRoot<SavedCapRecord>();
+    record.setToken(token);
+    record.getSaved().getObjectId().set(response.getObjectId());
+    auto words = capnp::messageToFlatArray(*message);
+    append(words);
+
+    Entry entry;
+    entry.token = kj::heapString(token.asChars());
+    entry.record = kj::mv(words);
+    kj::StringPtr key = entry.token;
+    KJ_ASSERT(entries.insert(std::make_pair(key, kj::mv(entry))).second,
+              "random token collision?");
+
+    return kj::mv(token);
+  });
+}
+
+capnp::Capability::Client SavedCapTable::restore(kj::ArrayPtr<const kj::byte> token) {
+  auto key = kj::heapString(token.asChars());
+  auto iter = entries.find(key);
+  KJ_REQUIRE(iter != entries.end(), "no such saved capability");
+  Entry& entry = iter->second;
+
+  KJ_IF_MAYBE(cap, entry.live) {
+    lru.splice(lru.begin(), lru, entry.lruPos);
+    return *cap;
+  }
+
+  capnp::FlatArrayMessageReader reader(entry.record);
+  auto request = app.restoreRequest();
+  request.getObjectId().set(reader.getRoot<SavedCapRecord>().getSaved().getObjectId());
+  auto promise = request.send();
+  capnp::Capability::Client cap = promise.getCap();
+
+  // Don't keep serving a broken capability from the cache if the app failed to restore it; the
+  // next restore() should try again. By the time this one fails, it may have been evicted and the
+  // token restored afresh, in which case the newer capability must stay.
+  uint64_t restoreId = ++restoreCount;
+  tasks.add(promise.then([](capnp::Response<MainView<>::RestoreResults>&&) {},
+      [this, KJ_MVCAP(key), restoreId](kj::Exception&& exception) {
+    auto iter = entries.find(key);
+    if (iter != entries.end() && iter->second.live != nullptr &&
+        iter->second.restoreId == restoreId) {
+      forgetLive(iter->second);
+    }
+  }));
+
+  entry.live = cap;
+  entry.restoreId = restoreId;
+  lru.push_front(&entry);
+  entry.lruPos = lru.begin();
+  if (lru.size() > liveCacheSize) {
+    forgetLive(*lru.back());
+  }
+
+  return cap;
+}
+
+void SavedCapTable::drop(kj::ArrayPtr<const kj::byte> token) {
+  auto iter = entries.find(kj::heapString(token.asChars()));
+  if (iter == entries.end()) return;
+  Entry& entry = iter->second;
+
+  {
+    capnp::FlatArrayMessageReader reader(entry.record);
+    auto request = app.dropRequest();
+    request.getObjectId().set(reader.getRoot<SavedCapRecord>().getSaved().getObjectId());
+    tasks.add(request.send().then([](capnp::Response<MainView<>::DropResults>&&) {},
+        [](kj::Exception&& exception) {
+      // Apps needn't implement drop().
+      if (exception.getType() != kj::Exception::Type::UNIMPLEMENTED) {
+        kj::throwFatalException(kj::mv(exception));
+      }
+    }));
+  }
+
+  capnp::MallocMessageBuilder message;
+  auto record = message.initRoot<SavedCapRecord>();
+  record.setToken(token);
+  record.setDropped();
+  append(capnp::messageToFlatArray(message));
+
+  if (entry.live != nullptr) {
+    forgetLive(entry);
+  }
+  entries.erase(iter);
+
+  // Both the saved record and the drop record are now dead.
+  deadRecords += 2;
+  maybeCompact();
+}
+
+void SavedCapTable::load() {
+  struct stat stats;
+  KJ_SYSCALL(fstat(logFd, &stats));
+  auto buffer = kj::heapArray<capnp::word>(stats.st_size / sizeof(capnp::word));
+  kj::FdInputStream(logFd.get()).read(buffer.begin(), buffer.size() * sizeof(capnp::word));
+
+  kj::ArrayPtr<const capnp::word> remaining = buffer;
+  while (remaining.size() > 0) {
+    const capnp::word* end = remaining.begin();
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      capnp::FlatArrayMessageReader reader(remaining);
+      auto record = reader.getRoot<SavedCapRecord>();
+      auto key = kj::heapString(record.getToken().asChars());
+
+      auto iter = entries.find(key);
+      if (iter != entries.end()) {
+        entries.erase(iter);
+        ++deadRecords;
+      }
+
+      switch (record.which()) {
+        case SavedCapRecord::SAVED: {
+          Entry entry;
+          entry.token = kj::mv(key);
+          entry.record = kj::heapArray<capnp::word>(
+              kj::arrayPtr(remaining.begin(), reader.getEnd()));
+          kj::StringPtr keyPtr = entry.token;
+          entries.insert(std::make_pair(keyPtr, kj::mv(entry)));
+          break;
+        }
+        case SavedCapRecord::DROPPED:
+          ++deadRecords;
+          break;
+      }
+
+      end = reader.getEnd();
+    })) {
+      // Most likely we crashed partway through appending a record. Anything after it is lost.
+      KJ_LOG(WARNING, "saved capability log is corrupt; discarding its tail", logPath, *exception);
+      break;
+    }
+
+    remaining = kj::arrayPtr(end, remaining.end());
+  }
+
+  off_t goodSize = (remaining.begin() - buffer.begin()) * sizeof(capnp::word);
+  if (goodSize != stats.st_size) {
+    KJ_SYSCALL(ftruncate(logFd, goodSize));
+  }
+}
+
+void SavedCapTable::append(kj::ArrayPtr<const capnp::word> record) {
+  // Not fsync()ed: a token is only useful to the app if the app also stored it somewhere, and
+  // syncing every save() would make saving thousands of capabilities unbearably slow. The log
+  // survives an app or supervisor crash either way.
+  kj::FdOutputStream(logFd.get()).write(record.begin(), record.size() * sizeof(capnp::word));
+}
+
+void SavedCapTable::maybeCompact() {
+  if (deadRecords < COMPACT_MIN_DEAD_RECORDS || deadRecords <= entries.size()) return;
+
+  auto tmpPath = kj::str(logPath, ".tmp");
+  auto newFd = raiiOpen(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+  {
+    kj::FdOutputStream fdStream(newFd.get());
+    kj::BufferedOutputStreamWrapper out(fdStream);
+    for (auto& entry: entries) {
+      auto& record = entry.second.record;
+      out.write(record.begin(), record.size() * sizeof(capnp::word));
+    }
+    out.flush();
+  }
+
+  // Sync before replacing the old log, so that a crash leaves one or the other intact.
+  KJ_SYSCALL(fsync(newFd));
+  KJ_SYSCALL(rename(tmpPath.cStr(), logPath.cStr()));
+  logFd = kj::mv(newFd);
+  deadRecords = 0;
+}
+
+void SavedCapTable::forgetLive(Entry& entry) {
+  entry.live = nullptr;
+  lru.erase(entry.lruPos);
+}
+
+void SavedCapTable::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, "saved capability call to app failed", exception);
+}
+
+}  // namespace sandstorm
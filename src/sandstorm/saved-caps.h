@@ -0,0 +1,112 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_SAVED_CAPS_H_
+#define SANDSTORM_SAVED_CAPS_H_
+
+#include <kj/async.h>
+#include <kj/io.h>
+#include <capnp/capability.h>
+#include <sandstorm/grain.capnp.h>
+#include <map>
+#include <list>
+
+namespace sandstorm {
+
+class SavedCapTable: private kj::TaskSet::ErrorHandler {
+  // Implements `SandstormApi.save()`, `restore()`, and `drop()` for capabilities hosted by the app
+  // itself (i.e. implementing `AppPersistent`).
+  //
+  // Saved capabilities are recorded in an append-only log of `SavedCapRecord`s, which is read
+  // into an in-memory index at startup, so restore() never reads the disk. The log is rewritten
+  // without its dead records once they outnumber the live ones. Restored capabilities are kept in
+  // an LRU cache, so restoring a recently-used token doesn't even call back into the app.
+
+public:
+  static constexpr size_t DEFAULT_LIVE_CACHE_SIZE = 1024;
+
+  SavedCapTable(kj::StringPtr logPath, kj::AutoCloseFd randomFd, MainView<>::Client app,
+                size_t liveCacheSize = DEFAULT_LIVE_CACHE_SIZE);
+  // `logPath` is created if it doesn't exist. `randomFd` is /dev/urandom, which is taken as a
+  // parameter because the supervisor can't open it once it has chrooted. `app` is used to
+  // restore and drop objects.
+
+  KJ_DISALLOW_COPY(SavedCapTable);
+  ~SavedCapTable() noexcept(false);
+
+  kj::Promise<kj::Array<kj::byte>> save(capnp::Capability::Client cap,
+                                        Util::LocalizedText::Reader label);
+  // Calls `AppPersistent.save()` on `cap` and records the result under a new random token.
+
+  capnp::Capability::Client restore(kj::ArrayPtr<const kj::byte> token);
+  // Throws if the token is unknown.
+
+  void drop(kj::ArrayPtr<const kj::byte> token);
+  // Forgets the token and tells the app to drop the object. Does nothing if the token is unknown.
+
+  size_t size() const { return entries.size(); }
+
+private:
+  struct Entry {
+    kj::String token;
+    // The token's bytes; also the map key.
+
+    kj::Array<capnp::word> record;
+    // The entry's `SavedCapRecord`, serialized exactly as it appears in the log.
+
+    kj::Maybe<capnp::Capability::Client> live;
+    // Non-null while in the live cache.
+
+    uint64_t restoreId = 0;
+    // Which restore() produced `live`, so that a late failure of an earlier one can be told apart.
+
+    std::list<Entry*>::iterator lruPos;
+    // Position in `lru`, if `live` is non-null.
+
+    Entry() = default;
+    Entry(Entry&&) = default;
+    Entry& operator=(Entry&&) = default;
+    KJ_DISALLOW_COPY(Entry);
+  };
+
+  kj::String logPath;
+  kj::AutoCloseFd logFd;
+  kj::AutoCloseFd randomFd;
+  MainView<>::Client app;
+  size_t liveCacheSize;
+
+  std::map<kj::StringPtr, Entry> entries;
+  std::list<Entry*> lru;
+  // Entries with live capabilities, most recently used first.
+
+  size_t deadRecords = 0;
+  // Records in the log that have been superseded.
+
+  uint64_t restoreCount = 0;
+  // Restores sent to the app so far; numbers them for `Entry::restoreId`.
+
+  kj::TaskSet tasks;
+
+  void load();
+  void append(kj::ArrayPtr<const capnp::word> record);
+  void maybeCompact();
+  void forgetLive(Entry& entry);
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_SAVED_CAPS_H_
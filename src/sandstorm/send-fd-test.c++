@@ -0,0 +1,177 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "send-fd.h"
+#include "util.h"
+#include <kj/test.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <thread>
+
+namespace sandstorm {
+namespace {
+
+struct SocketPair {
+  kj::AutoCloseFd a;
+  kj::AutoCloseFd b;
+
+  SocketPair() {
+    int fds[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    a = kj::AutoCloseFd(fds[0]);
+    b = kj::AutoCloseFd(fds[1]);
+  }
+};
+
+struct Pipe {
+  kj::AutoCloseFd readEnd;
+  kj::AutoCloseFd writeEnd;
+
+  Pipe() {
+    int fds[2];
+    KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+    readEnd = kj::AutoCloseFd(fds[0]);
+    writeEnd = kj::AutoCloseFd(fds[1]);
+  }
+};
+
+bool sameFile(int a, int b) {
+  struct stat statsA, statsB;
+  KJ_SYSCALL(fstat(a, &statsA));
+  KJ_SYSCALL(fstat(b, &statsB));
+  return statsA.st_dev == statsB.st_dev && statsA.st_ino == statsB.st_ino;
+}
+
+uint countOpenFds() {
+  return listDirectory("/proc/self/fd").size();
+}
+
+KJ_TEST("sendFds/receiveFds with payload") {
+  SocketPair sockets;
+  Pipe pipes[3];
+
+  int toSend[3] = { pipes[0].writeEnd, pipes[1].writeEnd, pipes[2].writeEnd };
+  kj::StringPtr payload = "hello";
+  sendFds(sockets.a, kj::arrayPtr(toSend, 3), payload.asBytes());
+
+  kj::byte received[5];
+  auto fds = receiveFds(sockets.b, 3, kj::arrayPtr(received, sizeof(received)));
+  KJ_ASSERT(fds.size() == 3);
+  KJ_EXPECT(memcmp(received, "hello", 5) == 0);
+
+  for (uint i = 0; i < 3; i++) {
+    KJ_EXPECT(sameFile(fds[i], pipes[i].writeEnd), i);
+
+    // Received FDs are close-on-exec.
+    int flags;
+    KJ_SYSCALL(flags = fcntl(fds[i], F_GETFD));
+    KJ_EXPECT(flags & FD_CLOEXEC, i);
+  }
+
+  // The FDs actually work.
+  kj::FdOutputStream(fds[1].get()).write("x", 1);
+  char c;
+  kj::FdInputStream(pipes[1].readEnd.get()).read(&c, 1);
+  KJ_EXPECT(c == 'x');
+}
+
+KJ_TEST("sendFds/receiveFds without payload") {
+  SocketPair sockets;
+  Pipe pipe;
+
+  int toSend[1] = { pipe.readEnd };
+  sendFds(sockets.a, kj::arrayPtr(toSend, 1));
+  auto fds = receiveFds(sockets.b, 1);
+  KJ_ASSERT(fds.size() == 1);
+  KJ_EXPECT(sameFile(fds[0], pipe.readEnd));
+}
+
+KJ_TEST("sendFds/receiveFds with a payload larger than the socket buffer") {
+  SocketPair sockets;
+  Pipe pipe;
+
+  auto payload = kj::heapArray<kj::byte>(4 << 20);
+  for (size_t i = 0; i < payload.size(); i++) {
+    payload[i] = i * 7;
+  }
+
+  std::thread sender([&]() {
+    int toSend[2] = { pipe.readEnd, pipe.writeEnd };
+    sendFds(sockets.a, kj::arrayPtr(toSend, 2), payload);
+  });
+  KJ_DEFER(sender.join());
+
+  auto received = kj::heapArray<kj::byte>(payload.size());
+  auto fds = receiveFds(sockets.b, 2, received);
+  KJ_ASSERT(fds.size() == 2);
+  KJ_EXPECT(sameFile(fds[0], pipe.readEnd));
+  KJ_EXPECT(sameFile(fds[1], pipe.writeEnd));
+  KJ_EXPECT(memcmp(received.begin(), payload.begin(), payload.size()) == 0);
+}
+
+KJ_TEST("receiveFds rejects and closes unexpected FDs") {
+  SocketPair sockets;
+  Pipe pipe;
+  uint baseline = countOpenFds();
+
+  {
+    // Too many.
+    int toSend[3] = { pipe.readEnd, pipe.writeEnd, pipe.readEnd };
+    sendFds(sockets.a, kj::arrayPtr(toSend, 3));
+    KJ_EXPECT_THROW_MESSAGE("wrong number of FDs", receiveFds(sockets.b, 2));
+    KJ_EXPECT(countOpenFds() == baseline);
+  }
+
+  {
+    // Too few.
+    int toSend[1] = { pipe.readEnd };
+    sendFds(sockets.a, kj::arrayPtr(toSend, 1));
+    KJ_EXPECT_THROW_MESSAGE("wrong number of FDs", receiveFds(sockets.b, 2));
+    KJ_EXPECT(countOpenFds() == baseline);
+  }
+
+  {
+    // No FDs with the first bytes of the payload.
+    kj::FdOutputStream(sockets.a.get()).write("ab", 2);
+    kj::byte received[2];
+    KJ_EXPECT_THROW_MESSAGE("wrong number of FDs",
+        receiveFds(sockets.b, 1, kj::arrayPtr(received, sizeof(received))));
+    KJ_EXPECT(countOpenFds() == baseline);
+  }
+
+  {
+    // More FDs arriving partway through the payload.
+    int toSend[1] = { pipe.readEnd };
+    sendFds(sockets.a, kj::arrayPtr(toSend, 1), kj::StringPtr("ab").asBytes());
+    sendFds(sockets.a, kj::arrayPtr(toSend, 1), kj::StringPtr("cd").asBytes());
+
+    kj::byte received[4];
+    KJ_EXPECT_THROW_MESSAGE("unexpected FDs",
+        receiveFds(sockets.b, 1, kj::arrayPtr(received, sizeof(received))));
+    KJ_EXPECT(countOpenFds() == baseline);
+  }
+
+  {
+    // Premature EOF.
+    sockets.a = nullptr;
+    KJ_EXPECT_THROW_MESSAGE("premature EOF", receiveFds(sockets.b, 1));
+  }
+}
+
+}  // namespace
+}  // namespace sandstorm
@@ -16,6 +16,7 @@
 
 #include "send-fd.h"
 #include <kj/debug.h>
+#include <kj/vector.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -117,4 +118,122 @@ kj::AutoCloseFd receiveFd(int sockFd,
   }
 }
 
+static constexpr size_t MAX_FDS_PER_MESSAGE = 253;
+// Linux's SCM_MAX_FD, which isn't exported to userspace.
+
+void sendFds(int sendOn, kj::ArrayPtr<const int> fdsToSend,
+             kj::ArrayPtr<const kj::byte> payload) {
+  KJ_REQUIRE(fdsToSend.size() > 0, "use write() to send data without FDs");
+  KJ_REQUIRE(fdsToSend.size() <= MAX_FDS_PER_MESSAGE, "too many FDs for one message",
+             fdsToSend.size());
+
+  kj::byte nul = 0;
+  if (payload.size() == 0) {
+    payload = kj::arrayPtr(&nul, 1);
+  }
+
+  struct msghdr msg;
+  struct iovec iov;
+  union {
+    struct cmsghdr cmsg;
+    char cmsgSpace[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+  };
+  memset(&msg, 0, sizeof(msg));
+  memset(&iov, 0, sizeof(iov));
+  memset(cmsgSpace, 0, sizeof(cmsgSpace));
+
+  iov.iov_base = const_cast<kj::byte*>(payload.begin());
+  iov.iov_len = payload.size();
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  msg.msg_control = &cmsg;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdsToSend.size());
+
+  cmsg.cmsg_len = CMSG_LEN(sizeof(int) * fdsToSend.size());
+  cmsg.cmsg_level = SOL_SOCKET;
+  cmsg.cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(&cmsg), fdsToSend.begin(), sizeof(int) * fdsToSend.size());
+
+  ssize_t n;
+  KJ_SYSCALL(n = sendmsg(sendOn, &msg, MSG_NOSIGNAL));
+
+  // The FDs went with the first chunk. A stream socket may accept only part of a large payload,
+  // so write the rest normally.
+  if (size_t(n) < payload.size()) {
+    kj::FdOutputStream(sendOn).write(payload.begin() + n, payload.size() - n);
+  }
+}
+
+kj::Array<kj::AutoCloseFd> receiveFds(int sockFd, size_t fdCount,
+                                      kj::ArrayPtr<kj::byte> payload) {
+  KJ_REQUIRE(fdCount > 0, "use read() to receive data without FDs");
+  KJ_REQUIRE(fdCount <= MAX_FDS_PER_MESSAGE, "too many FDs for one message", fdCount);
+
+  kj::byte nul;
+  bool expectNul = payload.size() == 0;
+  if (expectNul) {
+    payload = kj::arrayPtr(&nul, 1);
+  }
+
+  // Everything that arrives goes in here first, so that it is closed if we throw.
+  kj::Vector<kj::AutoCloseFd> fds(fdCount);
+
+  size_t received = 0;
+  while (received < payload.size()) {
+    struct msghdr msg;
+    struct iovec iov;
+    union {
+      struct cmsghdr cmsg;
+      char cmsgSpace[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+    };
+    memset(&msg, 0, sizeof(msg));
+    memset(&iov, 0, sizeof(iov));
+
+    iov.iov_base = payload.begin() + received;
+    iov.iov_len = payload.size() - received;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // Always offer room for the maximum number of FDs, so that a sender who sends too many
+    // doesn't cause the kernel to silently drop some; we'd rather see them all and reject the
+    // message.
+    msg.msg_control = &cmsg;
+    msg.msg_controllen = sizeof(cmsgSpace);
+
+    ssize_t n;
+    KJ_SYSCALL(n = recvmsg(sockFd, &msg, MSG_CMSG_CLOEXEC));
+    KJ_REQUIRE(n > 0, "premature EOF while waiting for FDs");
+
+    size_t fdsBefore = fds.size();
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+        size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const kj::byte* data = CMSG_DATA(c);
+        for (size_t i = 0; i < count; i++) {
+          int fd;
+          memcpy(&fd, data + i * sizeof(int), sizeof(int));
+          fds.add(kj::AutoCloseFd(fd));
+        }
+      }
+    }
+
+    KJ_REQUIRE(!(msg.msg_flags & MSG_CTRUNC),
+               "control message truncated; some FDs sent to us were dropped");
+    if (received == 0) {
+      KJ_REQUIRE(fds.size() == fdCount, "received wrong number of FDs", fds.size(), fdCount);
+    } else {
+      KJ_REQUIRE(fds.size() == fdsBefore, "received unexpected FDs in the middle of a payload");
+    }
+
+    received += n;
+  }
+
+  if (expectNul) {
+    KJ_REQUIRE(nul == 0, "expected NUL byte with FDs");
+  }
+
+  return fds.releaseAsArray();
+}
+
 }  // namespace sandstorm
@@ -40,6 +40,21 @@ kj::AutoCloseFd receiveFd(int sockFd,
 //
 // TODO(cleanup): This function belongs in KJ.
 
+void sendFds(int sendOn, kj::ArrayPtr<const int> fdsToSend,
+             kj::ArrayPtr<const kj::byte> payload = nullptr);
+// Sends all of `fdsToSend` in a single SCM_RIGHTS message attached to the first bytes of
+// `payload`. If `payload` is empty, a single NUL byte is sent instead, since at least one byte
+// must accompany the FDs. The receiver must call receiveFds() expecting the same number of FDs
+// and the same payload size.
+
+kj::Array<kj::AutoCloseFd> receiveFds(int sockFd, size_t fdCount,
+                                      kj::ArrayPtr<kj::byte> payload = nullptr);
+// Receives exactly `fdCount` FDs and exactly `payload.size()` bytes of payload (or the single NUL
+// byte, if `payload` is empty) as sent by sendFds(). Throws if the FDs don't arrive together with
+// the first byte, if a different number arrive, if the kernel truncated the control message
+// (MSG_CTRUNC), or on premature EOF. Any FDs received along the way are closed before throwing,
+// so unexpected FDs are never leaked into the process.
+
 }  // namespace sandstorm
 
 #endif // SANDSTORM_SEND_FD_H_
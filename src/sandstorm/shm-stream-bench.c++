@@ -0,0 +1,224 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <capnp/rpc-twoparty.h>
+#include <capnp/rpc.capnp.h>
+#include <sandstorm/util.capnp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "shm-stream.h"
+#include "util.h"
+
+namespace sandstorm {
+
+class ShmStreamBench {
+  // A benchmark program comparing a Cap'n Proto connection between two processes over a Unix
+  // socket, as the supervisor and app normally talk, against the same over the shared-memory
+  // transport. Measures the round-trip time of small calls and the throughput of large ones.
+
+public:
+  ShmStreamBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Shared-memory stream benchmark, unknown version",
+          "Makes <calls> small ByteStream.write() calls one at a time, then streams <size> MiB "
+          "through ByteStream.write(), to a child process, first over a Unix socket and then "
+          "over shared memory, and reports the latency and throughput of each.")
+        .addOptionWithArg({'s', "size"}, KJ_BIND_METHOD(*this, setSize), "<size>",
+                          "MiB to send in each mode. Default: 256.")
+        .addOptionWithArg({'c', "calls"}, KJ_BIND_METHOD(*this, setCalls), "<calls>",
+                          "Round trips to time in each mode. Default: 20000.")
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  size_t size = 256ull << 20;
+  uint calls = 20000;
+
+  static constexpr size_t CHUNK_SIZE = 65536;
+  static constexpr uint WINDOW = 8;
+  // Bulk writes are made as this many concurrent chains of CHUNK_SIZE writes.
+
+  struct Result {
+    uint64_t latencyTime;
+    uint64_t throughputTime;
+  };
+
+  kj::MainBuilder::Validity setSize(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n == 0) return "Must be positive.";
+      size = static_cast<size_t>(*n) << 20;
+      return true;
+    } else {
+      return "Not a number.";
+    }
+  }
+
+  kj::MainBuilder::Validity setCalls(kj::StringPtr arg) {
+    KJ_IF_MAYBE(n, parseUInt(arg, 10)) {
+      if (*n == 0) return "Must be positive.";
+      calls = *n;
+      return true;
+    } else {
+      return "Not a number.";
+    }
+  }
+
+  kj::MainBuilder::Validity run() {
+    Result socket = runMode(false);
+    Result shm = runMode(true);
+
+    report("socket", socket);
+    report("shared memory", shm);
+    context.exitInfo(kj::str(
+        "shm/socket throughput: ",
+        (double)socket.throughputTime / kj::max(shm.throughputTime, (uint64_t)1),
+        ", shm/socket round trips per second: ",
+        (double)socket.latencyTime / kj::max(shm.latencyTime, (uint64_t)1)));
+  }
+
+  Result runMode(bool useShm) {
+    // Each mode runs in its own pair of processes, forked before either sets up an event loop.
+
+    int fds[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+    kj::AutoCloseFd sockets[2] = { kj::AutoCloseFd(fds[0]), kj::AutoCloseFd(fds[1]) };
+    kj::Maybe<ShmStreamFds> shmFds;
+    if (useShm) shmFds = newShmStreamFds();
+
+    pid_t child;
+    KJ_SYSCALL(child = fork());
+    if (child == 0) {
+      sockets[0] = nullptr;
+      runServer(kj::mv(sockets[1]), kj::mv(shmFds));
+    }
+    KJ_DEFER(waitpid(child, nullptr, 0));
+    sockets[1] = nullptr;
+
+    auto io = kj::setupAsyncIo();
+    auto stream = openStream(io, kj::mv(sockets[0]), kj::mv(shmFds), 0);
+    capnp::TwoPartyVatNetwork network(*stream, capnp::rpc::twoparty::Side::CLIENT);
+    auto rpcSystem = capnp::makeRpcClient(network);
+
+    capnp::MallocMessageBuilder message;
+    auto vatId = message.initRoot<capnp::rpc::twoparty::VatId>();
+    vatId.setSide(capnp::rpc::twoparty::Side::SERVER);
+    ByteStream::Client client = rpcSystem.bootstrap(vatId).castAs<ByteStream>();
+
+    // Warm up, and make sure the bootstrap has resolved.
+    writeChain(client, nullptr, 1, 0).wait(io.waitScope);
+
+    Result result;
+    auto small = kj::heapArray<kj::byte>(16);
+    memset(small.begin(), 0, small.size());
+    uint64_t start = now();
+    writeChain(client, small, calls, 0).wait(io.waitScope);
+    result.latencyTime = now() - start;
+
+    auto chunk = kj::heapArray<kj::byte>(CHUNK_SIZE);
+    for (size_t i = 0; i < chunk.size(); i++) {
+      chunk[i] = i * 31;
+    }
+    size_t chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    start = now();
+    auto promises = kj::heapArrayBuilder<kj::Promise<void>>(WINDOW);
+    for (uint i = 0; i < WINDOW; i++) {
+      promises.add(writeChain(client, chunk, chunks / WINDOW + (i < chunks % WINDOW), 0));
+    }
+    kj::joinPromises(promises.finish()).wait(io.waitScope);
+    result.throughputTime = now() - start;
+
+    return result;
+  }
+
+  [[noreturn]] void runServer(kj::AutoCloseFd socket, kj::Maybe<ShmStreamFds> shmFds) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      auto io = kj::setupAsyncIo();
+      auto stream = openStream(io, kj::mv(socket), kj::mv(shmFds), 1);
+      capnp::TwoPartyVatNetwork network(*stream, capnp::rpc::twoparty::Side::SERVER);
+      auto rpcSystem = capnp::makeRpcServer(network, kj::heap<DiscardingByteStream>());
+      network.onDisconnect().wait(io.waitScope);
+    })) {
+      KJ_LOG(ERROR, *exception);
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  static kj::Own<kj::AsyncIoStream> openStream(kj::AsyncIoContext& io, kj::AutoCloseFd socket,
+                                               kj::Maybe<ShmStreamFds> shmFds, uint side) {
+    auto stream = io.lowLevelProvider->wrapSocketFd(socket.release(),
+        kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+        kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+    KJ_IF_MAYBE(fds, shmFds) {
+      return newShmStream(io.unixEventPort, kj::mv(*fds), side, kj::mv(stream));
+    } else {
+      return kj::mv(stream);
+    }
+  }
+
+  class DiscardingByteStream final: public ByteStream::Server {
+  protected:
+    kj::Promise<void> write(WriteContext context) override {
+      return kj::READY_NOW;
+    }
+
+    kj::Promise<void> done(DoneContext context) override {
+      return kj::READY_NOW;
+    }
+  };
+
+  static kj::Promise<void> writeChain(ByteStream::Client& client,
+                                      kj::ArrayPtr<const kj::byte> data, size_t count, size_t i) {
+    // Makes `count` calls to `write(data)`, each after the previous one returns.
+
+    if (i == count) return kj::READY_NOW;
+    auto request = client.writeRequest(capnp::MessageSize { data.size() / 8 + 8, 0 });
+    request.setData(data);
+    return request.send().then([&client, data, count, i](auto&&) {
+      return writeChain(client, data, count, i + 1);
+    });
+  }
+
+  static uint64_t now() {
+    struct timespec ts;
+    KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+  }
+
+  void report(kj::StringPtr mode, Result result) {
+    context.warning(kj::str(mode, ": ",
+        calls, " round trips in ", result.latencyTime / 1000, "ms (",
+        result.latencyTime * 1000 / calls, "ns each), ",
+        size >> 20, " MiB in ", result.throughputTime / 1000, "ms (",
+        (size >> 20) * 1000000ull / kj::max(result.throughputTime, (uint64_t)1), " MiB/s)"));
+  }
+};
+
+constexpr size_t ShmStreamBench::CHUNK_SIZE;
+constexpr uint ShmStreamBench::WINDOW;
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::ShmStreamBench)
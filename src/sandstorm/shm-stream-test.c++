@@ -0,0 +1,221 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shm-stream.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "test-util.h"
+
+namespace sandstorm {
+namespace {
+
+kj::AutoCloseFd dupFd(int fd) {
+  int result;
+  KJ_SYSCALL(result = fcntl(fd, F_DUPFD_CLOEXEC, 0));
+  return kj::AutoCloseFd(result);
+}
+
+ShmStreamFds dupFds(const ShmStreamFds& fds) {
+  ShmStreamFds result;
+  result.memory = dupFd(fds.memory);
+  result.doorbells[0] = dupFd(fds.doorbells[0]);
+  result.doorbells[1] = dupFd(fds.doorbells[1]);
+  return result;
+}
+
+struct StreamPair {
+  kj::Own<kj::AsyncIoStream> ends[2];
+
+  StreamPair(kj::AsyncIoContext& io, size_t ringSize) {
+    auto fds = newShmStreamFds(ringSize);
+    auto lifelines = io.provider->newTwoWayPipe();
+    ends[1] = newShmStream(io.unixEventPort, dupFds(fds), 1, kj::mv(lifelines.ends[1]));
+    ends[0] = newShmStream(io.unixEventPort, kj::mv(fds), 0, kj::mv(lifelines.ends[0]));
+  }
+};
+
+kj::Promise<void> writeInChunks(kj::AsyncOutputStream& stream, kj::ArrayPtr<const kj::byte> data,
+                                size_t chunkSize) {
+  if (data.size() == 0) return kj::READY_NOW;
+  size_t n = kj::min(chunkSize, data.size());
+  return stream.write(data.begin(), n).then([&stream, data, chunkSize, n]() {
+    return writeInChunks(stream, data.slice(n, data.size()), chunkSize);
+  });
+}
+
+KJ_TEST("shared-memory stream carries data both ways through a small ring") {
+  auto io = kj::setupAsyncIo();
+  const size_t RING_SIZE = 4096;
+  StreamPair pair(io, RING_SIZE);
+
+  // Several times the ring size in each direction at once, in chunks that don't divide it, so
+  // that writers block on a full ring and copies wrap around its end.
+  const size_t SIZE = RING_SIZE * 50 + 123;
+  auto forward = makeContent(SIZE, 1);
+  auto backward = makeContent(SIZE, 2);
+  auto forwardReceived = kj::heapArray<kj::byte>(SIZE);
+  auto backwardReceived = kj::heapArray<kj::byte>(SIZE);
+
+  auto promises = kj::heapArrayBuilder<kj::Promise<void>>(4);
+  promises.add(writeInChunks(*pair.ends[0], forward, 1000));
+  promises.add(writeInChunks(*pair.ends[1], backward, 7777));
+  promises.add(pair.ends[1]->read(forwardReceived.begin(), SIZE));
+  promises.add(pair.ends[0]->read(backwardReceived.begin(), SIZE));
+  kj::joinPromises(promises.finish()).wait(io.waitScope);
+
+  KJ_EXPECT(forwardReceived.asPtr() == forward.asPtr());
+  KJ_EXPECT(backwardReceived.asPtr() == backward.asPtr());
+
+  // Gathered writes.
+  kj::ArrayPtr<const kj::byte> pieces[3] = {
+    forward.slice(0, 10), forward.slice(10, 5000), forward.slice(5000, 5001)
+  };
+  auto writePromise = pair.ends[0]->write(kj::arrayPtr(pieces, 3));
+  kj::byte buffer[5001];
+  pair.ends[1]->read(buffer, sizeof(buffer)).wait(io.waitScope);
+  writePromise.wait(io.waitScope);
+  KJ_EXPECT(kj::arrayPtr(buffer, sizeof(buffer)) == forward.slice(0, 5001));
+}
+
+KJ_TEST("shared-memory stream EOF and disconnect") {
+  auto io = kj::setupAsyncIo();
+
+  {
+    StreamPair pair(io, 4096);
+    pair.ends[0]->write("foo", 3).wait(io.waitScope);
+    pair.ends[0]->shutdownWrite();
+
+    char buffer[16];
+    KJ_EXPECT(pair.ends[1]->tryRead(buffer, 16, 16).wait(io.waitScope) == 3);
+    KJ_EXPECT(kj::heapString(buffer, 3) == "foo");
+    KJ_EXPECT(pair.ends[1]->tryRead(buffer, 1, 16).wait(io.waitScope) == 0);
+  }
+
+  {
+    // A writer blocked on a full ring fails once the peer is gone.
+    StreamPair pair(io, 4096);
+    auto data = makeContent(10000, 3);
+    auto promise = pair.ends[0]->write(data.begin(), data.size());
+    pair.ends[1] = nullptr;
+    KJ_EXPECT_THROW_MESSAGE("peer went away", promise.wait(io.waitScope));
+  }
+}
+
+KJ_TEST("shared-memory transport negotiation") {
+  auto io = kj::setupAsyncIo();
+
+  {
+    // The app accepts.
+    int sockets[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets));
+    auto fds = newShmStreamFds(4096);
+    auto appFds = dupFds(fds);
+    auto env = kj::str(appFds.memory.release(), ',', appFds.doorbells[0].release(), ',',
+                       appFds.doorbells[1].release());
+    KJ_SYSCALL(setenv("SANDSTORM_API_SHM", env.cStr(), true));
+
+    auto app = connectShmTransport(io, sockets[1]);
+    KJ_EXPECT(getenv("SANDSTORM_API_SHM") == nullptr);
+
+    auto supervisor = acceptShmTransport(io.unixEventPort,
+        io.lowLevelProvider->wrapSocketFd(sockets[0],
+            kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP),
+        kj::mv(fds)).wait(io.waitScope);
+
+    app->write("hello", 5).wait(io.waitScope);
+    char buffer[5];
+    supervisor->read(buffer, 5).wait(io.waitScope);
+    KJ_EXPECT(kj::heapString(buffer, 5) == "hello");
+  }
+
+  {
+    // The app doesn't know about the transport and speaks first.
+    int sockets[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets));
+    kj::AutoCloseFd appSocket(sockets[1]);
+    KJ_SYSCALL(write(appSocket, "0123456789", 10));
+
+    auto supervisor = acceptShmTransport(io.unixEventPort,
+        io.lowLevelProvider->wrapSocketFd(sockets[0],
+            kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP),
+        newShmStreamFds(4096)).wait(io.waitScope);
+
+    char buffer[10];
+    supervisor->read(buffer, 10).wait(io.waitScope);
+    KJ_EXPECT(kj::heapString(buffer, 10) == "0123456789");
+  }
+
+  {
+    // The app hangs up without saying anything.
+    int sockets[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets));
+    KJ_SYSCALL(close(sockets[1]));
+
+    auto supervisor = acceptShmTransport(io.unixEventPort,
+        io.lowLevelProvider->wrapSocketFd(sockets[0],
+            kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP),
+        newShmStreamFds(4096)).wait(io.waitScope);
+
+    char c;
+    KJ_EXPECT(supervisor->tryRead(&c, 1, 1).wait(io.waitScope) == 0);
+  }
+}
+
+KJ_TEST("shared-memory transport negotiation with the magic arriving late and in pieces") {
+  auto io = kj::setupAsyncIo();
+
+  int sockets[2];
+  KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets));
+  auto fds = newShmStreamFds(4096);
+  auto appFds = dupFds(fds);
+  int appSocket = sockets[1];
+
+  kj::Maybe<kj::Own<kj::AsyncIoStream>> accepted;
+  auto promise = acceptShmTransport(io.unixEventPort,
+      io.lowLevelProvider->wrapSocketFd(sockets[0], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP),
+      kj::mv(fds)).then([&](kj::Own<kj::AsyncIoStream>&& stream) {
+    accepted = kj::mv(stream);
+  }).eagerlyEvaluate([](kj::Exception&& e) { KJ_FAIL_EXPECT(e); });
+
+  // Nothing yet, as if the app were slow to start: the supervisor keeps waiting.
+  io.provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(io.waitScope);
+  KJ_EXPECT(accepted == nullptr);
+
+  // Then the first few bytes only.
+  auto magic = reinterpret_cast<const kj::byte*>(&SHM_TRANSPORT_MAGIC);
+  KJ_SYSCALL(write(appSocket, magic, 3));
+  io.provider->getTimer().afterDelay(50 * kj::MILLISECONDS).wait(io.waitScope);
+  KJ_EXPECT(accepted == nullptr);
+
+  KJ_SYSCALL(write(appSocket, magic + 3, sizeof(SHM_TRANSPORT_MAGIC) - 3));
+  promise.wait(io.waitScope);
+  auto& supervisor = KJ_ASSERT_NONNULL(accepted);
+
+  auto app = newShmStream(io.unixEventPort, kj::mv(appFds), 1,
+      io.lowLevelProvider->wrapSocketFd(appSocket, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP));
+  app->write("hello", 5).wait(io.waitScope);
+  char buffer[5];
+  supervisor->read(buffer, 5).wait(io.waitScope);
+  KJ_EXPECT(kj::heapString(buffer, 5) == "hello");
+}
+
+}  // namespace
+}  // namespace sandstorm
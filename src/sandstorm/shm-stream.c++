@@ -0,0 +1,475 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shm-stream.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+// Older headers lack these.
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+#ifndef SYS_memfd_create
+#if defined(__x86_64__)
+#define SYS_memfd_create 319
+#else
+#error "SYS_memfd_create not defined; kernel headers are too old for this architecture"
+#endif
+#endif
+
+namespace sandstorm {
+
+namespace {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared-memory rings need lock-free 64-bit atomics");
+
+constexpr uint64_t HEADER_MAGIC = 0x31726d68736e6473ull;  // "sdnshmr1"
+constexpr size_t HEADER_SIZE = 4096;
+// The rings start after the header, at this offset.
+
+struct RingHeader {
+  alignas(64) std::atomic<uint64_t> head;
+  // Total bytes ever written to the ring. Only the producer stores to it.
+
+  alignas(64) std::atomic<uint64_t> tail;
+  // Total bytes ever read from the ring. Only the consumer stores to it.
+
+  alignas(64) std::atomic<uint32_t> consumerWaiting;
+  std::atomic<uint32_t> producerWaiting;
+  // Set by a side about to sleep on its doorbell, waiting for data or for space respectively.
+  // Whoever changes head or tail and finds the other side's flag set clears it and rings.
+
+  std::atomic<uint32_t> closed;
+  // Set by the producer once it will write no more.
+};
+
+struct SharedHeader {
+  uint64_t magic;
+  uint64_t ringSize;
+
+  RingHeader rings[2];
+  // `rings[i]` carries data written by side `i`.
+};
+
+static_assert(sizeof(SharedHeader) <= HEADER_SIZE, "shared-memory header too big");
+
+kj::Exception disconnected(kj::StringPtr description) {
+  return kj::Exception(kj::Exception::Type::DISCONNECTED, __FILE__, __LINE__,
+                       kj::heapString(description));
+}
+
+class ShmStream final: public kj::AsyncIoStream {
+public:
+  ShmStream(kj::UnixEventPort& eventPort, ShmStreamFds fdsParam, uint side,
+            kj::Own<kj::AsyncIoStream> lifelineParam)
+      : fds(kj::mv(fdsParam)), side(side), lifeline(kj::mv(lifelineParam)),
+        doorbell(eventPort, fds.doorbells[side], kj::UnixEventPort::FdObserver::OBSERVE_READ) {
+    KJ_REQUIRE(side < 2, "no such side", side);
+
+    // The peer can't resize the memory (it's sealed), so our mapping stays valid whatever the
+    // header says.
+    struct stat stats;
+    KJ_SYSCALL(fstat(fds.memory, &stats));
+    KJ_REQUIRE(stats.st_size >= (off_t)HEADER_SIZE, "shared-memory stream too small");
+    mappingSize = stats.st_size;
+    void* mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fds.memory, 0);
+    if (mapping == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno);
+    }
+    base = reinterpret_cast<kj::byte*>(mapping);
+    auto header = reinterpret_cast<SharedHeader*>(base);
+
+    ringSize = header->ringSize;
+    if (header->magic != HEADER_MAGIC || ringSize == 0 || (ringSize & (ringSize - 1)) != 0 ||
+        ringSize > (mappingSize - HEADER_SIZE) / 2) {
+      munmap(base, mappingSize);
+      KJ_FAIL_REQUIRE("invalid shared-memory stream header");
+    }
+
+    out = &header->rings[side];
+    in = &header->rings[1 - side];
+    outData = base + HEADER_SIZE + side * ringSize;
+    inData = base + HEADER_SIZE + (1 - side) * ringSize;
+    outHead = out->head.load();
+    inTail = in->tail.load();
+
+    doorbellTask = doorbellLoop().eagerlyEvaluate([this](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "shared-memory stream doorbell failed", exception);
+      gone = true;
+      wakeAll();
+    });
+    lifelineTask = lifeline->tryRead(&lifelineByte, 1, 1).then([this](size_t) {
+      gone = true;
+      wakeAll();
+    }, [this](kj::Exception&& exception) {
+      gone = true;
+      wakeAll();
+    }).eagerlyEvaluate(nullptr);
+  }
+
+  ~ShmStream() noexcept(false) {
+    // Let the peer see EOF even if it's slow to notice the lifeline.
+    kj::runCatchingExceptions([this]() { shutdownWrite(); });
+    munmap(base, mappingSize);
+  }
+
+  kj::Promise<size_t> read(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return tryRead(buffer, minBytes, maxBytes).then([minBytes](size_t n) {
+      if (n < minBytes) {
+        kj::throwFatalException(disconnected("premature EOF on shared-memory stream"));
+      }
+      return n;
+    });
+  }
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return tryReadInternal(reinterpret_cast<kj::byte*>(buffer), minBytes, maxBytes, 0);
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    auto pieces = kj::heapArray<kj::ArrayPtr<const kj::byte>>(1);
+    pieces[0] = kj::arrayPtr(reinterpret_cast<const kj::byte*>(buffer), size);
+    auto promise = writeInternal(pieces, 0, 0);
+    return promise.attach(kj::mv(pieces));
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    auto copy = kj::heapArray(pieces);
+    auto promise = writeInternal(copy, 0, 0);
+    return promise.attach(kj::mv(copy));
+  }
+
+  void shutdownWrite() override {
+    if (!isShutdown) {
+      isShutdown = true;
+      out->closed.store(1);
+      ring();
+    }
+  }
+
+private:
+  ShmStreamFds fds;
+  uint side;
+  kj::Own<kj::AsyncIoStream> lifeline;
+  kj::UnixEventPort::FdObserver doorbell;
+
+  kj::byte* base;
+  size_t mappingSize;
+  size_t ringSize;
+  RingHeader* out;
+  RingHeader* in;
+  kj::byte* outData;
+  kj::byte* inData;
+
+  uint64_t outHead;
+  uint64_t inTail;
+  // Our own copies of the positions only we advance. The shared copies are for the peer's
+  // benefit; we never read them back, in case the peer has changed them.
+
+  bool isShutdown = false;
+  bool gone = false;
+  // The peer went away (its lifeline hit EOF).
+
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> waiters;
+  // A pending read and a pending write may both be waiting for the doorbell. Only
+  // doorbellLoop() drains it, waking everyone, so that neither can swallow the other's wake-up.
+
+  kj::byte lifelineByte;
+  kj::Promise<void> doorbellTask = nullptr;
+  kj::Promise<void> lifelineTask = nullptr;
+
+  kj::Promise<void> doorbellLoop() {
+    return doorbell.whenBecomesReadable().then([this]() {
+      uint64_t count;
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = ::read(fds.doorbells[side], &count, sizeof(count)));
+      wakeAll();
+      return doorbellLoop();
+    });
+  }
+
+  kj::Promise<void> waitForDoorbell() {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    waiters.add(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }
+
+  void wakeAll() {
+    auto toWake = kj::mv(waiters);
+    for (auto& waiter: toWake) {
+      waiter->fulfill();
+    }
+  }
+
+  void ring() {
+    uint64_t one = 1;
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = ::write(fds.doorbells[1 - side], &one, sizeof(one)));
+  }
+
+  size_t available() {
+    uint64_t size = in->head.load() - inTail;
+    if (size > ringSize) {
+      kj::throwFatalException(disconnected("peer corrupted shared-memory stream"));
+    }
+    return size;
+  }
+
+  size_t space() {
+    uint64_t used = outHead - out->tail.load();
+    if (used > ringSize) {
+      kj::throwFatalException(disconnected("peer corrupted shared-memory stream"));
+    }
+    return ringSize - used;
+  }
+
+  size_t pull(kj::byte* buffer, size_t maxBytes) {
+    size_t n = kj::min(available(), maxBytes);
+    if (n == 0) return 0;
+
+    size_t offset = inTail & (ringSize - 1);
+    size_t first = kj::min(n, ringSize - offset);
+    memcpy(buffer, inData + offset, first);
+    memcpy(buffer + first, inData, n - first);
+    inTail += n;
+    in->tail.store(inTail);
+
+    if (in->producerWaiting.load() && in->producerWaiting.exchange(0)) {
+      ring();
+    }
+    return n;
+  }
+
+  size_t push(const kj::byte* buffer, size_t size) {
+    size_t n = kj::min(space(), size);
+    if (n == 0) return 0;
+
+    size_t offset = outHead & (ringSize - 1);
+    size_t first = kj::min(n, ringSize - offset);
+    memcpy(outData + offset, buffer, first);
+    memcpy(outData, buffer + first, n - first);
+    outHead += n;
+    out->head.store(outHead);
+
+    if (out->consumerWaiting.load() && out->consumerWaiting.exchange(0)) {
+      ring();
+    }
+    return n;
+  }
+
+  kj::Promise<size_t> tryReadInternal(kj::byte* buffer, size_t minBytes, size_t maxBytes,
+                                      size_t alreadyRead) {
+    for (;;) {
+      // Check for EOF before reading, so that we don't miss data written just before it.
+      bool eof = in->closed.load() || gone;
+      alreadyRead += pull(buffer + alreadyRead, maxBytes - alreadyRead);
+      if (alreadyRead >= minBytes || eof) {
+        return alreadyRead;
+      }
+
+      in->consumerWaiting.store(1);
+      if (available() > 0 || in->closed.load()) {
+        in->consumerWaiting.store(0);
+        continue;
+      }
+
+      return waitForDoorbell().then([this, buffer, minBytes, maxBytes, alreadyRead]() {
+        return tryReadInternal(buffer, minBytes, maxBytes, alreadyRead);
+      });
+    }
+  }
+
+  kj::Promise<void> writeInternal(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces,
+                                  size_t index, size_t offset) {
+    for (;;) {
+      if (gone) {
+        return disconnected("shared-memory stream peer went away");
+      }
+      KJ_REQUIRE(!isShutdown, "write after shutdownWrite()");
+
+      while (index < pieces.size() && offset == pieces[index].size()) {
+        ++index;
+        offset = 0;
+      }
+      if (index == pieces.size()) {
+        return kj::READY_NOW;
+      }
+
+      size_t n = push(pieces[index].begin() + offset, pieces[index].size() - offset);
+      if (n > 0) {
+        offset += n;
+        continue;
+      }
+
+      out->producerWaiting.store(1);
+      if (space() > 0) {
+        out->producerWaiting.store(0);
+        continue;
+      }
+
+      return waitForDoorbell().then([this, pieces, index, offset]() {
+        return writeInternal(pieces, index, offset);
+      });
+    }
+  }
+};
+
+class PrefixedStream final: public kj::AsyncIoStream {
+  // Returns `prefix` before anything read from `inner`. Used to put back bytes read while
+  // checking whether the app accepted the shared-memory transport.
+
+public:
+  PrefixedStream(kj::Array<kj::byte> prefix, kj::Own<kj::AsyncIoStream> inner)
+      : prefix(kj::mv(prefix)), inner(kj::mv(inner)) {}
+
+  kj::Promise<size_t> read(void* buffer, size_t minBytes, size_t maxBytes) override {
+    size_t n = takePrefix(buffer, maxBytes);
+    if (n >= minBytes) return n;
+    return inner->read(reinterpret_cast<kj::byte*>(buffer) + n, minBytes - n, maxBytes - n)
+        .then([n](size_t m) { return n + m; });
+  }
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    size_t n = takePrefix(buffer, maxBytes);
+    if (n >= minBytes) return n;
+    return inner->tryRead(reinterpret_cast<kj::byte*>(buffer) + n, minBytes - n, maxBytes - n)
+        .then([n](size_t m) { return n + m; });
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    return inner->write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    return inner->write(pieces);
+  }
+  void shutdownWrite() override {
+    inner->shutdownWrite();
+  }
+
+private:
+  kj::Array<kj::byte> prefix;
+  size_t prefixPos = 0;
+  kj::Own<kj::AsyncIoStream> inner;
+
+  size_t takePrefix(void* buffer, size_t maxBytes) {
+    size_t n = kj::min(prefix.size() - prefixPos, maxBytes);
+    memcpy(buffer, prefix.begin() + prefixPos, n);
+    prefixPos += n;
+    return n;
+  }
+};
+
+kj::AutoCloseFd newEventFd() {
+  int fd;
+  KJ_SYSCALL(fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  return kj::AutoCloseFd(fd);
+}
+
+}  // namespace
+
+ShmStreamFds newShmStreamFds(size_t ringSize) {
+  KJ_REQUIRE(ringSize > 0 && (ringSize & (ringSize - 1)) == 0,
+             "ring size must be a power of two", ringSize);
+
+  int fd;
+  KJ_SYSCALL(fd = syscall(SYS_memfd_create, "sandstorm-api", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  ShmStreamFds result;
+  result.memory = kj::AutoCloseFd(fd);
+  KJ_SYSCALL(ftruncate(fd, HEADER_SIZE + 2 * ringSize));
+
+  // Nobody may change the size from here on, lest whoever has it mapped get SIGBUS.
+  KJ_SYSCALL(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL));
+
+  SharedHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = HEADER_MAGIC;
+  header.ringSize = ringSize;
+  KJ_SYSCALL(pwrite(fd, &header, sizeof(header), 0));
+
+  result.doorbells[0] = newEventFd();
+  result.doorbells[1] = newEventFd();
+  return result;
+}
+
+kj::Own<kj::AsyncIoStream> newShmStream(kj::UnixEventPort& eventPort, ShmStreamFds fds,
+                                        uint side, kj::Own<kj::AsyncIoStream> lifeline) {
+  return kj::heap<ShmStream>(eventPort, kj::mv(fds), side, kj::mv(lifeline));
+}
+
+kj::Promise<kj::Own<kj::AsyncIoStream>> acceptShmTransport(
+    kj::UnixEventPort& eventPort, kj::Own<kj::AsyncIoStream> socket, ShmStreamFds fds) {
+  // The magic may arrive in pieces, so wait for all of it. A Cap'n Proto message is never shorter,
+  // so an app speaking Cap'n Proto on the socket doesn't leave us waiting either.
+  auto buffer = kj::heapArray<kj::byte>(sizeof(SHM_TRANSPORT_MAGIC));
+  auto& socketRef = *socket;
+  return socketRef.tryRead(buffer.begin(), buffer.size(), buffer.size())
+      .then([&eventPort, KJ_MVCAP(socket), KJ_MVCAP(fds), KJ_MVCAP(buffer)](
+          size_t n) mutable -> kj::Own<kj::AsyncIoStream> {
+    if (n == buffer.size() && memcmp(buffer.begin(), &SHM_TRANSPORT_MAGIC, n) == 0) {
+      return newShmStream(eventPort, kj::mv(fds), 0, kj::mv(socket));
+    }
+
+    // The app spoke Cap'n Proto on the socket, or hung up. Put back what we read.
+    auto prefix = kj::heapArray<kj::byte>(buffer.slice(0, n));
+    return kj::heap<PrefixedStream>(kj::mv(prefix), kj::mv(socket));
+  });
+}
+
+kj::Own<kj::AsyncIoStream> connectShmTransport(kj::AsyncIoContext& io, int apiFd) {
+  const char* env = getenv("SANDSTORM_API_SHM");
+  if (env == nullptr) {
+    return io.lowLevelProvider->wrapSocketFd(apiFd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+  }
+
+  // Format: "<memory>,<doorbell 0>,<doorbell 1>".
+  auto parts = split(kj::StringPtr(env), ',');
+  KJ_REQUIRE(parts.size() == 3, "bad SANDSTORM_API_SHM", env);
+  int fdNums[3];
+  for (uint i = 0; i < 3; i++) {
+    fdNums[i] = KJ_REQUIRE_NONNULL(parseUInt(kj::heapString(parts[i]), 10),
+                                   "bad SANDSTORM_API_SHM", env);
+    KJ_SYSCALL(fcntl(fdNums[i], F_SETFD, FD_CLOEXEC));
+  }
+  KJ_SYSCALL(unsetenv("SANDSTORM_API_SHM"));
+
+  ShmStreamFds fds;
+  fds.memory = kj::AutoCloseFd(fdNums[0]);
+  fds.doorbells[0] = kj::AutoCloseFd(fdNums[1]);
+  fds.doorbells[1] = kj::AutoCloseFd(fdNums[2]);
+
+  // Accept before anything else goes out on the socket. It's still in blocking mode here.
+  kj::FdOutputStream(apiFd).write(&SHM_TRANSPORT_MAGIC, sizeof(SHM_TRANSPORT_MAGIC));
+
+  auto socket = io.lowLevelProvider->wrapSocketFd(apiFd,
+      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+  return newShmStream(io.unixEventPort, kj::mv(fds), 1, kj::mv(socket));
+}
+
+}  // namespace sandstorm
@@ -0,0 +1,82 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_SHM_STREAM_H_
+#define SANDSTORM_SHM_STREAM_H_
+// A byte stream between two processes over a pair of rings in shared memory, for carrying the
+// Cap'n Proto connection between the supervisor and the app without a trip through the kernel
+// for every message.
+//
+// Negotiation: a supervisor offering the transport passes the app the stream's file descriptors
+// and names them in the SANDSTORM_API_SHM environment variable. An app that wants to use it
+// writes SHM_TRANSPORT_MAGIC to the API socket before anything else and then speaks Cap'n Proto
+// over the rings instead. An app that doesn't know about it ignores the variable and speaks Cap'n
+// Proto on the socket; the supervisor tells the two apart by the first 8 bytes it receives, which
+// is less than any Cap'n Proto message. The supervisor therefore sends nothing until the app has
+// sent something, so the transport must only be offered to apps that speak first; the front-end
+// offers it (`sandstorm-supervisor --shm-api`) to apps run by sandstorm-http-bridge. The API socket
+// stays open either way: it is how each side notices the other going away.
+
+#include <kj/async-io.h>
+#include <kj/async-unix.h>
+#include <kj/io.h>
+
+namespace sandstorm {
+
+constexpr uint64_t SHM_TRANSPORT_MAGIC = 0x53484d31ffffffffull;
+// Sent by the app (in native byte order) on the API socket to accept the shared-memory transport.
+// Read as the start of a Cap'n Proto message on a little-endian machine, this would claim 2^32
+// segments, so it can't be confused with one.
+
+constexpr size_t SHM_DEFAULT_RING_SIZE = 1 << 20;
+
+struct ShmStreamFds {
+  kj::AutoCloseFd memory;
+  // A sealed memfd holding both rings.
+
+  kj::AutoCloseFd doorbells[2];
+  // eventfds. `doorbells[i]` is rung to wake side `i` when there is something for it to read, or
+  // room for it to write.
+};
+
+ShmStreamFds newShmStreamFds(size_t ringSize = SHM_DEFAULT_RING_SIZE);
+// Allocates the shared memory for a stream with `ringSize` bytes of buffer in each direction.
+// `ringSize` must be a power of two.
+
+kj::Own<kj::AsyncIoStream> newShmStream(kj::UnixEventPort& eventPort, ShmStreamFds fds,
+                                        uint side, kj::Own<kj::AsyncIoStream> lifeline);
+// Opens one end (`side` 0 or 1) of a stream created with newShmStreamFds(). `lifeline` is any
+// other stream to the same peer on which it sends nothing further; when it reaches EOF the peer
+// is considered gone, so that reads see EOF and writes fail rather than waiting forever.
+//
+// Side 0 does not trust the shared memory: the peer may scribble on it at any time without
+// causing more than garbage on the stream.
+
+kj::Promise<kj::Own<kj::AsyncIoStream>> acceptShmTransport(
+    kj::UnixEventPort& eventPort, kj::Own<kj::AsyncIoStream> socket, ShmStreamFds fds);
+// Supervisor side of the negotiation: waits for the app's first 8 bytes, or for it to close the
+// socket, and returns side 0 of the shared-memory stream if they are SHM_TRANSPORT_MAGIC.
+// Otherwise returns `socket`, including anything already read from it.
+
+kj::Own<kj::AsyncIoStream> connectShmTransport(kj::AsyncIoContext& io, int apiFd);
+// App side of the negotiation: if the supervisor offered the transport, accepts it and returns
+// side 1. Otherwise wraps `apiFd`. Either way, takes ownership of `apiFd`, and leaves nothing
+// behind to be inherited by child processes started afterwards. Call it at startup, before
+// starting any, so that the supervisor isn't kept waiting.
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_SHM_STREAM_H_
@@ -1012,7 +1012,8 @@ private:
             "\" does not exist. Have you run `spk dev` yet?"));
       }
 
-      for (auto& line: splitLines(readAll(raiiOpen(fileListFile, O_RDONLY)))) {
+      auto fileList = readAll(raiiOpen(fileListFile, O_RDONLY));
+      for (auto& line: splitLinesInPlace(fileList)) {
         addNode(root, line, sourceMap, false);
       }
     }
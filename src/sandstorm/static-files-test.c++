@@ -0,0 +1,207 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "static-files.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <capnp/message.h>
+#include <sandstorm/util.capnp.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "test-util.h"
+#include "util.h"
+
+namespace sandstorm {
+namespace {
+
+void writeFile(kj::StringPtr path, kj::ArrayPtr<const kj::byte> content) {
+  auto fd = raiiOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  kj::FdOutputStream(fd.get()).write(content.begin(), content.size());
+}
+
+void writeFile(kj::StringPtr path, kj::StringPtr content) {
+  writeFile(path, content.asBytes());
+}
+
+class TestSession final: public WebSession::Server {
+  // Answers get() from the StaticFileServer only, the way the bridge does before falling back to
+  // the app.
+
+public:
+  explicit TestSession(StaticFileServer& files): files(files) {}
+
+protected:
+  kj::Promise<void> get(GetContext context) override {
+    auto params = context.getParams();
+    if (!files.tryGet(params.getPath(), params.getContext(), context.getResults())) {
+      KJ_FAIL_REQUIRE("not static", params.getPath());
+    }
+    return kj::READY_NOW;
+  }
+
+private:
+  StaticFileServer& files;
+};
+
+class CollectingStream final: public ByteStream::Server {
+public:
+  kj::Vector<kj::byte> data;
+  kj::Own<kj::PromiseFulfiller<void>> doneFulfiller;
+
+  explicit CollectingStream(kj::Own<kj::PromiseFulfiller<void>> doneFulfiller)
+      : doneFulfiller(kj::mv(doneFulfiller)) {}
+
+protected:
+  kj::Promise<void> write(WriteContext context) override {
+    data.addAll(context.getParams().getData());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    doneFulfiller->fulfill();
+    return kj::READY_NOW;
+  }
+};
+
+struct Fixture {
+  TempDir dir;
+  capnp::MallocMessageBuilder config;
+  kj::Own<StaticFileServer> files;
+  WebSession::Client session = nullptr;
+
+  Fixture() {
+    auto pkg = dir.path.asPtr();
+    KJ_SYSCALL(mkdir(kj::str(pkg, "/public").cStr(), 0755));
+    KJ_SYSCALL(mkdir(kj::str(pkg, "/public/css").cStr(), 0755));
+    KJ_SYSCALL(mkdir(kj::str(pkg, "/other").cStr(), 0755));
+    writeFile(kj::str(pkg, "/public/index.html"), "<h1>hi</h1>");
+    writeFile(kj::str(pkg, "/public/css/site.css"), "body {}");
+    writeFile(kj::str(pkg, "/other/app.js"), "go();");
+    writeFile(kj::str(pkg, "/secret"), "password");
+    KJ_SYSCALL(symlink("../secret", kj::str(pkg, "/public/link").cStr()));
+
+    auto paths = config.initRoot<spk::BridgeConfig>().initStaticPaths(3);
+    paths[0].setUrlPrefix("static");
+    paths[0].setPackagePath("/public");
+    paths[1].setUrlPrefix("/static/js/");
+    paths[1].setPackagePath("/other");
+    paths[2].setUrlPrefix("/missing/");
+    paths[2].setPackagePath("/no-such-dir");
+
+    files = kj::heap<StaticFileServer>(config.getRoot<spk::BridgeConfig>().getStaticPaths(),
+                                       raiiOpen(dir.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    session = kj::heap<TestSession>(*files);
+  }
+};
+
+KJ_TEST("StaticFileServer serves package files") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  Fixture fixture;
+
+  auto get = [&](kj::StringPtr path) {
+    auto request = fixture.session.getRequest();
+    request.setPath(path);
+    request.initContext();
+    return request.send().wait(waitScope);
+  };
+
+  {
+    auto response = get("static/css/site.css?v=3");
+    KJ_ASSERT(response.isContent());
+    auto content = response.getContent();
+    KJ_EXPECT(content.getStatusCode() == WebSession::Response::SuccessCode::OK);
+    KJ_EXPECT(content.getMimeType() == "text/css");
+    KJ_EXPECT(content.getETag().getValue().size() > 0);
+    KJ_EXPECT(kj::heapString(content.getBody().getBytes().asChars()) == "body {}");
+  }
+
+  {
+    auto response = get("static/");
+    KJ_EXPECT(response.getContent().getMimeType() == "text/html");
+    KJ_EXPECT(kj::heapString(response.getContent().getBody().getBytes().asChars()) ==
+              "<h1>hi</h1>");
+  }
+
+  // The longest prefix wins.
+  KJ_EXPECT(get("static/js/app.js").getContent().getMimeType() == "application/javascript");
+
+  // Anything else goes to the app.
+  KJ_EXPECT_THROW_MESSAGE("not static", get("static/link"));
+  KJ_EXPECT_THROW_MESSAGE("not static", get("static/../secret"));
+  KJ_EXPECT_THROW_MESSAGE("not static", get("static/%2e%2e/secret"));
+  KJ_EXPECT_THROW_MESSAGE("not static", get("static/css%2fsite.css"));
+  KJ_EXPECT_THROW_MESSAGE("not static", get("static/css"));
+  KJ_EXPECT_THROW_MESSAGE("not static", get("static/nope.css"));
+  KJ_EXPECT_THROW_MESSAGE("not static", get("missing/x"));
+  KJ_EXPECT_THROW_MESSAGE("not static", get("secret"));
+}
+
+KJ_TEST("StaticFileServer honors If-None-Match") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  Fixture fixture;
+
+  auto request = fixture.session.getRequest();
+  request.setPath("static/css/site.css");
+  request.initContext();
+  auto eTag = kj::heapString(request.send().wait(waitScope).getContent().getETag().getValue());
+
+  request = fixture.session.getRequest();
+  request.setPath("static/css/site.css");
+  auto tags = request.initContext().initETagPrecondition().initMatchesNoneOf(2);
+  tags[0].setValue("stale");
+  tags[1].setValue(eTag);
+  tags[1].setWeak(true);
+  auto response = request.send().wait(waitScope);
+  KJ_ASSERT(response.isPreconditionFailed());
+  KJ_EXPECT(response.getPreconditionFailed().getMatchingETag().getValue() == eTag);
+
+  request = fixture.session.getRequest();
+  request.setPath("static/css/site.css");
+  request.initContext().initETagPrecondition().initMatchesNoneOf(1)[0].setValue("stale");
+  KJ_EXPECT(request.send().wait(waitScope).isContent());
+}
+
+KJ_TEST("StaticFileServer streams large files") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  Fixture fixture;
+
+  auto content = kj::heapArray<kj::byte>(StaticFileServer::INLINE_LIMIT * 3 + 1234);
+  for (size_t i = 0; i < content.size(); i++) content[i] = i * 13;
+  writeFile(kj::str(fixture.dir.path, "/public/big.bin"), content);
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  auto stream = kj::heap<CollectingStream>(kj::mv(paf.fulfiller));
+  auto& streamRef = *stream;
+
+  auto request = fixture.session.getRequest();
+  request.setPath("static/big.bin");
+  request.initContext().setResponseStream(kj::mv(stream));
+  auto response = request.send().wait(waitScope);
+  KJ_ASSERT(response.getContent().getBody().isStream());
+  KJ_EXPECT(response.getContent().getMimeType() == "application/octet-stream");
+
+  // The response holds the stream's handle, keeping it going.
+  paf.promise.wait(waitScope);
+  KJ_EXPECT(streamRef.data.asPtr() == content.asPtr());
+}
+
+}  // namespace
+}  // namespace sandstorm
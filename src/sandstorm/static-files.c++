@@ -0,0 +1,277 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "static-files.h"
+#include <kj/debug.h>
+#include <sandstorm/util.capnp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#include "byte-stream.h"
+#include "util.h"
+
+namespace sandstorm {
+
+constexpr size_t StaticFileServer::INLINE_LIMIT;
+
+static const size_t STREAM_CHUNK_SIZE = 65536;
+
+static const struct {
+  const char* extension;
+  const char* mimeType;
+} MIME_TYPES[] = {
+  { "css", "text/css" },
+  { "csv", "text/csv" },
+  { "eot", "application/vnd.ms-fontobject" },
+  { "gif", "image/gif" },
+  { "htm", "text/html" },
+  { "html", "text/html" },
+  { "ico", "image/x-icon" },
+  { "jpeg", "image/jpeg" },
+  { "jpg", "image/jpeg" },
+  { "js", "application/javascript" },
+  { "json", "application/json" },
+  { "map", "application/json" },
+  { "mp3", "audio/mpeg" },
+  { "mp4", "video/mp4" },
+  { "ogg", "audio/ogg" },
+  { "otf", "font/otf" },
+  { "pdf", "application/pdf" },
+  { "png", "image/png" },
+  { "svg", "image/svg+xml" },
+  { "ttf", "font/ttf" },
+  { "txt", "text/plain" },
+  { "wasm", "application/wasm" },
+  { "webm", "video/webm" },
+  { "webp", "image/webp" },
+  { "woff", "font/woff" },
+  { "woff2", "font/woff2" },
+  { "xml", "application/xml" },
+};
+
+static kj::StringPtr guessMimeType(kj::StringPtr filename) {
+  KJ_IF_MAYBE(dot, filename.findLast('.')) {
+    auto extension = kj::heapString(filename.slice(*dot + 1));
+    toLower(extension);
+    for (auto& type: MIME_TYPES) {
+      if (extension == type.extension) return type.mimeType;
+    }
+  }
+  return "application/octet-stream";
+}
+
+static int hexDigitValue(char c) {
+  if ('0' <= c && c <= '9') return c - '0';
+  if ('a' <= c && c <= 'f') return c - 'a' + 10;
+  if ('A' <= c && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static kj::Maybe<kj::String> percentDecode(kj::ArrayPtr<const char> text) {
+  // Returns null for a malformed escape, or one which would smuggle in a '/' or NUL.
+
+  kj::Vector<char> result(text.size() + 1);
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    if (c == '%') {
+      if (i + 2 >= text.size()) return nullptr;
+      int high = hexDigitValue(text[i + 1]);
+      int low = hexDigitValue(text[i + 2]);
+      if (high < 0 || low < 0) return nullptr;
+      c = high * 16 + low;
+      i += 2;
+      if (c == '/') return nullptr;
+    }
+    if (c == '\0') return nullptr;
+    result.add(c);
+  }
+  result.add('\0');
+  return kj::String(result.releaseAsArray());
+}
+
+static kj::Maybe<kj::AutoCloseFd> openBeneath(int dirFd, kj::StringPtr path) {
+  // Opens a regular file under `dirFd` one component at a time, so that no symlink is followed
+  // and ".." can't climb out. Returns null if there is no such file.
+
+  auto components = split(path, '/');
+  kj::AutoCloseFd current;
+  int parent = dirFd;
+  for (uint i: kj::indices(components)) {
+    auto name = kj::heapString(components[i]);
+    if (name.size() == 0 || name == "." || name == "..") return nullptr;
+
+    int flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+    if (i + 1 < components.size()) flags |= O_DIRECTORY;
+    int fd = openat(parent, name.cStr(), flags);
+    if (fd < 0) return nullptr;
+    current = kj::AutoCloseFd(fd);
+    parent = current;
+  }
+  return kj::mv(current);
+}
+
+class StaticFileStream final: public Handle::Server {
+  // Streams a large file to the response stream from a mapping of it. Dropping the handle stops
+  // the stream.
+
+public:
+  StaticFileStream(int fd, size_t size, ByteStream::Client output)
+      : size(size), writer(kj::mv(output)) {
+    void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno);
+    }
+    mapping = reinterpret_cast<const kj::byte*>(ptr);
+
+    writer.expectSize(size);
+    pump = pumpFrom(0).eagerlyEvaluate([](kj::Exception&& e) {
+      // The client went away. Nothing to do.
+    });
+  }
+
+  ~StaticFileStream() noexcept(false) {
+    pump = nullptr;
+    munmap(const_cast<kj::byte*>(mapping), size);
+  }
+
+private:
+  const kj::byte* mapping;
+  size_t size;
+  ByteStreamWriter writer;
+  kj::Promise<void> pump = nullptr;
+
+  kj::Promise<void> pumpFrom(size_t offset) {
+    if (offset == size) return writer.done();
+    size_t n = kj::min(size - offset, STREAM_CHUNK_SIZE);
+    return writer.write(mapping + offset, n).then([this, offset, n]() {
+      return pumpFrom(offset + n);
+    });
+  }
+};
+
+StaticFileServer::StaticFileServer(capnp::List<spk::BridgeConfig::StaticPath>::Reader paths,
+                                   int packageRoot) {
+  for (auto path: paths) {
+    kj::StringPtr prefix = path.getUrlPrefix();
+    auto urlPrefix = kj::str(prefix.startsWith("/") ? "" : "/", prefix);
+    if (!urlPrefix.endsWith("/")) {
+      urlPrefix = kj::str(urlPrefix, '/');
+    }
+
+    kj::StringPtr packagePath = path.getPackagePath();
+    while (packagePath.startsWith("/")) {
+      packagePath = packagePath.slice(1);
+    }
+    if (packagePath.size() == 0) packagePath = ".";
+
+    int fd = openat(packageRoot, packagePath.cStr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      int error = errno;
+      KJ_LOG(WARNING, "can't open static path; passing its requests to the app",
+             path.getPackagePath(), strerror(error));
+      continue;
+    }
+
+    mounts.add(Mount { kj::mv(urlPrefix), kj::AutoCloseFd(fd) });
+  }
+
+  std::sort(mounts.begin(), mounts.end(), [](const Mount& a, const Mount& b) {
+    return a.urlPrefix.size() > b.urlPrefix.size();
+  });
+}
+
+bool StaticFileServer::tryGet(kj::StringPtr path, WebSession::Context::Reader context,
+                              WebSession::Response::Builder response) {
+  size_t end = path.size();
+  for (size_t i: kj::indices(path)) {
+    if (path[i] == '?' || path[i] == '#') {
+      end = i;
+      break;
+    }
+  }
+  auto urlPath = kj::str('/', path.slice(0, end));
+
+  for (auto& mount: mounts) {
+    if (!urlPath.startsWith(mount.urlPrefix)) continue;
+
+    // Only the longest matching prefix is considered.
+    kj::String filePath;
+    KJ_IF_MAYBE(decoded, percentDecode(urlPath.slice(mount.urlPrefix.size()))) {
+      filePath = kj::mv(*decoded);
+    } else {
+      return false;
+    }
+    if (filePath.size() == 0 || filePath.endsWith("/")) {
+      filePath = kj::str(filePath, "index.html");
+    }
+
+    kj::AutoCloseFd fd;
+    KJ_IF_MAYBE(f, openBeneath(mount.dir, filePath)) {
+      fd = kj::mv(*f);
+    } else {
+      return false;
+    }
+
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats));
+    if (!S_ISREG(stats.st_mode)) return false;
+
+    auto eTag = kj::str(kj::hex((uint64_t)stats.st_ino), '-', kj::hex((uint64_t)stats.st_size),
+                        '-', kj::hex((uint64_t)stats.st_mtime));
+
+    auto precondition = context.getETagPrecondition();
+    if (precondition.isMatchesNoneOf()) {
+      // If-None-Match uses weak comparison, so the weak flag doesn't matter.
+      for (auto tag: precondition.getMatchesNoneOf()) {
+        if (tag.getValue() == eTag) {
+          response.initPreconditionFailed().initMatchingETag().setValue(eTag);
+          return true;
+        }
+      }
+    }
+
+    auto content = response.initContent();
+    content.setStatusCode(WebSession::Response::SuccessCode::OK);
+    content.setMimeType(guessMimeType(filePath));
+    content.initETag().setValue(eTag);
+
+    size_t size = stats.st_size;
+    if (size <= INLINE_LIMIT) {
+      // Read straight into the response message.
+      auto data = content.initBody().initBytes(size);
+      size_t pos = 0;
+      while (pos < size) {
+        ssize_t n;
+        KJ_SYSCALL(n = pread(fd, data.begin() + pos, size - pos, pos), filePath);
+        KJ_REQUIRE(n > 0, "static file shrank while being served", filePath);
+        pos += n;
+      }
+    } else {
+      content.initBody().setStream(
+          kj::heap<StaticFileStream>(fd, size, context.getResponseStream()));
+    }
+    return true;
+  }
+
+  return false;
+}
+
+}  // namespace sandstorm
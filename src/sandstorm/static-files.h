@@ -0,0 +1,58 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_STATIC_FILES_H_
+#define SANDSTORM_STATIC_FILES_H_
+
+#include <kj/io.h>
+#include <kj/vector.h>
+#include <sandstorm/package.capnp.h>
+#include <sandstorm/web-session.capnp.h>
+
+namespace sandstorm {
+
+class StaticFileServer {
+  // Serves GET requests for the URL prefixes listed in an app's `BridgeConfig.staticPaths`
+  // directly from files in the package, so that sandstorm-http-bridge needn't pass them to the
+  // app. The package never changes while a grain is running, so a file's ETag is derived from its
+  // inode number, size, and modification time.
+
+public:
+  static constexpr size_t INLINE_LIMIT = 256 * 1024;
+  // Files up to this size are returned in the response itself; larger ones are streamed.
+
+  StaticFileServer(capnp::List<spk::BridgeConfig::StaticPath>::Reader paths, int packageRoot);
+  // Opens each `packagePath` in the package whose root directory is open as `packageRoot` (in the
+  // sandbox, that's "/"). Paths which can't be opened are logged and skipped.
+
+  bool tryGet(kj::StringPtr path, WebSession::Context::Reader context,
+              WebSession::Response::Builder response);
+  // `path` is as passed to `WebSession.get()`, i.e. without the leading '/' and possibly with a
+  // query string. If it names a file to be served statically, fills in `response` and returns
+  // true. Otherwise returns false, and the request should go to the app.
+
+private:
+  struct Mount {
+    kj::String urlPrefix;  // with leading and trailing '/'
+    kj::AutoCloseFd dir;
+  };
+  kj::Vector<Mount> mounts;
+  // Longest prefix first.
+};
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_STATIC_FILES_H_
@@ -32,6 +32,7 @@
 #include <sys/un.h>
 #include <sys/mount.h>
 #include <sys/prctl.h>
+#include <sys/mman.h>
 #include <sys/capability.h>
 #include <sys/ptrace.h>
 #include <sys/syscall.h>
@@ -49,6 +50,8 @@
 #include <pwd.h>
 #include <grp.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
 #include <seccomp.h>
 #include <map>
 #include <unordered_map>
@@ -58,8 +61,12 @@
 
 #include <sandstorm/grain.capnp.h>
 #include <sandstorm/supervisor.capnp.h>
+#include <sandstorm/web-session.capnp.h>
 
 #include "version.h"
+#include "call-tracer.h"
+#include "grain-placement.h"
+#include "saved-caps.h"
 #include "send-fd.h"
 #include "util.h"
 
@@ -67,22 +74,71 @@
 #ifndef PR_SET_NO_NEW_PRIVS
 #define PR_SET_NO_NEW_PRIVS 38
 #endif
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#endif
+
+// From <linux/fs.h>, which can't be included alongside <sys/mount.h>.
+struct SandstormFsxattr {
+  uint32_t fsx_xflags;
+  uint32_t fsx_extsize;
+  uint32_t fsx_nextents;
+  uint32_t fsx_projid;
+  uint32_t fsx_cowextsize;
+  unsigned char fsx_pad[8];
+};
+#define SANDSTORM_FS_IOC_FSGETXATTR _IOR('X', 31, struct SandstormFsxattr)
+#define SANDSTORM_FS_XFLAG_PROJINHERIT 0x00000200
 
 namespace sandstorm {
 
 // =======================================================================================
 // Directory size watcher
 
+bool hasProjectQuota(kj::StringPtr path) {
+  // Returns true if the directory `path` is the root of a filesystem project (xfs, or ext4 with
+  // the "project" feature) whose quota has a limit. In that case statfs() anywhere inside the
+  // directory reports the project's limit and usage instead of the whole filesystem's, which is
+  // how we detect the limit: compare with the parent directory. Querying the quota directly with
+  // quotactl() would need privileges we don't have.
+  //
+  // Setting up the project and its limit requires root outside of any sandbox, e.g.
+  // `xfs_quota -x -c 'project -s -p <grain-dir> <id>'` plus a `limit -p` for it.
+
+  auto fd = raiiOpen(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  struct SandstormFsxattr attr;
+  if (ioctl(fd, SANDSTORM_FS_IOC_FSGETXATTR, &attr) < 0) {
+    // Filesystem doesn't support project IDs.
+    return false;
+  }
+  if (attr.fsx_projid == 0 || !(attr.fsx_xflags & SANDSTORM_FS_XFLAG_PROJINHERIT)) {
+    return false;
+  }
+
+  struct statfs inside, outside;
+  KJ_SYSCALL(fstatfs(fd, &inside), path);
+  KJ_SYSCALL(statfs(kj::str(path, "/..").cStr(), &outside), path);
+  return inside.f_blocks != outside.f_blocks;
+}
+
 class DiskUsageWatcher {
   // Class which watches a directory tree, counts up the total disk usage, and fires events when
   // it changes. Uses inotify. Which turns out to be... harder than it should be.
+  //
+  // If the tree is a project with a quota (see hasProjectQuota()), the filesystem already knows
+  // its usage, so we just poll statfs() instead, which costs the same however big the tree is.
 
 public:
-  DiskUsageWatcher(kj::UnixEventPort& eventPort): eventPort(eventPort) {}
+  DiskUsageWatcher(kj::UnixEventPort& eventPort, bool useProjectQuota = false)
+      : eventPort(eventPort), useProjectQuota(useProjectQuota) {}
 
   kj::Promise<void> init() {
     // Start watching the current directory.
 
+    if (useProjectQuota) {
+      return pollProjectUsage();
+    }
+
     // Note: this function is also called to restart watching from scratch when the inotify event
     //   queue overflows (hopefully rare).
 
@@ -125,6 +181,7 @@ public:
 
 private:
   kj::UnixEventPort& eventPort;
+  bool useProjectQuota;
   kj::AutoCloseFd inotifyFd;
   kj::Own<kj::UnixEventPort::FdObserver> observer;
   uint64_t totalSize;
@@ -148,6 +205,17 @@ private:
   // to finish processing a list of events received from inotify before we mess with the watch
   // descriptor table.
 
+  kj::Promise<void> pollProjectUsage() {
+    struct statfs stats;
+    KJ_SYSCALL(statfs(".", &stats));
+    totalSize = (stats.f_blocks - stats.f_bfree) * stats.f_frsize;
+    maybeFireEvents();
+
+    return eventPort.atSteadyTime(eventPort.steadyTime() + 1 * kj::SECONDS).then([this]() {
+      return pollProjectUsage();
+    });
+  }
+
   void addPendingWatches() {
     // Start watching everything that has been added to the pendingWatches list.
 
@@ -189,25 +257,13 @@ private:
         watchInfo.childSizes.clear();
 
         // Now repopulate the children by listing the directory.
-        DIR* dir = opendir(pathPtr);
-        if (dir != nullptr) {
-          KJ_DEFER(closedir(dir));
-          for (;;) {
-            errno = 0;
-            struct dirent* entry = readdir(dir);
-            if (entry == nullptr) {
-              int error = errno;
-              if (error == 0) {
-                break;
-              } else {
-                KJ_FAIL_SYSCALL("readdir", error, pathPtr);
-              }
-            }
-
-            kj::StringPtr name = entry->d_name;
-            if (name != "." && name != "..") {
-              childEvent(watchInfo, name);
-            }
+        int dirFd = open(pathPtr, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd >= 0) {
+          kj::AutoCloseFd ownDirFd(dirFd);
+          for (auto& entry: listDirectoryEntries(dirFd)) {
+            // Note that we still stat each child in getDiskUsage() since we need its size, not
+            // just its type.
+            childEvent(watchInfo, entry.name);
           }
         }
 
@@ -419,6 +475,24 @@ private:
 pid_t childPid = 0;
 bool keepAlive = true;
 
+AppCgroup* exitCgroup = nullptr;
+// The app's cgroup, if it has one, so that we can remove it on our way out.
+
+uint wakeLockCount = 0;
+// Number of wake locks held by the app. While non-zero, we stay up even without keep-alives.
+
+bool loggedWakeLock = false;
+// Whether we've logged that a wake lock is keeping us up. Reset once a check finds no lock held,
+// so that the log shows when the grain went from idle to held awake and back, not every check.
+
+bool hibernating = false;
+// Whether the app is frozen by Supervisor.hibernate(). If so, we stay up even without
+// keep-alives; the host decides when to shut down a hibernating grain.
+
+const char* volatile callStatsSnapshot = nullptr;
+// The app's call stats as of the last snapshotCallStats(), for the signal handler to log on the
+// way out, as it can't dump the tracer itself.
+
 void logSafely(const char* text) {
   // Log a message in an async-signal-safe way.
 
@@ -444,6 +518,7 @@ void killChild() {
 
 [[noreturn]] void killChildAndExit(int status) {
   killChild();
+  if (exitCgroup != nullptr) exitCgroup->killAndRemove();
 
   // TODO(cleanup):  Decide what exit status is supposed to mean.  Maybe it should just always be
   //   zero?
@@ -458,12 +533,26 @@ void signalHandler(int signo) {
         keepAlive = false;
         return;
       }
+      if (wakeLockCount > 0) {
+        if (!loggedWakeLock) {
+          SANDSTORM_LOG("Grain holds a wake lock; staying up for now.");
+          loggedWakeLock = true;
+        }
+        return;
+      }
+      loggedWakeLock = false;
+      if (hibernating) {
+        SANDSTORM_LOG("Grain is hibernating; staying up for now.");
+        return;
+      }
       SANDSTORM_LOG("Grain no longer in use; shutting down.");
+      if (callStatsSnapshot != nullptr) logSafely(callStatsSnapshot);
       killChildAndExit(0);
 
     case SIGINT:
     case SIGTERM:
       SANDSTORM_LOG("Grain supervisor terminated by signal.");
+      if (callStatsSnapshot != nullptr) logSafely(callStatsSnapshot);
       killChildAndExit(0);
 
     default:
@@ -549,8 +638,34 @@ kj::MainFunc SupervisorMain::getMain() {
                  "Allow some system calls useful for debugging which are blocked in production.")
       .addOption({"seccomp-dump-pfc"}, [this]() { seccompDumpPfc = true; return true; },
                  "Dump libseccomp PFC output.")
+      .addOption({"shm-api"}, [this]() { shmApi = true; return true; },
+                 "Offer the app a shared-memory transport for its API connection.  Apps that "
+                 "don't take it up are unaffected, as long as they send something on the API "
+                 "socket before waiting for the supervisor to; sandstorm-http-bridge does, and the "
+                 "front-end passes this option for apps that use it.  An app that only listens "
+                 "would wait forever.")
+      .addOption({"merge-memory"}, [this]() { mergeMemory = true; return true; },
+                 "Let the kernel deduplicate (KSM) the app's memory with that of other processes "
+                 "which allow it, e.g. other grains of the same app started with this option.  "
+                 "Saves memory when many grains run the same runtime, but a grain may then be "
+                 "able to tell, by timing, whether another holds a page of given contents.  Has "
+                 "no effect unless KSM is enabled (/sys/kernel/mm/ksm/run).  Implied for every "
+                 "grain if the server's config sets MERGE_MEMORY=yes.")
       .addOption({'n', "new"}, [this]() { setIsNew(true); return true; },
                  "Initializes a new grain.  (Otherwise, runs an existing one.)")
+      .addOptionWithArg({"quota"}, KJ_BIND_METHOD(*this, setQuota), "<bytes>",
+                        "Shut the grain down if its storage grows beyond <bytes>.  Can be changed "
+                        "later with Supervisor.setStorageQuota().  Default: no quota.")
+      .addOptionWithArg({"clone"}, KJ_BIND_METHOD(*this, setCloneFrom), "<path>",
+                        "With --new, initializes the grain's storage as a copy of that of the "
+                        "grain whose var directory is <path>.  The copy shares storage with the "
+                        "original where the filesystem supports reflinks.")
+      .addOptionWithArg({"cgroup"}, KJ_BIND_METHOD(*this, setCgroup), "<path>",
+                        "Run the app in its own cgroup, <path>/<grain-id>, so that it can be "
+                        "hibernated with Supervisor.hibernate().  <path> must be a cgroup v2 "
+                        "directory delegated to the supervisor's user, containing the "
+                        "supervisor's own cgroup or a sibling of it.  The front-end passes this "
+                        "option if the server's config sets GRAIN_CGROUP.")
       .expectArg("<app-name>", KJ_BIND_METHOD(*this, setAppName))
       .expectArg("<grain-id>", KJ_BIND_METHOD(*this, setGrainId))
       .expectOneOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
@@ -598,6 +713,26 @@ kj::MainBuilder::Validity SupervisorMain::setVar(kj::StringPtr path) {
   return true;
 }
 
+kj::MainBuilder::Validity SupervisorMain::setQuota(kj::StringPtr arg) {
+  char* end;
+  errno = 0;
+  quota = strtoull(arg.cStr(), &end, 10);
+  if (arg.size() == 0 || *end != '\0' || errno != 0) {
+    return "Invalid byte count.";
+  }
+  return true;
+}
+
+kj::MainBuilder::Validity SupervisorMain::setCloneFrom(kj::StringPtr path) {
+  cloneFromPath = realPath(kj::heapString(path));
+  return true;
+}
+
+kj::MainBuilder::Validity SupervisorMain::setCgroup(kj::StringPtr path) {
+  cgroupParent = realPath(kj::heapString(path));
+  return true;
+}
+
 kj::MainBuilder::Validity SupervisorMain::addEnv(kj::StringPtr arg) {
   environment.add(kj::heapString(arg));
   return true;
@@ -624,6 +759,23 @@ kj::MainBuilder::Validity SupervisorMain::run() {
   // Allocate the API socket.
   int fds[2];
   KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+  if (shmApi) {
+    apiShm = newShmStreamFds();
+  }
+
+  // Have the kernel start reading in what the app will need, or, if we don't know that yet, clear
+  // the package out of the page cache so that we can find out by seeing what comes back.
+  KJ_IF_MAYBE(p, prefetcher) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      if (p->get()->hasProfile()) {
+        p->get()->prefetch();
+      } else {
+        p->get()->evict();
+      }
+    })) {
+      KJ_LOG(WARNING, "package prefetch failed", *exception);
+    }
+  }
 
   // Now time to run the start command, in a further chroot.
   KJ_SYSCALL(childPid = fork());
@@ -693,6 +845,7 @@ void SupervisorMain::setupSupervisor() {
   KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
 
   closeFds();
+  placeGrain();
   checkPaths();
   unshareOuter();
   setupFilesystem();
@@ -701,6 +854,24 @@ void SupervisorMain::setupSupervisor() {
   // Note:  permanentlyDropSuperuser() is performed post-fork; see comment in function def.
 }
 
+void SupervisorMain::placeGrain() {
+  // Confine ourselves, and so the app, to the least busy of the CPU domains that the server set
+  // aside for grains, if it did. See grain-placement.h.
+
+  const char* domainsText = getenv(GRAIN_PLACEMENT_ENV);
+  if (domainsText == nullptr) return;
+
+  // Grains run fine anywhere, so don't refuse to start over this.
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    auto domains = parsePlacementDomains(domainsText);
+    auto& domain = domains[choosePlacementDomain(domains, findRunningGrainCpus())];
+    applyPlacement(domain);
+    placed = true;
+  })) {
+    KJ_LOG(WARNING, "grain placement failed", *exception);
+  }
+}
+
 void SupervisorMain::closeFds() {
   // Close all unexpected file descriptors (i.e. other than stdin/stdout/stderr).  This is a
   // safety measure incase we were launched by a badly-written parent program which forgot to
@@ -765,6 +936,26 @@ void SupervisorMain::checkPaths() {
   // Check that package exists.
   KJ_SYSCALL(access(pkgPath.cStr(), R_OK | X_OK), pkgPath);
 
+  // Open the package for prefetching while it can still be found by path.  Prefetching is only
+  // an optimization, so it mustn't stop the grain from starting.
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    prefetcher = kj::heap<PackagePrefetcher>(pkgPath);
+  })) {
+    KJ_LOG(WARNING, "package prefetch unavailable", *exception);
+  }
+
+  // Likewise, the app's cgroup must be set up while it can be found, but the grain can run
+  // without it, just not hibernate.
+  if (cgroupParent != nullptr) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      auto cgroup = kj::heap<AppCgroup>(cgroupParent, grainId);
+      exitCgroup = cgroup;
+      appCgroup = kj::mv(cgroup);
+    })) {
+      KJ_LOG(WARNING, "can't create the app's cgroup; hibernation unavailable", *exception);
+    }
+  }
+
   // Create / verify existence of the var directory.  Do this as the target user.
   if (isNew) {
     if (mkdir(varPath.cStr(), 0770) != 0) {
@@ -775,8 +966,25 @@ void SupervisorMain::checkPaths() {
         KJ_FAIL_SYSCALL("mkdir(varPath.cStr(), 0770)", error, varPath);
       }
     }
-    KJ_SYSCALL(mkdir(kj::str(varPath, "/sandbox").cStr(), 0770), varPath);
+    if (cloneFromPath == nullptr) {
+      KJ_SYSCALL(mkdir(kj::str(varPath, "/sandbox").cStr(), 0770), varPath);
+    } else {
+      // Reflinked where possible, so this is mostly metadata work even for a big grain. Files
+      // written by the source grain while we copy are each copied whole, but not necessarily all
+      // at the same instant; callers wanting an exact snapshot should stop the source first.
+      // The new grain's DiskUsageWatcher counts cloned files at their full size, which is also
+      // what they will cost once either grain modifies them.
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        cloneTree(kj::str(cloneFromPath, "/sandbox"), kj::str(varPath, "/sandbox"));
+      })) {
+        recursivelyDelete(varPath);
+        kj::throwFatalException(kj::mv(*exception));
+      }
+    }
   } else {
+    if (cloneFromPath != nullptr) {
+      context.exitError("--clone can only be used with --new.");
+    }
     if (access(varPath.cStr(), R_OK | W_OK | X_OK) != 0) {
       int error = errno;
       if (error == ENOENT) {
@@ -801,6 +1009,9 @@ void SupervisorMain::checkPaths() {
   KJ_SYSCALL(logfd = open(kj::str(varPath, "/log").cStr(),
       O_WRONLY | O_APPEND | O_CLOEXEC | O_CREAT, 0600));
   KJ_SYSCALL(close(logfd));
+
+  // Check now, while the grain directory's parent is still visible.
+  projectQuota = hasProjectQuota(varPath);
 }
 
 void SupervisorMain::writeSetgroupsIfPresent(const char *contents) {
@@ -1065,6 +1276,14 @@ void SupervisorMain::setupSeccomp() {
   CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(set_mempolicy), 0));
   CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(migrate_pages), 0));
   CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(move_pages), 0));
+
+  // Keep the app in the CPU domain we placed it in (see placeGrain()). This refuses every call,
+  // including ones that would only narrow the affinity within the domain, e.g. a runtime pinning
+  // its threads: seccomp can't read the mask the call points to, so it can't tell the two apart.
+  // Such apps run unpinned; they generally cope with EPERM here, as containers often refuse it.
+  if (placed) {
+    CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EPERM), SCMP_SYS(sched_setaffinity), 0));
+  }
   CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(vmsplice), 0));
 
   // Scary futex operations
@@ -1074,6 +1293,17 @@ void SupervisorMain::setupSeccomp() {
   // Utterly terrifying profiling operations
   CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(perf_event_open), 0));
 
+  // Memory merging (KSM) is a side channel between the processes taking part, so whether the app
+  // takes part is up to the supervisor (--merge-memory), not the app.  Fail the way a kernel
+  // without KSM would.  Opting out with MADV_UNMERGEABLE remains allowed.
+  //
+  // Both arguments are ints, which the kernel truncates to 32 bits, so compare only those: the
+  // upper half of the register may hold anything.
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EINVAL), SCMP_SYS(prctl), 1,
+      SCMP_A0(SCMP_CMP_MASKED_EQ, 0xffffffff, PR_SET_MEMORY_MERGE)));
+  CHECK_SECCOMP(seccomp_rule_add(ctx, SCMP_ACT_ERRNO(EINVAL), SCMP_SYS(madvise), 1,
+      SCMP_A2(SCMP_CMP_MASKED_EQ, 0xffffffff, MADV_MERGEABLE)));
+
   // TOOD(someday): See if we can get away with turning off mincore, madvise, sysinfo etc.
 
   // TODO(someday): Turn off POSIX message queues and other such esoteric features.
@@ -1408,6 +1638,16 @@ void SupervisorMain::enterSandbox() {
   // Mount proc if --proc was passed.
   maybeFinishMountingProc();
 
+  // Opt into memory merging if --merge-memory was passed, or implied by the server's config.  The
+  // setting is inherited across fork() and, on recent kernels, exec(), so it covers the whole app.
+  if (mergeMemory || getenv(MERGE_MEMORY_ENV) != nullptr) {
+    if (prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) < 0) {
+      int error = errno;
+      KJ_LOG(WARNING, "kernel doesn't support memory merging; running without it",
+             strerror(error));
+    }
+  }
+
   // Now actually drop all credentials.
   permanentlyDropSuperuser();
 
@@ -1474,6 +1714,11 @@ void SupervisorMain::checkIfAlreadyRunning() {
 [[noreturn]] void SupervisorMain::runChild(int apiFd) {
   // We are the child.
 
+  // Join the app's cgroup first, so that everything the app starts is inside it.
+  KJ_IF_MAYBE(c, appCgroup) {
+    c->get()->enter();
+  }
+
   enterSandbox();
 
   // Reset all signal handlers to default.  (exec() will leave ignored signals ignored, and KJ
@@ -1488,6 +1733,16 @@ void SupervisorMain::checkIfAlreadyRunning() {
   sigemptyset(&sigmask);
   KJ_SYSCALL(sigprocmask(SIG_SETMASK, &sigmask, nullptr));
 
+  // If offering the shared-memory transport, first move its FDs out of the way of the ones we're
+  // about to place.
+  int shmFds[3];
+  KJ_IF_MAYBE(shm, apiShm) {
+    int original[3] = { shm->memory, shm->doorbells[0], shm->doorbells[1] };
+    for (uint i = 0; i < 3; i++) {
+      KJ_SYSCALL(shmFds[i] = fcntl(original[i], F_DUPFD_CLOEXEC, 10));
+    }
+  }
+
   // Make sure the API socket is on FD 3.
   if (apiFd == 3) {
     // Socket end already has correct fd.  Unset CLOEXEC.
@@ -1498,6 +1753,14 @@ void SupervisorMain::checkIfAlreadyRunning() {
     KJ_SYSCALL(close(apiFd));
   }
 
+  // Shared-memory transport FDs go on 4, 5, and 6.  (dup2() clears CLOEXEC.)
+  if (apiShm != nullptr) {
+    for (uint i = 0; i < 3; i++) {
+      KJ_SYSCALL(dup2(shmFds[i], 4 + i));
+    }
+    environment.add(kj::heapString("SANDSTORM_API_SHM=4,5,6"));
+  }
+
   // Redirect stdout to stderr, so that our own stdout serves one purpose:  to notify the parent
   // process when we're ready to accept connections.  We previously directed stderr to a log file.
   KJ_SYSCALL(dup2(STDERR_FILENO, STDOUT_FILENO));
@@ -1521,9 +1784,107 @@ void SupervisorMain::checkIfAlreadyRunning() {
   KJ_UNREACHABLE;
 }
 
+class SupervisorMain::WakeLockTable {
+  // Tracks wake locks taken with `SandstormApi.stayAwake()`. Wake locks don't outlast the
+  // process, so this lives only in memory.
+
+public:
+  uint32_t add(NotificationDisplayInfo::Reader displayInfo,
+               OngoingNotification::Client notification) {
+    uint32_t id = nextId++;
+    auto& lock = locks.insert(std::make_pair(id, Lock(kj::mv(notification)))).first->second;
+    lock.displayInfo->setRoot(displayInfo);
+    struct timeval now;
+    KJ_SYSCALL(gettimeofday(&now, nullptr));
+    lock.since = now.tv_sec * 1000ll + now.tv_usec / 1000;
+    wakeLockCount = locks.size();
+    return id;
+  }
+
+  void release(uint32_t id) {
+    // Does nothing if the lock is already gone, e.g. because it was canceled.
+    locks.erase(id);
+    wakeLockCount = locks.size();
+  }
+
+  kj::Promise<void> cancel(uint32_t id) {
+    auto iter = locks.find(id);
+    if (iter == locks.end()) return kj::READY_NOW;
+    auto notification = kj::mv(iter->second.notification);
+    release(id);
+    return notification.cancelRequest().send().then([](auto&&) {});
+  }
+
+  void list(capnp::List<WakeLockInfo>::Builder builder) {
+    uint i = 0;
+    for (auto& lock: locks) {
+      auto info = builder[i++];
+      info.setId(lock.first);
+      info.setDisplayInfo(lock.second.displayInfo->getRoot<NotificationDisplayInfo>().asReader());
+      info.setSince(lock.second.since);
+    }
+  }
+
+  size_t size() const { return locks.size(); }
+
+private:
+  struct Lock {
+    OngoingNotification::Client notification;
+    kj::Own<capnp::MallocMessageBuilder> displayInfo;
+    int64_t since = 0;
+    // Milliseconds since the Unix epoch.
+
+    explicit Lock(OngoingNotification::Client notification)
+        : notification(kj::mv(notification)),
+          displayInfo(kj::heap<capnp::MallocMessageBuilder>()) {}
+  };
+
+  std::map<uint32_t, Lock> locks;
+  uint32_t nextId = 1;
+};
+
+class SupervisorMain::WakeLockHandle final: public Util::Handle::Server {
+  // Returned by `stayAwake()`. Releases the lock when the app drops it.
+
+public:
+  WakeLockHandle(WakeLockTable& table, uint32_t id): table(table), id(id) {}
+  ~WakeLockHandle() noexcept(false) {
+    table.release(id);
+  }
+
+private:
+  WakeLockTable& table;
+  uint32_t id;
+};
+
 class SupervisorMain::SandstormApiImpl final: public SandstormApi<>::Server {
 public:
-  // TODO(someday):  Implement API.
+  SandstormApiImpl(SavedCapTable& savedCaps, WakeLockTable& wakeLocks)
+      : savedCaps(savedCaps), wakeLocks(wakeLocks) {}
+
+  kj::Promise<void> save(SaveContext context) override {
+    // TODO(someday): Support saving capabilities that aren't hosted by the app, which requires
+    //   a connection to SandstormCore.
+    auto params = context.getParams();
+    return savedCaps.save(params.getCap(), params.getLabel())
+        .then([context](kj::Array<kj::byte>&& token) mutable {
+      context.getResults().setToken(token);
+    });
+  }
+
+  kj::Promise<void> restore(RestoreContext context) override {
+    auto cap = savedCaps.restore(context.getParams().getToken());
+    context.releaseParams();
+    context.getResults(capnp::MessageSize {4, 1}).setCap(kj::mv(cap));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> drop(DropContext context) override {
+    savedCaps.drop(context.getParams().getToken());
+    return kj::READY_NOW;
+  }
+
+  // TODO(someday):  Implement the rest of the API.
 //  kj::Promise<void> publish(PublishContext context) override {
 
 //  }
@@ -1540,54 +1901,68 @@ public:
 
 //  }
 
-//  kj::Promise<void> restore(RestoreContext context) override {
+//  kj::Promise<void> deleted(DeletedContext context) override {
 
 //  }
 
-//  kj::Promise<void> drop(DropContext context) override {
-
-//  }
+  kj::Promise<void> stayAwake(StayAwakeContext context) override {
+    // TODO(someday): Also pass a wrapper around `notification` to
+    //   SandstormCore.getOwnerNotificationTarget().addOngoing(), so that the owner sees it and can
+    //   cancel it. For now the front-end can only discover the lock via
+    //   `Supervisor.getWakeLocks()` and cancel it via `Supervisor.cancelWakeLock()`.
+    auto params = context.getParams();
+    uint32_t id = wakeLocks.add(params.getDisplayInfo(), params.getNotification());
+    context.releaseParams();
+    context.getResults(capnp::MessageSize {4, 1}).setHandle(
+        kj::heap<WakeLockHandle>(wakeLocks, id));
+    return kj::READY_NOW;
+  }
 
-//  kj::Promise<void> deleted(DeletedContext context) override {
+private:
+  SavedCapTable& savedCaps;
+  WakeLockTable& wakeLocks;
+};
 
-//  }
+static void logCallStats(const CallTracer& tracer) {
+  auto text = tracer.dump();
+  if (text.size() > 0) {
+    auto message = kj::str("** SANDSTORM SUPERVISOR: App call stats:\n", text);
+    kj::FdOutputStream(STDERR_FILENO).write(message.begin(), message.size());
+  }
+}
 
-//  kj::Promise<void> stayAwake(StayAwakeContext context) override {
-    // TODO(someday): The supervisor will need to maintain a map of "wake locks". Since wake locks
-    //   by their nature do not outlast the process, this map can be held in-memory. When
-    //   `stayAwake()` is called, the supervisor:
-    //   - Generates a new wake lock ID (a random byte string; use libsodium's randombytes()).
-    //   - Adds it to the table, mapping it to the `OngoingNotification` provided by the app.
-    //   - Constructs a wrapper around `OngoingNotification` to be passed to the front-end. The
-    //     wrapper is persistent (using the wake lock ID).
-    //   - Calls SandstormCore.getOwnerNotificationTarget().addOngoing(), passing along
-    //     this new wrapper object as well as the `displayInfo` provided from the app.
-    //   - On the handle returned by `notifyOwnerOngoing()`, immediately calls `save()` (with
-    //     sealFor = this grain; see `SystemPersistent`), storing the resulting `SturdyRef`
-    //     (actually, just an API token) into the wake lock table entry.
-    //   - Constructs a new handle object and returns it from `stayAwake()`.
-    //   - When that handle is destroyed, loads up the wake lock table entry and calls
-    //     SandstormCore.drop() on the handle SturdyRef stored there.
-    //   - When SandstormCore calls the wrapper OngoingNotification's `cancel()` method, forwards
-    //     that call to the app.
-    //   - When SandstormCore drops the wrapper OngoingNotification (via `Supervisor.drop()`),
-    //     drops the underlying OngoingNotification from the app.
-    //   - When everything is dropped, deletes the wake lock table entry.
-    //
-    //   Meanwhile, until the point that SandstormCore drops the OngoingNotification, the
-    //   supervisor does not kill itself during its regular keep-alive check.
-    //
-    //   The main reason this is so complicated is that the front-end is supposed to be able to
-    //   restart independently of the app, but the `OngoingNotification` provided by the app is
-    //   not required to be persistent. The supervisor thus takes care of the complication of
-    //   dealing with persistence through front-end restarts.
-//  }
-};
+static constexpr kj::Duration CALL_STATS_SNAPSHOT_INTERVAL = 30 * kj::SECONDS;
+// How often snapshotCallStats() runs. The idle shutdown comes at least 90 seconds after the last
+// keep-alive, so the snapshot it logs misses nothing but stragglers.
+
+static kj::String callStatsText;
+// Owns the string callStatsSnapshot points at.
+
+static kj::Promise<void> snapshotCallStats(kj::Timer& timer, const CallTracer& tracer) {
+  auto text = tracer.dump();
+  if (text.size() > 0) {
+    // Publish the new snapshot before freeing the old one, which the signal handler might
+    // otherwise be reading.
+    auto snapshot = kj::str("** SANDSTORM SUPERVISOR: App call stats:\n", text);
+    callStatsSnapshot = snapshot.cStr();
+    callStatsText = kj::mv(snapshot);
+  }
+  return timer.afterDelay(CALL_STATS_SNAPSHOT_INTERVAL).then([&timer, &tracer]() {
+    return snapshotCallStats(timer, tracer);
+  });
+}
 
 class SupervisorMain::SupervisorImpl final: public Supervisor::Server {
 public:
-  inline SupervisorImpl(UiView::Client&& mainView, DiskUsageWatcher& diskWatcher)
-      : mainView(kj::mv(mainView)), diskWatcher(diskWatcher) {}
+  inline SupervisorImpl(UiView::Client&& mainView, HttpBridgeUiView::Client&& bridgeView,
+                        DiskUsageWatcher& diskWatcher, WakeLockTable& wakeLocks,
+                        CallTracer& tracer, uint64_t quota,
+                        kj::Maybe<AppCgroup&> appCgroup, kj::Timer& timer)
+      : mainView(kj::mv(mainView)), bridgeView(kj::mv(bridgeView)),
+        diskWatcher(diskWatcher), wakeLocks(wakeLocks),
+        tracer(tracer), appCgroup(appCgroup), timer(timer), quotaTask(kj::READY_NOW) {
+    setQuota(quota);
+  }
 
   kj::Promise<void> getMainView(GetMainViewContext context) {
     context.getResults(capnp::MessageSize {4, 1}).setView(mainView);
@@ -1600,6 +1975,7 @@ public:
   }
 
   kj::Promise<void> shutdown(ShutdownContext context) {
+    logCallStats(tracer);
     killChildAndExit(0);
   }
 
@@ -1616,9 +1992,146 @@ public:
     });
   }
 
+  kj::Promise<void> setStorageQuota(SetStorageQuotaContext context) {
+    setQuota(context.getParams().getBytes());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> drop(DropContext context) {
+    auto ref = context.getParams().getRef();
+    switch (ref.which()) {
+      case SupervisorObjectId<>::APP_REF: {
+        auto request = mainView.castAs<MainView<>>().dropRequest();
+        request.getObjectId().set(ref.getAppRef());
+        context.releaseParams();
+        return request.send().then([](auto&&) {});
+      }
+      case SupervisorObjectId<>::WAKE_LOCK_NOTIFICATION:
+        wakeLocks.release(ref.getWakeLockNotification());
+        return kj::READY_NOW;
+    }
+    KJ_UNREACHABLE;
+  }
+
+  kj::Promise<void> getWakeLocks(GetWakeLocksContext context) {
+    wakeLocks.list(context.getResults().initLocks(wakeLocks.size()));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> cancelWakeLock(CancelWakeLockContext context) {
+    return wakeLocks.cancel(context.getParams().getId());
+  }
+
+  kj::Promise<void> getCallStats(GetCallStatsContext context) {
+    auto results = context.getResults();
+    results.adoptMethods(tracer.getStats(capnp::Orphanage::getForMessageContaining(results)));
+
+    // Only sandstorm-http-bridge has a request queue to report. Asking goes through the untraced
+    // view, and not at all while hibernating, as it would thaw the app.
+    if (hibernating) return kj::READY_NOW;
+    return bridgeView.getRequestQueueStatsRequest().send().then(
+        [context](capnp::Response<HttpBridgeUiView::GetRequestQueueStatsResults>&& response)
+        mutable {
+      context.getResults().setRequestQueue(response.getStats());
+    }, [](kj::Exception&& exception) {
+      if (exception.getType() != kj::Exception::Type::UNIMPLEMENTED) {
+        kj::throwFatalException(kj::mv(exception));
+      }
+    });
+  }
+
+  kj::Promise<void> hibernate(HibernateContext context) {
+    AppCgroup* cgroup;
+    KJ_IF_MAYBE(c, appCgroup) {
+      cgroup = c;
+    } else {
+      KJ_FAIL_REQUIRE("can't hibernate: supervisor wasn't given a cgroup for the app");
+    }
+    bool reclaimMemory = context.getParams().getReclaimMemory();
+
+    if (!cgroup->isFrozen()) {
+      SANDSTORM_LOG("Grain hibernating.");
+      cgroup->freeze();
+      hibernating = true;
+    }
+
+    return waitUntilFrozen(*cgroup, 0).then([this, cgroup, reclaimMemory]()
+        -> kj::Promise<kj::Maybe<uint64_t>> {
+      // Don't bother if a call has already woken the app.
+      if (reclaimMemory && cgroup->isFrozen()) {
+        return cgroup->reclaimMemory(timer);
+      } else {
+        return kj::Maybe<uint64_t>(nullptr);
+      }
+    }).then([context](kj::Maybe<uint64_t> bytes) mutable {
+      uint64_t residentBytes = 0;
+      KJ_IF_MAYBE(b, bytes) {
+        residentBytes = *b;
+      }
+      context.getResults(capnp::MessageSize { 2, 0 }).setResidentBytes(residentBytes);
+    });
+  }
+
 private:
   UiView::Client mainView;
+  HttpBridgeUiView::Client bridgeView;
+  // The app's view without the tracer, if it's sandstorm-http-bridge's.
   DiskUsageWatcher& diskWatcher;
+  WakeLockTable& wakeLocks;
+  CallTracer& tracer;
+  kj::Maybe<AppCgroup&> appCgroup;
+  kj::Timer& timer;
+
+  uint64_t quota = 0;
+  // Zero if there is no quota.
+
+  uint64_t allowance = 0;
+  // The size the grain may grow to: the quota, or the smallest size seen since the quota was set
+  // if that's bigger. A grain that is already over its quota may keep running -- e.g. so that the
+  // user can delete things -- as long as it doesn't grow.
+
+  kj::Promise<void> quotaTask;
+
+  void setQuota(uint64_t bytes) {
+    quota = bytes;
+    if (quota == 0) {
+      quotaTask = kj::READY_NOW;
+    } else {
+      allowance = kj::max(quota, diskWatcher.getSize());
+      quotaTask = watchQuota(diskWatcher.getSize()).eagerlyEvaluate([](kj::Exception&& e) {
+        KJ_LOG(ERROR, "storage quota watch failed", e);
+      });
+    }
+  }
+
+  kj::Promise<void> waitUntilFrozen(AppCgroup& cgroup, uint attempts) {
+    // The kernel only announces that freezing is complete through a change to cgroup.events, so
+    // poll that, for up to a second. Give up early if the app is thawed meanwhile.
+
+    if (!cgroup.isFrozen() || cgroup.isFullyFrozen() || attempts >= 100) {
+      return kj::READY_NOW;
+    }
+    return timer.afterDelay(10 * kj::MILLISECONDS).then([this, &cgroup, attempts]() {
+      return waitUntilFrozen(cgroup, attempts + 1);
+    });
+  }
+
+  kj::Promise<void> watchQuota(uint64_t size) {
+    // We can't make the app's writes fail once it reaches the quota: without a project quota (see
+    // hasProjectQuota(), in which case the kernel returns EDQUOT itself) nothing below us counts
+    // the grain's usage, and we're too unprivileged to set one up. So the grain may overrun by
+    // whatever it writes before the watcher reports the change, and is then shut down.
+
+    allowance = kj::max(quota, kj::min(allowance, size));
+    if (size > allowance) {
+      SANDSTORM_LOG("Grain exceeded its storage quota; shutting down.");
+      killChildAndExit(1);
+    }
+
+    return diskWatcher.getSizeWhenChanged(size).then([this](uint64_t newSize) {
+      return watchQuota(newSize);
+    });
+  }
 };
 
 struct SupervisorMain::AcceptedConnection {
@@ -1652,6 +2165,47 @@ public:
   }
 };
 
+class SupervisorMain::ThawingStream final: public kj::AsyncIoStream {
+  // Wraps the connection to the app, thawing the app before anything is sent to it, so that
+  // callers never notice that it was hibernating. Supervisor calls that the supervisor answers
+  // itself, such as getWakeLocks() and getCallStats(), send nothing to the app, and so
+  // deliberately leave it frozen.
+
+public:
+  ThawingStream(kj::Own<kj::AsyncIoStream>&& inner, AppCgroup& cgroup)
+      : inner(kj::mv(inner)), cgroup(cgroup) {}
+
+  kj::Promise<size_t> read(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return inner->read(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return inner->tryRead(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    thawIfFrozen();
+    return inner->write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const kj::byte>> pieces) override {
+    thawIfFrozen();
+    return inner->write(pieces);
+  }
+  void shutdownWrite() override {
+    inner->shutdownWrite();
+  }
+
+private:
+  kj::Own<kj::AsyncIoStream> inner;
+  AppCgroup& cgroup;
+
+  void thawIfFrozen() {
+    if (cgroup.isFrozen()) {
+      cgroup.thaw();
+      hibernating = false;
+      SANDSTORM_LOG("Grain woke from hibernation.");
+    }
+  }
+};
+
 [[noreturn]] void SupervisorMain::runSupervisor(int apiFd) {
   // We're currently in a somewhat dangerous state: our root directory is controlled
   // by the app.  If glibc reads, say, /etc/nsswitch.conf, the grain could take control
@@ -1659,6 +2213,10 @@ public:
   // TODO(someday): chroot somewhere that's guaranteed to be empty instead, so that if the
   //   supervisor storage is itself compromised it can't be used to execute arbitrary code in
   //   the supervisor process.
+  // The saved capability table needs randomness for its tokens, and there's no /dev after the
+  // chroot.
+  auto randomFd = raiiOpen("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
   KJ_SYSCALL(chroot("."));
 
   permanentlyDropSuperuser();
@@ -1672,13 +2230,23 @@ public:
   kj::UnixEventPort::captureSignal(SIGCHLD);
   auto ioContext = kj::setupAsyncIo();
 
+  // Count and time calls into the app, so that a slow app can be told apart from a slow platform.
+  CallTracer tracer;
+  auto callStatsTask = snapshotCallStats(ioContext.provider->getTimer(), tracer)
+      .eagerlyEvaluate([](kj::Exception&& e) {
+    KJ_LOG(ERROR, "snapshotting call stats failed", e);
+  });
+
   // Detect child exit.
-  auto exitPromise = ioContext.unixEventPort.onSignal(SIGCHLD).then([this](siginfo_t info) {
+  auto exitPromise = ioContext.unixEventPort.onSignal(SIGCHLD)
+      .then([this, &tracer](siginfo_t info) {
     KJ_ASSERT(childPid != 0);
     int status;
     KJ_SYSCALL(waitpid(childPid, &status, 0));
     childPid = 0;
     KJ_ASSERT(WIFEXITED(status) || WIFSIGNALED(status));
+    logCallStats(tracer);
+    if (exitCgroup != nullptr) exitCgroup->killAndRemove();
     if (WIFSIGNALED(status)) {
       context.exitError(kj::str(
           "** SANDSTORM SUPERVISOR: App exited due to signal ", WTERMSIG(status),
@@ -1693,27 +2261,66 @@ public:
   });
 
   // Compute grain size and watch for changes.
-  DiskUsageWatcher diskWatcher(ioContext.unixEventPort);
+  DiskUsageWatcher diskWatcher(ioContext.unixEventPort, projectQuota);
   auto diskWatcherTask = diskWatcher.init();
 
+  // Once the app has had time to start, record what it read from the package, if nobody has yet.
+  kj::Promise<void> prefetchTask = nullptr;
+  KJ_IF_MAYBE(p, prefetcher) {
+    if (!p->get()->hasProfile()) {
+      PackagePrefetcher& prefetcherRef = **p;
+      prefetchTask = ioContext.provider->getTimer().afterDelay(PREFETCH_RECORD_DELAY)
+          .then([&prefetcherRef]() {
+        prefetcherRef.record();
+      }).eagerlyEvaluate([](kj::Exception&& e) {
+        KJ_LOG(WARNING, "recording package prefetch profile failed", e);
+      });
+    }
+  }
+
   // Set up the RPC connection to the app and export the supervisor interface.
-  auto appConnection = ioContext.lowLevelProvider->wrapSocketFd(apiFd,
+  kj::Own<kj::AsyncIoStream> appConnection = ioContext.lowLevelProvider->wrapSocketFd(apiFd,
       kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
       kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+  KJ_IF_MAYBE(shm, apiShm) {
+    appConnection = acceptShmTransport(ioContext.unixEventPort, kj::mv(appConnection),
+                                       kj::mv(*shm))
+        .wait(ioContext.waitScope);
+    apiShm = nullptr;
+  }
+  kj::Maybe<AppCgroup&> cgroup;
+  KJ_IF_MAYBE(c, appCgroup) {
+    appConnection = kj::heap<ThawingStream>(kj::mv(appConnection), **c);
+    cgroup = **c;
+  }
   capnp::TwoPartyVatNetwork appNetwork(*appConnection, capnp::rpc::twoparty::Side::SERVER);
-  auto server = capnp::makeRpcServer(appNetwork, kj::heap<SandstormApiImpl>());
 
-  // Get the app's UiView by restoring a null SturdyRef from it.
+  // The saved capability table restores objects through the app's MainView, which we can only
+  // get once the RPC system exists, which in turn needs the table. Break the cycle with a promise.
+  auto appPaf = kj::newPromiseAndFulfiller<MainView<>::Client>();
+  SavedCapTable savedCaps("saved-caps", kj::mv(randomFd), kj::mv(appPaf.promise));
+  WakeLockTable wakeLocks;
+  auto server = capnp::makeRpcServer(appNetwork,
+      kj::heap<SandstormApiImpl>(savedCaps, wakeLocks));
+
+  // Get the app's MainView by restoring a null SturdyRef from it.
   capnp::MallocMessageBuilder message;
   auto hostId = message.initRoot<capnp::rpc::twoparty::VatId>();
   hostId.setSide(capnp::rpc::twoparty::Side::CLIENT);
-  UiView::Client app = server.bootstrap(hostId).castAs<UiView>();
+  tracer.addInterface(capnp::Schema::from<WebSession>());
+  auto bootstrap = server.bootstrap(hostId);
+  auto mainView = tracer.wrap<MainView<>>(bootstrap.castAs<MainView<>>());
+  appPaf.fulfiller->fulfill(kj::cp(mainView));
+  UiView::Client app = mainView.castAs<UiView>();
 
   // Set up the external RPC interface, re-exporting the UiView.
   // TODO(someday):  If there are multiple front-ends, or the front-ends restart a lot, we'll
   //   want to wrap the UiView and cache session objects.  Perhaps we could do this by making
   //   them persistable, though it's unclear how that would work with SessionContext.
-  Supervisor::Client mainCap = kj::heap<SupervisorImpl>(kj::mv(app), diskWatcher);
+  Supervisor::Client mainCap = kj::heap<SupervisorImpl>(
+      kj::mv(app), bootstrap.castAs<HttpBridgeUiView>(), diskWatcher, wakeLocks, tracer, quota,
+      cgroup,
+      ioContext.provider->getTimer());
   ErrorHandlerImpl errorHandler;
   kj::TaskSet tasks(errorHandler);
   unlink("socket");  // Clear stale socket, if any.
@@ -1741,6 +2348,7 @@ public:
       .wait(ioContext.waitScope);
 
   SANDSTORM_LOG("App disconnected API socket but didn't actually exit; killing it.");
+  logCallStats(tracer);
   killChildAndExit(1);
 }
 
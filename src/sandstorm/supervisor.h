@@ -18,12 +18,19 @@
 #define SANDSTORM_SUPERVISOR_H_
 
 #include "abstract-main.h"
+#include "shm-stream.h"
+#include "prefetch.h"
+#include "app-cgroup.h"
 #include <kj/vector.h>
 #include <kj/async-io.h>
 #include <capnp/capability.h>
 
 namespace sandstorm {
 
+constexpr const char* MERGE_MEMORY_ENV = "SANDSTORM_MERGE_MEMORY";
+// If set, the supervisor acts as if given --merge-memory. The server monitor sets it per the
+// MERGE_MEMORY config key, and the front-end's supervisors inherit it.
+
 class SupervisorMain: public AbstractMain {
   // Main class for the Sandstorm supervisor.  This program:
   // - Sets up a sandbox for a grain.
@@ -46,6 +53,9 @@ public:
   kj::MainBuilder::Validity setGrainId(kj::StringPtr id);
   kj::MainBuilder::Validity setPkg(kj::StringPtr path);
   kj::MainBuilder::Validity setVar(kj::StringPtr path);
+  kj::MainBuilder::Validity setCloneFrom(kj::StringPtr path);
+  kj::MainBuilder::Validity setCgroup(kj::StringPtr path);
+  kj::MainBuilder::Validity setQuota(kj::StringPtr arg);
   kj::MainBuilder::Validity addEnv(kj::StringPtr arg);
   kj::MainBuilder::Validity addCommandArg(kj::StringPtr arg);
   // Flag handlers
@@ -59,6 +69,8 @@ private:
   kj::String grainId;
   kj::String pkgPath;
   kj::String varPath;
+  kj::String cloneFromPath;
+  kj::String cgroupParent;
   kj::Vector<kj::String> command;
   kj::Vector<kj::String> environment;
   bool isNew = false;
@@ -67,15 +79,27 @@ private:
   bool devmode = false;
   bool seccompDumpPfc = false;
   bool isIpTablesAvailable = false;
+  bool projectQuota = false;
+  bool shmApi = false;
+  bool mergeMemory = false;
+  bool placed = false;
+  uint64_t quota = 0;
+  kj::Maybe<ShmStreamFds> apiShm;
+  kj::Maybe<kj::Own<PackagePrefetcher>> prefetcher;
+  kj::Maybe<kj::Own<AppCgroup>> appCgroup;
 
+  class WakeLockTable;
+  class WakeLockHandle;
   class SandstormApiImpl;
   class SupervisorImpl;
+  class ThawingStream;
   struct AcceptedConnection;
   class ErrorHandlerImpl;
 
   void bind(kj::StringPtr src, kj::StringPtr dst, unsigned long flags = 0);
   kj::String realPath(kj::StringPtr path);
   void setupSupervisor();
+  void placeGrain();
   void closeFds();
   void checkPaths();
   void writeSetgroupsIfPresent(const char *contents);
@@ -0,0 +1,72 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014 Sandstorm Development Group, Inc. and contributors
+// All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SANDSTORM_TEST_UTIL_H_
+#define SANDSTORM_TEST_UTIL_H_
+// Helpers shared by the *-test.c++ files. Not for use outside tests.
+
+#include <kj/async.h>
+#include <kj/debug.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+namespace sandstorm {
+
+class TempDir {
+  // A fresh directory under /tmp, recursively deleted on destruction.
+
+public:
+  explicit TempDir(kj::StringPtr prefix = "sandstorm-test") {
+    auto tmpl = kj::str("/tmp/", prefix, ".XXXXXX");
+    KJ_ASSERT(mkdtemp(tmpl.begin()) != nullptr);
+    path = kj::mv(tmpl);
+  }
+  ~TempDir() noexcept(false) {
+    recursivelyDelete(path);
+  }
+  KJ_DISALLOW_COPY(TempDir);
+
+  kj::String path;
+};
+
+inline kj::byte patternByte(size_t i, uint seed = 0) {
+  // Byte `i` of a pattern that doesn't repeat every 256 bytes, so that misplaced or duplicated
+  // chunks of a stream show up when it's compared with what was sent.
+  return i * 31 + (i >> 8) + seed;
+}
+
+inline kj::Array<kj::byte> makeContent(size_t size, uint seed) {
+  // `size` bytes of patternByte(), e.g. for an attachment or a stream's payload. Different seeds
+  // give different content.
+  auto result = kj::heapArray<kj::byte>(size);
+  for (size_t i = 0; i < size; i++) {
+    result[i] = patternByte(i, seed);
+  }
+  return result;
+}
+
+inline void turn(kj::WaitScope& waitScope) {
+  // Runs the event loop for a while, so that queued local calls, their returns, and promises
+  // waiting on them all get to run.
+  for (uint i = 0; i < 20; i++) {
+    kj::evalLater([]() {}).wait(waitScope);
+  }
+}
+
+}  // namespace sandstorm
+
+#endif // SANDSTORM_TEST_UTIL_H_
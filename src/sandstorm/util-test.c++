@@ -16,6 +16,13 @@
 
 #include "util.h"
 #include <kj/test.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <thread>
 
 namespace sandstorm {
 namespace {
@@ -71,5 +78,333 @@ KJ_TEST("base64 encoding/decoding") {
   }
 }
 
+class CollectingOutput final: public kj::OutputStream {
+public:
+  kj::Vector<char> text;
+
+  void write(const void* buffer, size_t size) override {
+    text.addAll(reinterpret_cast<const char*>(buffer),
+                reinterpret_cast<const char*>(buffer) + size);
+  }
+};
+
+KJ_TEST("Base64Encoder matches base64Encode for any split of the input") {
+  srand(1234);
+  for (uint i = 0; i < 200; i++) {
+    auto input = kj::heapArray<byte>(rand() % 20000);
+    for (auto& b: input) b = rand();
+    bool breakLines = i % 2 == 0;
+    auto expected = base64Encode(input, breakLines);
+
+    CollectingOutput output;
+    Base64Encoder encoder(breakLines);
+    size_t offset = 0;
+    while (offset < input.size()) {
+      size_t n = kj::min(input.size() - offset, size_t(rand() % 5000));
+      encoder.encode(input.slice(offset, offset + n), output);
+      offset += n;
+    }
+    encoder.finish(output);
+
+    KJ_ASSERT(kj::heapString(output.text.asPtr()) == expected, input.size());
+  }
+}
+
+KJ_TEST("readAll on a large file") {
+  char tmpl[] = "/tmp/sandstorm-util-test.XXXXXX";
+  int fd;
+  KJ_SYSCALL(fd = mkstemp(tmpl));
+  kj::AutoCloseFd file(fd);
+  KJ_DEFER(unlink(tmpl));
+
+  // Not a multiple of any buffer size we might use.
+  auto content = kj::heapString(5 * 1024 * 1024 + 123);
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = 'a' + i % 26;
+  }
+  kj::FdOutputStream(fd).write(content.begin(), content.size());
+
+  auto result = readAll(kj::StringPtr(tmpl));
+  KJ_EXPECT(result.size() == content.size());
+  KJ_EXPECT(result == content);
+  KJ_EXPECT(result.cStr()[result.size()] == '\0');
+
+  KJ_EXPECT(readAll(raiiOpen("/dev/null", O_RDONLY)) == "");
+}
+
+KJ_TEST("readAll on a pipe with short reads") {
+  int fds[2];
+  KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+  kj::AutoCloseFd readEnd(fds[0]);
+  kj::AutoCloseFd writeEnd(fds[1]);
+
+  // Write in small, delayed chunks so that the reader sees many short reads before EOF. Total
+  // size exceeds the pipe buffer, so the reader must keep going past the first stall.
+  const size_t CHUNK = 1000;
+  const uint CHUNKS = 200;
+  std::thread writer([&]() {
+    char buffer[CHUNK];
+    for (uint i = 0; i < CHUNKS; i++) {
+      memset(buffer, 'a' + i % 26, sizeof(buffer));
+      kj::FdOutputStream(writeEnd.get()).write(buffer, sizeof(buffer));
+      if (i % 16 == 0) usleep(1000);
+    }
+    writeEnd = nullptr;
+  });
+  KJ_DEFER(writer.join());
+
+  auto result = readAll(readEnd);
+  KJ_ASSERT(result.size() == CHUNK * CHUNKS, result.size());
+  for (uint i = 0; i < CHUNKS; i++) {
+    KJ_EXPECT(result[i * CHUNK] == 'a' + i % 26, i);
+    KJ_EXPECT(result[i * CHUNK + CHUNK - 1] == 'a' + i % 26, i);
+  }
+}
+
+KJ_TEST("readAll on /proc") {
+  // /proc files report st_size == 0.
+  auto status = readAll("/proc/self/status");
+  KJ_EXPECT(status.startsWith("Name:"), status);
+}
+
+KJ_TEST("splitLines") {
+  auto text = kj::heapString(
+      "  foo  \n"
+      "\n"
+      "# comment\n"
+      "bar = baz # trailing comment\n"
+      "\t\n"
+      "qux");
+
+  auto copies = splitLines(kj::heapString(text));
+  KJ_ASSERT(copies.size() == 3);
+  KJ_EXPECT(copies[0] == "foo");
+  KJ_EXPECT(copies[1] == "bar = baz");
+  KJ_EXPECT(copies[2] == "qux");
+
+  auto views = splitLinesInPlace(text);
+  KJ_ASSERT(views.size() == 3);
+  KJ_EXPECT(views[0] == "foo");
+  KJ_EXPECT(views[1] == "bar = baz");
+  KJ_EXPECT(views[2] == "qux");
+
+  // They really are views into the original buffer.
+  for (auto& view: views) {
+    KJ_EXPECT(view.begin() >= text.begin() && view.end() <= text.end());
+  }
+}
+
+KJ_TEST("splitLines on a large input") {
+  kj::Vector<kj::String> parts;
+  const uint LINE_COUNT = 100000;
+  for (uint i = 0; i < LINE_COUNT; i++) {
+    parts.add(kj::str("  line ", i, i % 10 == 0 ? " # comment" : "", "\n"));
+  }
+  auto text = kj::strArray(parts, "");
+
+  auto lines = splitLinesInPlace(text);
+  KJ_ASSERT(lines.size() == LINE_COUNT);
+  KJ_EXPECT(lines[0] == "line 0");
+  KJ_EXPECT(lines[12345] == "line 12345");
+  KJ_EXPECT(lines[LINE_COUNT - 1] == kj::str("line ", LINE_COUNT - 1));
+}
+
+static uint64_t nowMicros() {
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static uint makeTree(int dirfd, uint depth, uint fanout, uint filesPerDir) {
+  // Populate `dirfd` with `filesPerDir` files and `fanout` subdirectories, recursing to `depth`.
+  // Returns the number of entries created.
+
+  uint count = 0;
+  for (uint i = 0; i < filesPerDir; i++) {
+    auto name = kj::str("file", i);
+    if (i % 4 == 3) {
+      // Sprinkle in some symlinks, which must be deleted rather than followed.
+      KJ_SYSCALL(symlinkat("..", dirfd, name.cStr()));
+    } else {
+      raiiOpenAt(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+    }
+    ++count;
+  }
+  if (depth > 0) {
+    for (uint i = 0; i < fanout; i++) {
+      auto name = kj::str("dir", i);
+      KJ_SYSCALL(mkdirat(dirfd, name.cStr(), 0777));
+      count += 1 + makeTree(raiiOpenAt(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+                            depth - 1, fanout, filesPerDir);
+    }
+  }
+  return count;
+}
+
+KJ_TEST("recursivelyDelete on a synthetic deep tree") {
+  // Doubles as a benchmark: run with --verbose to see timings.
+
+  char tmpl[] = "/tmp/sandstorm-util-test.XXXXXX";
+  KJ_ASSERT(mkdtemp(tmpl) != nullptr);
+  kj::StringPtr root = tmpl;
+
+  // A bushy tree: 4^5 leaf directories, each level holding a few files.
+  uint entries = makeTree(raiiOpen(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC), 5, 4, 8);
+
+  // Plus one long chain, which can't be parallelized and exercises fd-relative descent.
+  {
+    auto chain = raiiOpen(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    for (uint i = 0; i < 200; i++) {
+      KJ_SYSCALL(mkdirat(chain, "d", 0777));
+      raiiOpenAt(chain, "f", O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+      chain = raiiOpenAt(chain, "d", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      entries += 2;
+    }
+  }
+
+  uint64_t start = nowMicros();
+  recursivelyDelete(root);
+  uint64_t elapsed = nowMicros() - start;
+
+  KJ_LOG(INFO, "recursivelyDelete", entries, elapsed);
+  KJ_EXPECT(access(tmpl, F_OK) < 0 && errno == ENOENT);
+}
+
+KJ_TEST("listDirectoryEntries") {
+  char tmpl[] = "/tmp/sandstorm-util-test.XXXXXX";
+  KJ_ASSERT(mkdtemp(tmpl) != nullptr);
+  KJ_DEFER(recursivelyDelete(tmpl));
+  auto dirFd = raiiOpen(tmpl, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  KJ_SYSCALL(mkdirat(dirFd, "subdir", 0777));
+  KJ_SYSCALL(symlinkat("subdir", dirFd, "link"));
+
+  // Enough files with long names to overflow the initial getdents64() buffer several times.
+  const uint FILE_COUNT = 2000;
+  for (uint i = 0; i < FILE_COUNT; i++) {
+    raiiOpenAt(dirFd, kj::str("some-rather-long-file-name-to-fill-the-buffer-", i),
+               O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC);
+  }
+
+  auto listing = listDirectoryEntries(raiiOpen(tmpl, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  KJ_EXPECT(listing.size() == FILE_COUNT + 2);
+
+  uint files = 0;
+  bool sawSubdir = false, sawLink = false;
+  for (auto& entry: listing) {
+    KJ_EXPECT(entry.name != "." && entry.name != "..");
+
+    struct stat stats;
+    KJ_SYSCALL(fstatat(dirFd, entry.name.cStr(), &stats, AT_SYMLINK_NOFOLLOW), entry.name);
+    KJ_EXPECT(entry.inode == stats.st_ino, entry.name);
+
+    if (entry.name == "subdir") {
+      sawSubdir = true;
+      KJ_EXPECT(entry.type == DT_DIR || entry.type == DT_UNKNOWN);
+    } else if (entry.name == "link") {
+      sawLink = true;
+      KJ_EXPECT(entry.type == DT_LNK || entry.type == DT_UNKNOWN);
+    } else {
+      ++files;
+      KJ_EXPECT(entry.type == DT_REG || entry.type == DT_UNKNOWN);
+    }
+  }
+  KJ_EXPECT(files == FILE_COUNT);
+  KJ_EXPECT(sawSubdir);
+  KJ_EXPECT(sawLink);
+
+  KJ_EXPECT(listDirectory(tmpl).size() == FILE_COUNT + 2);
+}
+
+KJ_TEST("recursivelyDelete on non-directories") {
+  char tmpl[] = "/tmp/sandstorm-util-test.XXXXXX";
+  int fd;
+  KJ_SYSCALL(fd = mkstemp(tmpl));
+  close(fd);
+
+  recursivelyDelete(tmpl);
+  KJ_EXPECT(access(tmpl, F_OK) < 0 && errno == ENOENT);
+}
+
+static void expectSameTree(kj::StringPtr a, kj::StringPtr b) {
+  // Check that `b` has the same entries, contents, modes, and mtimes as `a`.
+
+  auto names = listDirectory(a);
+  KJ_EXPECT(names.size() == listDirectory(b).size(), a, b);
+  for (auto& name: names) {
+    auto pathA = kj::str(a, '/', name);
+    auto pathB = kj::str(b, '/', name);
+    struct stat statsA, statsB;
+    KJ_SYSCALL(lstat(pathA.cStr(), &statsA));
+    KJ_SYSCALL(lstat(pathB.cStr(), &statsB), pathB);
+    KJ_EXPECT(statsA.st_mode == statsB.st_mode, pathB);
+
+    if (S_ISDIR(statsA.st_mode)) {
+      expectSameTree(pathA, pathB);
+    } else if (S_ISREG(statsA.st_mode)) {
+      KJ_EXPECT(readAll(pathA) == readAll(pathB), pathB);
+    } else if (S_ISLNK(statsA.st_mode)) {
+      char targetA[256], targetB[256];
+      ssize_t n, m;
+      KJ_SYSCALL(n = readlink(pathA.cStr(), targetA, sizeof(targetA)));
+      KJ_SYSCALL(m = readlink(pathB.cStr(), targetB, sizeof(targetB)));
+      KJ_EXPECT(kj::heapString(targetA, n) == kj::heapString(targetB, m), pathB);
+    }
+
+    // Directory mtimes are only meaningful once everything inside has been written.
+    KJ_EXPECT(statsA.st_mtim.tv_sec == statsB.st_mtim.tv_sec &&
+              statsA.st_mtim.tv_nsec == statsB.st_mtim.tv_nsec, pathB);
+  }
+}
+
+KJ_TEST("cloneTree copies a tree and then refreshes it") {
+  // Exercises reflinks when /tmp supports them (btrfs, xfs), and plain copies otherwise. Run with
+  // --verbose to see which.
+
+  char tmpl[] = "/tmp/sandstorm-util-test.XXXXXX";
+  KJ_ASSERT(mkdtemp(tmpl) != nullptr);
+  KJ_DEFER(recursivelyDelete(tmpl));
+  auto src = kj::str(tmpl, "/src");
+  auto dst = kj::str(tmpl, "/dst");
+  KJ_SYSCALL(mkdir(src.cStr(), 0750));
+
+  makeTree(raiiOpen(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC), 3, 3, 6);
+
+  // A few multi-megabyte files, big enough to be copied in parallel.
+  auto bigContent = kj::heapArray<char>(3 << 20);
+  for (size_t i = 0; i < bigContent.size(); i++) {
+    bigContent[i] = 'a' + (i * 7 + (i >> 12)) % 26;
+  }
+  for (uint i = 0; i < 4; i++) {
+    kj::FdOutputStream(raiiOpen(kj::str(src, "/dir1/big", i), O_WRONLY | O_CREAT | O_EXCL, 0640))
+        .write(bigContent.begin(), bigContent.size());
+  }
+  kj::FdOutputStream(raiiOpen(kj::str(src, "/dir0/small"), O_WRONLY | O_CREAT | O_EXCL, 0600))
+      .write("hello", 5);
+  KJ_SYSCALL(chmod(kj::str(src, "/dir2").cStr(), 0700));
+
+  auto first = cloneTree(src, dst);
+  KJ_LOG(INFO, "first clone", first.files, first.bytes, first.reflinkedBytes);
+  KJ_EXPECT(first.files == 40 * 5 + 5, first.files);  // makeTree() makes 40 dirs of 5 files
+  KJ_EXPECT(first.unchangedFiles == 0);
+  KJ_EXPECT(first.bytes == 4 * bigContent.size() + 5);
+  expectSameTree(src, dst);
+
+  // Change some things, then refresh.
+  kj::FdOutputStream(raiiOpen(kj::str(src, "/dir0/small"), O_WRONLY | O_APPEND))
+      .write(", world", 7);
+  KJ_SYSCALL(unlink(kj::str(src, "/dir1/big0").cStr()));
+  recursivelyDelete(kj::str(src, "/dir2"));
+  KJ_SYSCALL(symlink("dir0/small", kj::str(src, "/dir2").cStr()));
+  KJ_SYSCALL(mkdir(kj::str(src, "/dir1/file1").cStr(), 0755));  // was a file
+
+  auto second = cloneTree(src, dst);
+  KJ_EXPECT(second.files == 1, second.files);
+  KJ_EXPECT(second.bytes == 12, second.bytes);
+  // Everything but small, big0, file1, and the 13 dirs of 5 files under dir2 was left alone.
+  KJ_EXPECT(second.unchangedFiles == first.files - 3 - 13 * 5, second.unchangedFiles);
+  expectSameTree(src, dst);
+}
+
 }  // namespace
 }  // namespace sandstorm
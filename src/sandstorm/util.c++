@@ -23,6 +23,25 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <syscall.h>
+#include <sys/ioctl.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// In case kernel headers are old.
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#ifndef SYS_copy_file_range
+#if defined(__x86_64__)
+#define SYS_copy_file_range 326
+#else
+#error "SYS_copy_file_range not defined; kernel headers are too old for this architecture"
+#endif
+#endif
 
 namespace sandstorm {
 
@@ -141,114 +160,784 @@ bool isDirectory(kj::StringPtr path) {
   return S_ISDIR(stats.st_mode);
 }
 
-static kj::Array<kj::String> listDirectoryAndClose(DIR* dir) {
-  KJ_DEFER(closedir(dir));
-  kj::Vector<kj::String> entries;
+DirectoryListing listDirectoryEntries(int dirfd) {
+  // Read the raw getdents64() records into one buffer, growing it for big directories, then index
+  // the names in place. Each record is laid out as a `struct dirent64` with a NUL-terminated name.
+
+  size_t capacity = 32768;
+  auto arena = kj::heapArray<byte>(capacity);
+  size_t used = 0;
 
   for (;;) {
-    errno = 0;
-    struct dirent* entry = readdir(dir);
-    if (entry == nullptr) {
-      int error = errno;
-      if (error == 0) {
-        break;
-      } else {
-        KJ_FAIL_SYSCALL("readdir", error);
-      }
+    if (capacity - used < sizeof(struct dirent64)) {
+      // Not guaranteed to fit another record; getdents64() would fail with EINVAL.
+      auto newArena = kj::heapArray<byte>(capacity * 2);
+      memcpy(newArena.begin(), arena.begin(), used);
+      arena = kj::mv(newArena);
+      capacity *= 2;
     }
 
-    kj::StringPtr name = entry->d_name;
+    ssize_t n;
+    KJ_SYSCALL(n = syscall(SYS_getdents64, dirfd, arena.begin() + used, capacity - used));
+    if (n == 0) break;
+    used += n;
+  }
+
+  kj::Vector<DirectoryListing::Entry> entries;
+  for (size_t pos = 0; pos < used;) {
+    auto record = reinterpret_cast<const struct dirent64*>(arena.begin() + pos);
+    pos += record->d_reclen;
+
+    kj::StringPtr name = record->d_name;
     if (name != "." && name != "..") {
-      entries.add(kj::heapString(entry->d_name));
+      entries.add(DirectoryListing::Entry { name, record->d_ino, record->d_type });
     }
   }
 
-  return entries.releaseAsArray();
+  return DirectoryListing(kj::mv(arena), entries.releaseAsArray());
+}
+
+static kj::Array<kj::String> namesOf(const DirectoryListing& listing) {
+  return KJ_MAP(entry, listing) { return kj::heapString(entry.name); };
 }
 
 kj::Array<kj::String> listDirectory(kj::StringPtr dirname) {
-  DIR* dir = opendir(dirname.cStr());
-  if (dir == nullptr) {
-    KJ_FAIL_SYSCALL("opendir", errno, dirname);
-  }
-  return listDirectoryAndClose(dir);
+  return namesOf(listDirectoryEntries(raiiOpen(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
 }
 
 kj::Array<kj::String> listDirectoryFd(int dirfd) {
-  // We need to reopen the directory FD to get a separately-seekable file, and because closedir()
-  // will close the fd even if opened with fdopendir().
-  int fd;
-  KJ_SYSCALL(fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY));
-  DIR* dir = fdopendir(fd);
-  if (dir == nullptr) {
-    KJ_FAIL_SYSCALL("fdopendir", errno);
-  }
-  return listDirectoryAndClose(dir);
+  // We need to reopen the directory FD to get a separately-seekable file.
+  return namesOf(listDirectoryEntries(
+      raiiOpenAt(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
 }
 
+namespace {
+
+const uint RECURSIVE_DELETE_MAX_THREADS = 8;
+
+class ParallelDeleter {
+  // Deletes the contents of a directory tree, walking it with openat()/fstatat()/unlinkat()
+  // relative to directory FDs rather than building and re-resolving full paths. Subdirectories
+  // are fanned out to a bounded pool of threads, which matters for trees with hundreds of
+  // thousands of files (e.g. old Sandstorm versions or large grains).
+  //
+  // Each directory is represented by a Node which stays open while any of its subdirectories are
+  // still being emptied, since those are opened and removed relative to it. When the last
+  // subdirectory finishes, the directory itself is removed from its parent, which may in turn
+  // complete the parent.
+  //
+  // Deletion is best-effort: an error deleting one entry doesn't stop the rest of the walk. The
+  // first error is reported by run().
+
+public:
+  explicit ParallelDeleter(uint maxThreads): maxThreads(kj::max(maxThreads, 1u)) {}
+
+  ~ParallelDeleter() noexcept(false) {
+    for (auto& thread: threads) {
+      thread.join();
+    }
+  }
+
+  kj::Maybe<kj::Exception> run(kj::AutoCloseFd rootFd) {
+    // Delete everything inside `rootFd`, leaving it empty, and close it. Returns the first error
+    // encountered, if any.
+
+    Node root(nullptr, nullptr);
+    root.fd = kj::mv(rootFd);
+    processEntries(root);
+    release(root);
+
+    // The calling thread works the queue too, until the root has been emptied.
+    workLoop();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    return kj::mv(error);
+  }
+
+private:
+  struct Node {
+    Node* parent;
+    // Null for the root.
+
+    kj::String name;
+    // Name of this directory within `parent`.
+
+    kj::AutoCloseFd fd;
+    // Open while this node's entries are being deleted.
+
+    std::atomic<uint> refcount;
+    // One reference is held while listing the directory, plus one per subdirectory that is still
+    // being emptied.
+
+    Node(Node* parent, kj::String name)
+        : parent(parent), name(kj::mv(name)), refcount(1) {}
+  };
+
+  const uint maxThreads;
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // Everything below is protected by `mutex`.
+  std::vector<Node*> queue;
+  // Directories waiting to be emptied. Popped from the back, so the walk is roughly depth-first,
+  // which keeps the number of simultaneously-open directories proportional to the depth of the
+  // tree rather than its width.
+
+  std::vector<std::thread> threads;
+  uint idleThreads = 0;
+  bool done = false;
+  kj::Maybe<kj::Exception> error;
+
+  void workLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      while (queue.empty() && !done) {
+        ++idleThreads;
+        cv.wait(lock);
+        --idleThreads;
+      }
+      if (queue.empty()) return;
+
+      Node* node = queue.back();
+      queue.pop_back();
+      lock.unlock();
+
+      bool opened = tryOrRecord([&]() {
+        node->fd = raiiOpenAt(node->parent->fd, node->name,
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      });
+      if (opened) {
+        processEntries(*node);
+      }
+      release(*node);
+
+      lock.lock();
+    }
+  }
+
+  void processEntries(Node& node) {
+    // Unlink all non-directories in `node` and queue its subdirectories.
+
+    int fd = node.fd;
+    DirectoryListing listing;
+    if (!tryOrRecord([&]() { listing = listDirectoryEntries(fd); })) {
+      return;
+    }
+
+    for (auto& entry: listing) {
+      kj::StringPtr name = entry.name;
+      tryOrRecord([&]() {
+        bool isDir;
+        if (entry.type == DT_UNKNOWN) {
+          // Some filesystems don't fill in d_type, so we have to stat.
+          struct stat stats;
+          KJ_SYSCALL(fstatat(fd, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW), name);
+          isDir = S_ISDIR(stats.st_mode);
+        } else {
+          isDir = entry.type == DT_DIR;
+        }
+
+        if (isDir) {
+          ++node.refcount;
+          enqueue(new Node(&node, kj::heapString(name)));
+        } else {
+          KJ_SYSCALL(unlinkat(fd, name.cStr(), 0), name);
+        }
+      });
+    }
+  }
+
+  void release(Node& start) {
+    // Drop a reference to `start`. If it was the last one, the directory is now empty, so remove
+    // it and release its parent in turn.
+
+    Node* node = &start;
+    while (--node->refcount == 0) {
+      node->fd = nullptr;
+
+      Node* parent = node->parent;
+      if (parent == nullptr) {
+        // The root is empty; we're done. The caller removes the root itself.
+        std::unique_lock<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_all();
+        return;
+      }
+
+      tryOrRecord([&]() {
+        if (unlinkat(parent->fd, node->name.cStr(), AT_REMOVEDIR) < 0) {
+          int error = errno;
+          if (error != ENOENT) {
+            KJ_FAIL_SYSCALL("unlinkat(AT_REMOVEDIR)", error, node->name);
+          }
+        }
+      });
+
+      delete node;
+      node = parent;
+    }
+  }
+
+  void enqueue(Node* node) {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(node);
+    if (idleThreads > 0) {
+      cv.notify_one();
+    } else if (threads.size() + 1 < maxThreads) {
+      // The calling thread counts as one worker. Threads are only started once there is
+      // actually a subdirectory to hand off, so deleting a flat directory costs nothing extra.
+      threads.emplace_back([this]() { workLoop(); });
+    }
+  }
+
+  template <typename Func>
+  bool tryOrRecord(Func&& func) {
+    // Run `func`, recording any exception it throws rather than propagating it, since worker
+    // threads must not throw. Returns true if `func` succeeded.
+
+    auto maybeException = kj::runCatchingExceptions(kj::fwd<Func>(func));
+    KJ_IF_MAYBE(exception, maybeException) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (error == nullptr) {
+        error = kj::mv(*exception);
+      }
+      return false;
+    }
+    return true;
+  }
+};
+
+}  // namespace
+
 void recursivelyDelete(kj::StringPtr path) {
   struct stat stats;
   KJ_SYSCALL(lstat(path.cStr(), &stats), path) { return; }
   if (S_ISDIR(stats.st_mode)) {
-    for (auto& file: listDirectory(path)) {
-      recursivelyDelete(kj::str(path, "/", file));
+    int fd;
+    KJ_SYSCALL(fd = open(path.cStr(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC), path) {
+      return;
+    }
+
+    // Deletion is mostly bound by filesystem metadata operations rather than CPU, so a handful of
+    // threads is enough to keep the disk busy.
+    uint threadCount = kj::min(kj::max(std::thread::hardware_concurrency(), 1u),
+                               RECURSIVE_DELETE_MAX_THREADS);
+    ParallelDeleter deleter(threadCount);
+    auto maybeError = deleter.run(kj::AutoCloseFd(fd));
+    KJ_IF_MAYBE(exception, maybeError) {
+      kj::throwRecoverableException(kj::mv(*exception));
     }
+
     KJ_SYSCALL(rmdir(path.cStr()), path) { break; }
   } else {
     KJ_SYSCALL(unlink(path.cStr()), path) { break; }
   }
 }
 
+namespace {
+
+const uint CLONE_MAX_THREADS = 8;
+
+const uint64_t CLONE_PARALLEL_FILE_SIZE = 1 << 20;
+// Files at least this big are handed to the thread pool individually. Smaller ones are copied by
+// whichever thread lists their directory, since queueing them would cost more than it saves.
+
+class ParallelCopier {
+  // Copies a directory tree using the same fd-relative, thread-pooled walk as ParallelDeleter.
+  // Each directory is a Node which stays open while any of its entries are still being copied.
+  // Its mode and timestamps are applied only once they are all done, since creating entries
+  // would otherwise bump its mtime again.
+  //
+  // Unlike deletion, copying gives up at the first error, which run() throws.
+
+public:
+  explicit ParallelCopier(uint maxThreads): maxThreads(kj::max(maxThreads, 1u)) {}
+
+  ~ParallelCopier() noexcept(false) {
+    for (auto& thread: threads) {
+      thread.join();
+    }
+  }
+
+  CloneStats run(kj::AutoCloseFd srcFd, kj::AutoCloseFd dstFd, bool dstExisted) {
+    Node root(nullptr, nullptr);
+    KJ_SYSCALL(fstat(srcFd, &root.stats));
+    root.srcFd = kj::mv(srcFd);
+    root.dstFd = kj::mv(dstFd);
+    root.dstExisted = dstExisted;
+    processEntries(root);
+    release(root);
+
+    // The calling thread works the queue too, until the root is complete.
+    workLoop();
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      KJ_IF_MAYBE(exception, error) {
+        kj::throwFatalException(kj::mv(*exception));
+      }
+    }
+
+    CloneStats result;
+    result.files = files;
+    result.bytes = bytes;
+    result.reflinkedBytes = reflinkedBytes;
+    result.unchangedFiles = unchangedFiles;
+    return result;
+  }
+
+private:
+  struct Node {
+    Node* parent;
+    // Null for the root.
+
+    kj::String name;
+    // Name of this directory within `parent`, on both sides.
+
+    struct stat stats;
+    // The source directory's stats, applied to the destination when complete.
+
+    bool dstExisted = false;
+    // Whether the destination directory was already there, so must be reconciled rather than
+    // just filled in.
+
+    kj::AutoCloseFd srcFd;
+    kj::AutoCloseFd dstFd;
+
+    std::atomic<uint> refcount;
+    // One reference is held while listing the directory, plus one per queued job inside it.
+
+    Node(Node* parent, kj::String name)
+        : parent(parent), name(kj::mv(name)), refcount(1) {}
+  };
+
+  struct Job {
+    Node* node;
+
+    kj::String fileName;
+    // If null, the job is to copy the directory `node`. Otherwise, to copy this regular file
+    // within `node`.
+  };
+
+  const uint maxThreads;
+  std::atomic<bool> failed { false };
+  std::atomic<bool> reflinkSupported { true };
+  std::atomic<bool> copyFileRangeSupported { true };
+  std::atomic<uint64_t> files { 0 };
+  std::atomic<uint64_t> bytes { 0 };
+  std::atomic<uint64_t> reflinkedBytes { 0 };
+  std::atomic<uint64_t> unchangedFiles { 0 };
+
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  // Everything below is protected by `mutex`.
+  std::vector<Job> queue;
+  std::vector<std::thread> threads;
+  uint idleThreads = 0;
+  bool done = false;
+  kj::Maybe<kj::Exception> error;
+
+  void workLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      while (queue.empty() && !done) {
+        ++idleThreads;
+        cv.wait(lock);
+        --idleThreads;
+      }
+      if (queue.empty()) return;
+
+      Job job = kj::mv(queue.back());
+      queue.pop_back();
+      lock.unlock();
+
+      if (!failed) {
+        if (job.fileName == nullptr) {
+          Node& node = *job.node;
+          bool opened = tryOrRecord([&]() {
+            Node& parent = *node.parent;
+            node.srcFd = raiiOpenAt(parent.srcFd, node.name,
+                                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (!node.dstExisted) {
+              KJ_SYSCALL(mkdirat(parent.dstFd, node.name.cStr(), 0700), node.name);
+            }
+            node.dstFd = raiiOpenAt(parent.dstFd, node.name,
+                                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+          });
+          if (opened) {
+            processEntries(node);
+          }
+        } else {
+          tryOrRecord([&]() { copyFile(*job.node, job.fileName); });
+        }
+      }
+      release(*job.node);
+
+      lock.lock();
+    }
+  }
+
+  void processEntries(Node& node) {
+    // Copy or queue everything in `node`, and delete whatever is in the destination but no longer
+    // in the source.
+
+    if (failed) return;
+
+    int srcFd = node.srcFd;
+    int dstFd = node.dstFd;
+    DirectoryListing srcListing;
+    DirectoryListing dstListing;
+    if (!tryOrRecord([&]() {
+      srcListing = listDirectoryEntries(srcFd);
+      if (node.dstExisted) {
+        dstListing = listDirectoryEntries(dstFd);
+      }
+    })) {
+      return;
+    }
+
+    std::set<kj::StringPtr> stale;
+    for (auto& entry: dstListing) {
+      stale.insert(entry.name);
+    }
+
+    for (auto& entry: srcListing) {
+      if (failed) return;
+
+      kj::StringPtr name = entry.name;
+      tryOrRecord([&]() {
+        struct stat stats;
+        KJ_SYSCALL(fstatat(srcFd, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW), name);
+
+        struct stat dstStats;
+        bool dstExists = stale.erase(name) > 0;
+        if (dstExists) {
+          KJ_SYSCALL(fstatat(dstFd, name.cStr(), &dstStats, AT_SYMLINK_NOFOLLOW), name);
+          if ((dstStats.st_mode & S_IFMT) != (stats.st_mode & S_IFMT)) {
+            removeAt(dstFd, name, dstStats);
+            dstExists = false;
+          }
+        }
+
+        if (S_ISDIR(stats.st_mode)) {
+          auto child = new Node(&node, kj::heapString(name));
+          child->stats = stats;
+          child->dstExisted = dstExists;
+          ++node.refcount;
+          enqueue(Job { child, nullptr });
+        } else if (S_ISREG(stats.st_mode)) {
+          if (dstExists && dstStats.st_size == stats.st_size &&
+              dstStats.st_mtim.tv_sec == stats.st_mtim.tv_sec &&
+              dstStats.st_mtim.tv_nsec == stats.st_mtim.tv_nsec) {
+            ++unchangedFiles;
+          } else if (stats.st_size >= CLONE_PARALLEL_FILE_SIZE) {
+            ++node.refcount;
+            enqueue(Job { &node, kj::heapString(name) });
+          } else {
+            copyFile(node, name);
+          }
+        } else if (S_ISLNK(stats.st_mode)) {
+          auto target = readLinkAt(srcFd, name, stats.st_size);
+          if (dstExists) {
+            if (readLinkAt(dstFd, name, dstStats.st_size) == target) return;
+            KJ_SYSCALL(unlinkat(dstFd, name.cStr(), 0), name);
+          }
+          KJ_SYSCALL(symlinkat(target.cStr(), dstFd, name.cStr()), name);
+          struct timespec times[2] = { stats.st_atim, stats.st_mtim };
+          KJ_SYSCALL(utimensat(dstFd, name.cStr(), times, AT_SYMLINK_NOFOLLOW), name);
+        } else if (S_ISFIFO(stats.st_mode)) {
+          if (!dstExists) {
+            KJ_SYSCALL(mkfifoat(dstFd, name.cStr(), stats.st_mode & 07777), name);
+          }
+          struct timespec times[2] = { stats.st_atim, stats.st_mtim };
+          KJ_SYSCALL(utimensat(dstFd, name.cStr(), times, AT_SYMLINK_NOFOLLOW), name);
+        } else {
+          // Sockets and device nodes are meaningless in a copy (and a sandbox can't create
+          // devices anyway).
+          if (dstExists) {
+            removeAt(dstFd, name, dstStats);
+          }
+        }
+      });
+    }
+
+    for (auto& name: stale) {
+      if (failed) return;
+      tryOrRecord([&]() {
+        struct stat stats;
+        KJ_SYSCALL(fstatat(dstFd, name.cStr(), &stats, AT_SYMLINK_NOFOLLOW), name);
+        removeAt(dstFd, name, stats);
+      });
+    }
+  }
+
+  void copyFile(Node& node, kj::StringPtr name) {
+    auto from = raiiOpenAt(node.srcFd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    auto to = raiiOpenAt(node.dstFd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                         0600);
+
+    // Take the timestamps from the fd we're copying, so that if the file changes after this, its
+    // mtime will differ and a later refresh will copy it again.
+    struct stat stats;
+    KJ_SYSCALL(fstat(from, &stats));
+
+    uint64_t size;
+    if (copyContents(from, to, size)) {
+      reflinkedBytes += size;
+    }
+    ++files;
+    bytes += size;
+
+    KJ_SYSCALL(fchmod(to, stats.st_mode & 07777), name);
+    struct timespec times[2] = { stats.st_atim, stats.st_mtim };
+    KJ_SYSCALL(futimens(to, times), name);
+  }
+
+  bool copyContents(int from, int to, uint64_t& size) {
+    // Copy the whole of `from` into the empty file `to`, setting `size` to the number of bytes.
+    // Returns true if the data was reflinked rather than copied.
+
+    if (reflinkSupported) {
+      if (ioctl(to, FICLONE, from) == 0) {
+        struct stat stats;
+        KJ_SYSCALL(fstat(to, &stats));
+        size = stats.st_size;
+        return true;
+      }
+
+      int error = errno;
+      if (!isUnsupported(error)) {
+        KJ_FAIL_SYSCALL("ioctl(FICLONE)", error);
+      }
+      reflinkSupported = false;
+    }
+
+    size = 0;
+    if (copyFileRangeSupported) {
+      for (;;) {
+        ssize_t n = syscall(SYS_copy_file_range, from, nullptr, to, nullptr, 1u << 30, 0);
+        if (n < 0) {
+          int error = errno;
+          if (error == EINTR) continue;
+          if (size == 0 && isUnsupported(error)) {
+            copyFileRangeSupported = false;
+            break;
+          }
+          KJ_FAIL_SYSCALL("copy_file_range", error);
+        }
+        if (n == 0) return false;
+        size += n;
+      }
+    }
+
+    kj::FdOutputStream out(to);
+    byte buffer[65536];
+    for (;;) {
+      ssize_t n;
+      KJ_SYSCALL(n = read(from, buffer, sizeof(buffer)));
+      if (n == 0) return false;
+      out.write(buffer, n);
+      size += n;
+    }
+  }
+
+  static bool isUnsupported(int error) {
+    // Errors meaning that a copy offload isn't available for this pair of files, as opposed to
+    // the copy itself failing.
+    return error == EOPNOTSUPP || error == ENOTTY || error == ENOSYS ||
+           error == EXDEV || error == EINVAL;
+  }
+
+  static kj::String readLinkAt(int dirFd, kj::StringPtr name, size_t sizeHint) {
+    auto buffer = kj::heapArray<char>(sizeHint + 2);
+    ssize_t n;
+    KJ_SYSCALL(n = readlinkat(dirFd, name.cStr(), buffer.begin(), buffer.size()), name);
+    KJ_REQUIRE(n < buffer.size(), "symlink changed while copying", name);
+    return kj::heapString(buffer.begin(), n);
+  }
+
+  static void removeAt(int dirFd, kj::StringPtr name, const struct stat& stats) {
+    if (S_ISDIR(stats.st_mode)) {
+      ParallelDeleter deleter(1);
+      KJ_IF_MAYBE(exception, deleter.run(raiiOpenAt(dirFd, name,
+          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC))) {
+        kj::throwFatalException(kj::mv(*exception));
+      }
+      KJ_SYSCALL(unlinkat(dirFd, name.cStr(), AT_REMOVEDIR), name);
+    } else {
+      KJ_SYSCALL(unlinkat(dirFd, name.cStr(), 0), name);
+    }
+  }
+
+  void release(Node& start) {
+    // Drop a reference to `start`. If it was the last one, everything in the directory has been
+    // copied, so finish it off and release its parent in turn.
+
+    Node* node = &start;
+    while (--node->refcount == 0) {
+      if (!failed && node->dstFd.get() >= 0) {
+        tryOrRecord([&]() {
+          KJ_SYSCALL(fchmod(node->dstFd, node->stats.st_mode & 07777), node->name);
+          struct timespec times[2] = { node->stats.st_atim, node->stats.st_mtim };
+          KJ_SYSCALL(futimens(node->dstFd, times), node->name);
+        });
+      }
+      node->srcFd = nullptr;
+      node->dstFd = nullptr;
+
+      Node* parent = node->parent;
+      if (parent == nullptr) {
+        std::unique_lock<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_all();
+        return;
+      }
+
+      delete node;
+      node = parent;
+    }
+  }
+
+  void enqueue(Job&& job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(kj::mv(job));
+    if (idleThreads > 0) {
+      cv.notify_one();
+    } else if (threads.size() + 1 < maxThreads) {
+      threads.emplace_back([this]() { workLoop(); });
+    }
+  }
+
+  template <typename Func>
+  bool tryOrRecord(Func&& func) {
+    // Run `func`, recording the first exception thrown and stopping the copy.
+
+    auto maybeException = kj::runCatchingExceptions(kj::fwd<Func>(func));
+    KJ_IF_MAYBE(exception, maybeException) {
+      failed = true;
+      std::unique_lock<std::mutex> lock(mutex);
+      if (error == nullptr) {
+        error = kj::mv(*exception);
+      }
+      return false;
+    }
+    return true;
+  }
+};
+
+}  // namespace
+
+CloneStats cloneTree(kj::StringPtr src, kj::StringPtr dst) {
+  auto srcFd = raiiOpen(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  bool dstExisted = false;
+  if (mkdir(dst.cStr(), 0700) < 0) {
+    int error = errno;
+    if (error != EEXIST) {
+      KJ_FAIL_SYSCALL("mkdir", error, dst);
+    }
+    dstExisted = true;
+  }
+  auto dstFd = raiiOpen(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  // With reflinks, cloning is all metadata operations, like deletion. Without, a few threads
+  // copying different files at once keep the disk's queue full.
+  uint threadCount = kj::min(kj::max(std::thread::hardware_concurrency(), 1u),
+                             CLONE_MAX_THREADS);
+  ParallelCopier copier(threadCount);
+  return copier.run(kj::mv(srcFd), kj::mv(dstFd), dstExisted);
+}
+
 kj::String readAll(int fd) {
-  kj::FdInputStream input(fd);
-  kj::Vector<char> content;
+  // Size the buffer from fstat() where possible, with one extra byte for the NUL terminator. That
+  // extra byte is also where the final read() returns 0, so a regular file that doesn't change
+  // while we read it costs exactly one allocation. Pipes, sockets, and /proc files report a size
+  // of zero (or a meaningless one), so for those we grow geometrically. Either way we keep going
+  // until read() actually reports EOF, since short reads are normal on pipes.
+
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+
+  size_t capacity = 4096;
+  if (S_ISREG(stats.st_mode) && stats.st_size > 0) {
+    capacity = stats.st_size + 1;
+  }
+
+  auto buffer = kj::heapArray<char>(capacity);
+  size_t size = 0;
   for (;;) {
-    char buffer[4096];
-    size_t n = input.tryRead(buffer, sizeof(buffer), sizeof(buffer));
-    content.addAll(buffer, buffer + n);
-    if (n < sizeof(buffer)) {
-      // Done!
-      break;
+    if (size == capacity) {
+      // Pipe, or the file grew underneath us.
+      auto newBuffer = kj::heapArray<char>(capacity * 2);
+      memcpy(newBuffer.begin(), buffer.begin(), size);
+      buffer = kj::mv(newBuffer);
+      capacity *= 2;
     }
+
+    ssize_t n;
+    KJ_SYSCALL(n = read(fd, buffer.begin() + size, capacity - size));
+    if (n == 0) break;
+    size += n;
+  }
+
+  if (size + 1 != capacity) {
+    // kj::String requires the array to be exactly the text plus NUL. Regular files normally skip
+    // this copy.
+    auto newBuffer = kj::heapArray<char>(size + 1);
+    memcpy(newBuffer.begin(), buffer.begin(), size);
+    buffer = kj::mv(newBuffer);
   }
-  content.add('\0');
-  return kj::String(content.releaseAsArray());
+
+  buffer[size] = '\0';
+  return kj::String(kj::mv(buffer));
 }
 
 kj::String readAll(kj::StringPtr name) {
   return readAll(raiiOpen(name, O_RDONLY));
 }
 
-kj::Array<kj::String> splitLines(kj::String input) {
+kj::Array<kj::StringPtr> splitLinesInPlace(kj::String& input) {
+  kj::Vector<kj::StringPtr> results;
+
+  // Index through a raw pointer, since we also write the terminator slot at text[size].
+  char* text = input.begin();
+  size_t size = input.size();
+
+  auto addLine = [&](size_t start, size_t end) {
+    while (start < end && isspace(text[start])) ++start;
+    while (end > start && isspace(text[end - 1])) --end;
+    if (end > start) {
+      text[end] = '\0';
+      results.add(kj::StringPtr(text + start, end - start));
+    }
+  };
+
   size_t lineStart = 0;
-  kj::Vector<kj::String> results;
-  for (size_t i = 0; i < input.size(); i++) {
-    if (input[i] == '\n' || input[i] == '#') {
-      bool hasComment = input[i] == '#';
-      input[i] = '\0';
-      auto line = trim(input.slice(lineStart, i));
-      if (line.size() > 0) {
-        results.add(kj::mv(line));
-      }
+  for (size_t i = 0; i < size; i++) {
+    if (text[i] == '\n' || text[i] == '#') {
+      bool hasComment = text[i] == '#';
+      addLine(lineStart, i);
       if (hasComment) {
         // Ignore through newline.
         ++i;
-        while (i < input.size() && input[i] != '\n') ++i;
+        while (i < size && text[i] != '\n') ++i;
       }
       lineStart = i + 1;
     }
   }
 
-  if (lineStart < input.size()) {
-    auto lastLine = trim(input.slice(lineStart));
-    if (lastLine.size() > 0) {
-      results.add(kj::mv(lastLine));
-    }
+  if (lineStart < size) {
+    addLine(lineStart, size);
   }
 
   return results.releaseAsArray();
 }
 
+kj::Array<kj::String> splitLines(kj::String input) {
+  return KJ_MAP(line, splitLinesInPlace(input)) { return kj::heapString(line); };
+}
+
 kj::Vector<kj::ArrayPtr<const char>> split(kj::ArrayPtr<const char> input, char delim) {
   kj::Vector<kj::ArrayPtr<const char>> result;
 
@@ -452,6 +1141,44 @@ kj::String base64Encode(kj::ArrayPtr<const byte> input, bool breakLines) {
   return output;
 }
 
+void Base64Encoder::encode(kj::ArrayPtr<const byte> input, kj::OutputStream& output) {
+  base64_encodestate s;
+  s.step = static_cast<base64_encodestep>(step);
+  s.result = partial;
+  s.stepcount = stepCount;
+
+  // Each 3 input bytes make 4 characters, plus a newline per line and the carried-over quantum.
+  constexpr size_t CHUNK = 3 * 1024;
+  char buffer[CHUNK / 3 * 4 + CHUNK / 3 * 4 / CHARS_PER_LINE + 8];
+
+  while (input.size() > 0) {
+    size_t n = kj::min(input.size(), CHUNK);
+    int cnt = base64_encode_block(reinterpret_cast<const char*>(input.begin()), n,
+                                  buffer, &s, breakLines);
+    output.write(buffer, cnt);
+    input = input.slice(n, input.size());
+  }
+
+  step = s.step;
+  partial = s.result;
+  stepCount = s.stepcount;
+}
+
+void Base64Encoder::finish(kj::OutputStream& output) {
+  base64_encodestate s;
+  s.step = static_cast<base64_encodestep>(step);
+  s.result = partial;
+  s.stepcount = stepCount;
+
+  char buffer[8];
+  int cnt = base64_encode_blockend(buffer, &s, breakLines);
+  output.write(buffer, cnt);
+
+  step = step_A;
+  partial = 0;
+  stepCount = 0;
+}
+
 // -------------------------------------------------------------------
 // Decoder
 
@@ -110,6 +110,42 @@ kj::AutoCloseFd openTemporary(kj::StringPtr near);
 
 bool isDirectory(kj::StringPtr path);
 
+class DirectoryListing {
+  // A directory listing read with large getdents64() batches. All names live in a single buffer
+  // owned by the listing, so entries are only valid for as long as the listing is.
+
+public:
+  struct Entry {
+    kj::StringPtr name;
+    ino_t inode;
+
+    unsigned char type;
+    // One of the DT_* constants from <dirent.h>. Some filesystems always report DT_UNKNOWN, in
+    // which case the caller has to stat the entry to find out what it is.
+  };
+
+  DirectoryListing() = default;
+  DirectoryListing(kj::Array<byte> arena, kj::Array<Entry> entries)
+      : arena(kj::mv(arena)), entries(kj::mv(entries)) {}
+  DirectoryListing(DirectoryListing&&) = default;
+  DirectoryListing& operator=(DirectoryListing&&) = default;
+  KJ_DISALLOW_COPY(DirectoryListing);
+
+  size_t size() const { return entries.size(); }
+  const Entry& operator[](size_t index) const { return entries[index]; }
+  const Entry* begin() const { return entries.begin(); }
+  const Entry* end() const { return entries.end(); }
+
+private:
+  kj::Array<byte> arena;
+  kj::Array<Entry> entries;
+};
+
+DirectoryListing listDirectoryEntries(int dirfd);
+// List the directory open as `dirfd`, excluding "." and "..". This reads from the fd's current
+// position and leaves it at the end, so it should be given a freshly-opened directory fd that
+// isn't shared with anyone else.
+
 kj::Array<kj::String> listDirectory(kj::StringPtr dirname);
 // Get names of all files in the given directory except for "." and "..".
 
@@ -122,8 +158,35 @@ void recursivelyDelete(kj::StringPtr path);
 // Since this may be used in KJ_DEFER to delete temporary directories, all exceptions are
 // recoverable (won't throw if already unwinding).
 
+struct CloneStats {
+  uint64_t files = 0;
+  // Regular files whose contents were copied or cloned.
+
+  uint64_t bytes = 0;
+  // Total size of those files.
+
+  uint64_t reflinkedBytes = 0;
+  // Portion of `bytes` cloned with FICLONE, i.e. sharing extents with the source rather than
+  // taking up new space.
+
+  uint64_t unchangedFiles = 0;
+  // Files skipped because the destination already had them with the same size and mtime.
+};
+
+CloneStats cloneTree(kj::StringPtr src, kj::StringPtr dst);
+// Make the directory `dst` a copy of the directory tree `src`, including modes and timestamps.
+// File contents are reflinked (FICLONE) where the filesystem supports it, so that the copy is
+// nearly free until either side is modified; otherwise they are copied with copy_file_range(),
+// or read()/write() as a last resort, spread over a few threads. Sockets and device nodes are
+// skipped, and hard links become separate files.
+//
+// If `dst` already exists, it is brought up to date with `src`: files whose size and mtime match
+// are left alone and entries missing from `src` are deleted. So a live directory can be copied
+// in two passes, the second (fast) one after writers have been stopped.
+
 kj::String readAll(int fd);
-// Read entire contents of the file descirptor to a String.
+// Read entire contents of the file descirptor to a String. Reads until EOF, so this works on pipes
+// and sockets as well as files.
 
 kj::String readAll(kj::StringPtr name);
 // Read entire contents of a named file to a String.
@@ -132,6 +195,10 @@ kj::Array<kj::String> splitLines(kj::String input);
 // Split the input into lines, trimming whitespace, and ignoring blank lines or lines that start
 // with #. Consumes the input string.
 
+kj::Array<kj::StringPtr> splitLinesInPlace(kj::String& input);
+// Like splitLines(), but returns views into `input` rather than copying each line. `input` is
+// modified (line ends are overwritten with NULs) and must outlive the result.
+
 kj::Vector<kj::ArrayPtr<const char>> split(kj::ArrayPtr<const char> input, char delim);
 // Split the char array on an arbitrary delimiter character.
 
@@ -147,6 +214,24 @@ kj::String base64Encode(kj::ArrayPtr<const byte> input, bool breakLines);
 // Encode the input as base64. If `breakLines` is true, insert line breaks every 72 characters and
 // at the end of the output. (Otherwise, return one long line.)
 
+class Base64Encoder {
+  // Incremental base64Encode(): feeding the input through encode() in pieces of any size, then
+  // calling finish(), writes the same text as one base64Encode() call on the whole input. Lets
+  // large inputs be encoded straight to a file.
+
+public:
+  explicit Base64Encoder(bool breakLines): breakLines(breakLines) {}
+
+  void encode(kj::ArrayPtr<const byte> input, kj::OutputStream& output);
+  void finish(kj::OutputStream& output);
+
+private:
+  bool breakLines;
+  int step = 0;
+  char partial = 0;
+  int stepCount = 0;
+};
+
 kj::Array<byte> base64Decode(kj::StringPtr input);
 // Decode base64 input to bytes. Non-base64 characters in the input will be ignored.
 